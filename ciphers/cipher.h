@@ -64,6 +64,9 @@ struct _Cipher {
          of the array specifies the default block and key size. */
       CipherSize *    paSizes;
 
+      /* encryptBlock and decryptBlock only read the key, so once it
+         has been expanded a key can be used by several threads at
+         once. */
       ExpandKey       expandKey;
       FreeExpandedKey freeExpandedKey;
       EncryptBlock    encryptBlock;
@@ -75,7 +75,7 @@ static u4byte  fl_tab[4][256];
 static u4byte  il_tab[4][256];
 #endif
 
-static u4byte  tab_gen = 0;
+static bool    tab_gen = false;
 
 typedef struct {
         u4byte  k_len;
@@ -222,8 +222,6 @@ static void gen_tabs(void)
         it_tab[2][i] = rotl(t, 16); 
         it_tab[3][i] = rotl(t, 24); 
     }
-
-    tab_gen = 1;
 }
 
 #define star_x(x) (((x) & 0x7f7f7f7f) << 1) ^ ((((x) & 0x80808080) >> 7) * 0x1b)
@@ -275,9 +273,8 @@ static void set_key(KeyData * key, const u4byte in_key[],
    const u4byte key_len)
 {   u4byte  i, t, u, v, w;
 
-    if(!tab_gen)
-
-        gen_tabs();
+    /* Several threads may be expanding keys at the same time. */
+    sysCallOnce(&tab_gen, gen_tabs);
 
     key->k_len = (key_len + 31) / 32;
 
@@ -116,7 +116,6 @@ u1byte qp(const u4byte n, const u1byte x)
     return (b4 << 4) | a4;
 }
 
-static u4byte  qt_gen = 0;
 static u1byte  q_tab[2][256];
 
 #define q(n,x)  q_tab[n][x]
@@ -131,7 +130,6 @@ static void gen_qtab(void)
     }
 }
 
-static u4byte  mt_gen = 0;
 static u4byte  m_tab[4][256];
 
 static void gen_mtab(void)
@@ -151,6 +149,13 @@ static void gen_mtab(void)
 
 #define mds(n,x)    m_tab[n][x]
 
+static bool    tab_gen = false;
+
+static void gen_tabs(void)
+{
+    gen_qtab(); gen_mtab();
+}
+
 static u4byte h_fun(int k_len, const u4byte x, const u4byte key[])
 {   u4byte  b0, b1, b2, b3;
 
@@ -292,15 +297,8 @@ static void set_key(KeyData * key, const u4byte in_key[],
     const u4byte key_len)
 {   u4byte  i, a, b, me_key[4], mo_key[4];
 
-    if(!qt_gen)
-    {
-        gen_qtab(); qt_gen = 1;
-    }
-
-    if(!mt_gen)
-    {
-        gen_mtab(); mt_gen = 1;
-    }
+    /* Several threads may be expanding keys at the same time. */
+    sysCallOnce(&tab_gen, gen_tabs);
 
     key->k_len = key_len / 64;   /* 2, 3 or 4 */
 
@@ -17,15 +17,21 @@
    along with this program; if not, write to the Free Software Foundation,
    Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #include "corefs.h"
+#include "infocache.h"
 
 
-static SectorNumber fileSizeToAllocation(CryptedFilePos cbFileSize)
+static SectorNumber fileSizeToAllocation(CryptedVolume * pVolume,
+   CryptedFilePos cbFileSize)
 {
-   return cbFileSize ? (cbFileSize - 1) / PAYLOAD_SIZE + 1 : 0;
+   unsigned int cbPayload =
+      PAYLOAD_SIZE_OF(coreQueryVolumeParms(pVolume)->cbSector);
+   return cbFileSize ? (cbFileSize - 1) / cbPayload + 1 : 0;
 }
 
 
@@ -45,7 +51,7 @@ CoreResult coreCreateBaseFile(CryptedVolume * pVolume,
 
    /* How many data sectors do we need for a file of cbInitialSize
       bytes? */
-   cSectors = fileSizeToAllocation(pInfo->cbFileSize);
+   cSectors = fileSizeToAllocation(pVolume, pInfo->cbFileSize);
 
    /* Allocate an info sector, which gives us a new file ID. */
    cr = coreAllocID(pVolume, &id);
@@ -82,7 +88,9 @@ CoreResult coreDestroyBaseFile(CryptedVolume * pVolume,
    
    if (!id) return CORERC_INVALID_PARAMETER;
    
+   coreLockFile(pVolume, id);
    cr = coreDestroyFile(pVolume, id);
+   coreUnlockFile(pVolume, id);
    if (cr) return cr;
 
    cr = coreFreeID(pVolume, id);
@@ -92,13 +100,40 @@ CoreResult coreDestroyBaseFile(CryptedVolume * pVolume,
 }
 
 
+/* Copy the info in *pInfoOnDisk to *pInfo.  The padding in *pInfo
+   is cleared, so that the result can be compared with memcmp(). */
+static void decodeInfo(CryptedFileInfoOnDisk * pInfoOnDisk,
+   CryptedFileInfo * pInfo)
+{
+   memset(pInfo, 0, sizeof(CryptedFileInfo));
+   pInfo->flFlags = bytesToInt32(pInfoOnDisk->flFlags);
+   pInfo->cRefs = bytesToInt32(pInfoOnDisk->cRefs);
+   pInfo->cbFileSize = bytesToInt32(pInfoOnDisk->cbFileSize);
+   pInfo->csSet = bytesToInt32(pInfoOnDisk->csSet);
+   pInfo->timeCreation = bytesToInt32(pInfoOnDisk->timeCreation);
+   pInfo->timeAccess = bytesToInt32(pInfoOnDisk->timeAccess);
+   pInfo->timeWrite = bytesToInt32(pInfoOnDisk->timeWrite);
+   pInfo->idParent = bytesToInt32(pInfoOnDisk->idParent);
+   pInfo->cbEAs = bytesToInt32(pInfoOnDisk->cbEAs);
+   pInfo->idEAFile = bytesToInt32(pInfoOnDisk->idEAFile);
+   pInfo->uid = bytesToInt32(pInfoOnDisk->uid);
+   pInfo->gid = bytesToInt32(pInfoOnDisk->gid);
+}
+
+
+/* Decoded info is kept in the volume's info cache, if it has one. */
 CoreResult coreQueryFileInfo(CryptedVolume * pVolume,
    CryptedFileID id, CryptedFileInfo * pInfo)
 {
    CoreResult cr;
    CryptedFileInfoOnDisk infoOnDisk;
+   InfoCache * pCache = coreQueryInfoCache(pVolume);
+   unsigned int seq;
    
    if (!id) return CORERC_INVALID_PARAMETER;
+
+   if (pCache && coreLookupInfo(pCache, id, pInfo, &seq))
+      return CORERC_OK;
    
    /* Get the file's info sector. */
    cr = coreQuerySectorData(pVolume, INFOSECTORFILE_ID,
@@ -106,34 +141,29 @@ CoreResult coreQueryFileInfo(CryptedVolume * pVolume,
       0, sizeof(CryptedFileInfoOnDisk), 0, &infoOnDisk);
    if (cr) return cr;
 
-   /* Copy the info in infoOnDisk to *pInfo. */
-   pInfo->flFlags = bytesToInt32(infoOnDisk.flFlags);
-   pInfo->cRefs = bytesToInt32(infoOnDisk.cRefs);
-   pInfo->cbFileSize = bytesToInt32(infoOnDisk.cbFileSize);
-   pInfo->csSet = bytesToInt32(infoOnDisk.csSet);
-   pInfo->timeCreation = bytesToInt32(infoOnDisk.timeCreation);
-   pInfo->timeAccess = bytesToInt32(infoOnDisk.timeAccess);
-   pInfo->timeWrite = bytesToInt32(infoOnDisk.timeWrite);
-   pInfo->idParent = bytesToInt32(infoOnDisk.idParent);
-   pInfo->cbEAs = bytesToInt32(infoOnDisk.cbEAs);
-   pInfo->idEAFile = bytesToInt32(infoOnDisk.idEAFile);
-   pInfo->uid = bytesToInt32(infoOnDisk.uid);
-   pInfo->gid = bytesToInt32(infoOnDisk.gid);
+   decodeInfo(&infoOnDisk, pInfo);
 
    /* Perform a few checks. */
    if ((bytesToInt32(infoOnDisk.magic) != INFOSECTOR_MAGIC_INUSE) ||
        (bytesToInt32(infoOnDisk.id) != id))
       return CORERC_BAD_INFOSECTOR;
 
+   if (pCache) coreStoreInfo(pCache, id, pInfo, seq);
+
    return CORERC_OK;
 }
 
 
+/* The info cache is updated along with the info sector.  If the
+   info hasn't changed, the info sector is left alone. */
 CoreResult coreSetFileInfo(CryptedVolume * pVolume,
    CryptedFileID id, CryptedFileInfo * pInfo)
 {
    CoreResult cr;
    CryptedFileInfoOnDisk infoOnDisk;
+   CryptedFileInfo info;
+   InfoCache * pCache = coreQueryInfoCache(pVolume);
+   unsigned int seq;
 
    if (!id) return CORERC_INVALID_PARAMETER;
 
@@ -157,29 +187,41 @@ CoreResult coreSetFileInfo(CryptedVolume * pVolume,
    int32ToBytes(pInfo->uid, infoOnDisk.uid);
    int32ToBytes(pInfo->gid, infoOnDisk.gid);
 
+   if (!pCache)
+      return coreSetSectorData(pVolume, INFOSECTORFILE_ID,
+         coreQueryInfoSectorNumber(pVolume, id),
+         0, sizeof(CryptedFileInfoOnDisk), 0, &infoOnDisk);
+
+   /* What a query would return from now on. */
+   decodeInfo(&infoOnDisk, &info);
+
    /* Rewrite the file's info sector. */
+   if (coreBeginInfoUpdate(pCache, id, &info, &seq)) return CORERC_OK;
    cr = coreSetSectorData(pVolume, INFOSECTORFILE_ID,
       coreQueryInfoSectorNumber(pVolume, id),
       0, sizeof(CryptedFileInfoOnDisk), 0, &infoOnDisk);
-   if (cr) return cr;
+   coreEndInfoUpdate(pCache, id, cr ? 0 : &info, seq);
 
-   return CORERC_OK;
+   return cr;
 }
 
 
 /* Read bytes from a file until the end-of-file is reached.  Reaching
    or starting beyond EOF is not an error.  The number of bytes read
    is returned in *pcbRead. */
-CoreResult coreReadFromFile(CryptedVolume * pVolume, CryptedFileID id,
+static CoreResult readFromFile(CryptedVolume * pVolume, CryptedFileID id,
    CryptedFilePos fpStart, CryptedFilePos cbLength, octet * pabBuffer,
-   CryptedFilePos * pcbRead)
+   CryptedFilePos * pcbRead, unsigned int flFlags)
 {
-   CoreResult cr, finalcr = CORERC_OK;
+   CoreResult cr, crSector, finalcr = CORERC_OK;
    CryptedFileInfo info;
-   SectorNumber csExtent;
+   SectorNumber csExtent, i;
    SectorNumber sCurrent;
    unsigned int offset, read;
    CryptedVolumeParms * pParms = coreQueryVolumeParms(pVolume);
+   unsigned int cbPayload = PAYLOAD_SIZE_OF(pParms->cbSector);
+   CryptedSector * * papSectors;
+   bool fStream;
    
    *pcbRead = 0;
    
@@ -194,39 +236,73 @@ CoreResult coreReadFromFile(CryptedVolume * pVolume, CryptedFileID id,
    if (fpStart + cbLength > info.cbFileSize)
       cbLength = info.cbFileSize - fpStart;
 
-   sCurrent = fpStart / PAYLOAD_SIZE;
-   offset = fpStart % PAYLOAD_SIZE;
+   sCurrent = fpStart / cbPayload;
+   offset = fpStart % cbPayload;
+
+   /* Large reads would only push other data out of the cache. */
+   fStream = (flFlags & CREAD_STREAM) ||
+      (pParms->csStreamThreshold &&
+       cbLength / cbPayload >= pParms->csStreamThreshold);
+
+   cr = coreGetSectorList(pVolume, &papSectors);
+   if (cr) return cr;
 
    /* Read the data. */
    while (cbLength && (sCurrent < info.csSet)) {
 
+      /* Stream the whole sectors.  A partial sector at the start or
+         the end goes through the cache; so does the rest of the
+         range if streaming fails, to salvage what we can (see
+         below). */
+      if (fStream && !offset && cbLength >= cbPayload) {
+         csExtent = cbLength / cbPayload;
+         if (sCurrent + csExtent > info.csSet)
+            csExtent = info.csSet - sCurrent;
+         cr = coreStreamSectors(pVolume, id, sCurrent, csExtent,
+            pabBuffer);
+         if (!cr) {
+            pabBuffer += csExtent * cbPayload;
+            *pcbRead += csExtent * cbPayload;
+            cbLength -= csExtent * cbPayload;
+            sCurrent += csExtent;
+            continue;
+         }
+         fStream = false;
+      }
+
       /* Note: in case of I/O errors, we always try to read as much as
          can be salvaged.  Of course, an error code will be returned
          to the caller, who can then decide what to with the data in
-         pabBuffer.  So we don't bail out if coreFetchSectors returns
-         an error.  Since coreFetchSectors tries to read multiple
+         pabBuffer.  So we don't bail out if corePinSectors returns
+         an error.  Since corePinSectors tries to read multiple
          sectors at once, it might not recover all it can if part of
-         an extent is unreadable.  However, that's not a problem: the
-         call to coreQuerySectorData will try again on a per-sector
-         basis. */
+         an extent is unreadable.  However, that's not a problem: we
+         then fall back to coreQuerySectorData, which will try again
+         on a per-sector basis and tell us which sectors are bad. */
 
-      /* Fetch at most csIOGranularity sectors. */
-      csExtent = (offset + cbLength - 1) / PAYLOAD_SIZE + 1;
+      /* Pin at most csIOGranularity sectors. */
+      csExtent = (offset + cbLength - 1) / cbPayload + 1;
       if (sCurrent + csExtent > info.csSet)
          csExtent = info.csSet - sCurrent;
       if (csExtent > pParms->csIOGranularity)
          csExtent = pParms->csIOGranularity;
-      cr = coreFetchSectors(pVolume, id, sCurrent, csExtent, 0);
-      if (cr) finalcr = cr;
+      cr = corePinSectors(pVolume, id, sCurrent, csExtent, 0,
+         papSectors);
 
-      /* Copy the sectors we just fetched into the buffer. */
-      while (csExtent--) {
-         read = PAYLOAD_SIZE - offset;
+      /* Copy the sectors we just pinned into the buffer. */
+      for (i = 0; i < csExtent; i++) {
+         read = cbPayload - offset;
          if (read > cbLength) read = cbLength;
 
-         cr = coreQuerySectorData(pVolume, id, sCurrent,
-            offset, read, 0, pabBuffer);
-         if (cr && finalcr == CORERC_OK) finalcr = cr;
+         if (!cr)
+            memcpy(pabBuffer,
+               coreQuerySectorPayload(pVolume, papSectors[i]) + offset,
+               read);
+         else {
+            crSector = coreQuerySectorData(pVolume, id, sCurrent,
+               offset, read, 0, pabBuffer);
+            if (crSector && finalcr == CORERC_OK) finalcr = crSector;
+         }
       
          pabBuffer += read;
          *pcbRead += read;
@@ -234,8 +310,12 @@ CoreResult coreReadFromFile(CryptedVolume * pVolume, CryptedFileID id,
          sCurrent++;
          offset = 0;
       }
+
+      if (!cr) coreUnpinSectors(pVolume, csExtent, papSectors);
    }
 
+   coreReleaseSectorList(pVolume, papSectors);
+
    if (cbLength) {
       memset(pabBuffer, 0, cbLength);
       *pcbRead += cbLength;
@@ -245,6 +325,28 @@ CoreResult coreReadFromFile(CryptedVolume * pVolume, CryptedFileID id,
 }
 
 
+CoreResult coreReadFromFile(CryptedVolume * pVolume, CryptedFileID id,
+   CryptedFilePos fpStart, CryptedFilePos cbLength, octet * pabBuffer,
+   CryptedFilePos * pcbRead)
+{
+   return coreReadFromFileEx(pVolume, id, fpStart, cbLength,
+      pabBuffer, pcbRead, 0);
+}
+
+
+CoreResult coreReadFromFileEx(CryptedVolume * pVolume, CryptedFileID id,
+   CryptedFilePos fpStart, CryptedFilePos cbLength, octet * pabBuffer,
+   CryptedFilePos * pcbRead, unsigned int flFlags)
+{
+   CoreResult cr;
+   coreLockFile(pVolume, id);
+   cr = readFromFile(pVolume, id, fpStart, cbLength, pabBuffer, pcbRead,
+      flFlags);
+   coreUnlockFile(pVolume, id);
+   return cr;
+}
+
+
 static CoreResult zeroSectors(CryptedVolume * pVolume,
    CryptedFileID id, CryptedVolumeParms * pParms,
    CryptedFileInfo * pInfo, SectorNumber csInit)
@@ -269,16 +371,17 @@ static CoreResult zeroSectors(CryptedVolume * pVolume,
 /* Write bytes to a file.  Zero-byte writes are not an error.  The
    number of bytes succesfully written is stored in *pcbWritten, which
    may be less than the given number of bytes iff an error occurs. */
-CoreResult coreWriteToFile(CryptedVolume * pVolume, CryptedFileID id,
+static CoreResult writeToFile(CryptedVolume * pVolume, CryptedFileID id,
    CryptedFilePos fpStart, CryptedFilePos cbLength, const octet * pabBuffer,
-   CryptedFilePos * pcbWritten)
+   CryptedFilePos * pcbWritten, unsigned int flWrite)
 {
    CoreResult cr;
    CryptedFileInfo info;
    SectorNumber sCurrent;
    unsigned int offset, write;
    CryptedVolumeParms * pParms = coreQueryVolumeParms(pVolume);
-   bool fChanged = false;
+   unsigned int cbPayload = PAYLOAD_SIZE_OF(pParms->cbSector);
+   bool fChanged = false, fStream;
    SectorNumber csExtent;
    unsigned int flFlags;
    
@@ -291,15 +394,22 @@ CoreResult coreWriteToFile(CryptedVolume * pVolume, CryptedFileID id,
    /* Ignore zero-length writes. */
    if (!cbLength) return CORERC_OK;
 
-   /* Write (extends) beyond current end-of-file?  Then we allocate
-      more storage sectors. */
-   if (fpStart + cbLength > info.cbFileSize)
-      if ((cr = coreSetFileSize(pVolume, id, fpStart + cbLength)) ||
-          (cr = coreQueryFileInfo(pVolume, id, &info)))
-         return cr;
+   /* Write (extends) beyond current end-of-file?  The new size goes
+      into the same info update as csSet.  We don't need to grow the
+      storage file first (as setFileSize() would): every sector up to
+      the new end is written below. */
+   if (fpStart + cbLength > info.cbFileSize) {
+      info.cbFileSize = fpStart + cbLength;
+      fChanged = true;
+   }
 
-   sCurrent = fpStart / PAYLOAD_SIZE;
-   offset = fpStart % PAYLOAD_SIZE;
+   if ((flWrite & CWRITE_STAMP) && info.timeWrite != (CoreTime) time(0)) {
+      info.timeWrite = (CoreTime) time(0);
+      fChanged = true;
+   }
+
+   sCurrent = fpStart / cbPayload;
+   offset = fpStart % cbPayload;
 
    /* Initialize uninitialized sectors lower than the start sector. */
    if (sCurrent > info.csSet) {
@@ -308,16 +418,43 @@ CoreResult coreWriteToFile(CryptedVolume * pVolume, CryptedFileID id,
       fChanged = true;
    }
 
+   /* Large writes would only push other data out of the cache. */
+   fStream = (flWrite & CWRITE_STREAM) ||
+      (pParms->csStreamThreshold &&
+       cbLength / cbPayload >= pParms->csStreamThreshold);
+
    /* Write the data. */
    while (cbLength) {
 
+      /* Write whole sectors through.  A partial sector at the start
+         or the end goes through the cache. */
+      if (fStream && !offset && cbLength >= cbPayload) {
+         csExtent = cbLength / cbPayload;
+         cr = coreWriteSectorsThrough(pVolume, id, sCurrent, csExtent,
+            pabBuffer);
+         if (cr) {
+            if (fChanged)
+               coreSetFileInfo(pVolume, id, &info); /* commit successful writes */
+            return cr;
+         }
+         pabBuffer += csExtent * cbPayload;
+         *pcbWritten += csExtent * cbPayload;
+         cbLength -= csExtent * cbPayload;
+         sCurrent += csExtent;
+         if (sCurrent > info.csSet) {
+            info.csSet = sCurrent;
+            fChanged = true;
+         }
+         continue;
+      }
+
       /* Fetch at most csIOGranularity sectors.  To cluster potential
          I/O, all sectors in the extent should *either* not be
          initialised or about to be completely overwritten, *or*
          should be initialised and be about to be partially written
          to. */
       flFlags = CFETCH_NO_READ;
-      csExtent = (offset + cbLength - 1) / PAYLOAD_SIZE + 1;
+      csExtent = (offset + cbLength - 1) / cbPayload + 1;
 
       if (sCurrent < info.csSet) {
 
@@ -326,18 +463,18 @@ CoreResult coreWriteToFile(CryptedVolume * pVolume, CryptedFileID id,
             /* Optimisation: if we are writing partially to exactly
                two sectors that are completely contained in the
                initialised area, read them in one go. */
-            if (offset + cbLength > PAYLOAD_SIZE &&
-                offset + cbLength < 2 * PAYLOAD_SIZE &&
+            if (offset + cbLength > cbPayload &&
+                offset + cbLength < 2 * cbPayload &&
                 sCurrent + 2 <= info.csSet)
                csExtent = 2, flFlags = 0;
             else
                csExtent = 1, flFlags = 0;
          /* No, but maybe partial write to end of first sector? */
-         else if (cbLength < PAYLOAD_SIZE)
+         else if (cbLength < cbPayload)
             csExtent = 1, flFlags = 0;
          /* Multiple sectors, starting at offset 0 of first.  Partial
             write to end of last sector? */
-         else if (cbLength % PAYLOAD_SIZE != 0 &&
+         else if (cbLength % cbPayload != 0 &&
             sCurrent + csExtent <= info.csSet)
             csExtent--; /* do last sector separately */
          else /* no need to read anything */ ;
@@ -356,12 +493,16 @@ CoreResult coreWriteToFile(CryptedVolume * pVolume, CryptedFileID id,
 
       /* Copy buffer data into the sectors. */
       while (csExtent--) {
-         write = PAYLOAD_SIZE - offset;
+         write = cbPayload - offset;
          if (write > cbLength) write = cbLength;
          
          cr = coreSetSectorData(pVolume, id, sCurrent,
             offset, write, flFlags, pabBuffer);
-         if (cr) return cr; /* shouldn't happen */
+         if (cr) { /* shouldn't happen */
+            if (fChanged)
+               coreSetFileInfo(pVolume, id, &info);
+            return cr;
+         }
          
          pabBuffer += write;
          *pcbWritten += write;
@@ -383,17 +524,41 @@ CoreResult coreWriteToFile(CryptedVolume * pVolume, CryptedFileID id,
 }
 
 
+CoreResult coreWriteToFile(CryptedVolume * pVolume, CryptedFileID id,
+   CryptedFilePos fpStart, CryptedFilePos cbLength, const octet * pabBuffer,
+   CryptedFilePos * pcbWritten)
+{
+   return coreWriteToFileEx(pVolume, id, fpStart, cbLength,
+      pabBuffer, pcbWritten, 0);
+}
+
+
+CoreResult coreWriteToFileEx(CryptedVolume * pVolume, CryptedFileID id,
+   CryptedFilePos fpStart, CryptedFilePos cbLength, const octet * pabBuffer,
+   CryptedFilePos * pcbWritten, unsigned int flFlags)
+{
+   CoreResult cr;
+   coreLockFile(pVolume, id);
+   cr = writeToFile(pVolume, id, fpStart, cbLength, pabBuffer,
+      pcbWritten, flFlags);
+   coreUnlockFile(pVolume, id);
+   return cr;
+}
+
+
 /* Set the size of the file.  The number of sectors in the file is
    increased or decreased as required. */ 
-CoreResult coreSetFileSize(CryptedVolume * pVolume, CryptedFileID id,
+static CoreResult setFileSize(CryptedVolume * pVolume, CryptedFileID id,
    CryptedFilePos cbFileSize)
 {
    CoreResult cr;
    CryptedFileInfo info;
    SectorNumber cSectors;
-   octet zero[PAYLOAD_SIZE];
+   octet zero[MAX_PAYLOAD_SIZE];
    CryptedFilePos cbOldSize;
    unsigned int offset;
+   unsigned int cbPayload =
+      PAYLOAD_SIZE_OF(coreQueryVolumeParms(pVolume)->cbSector);
    
    if (!id) return CORERC_INVALID_PARAMETER;
    
@@ -408,7 +573,7 @@ CoreResult coreSetFileSize(CryptedVolume * pVolume, CryptedFileID id,
    info.cbFileSize = cbFileSize;
 
    /* How many sectors do we need? */
-   cSectors = fileSizeToAllocation(cbFileSize);
+   cSectors = fileSizeToAllocation(pVolume, cbFileSize);
 
    /* If the file shrinks, we might have to reduce csSet. */
    if (info.csSet > cSectors) info.csSet = cSectors;
@@ -424,13 +589,24 @@ CoreResult coreSetFileSize(CryptedVolume * pVolume, CryptedFileID id,
    /* Kill old data in the last set sector.  Otherwise, if the
       file grows later on, old data might re-appear. */
    if ((info.cbFileSize < cbOldSize) &&
-       (info.cbFileSize < info.csSet * PAYLOAD_SIZE)) {
-      offset = info.cbFileSize % PAYLOAD_SIZE;
-      memset(zero, 0, PAYLOAD_SIZE - offset);
+       (info.cbFileSize < info.csSet * cbPayload)) {
+      offset = info.cbFileSize % cbPayload;
+      memset(zero, 0, cbPayload - offset);
       cr = coreSetSectorData(pVolume, id, info.csSet - 1,
-         offset, PAYLOAD_SIZE - offset, 0, zero);
+         offset, cbPayload - offset, 0, zero);
       if (cr) return cr;
    }
 
    return CORERC_OK;
 }
+
+
+CoreResult coreSetFileSize(CryptedVolume * pVolume, CryptedFileID id,
+   CryptedFilePos cbFileSize)
+{
+   CoreResult cr;
+   coreLockFile(pVolume, id);
+   cr = setFileSize(pVolume, id, cbFileSize);
+   coreUnlockFile(pVolume, id);
+   return cr;
+}
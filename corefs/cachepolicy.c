@@ -0,0 +1,561 @@
+/* cachepolicy.c -- Replacement policies for the sector cache.
+   Copyright (C) 1999, 2001 Eelco Dolstra (eelco@cs.uu.nl).
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "cachepolicy.h"
+
+
+CachePolicy * cachePolicyTable[] =
+{
+   /* The first policy is the default. */
+   &cachePolicyLRU,
+   &cachePolicyCLOCK,
+   &cachePolicy2Q,
+   0
+};
+
+
+CachePolicy * coreFindCachePolicy(char * pszID)
+{
+   CachePolicy * * ppPolicy;
+   for (ppPolicy = cachePolicyTable; *ppPolicy; ppPolicy++)
+      if (stricmp((*ppPolicy)->pszID, pszID) == 0)
+         return *ppPolicy;
+   return 0;
+}
+
+
+/*
+ * Doubly-linked lists of sector indices.  The links are kept in an
+ * array indexed by sector index.
+ */
+
+
+typedef struct {
+      SectorIndex iNext;
+      SectorIndex iPrev;
+} IndexLink;
+
+typedef struct {
+      SectorIndex iFirst;
+      SectorIndex iLast;
+      unsigned int c;
+} IndexList;
+
+
+/* Add sector i at the head of the list. */
+static void addToList(IndexLink * paLinks, IndexList * pList,
+   SectorIndex i)
+{
+   paLinks[i].iNext = pList->iFirst;
+   paLinks[i].iPrev = 0;
+   if (pList->iFirst)
+      paLinks[pList->iFirst].iPrev = i;
+   else
+      pList->iLast = i;
+   pList->iFirst = i;
+   pList->c++;
+}
+
+
+static void removeFromList(IndexLink * paLinks, IndexList * pList,
+   SectorIndex i)
+{
+   if (paLinks[i].iPrev)
+      paLinks[paLinks[i].iPrev].iNext = paLinks[i].iNext;
+   else
+      pList->iFirst = paLinks[i].iNext;
+   if (paLinks[i].iNext)
+      paLinks[paLinks[i].iNext].iPrev = paLinks[i].iPrev;
+   else
+      pList->iLast = paLinks[i].iPrev;
+   pList->c--;
+}
+
+
+/* Grow an array of per-sector data of cbEntry bytes each from
+   iOldMax + 1 to iMax + 1 entries.  The new entries are zeroed. */
+static bool growArray(void * * ppa, unsigned int cbEntry,
+   SectorIndex iOldMax, SectorIndex iMax)
+{
+   octet * pa;
+   if (iMax <= iOldMax) return true;
+   pa = realloc(*ppa, (iMax + 1) * cbEntry);
+   if (!pa) return false;
+   memset(pa + (iOldMax + 1) * cbEntry, 0, (iMax - iOldMax) * cbEntry);
+   *ppa = pa;
+   return true;
+}
+
+
+/*
+ * LRU: evict the least recently used sector.
+ */
+
+
+typedef struct {
+      SectorIndex iMax;
+      IndexLink * paLinks;
+      IndexList mru;
+} LRUState;
+
+
+static void * lruCreate(unsigned int csMax)
+{
+   LRUState * pState = malloc(sizeof(LRUState));
+   if (!pState) return 0;
+   memset(&pState->mru, 0, sizeof(IndexList));
+   pState->iMax = csMax;
+   pState->paLinks = malloc((csMax + 1) * sizeof(IndexLink));
+   if (!pState->paLinks) {
+      free(pState);
+      return 0;
+   }
+   return pState;
+}
+
+
+static void lruDestroy(void * pState)
+{
+   free(((LRUState *) pState)->paLinks);
+   free(pState);
+}
+
+
+static bool lruResize(void * pState, unsigned int csMax,
+   SectorIndex iMax)
+{
+   LRUState * p = pState;
+   if (!growArray((void * *) &p->paLinks, sizeof(IndexLink),
+          p->iMax, iMax))
+      return false;
+   if (iMax > p->iMax) p->iMax = iMax;
+   return true;
+}
+
+
+static void lruInsert(void * pState, SectorIndex i,
+   CryptedFileID id, SectorNumber s)
+{
+   LRUState * p = pState;
+   addToList(p->paLinks, &p->mru, i);
+}
+
+
+static void lruTouch(void * pState, SectorIndex i)
+{
+   LRUState * p = pState;
+   if (p->mru.iFirst == i) return;
+   removeFromList(p->paLinks, &p->mru, i);
+   addToList(p->paLinks, &p->mru, i);
+}
+
+
+static void lruRemove(void * pState, SectorIndex i,
+   CryptedFileID id, SectorNumber s, bool fEvicted)
+{
+   LRUState * p = pState;
+   removeFromList(p->paLinks, &p->mru, i);
+}
+
+
+static SectorIndex lruNextVictim(void * pState, SectorIndex iSkip)
+{
+   LRUState * p = pState;
+   return iSkip ? p->paLinks[iSkip].iPrev : p->mru.iLast;
+}
+
+
+CachePolicy cachePolicyLRU = {
+   "lru",
+   "least recently used",
+   lruCreate,
+   lruDestroy,
+   lruResize,
+   lruInsert,
+   lruTouch,
+   lruRemove,
+   lruNextVictim
+};
+
+
+/*
+ * CLOCK: a clock hand sweeps over the sector pool and evicts the
+ * first sector that has not been referenced since the previous sweep.
+ * Newly inserted sectors start out unreferenced, so a sector that is
+ * read only once (e.g. by a sequential scan) goes on the first sweep.
+ * Hits are cheap: they only set a flag.
+ */
+
+
+#define CLOCK_FREE       0
+#define CLOCK_CACHED     1
+#define CLOCK_REFERENCED 2
+
+
+typedef struct {
+      SectorIndex iMax;
+      SectorIndex iHand;
+      octet * pabState; /* CLOCK_* */
+} ClockState;
+
+
+static void * clockCreate(unsigned int csMax)
+{
+   ClockState * pState = malloc(sizeof(ClockState));
+   if (!pState) return 0;
+   pState->iMax = csMax;
+   pState->iHand = 0;
+   pState->pabState = calloc(csMax + 1, 1);
+   if (!pState->pabState) {
+      free(pState);
+      return 0;
+   }
+   return pState;
+}
+
+
+static void clockDestroy(void * pState)
+{
+   free(((ClockState *) pState)->pabState);
+   free(pState);
+}
+
+
+static bool clockResize(void * pState, unsigned int csMax,
+   SectorIndex iMax)
+{
+   ClockState * p = pState;
+   if (!growArray((void * *) &p->pabState, 1, p->iMax, iMax))
+      return false;
+   if (iMax > p->iMax) p->iMax = iMax;
+   return true;
+}
+
+
+static void clockInsert(void * pState, SectorIndex i,
+   CryptedFileID id, SectorNumber s)
+{
+   ((ClockState *) pState)->pabState[i] = CLOCK_CACHED;
+}
+
+
+static void clockTouch(void * pState, SectorIndex i)
+{
+   ((ClockState *) pState)->pabState[i] = CLOCK_REFERENCED;
+}
+
+
+static void clockRemove(void * pState, SectorIndex i,
+   CryptedFileID id, SectorNumber s, bool fEvicted)
+{
+   ((ClockState *) pState)->pabState[i] = CLOCK_FREE;
+}
+
+
+static SectorIndex clockNextVictim(void * pState, SectorIndex iSkip)
+{
+   ClockState * p = pState;
+   unsigned int c;
+
+   /* Two sweeps suffice to find an unreferenced sector, if there are
+      any sectors at all. */
+   for (c = 0; c < 2 * p->iMax; c++) {
+      if (++p->iHand > p->iMax) p->iHand = 1;
+      switch (p->pabState[p->iHand]) {
+         case CLOCK_REFERENCED:
+            p->pabState[p->iHand] = CLOCK_CACHED;
+            break;
+         case CLOCK_CACHED:
+            return p->iHand;
+      }
+   }
+
+   return 0;
+}
+
+
+CachePolicy cachePolicyCLOCK = {
+   "clock",
+   "CLOCK (second chance)",
+   clockCreate,
+   clockDestroy,
+   clockResize,
+   clockInsert,
+   clockTouch,
+   clockRemove,
+   clockNextVictim
+};
+
+
+/*
+ * 2Q (Johnson & Shasha, VLDB '94).  Sectors enter the cache in the
+ * FIFO queue A1in.  Sectors evicted from A1in are remembered (by key
+ * only) in the ghost queue A1out.  A miss on a sector in A1out means
+ * it is part of the working set; it is then placed in the LRU queue
+ * Am.  Hits in A1in are ignored, so that sectors that are accessed
+ * several times in quick succession (e.g. by a sequential scan in
+ * small pieces) do not get promoted.
+ */
+
+
+#define Q_NONE   0
+#define Q_A1IN   1
+#define Q_AM     2
+
+/* Target size of A1in and A1out, in percent of the cache size. */
+#define A1IN_PERCENT  25
+#define A1OUT_PERCENT 50
+
+
+typedef struct {
+      uint32 id; /* 0 if this entry is not in use */
+      uint32 sectorNumber;
+      unsigned int iNextInHash; /* 1-based; 0 terminates */
+} GhostEntry;
+
+typedef struct {
+      SectorIndex iMax;
+      IndexLink * paLinks;
+      octet * pabQueue; /* Q_* */
+      IndexList a1in, am;
+      unsigned int csA1inMax;
+
+      /* A1out is a ring buffer of cGhosts entries; the oldest entry
+         is at iGhost.  A chained hash table finds entries by key. */
+      GhostEntry * paGhosts;
+      unsigned int cGhosts;
+      unsigned int iGhost;
+      unsigned int * paGhostHash; /* 1-based entry indices */
+      unsigned int cGhostHashBits;
+} TwoQState;
+
+
+static unsigned int ghostHash(TwoQState * p, CryptedFileID id,
+   SectorNumber s)
+{
+   return (((uint32) id * 0x9e3779b9 + (uint32) s) * 0x9e3779b9) >>
+      (32 - p->cGhostHashBits);
+}
+
+
+/* Find the ghost entry for the given key.  Returns a pointer to the
+   chain link that refers to it, or 0 if it's not there. */
+static unsigned int * findGhost(TwoQState * p, CryptedFileID id,
+   SectorNumber s)
+{
+   unsigned int * pi = &p->paGhostHash[ghostHash(p, id, s)];
+   GhostEntry * pGhost;
+   while (*pi) {
+      pGhost = &p->paGhosts[*pi - 1];
+      if (pGhost->id == (uint32) id && pGhost->sectorNumber == (uint32) s)
+         return pi;
+      pi = &pGhost->iNextInHash;
+   }
+   return 0;
+}
+
+
+static void removeGhost(TwoQState * p, unsigned int * pi)
+{
+   GhostEntry * pGhost = &p->paGhosts[*pi - 1];
+   *pi = pGhost->iNextInHash;
+   pGhost->id = 0;
+}
+
+
+/* Add a key to A1out, pushing out the oldest entry if it's full. */
+static void addGhost(TwoQState * p, CryptedFileID id, SectorNumber s)
+{
+   GhostEntry * pGhost = &p->paGhosts[p->iGhost];
+   unsigned int * pi;
+
+   if (pGhost->id) {
+      pi = findGhost(p, pGhost->id, pGhost->sectorNumber);
+      assert(pi && *pi == p->iGhost + 1);
+      removeGhost(p, pi);
+   }
+
+   pi = &p->paGhostHash[ghostHash(p, id, s)];
+   pGhost->id = id;
+   pGhost->sectorNumber = s;
+   pGhost->iNextInHash = *pi;
+   *pi = p->iGhost + 1;
+
+   p->iGhost = (p->iGhost + 1) % p->cGhosts;
+}
+
+
+static void twoQDestroy(void * pState)
+{
+   TwoQState * p = pState;
+   free(p->paLinks);
+   free(p->pabQueue);
+   free(p->paGhosts);
+   free(p->paGhostHash);
+   free(p);
+}
+
+
+/* Size A1in and A1out for a cache of csMax sectors.  A1out starts
+   out empty.  Returns false if out of memory, in which case A1out is
+   left as it was. */
+static bool sizeQueues(TwoQState * p, unsigned int csMax)
+{
+   GhostEntry * paGhosts;
+   unsigned int * paGhostHash, cGhosts, cGhostHashBits;
+
+   p->csA1inMax = csMax * A1IN_PERCENT / 100;
+   if (!p->csA1inMax) p->csA1inMax = 1;
+
+   cGhosts = csMax * A1OUT_PERCENT / 100;
+   if (!cGhosts) cGhosts = 1;
+   if (cGhosts == p->cGhosts) return true;
+   for (cGhostHashBits = 1;
+        (1U << cGhostHashBits) < cGhosts;
+        cGhostHashBits++) ;
+
+   paGhosts = calloc(cGhosts, sizeof(GhostEntry));
+   paGhostHash = calloc(1 << cGhostHashBits, sizeof(unsigned int));
+   if (!paGhosts || !paGhostHash) {
+      free(paGhosts);
+      free(paGhostHash);
+      return false;
+   }
+
+   free(p->paGhosts);
+   free(p->paGhostHash);
+   p->paGhosts = paGhosts;
+   p->cGhosts = cGhosts;
+   p->iGhost = 0;
+   p->paGhostHash = paGhostHash;
+   p->cGhostHashBits = cGhostHashBits;
+   return true;
+}
+
+
+static void * twoQCreate(unsigned int csMax)
+{
+   TwoQState * p = calloc(1, sizeof(TwoQState));
+   if (!p) return 0;
+
+   p->iMax = csMax;
+   p->paLinks = malloc((csMax + 1) * sizeof(IndexLink));
+   p->pabQueue = calloc(csMax + 1, 1);
+   if (!p->paLinks || !p->pabQueue || !sizeQueues(p, csMax)) {
+      twoQDestroy(p);
+      return 0;
+   }
+
+   return p;
+}
+
+
+/* If the ghosts cannot be reallocated, the old ones do. */
+static bool twoQResize(void * pState, unsigned int csMax,
+   SectorIndex iMax)
+{
+   TwoQState * p = pState;
+   if (!growArray((void * *) &p->paLinks, sizeof(IndexLink),
+          p->iMax, iMax) ||
+       !growArray((void * *) &p->pabQueue, 1, p->iMax, iMax))
+      return false;
+   if (iMax > p->iMax) p->iMax = iMax;
+   sizeQueues(p, csMax);
+   return true;
+}
+
+
+static void twoQInsert(void * pState, SectorIndex i,
+   CryptedFileID id, SectorNumber s)
+{
+   TwoQState * p = pState;
+   unsigned int * pi = findGhost(p, id, s);
+   if (pi) {
+      removeGhost(p, pi);
+      p->pabQueue[i] = Q_AM;
+      addToList(p->paLinks, &p->am, i);
+   } else {
+      p->pabQueue[i] = Q_A1IN;
+      addToList(p->paLinks, &p->a1in, i);
+   }
+}
+
+
+static void twoQTouch(void * pState, SectorIndex i)
+{
+   TwoQState * p = pState;
+   if (p->pabQueue[i] == Q_AM && p->am.iFirst != i) {
+      removeFromList(p->paLinks, &p->am, i);
+      addToList(p->paLinks, &p->am, i);
+   }
+}
+
+
+static void twoQRemove(void * pState, SectorIndex i,
+   CryptedFileID id, SectorNumber s, bool fEvicted)
+{
+   TwoQState * p = pState;
+   if (p->pabQueue[i] == Q_A1IN) {
+      removeFromList(p->paLinks, &p->a1in, i);
+      if (fEvicted) addGhost(p, id, s);
+   } else {
+      assert(p->pabQueue[i] == Q_AM);
+      removeFromList(p->paLinks, &p->am, i);
+   }
+   p->pabQueue[i] = Q_NONE;
+}
+
+
+static SectorIndex twoQNextVictim(void * pState, SectorIndex iSkip)
+{
+   TwoQState * p = pState;
+   IndexList * pFirst, * pSecond;
+
+   /* Evict from A1in if it exceeds its target size, otherwise from
+      Am.  If all candidates in that queue are skipped, go on with the
+      other queue. */
+   if (p->a1in.c > p->csA1inMax || !p->am.c)
+      pFirst = &p->a1in, pSecond = &p->am;
+   else
+      pFirst = &p->am, pSecond = &p->a1in;
+
+   if (!iSkip) return pFirst->iLast ? pFirst->iLast : pSecond->iLast;
+
+   if (p->paLinks[iSkip].iPrev) return p->paLinks[iSkip].iPrev;
+
+   /* End of iSkip's queue; switch to the other one. */
+   return p->pabQueue[iSkip] == Q_A1IN ? p->am.iLast : p->a1in.iLast;
+}
+
+
+CachePolicy cachePolicy2Q = {
+   "2q",
+   "2Q (scan resistant)",
+   twoQCreate,
+   twoQDestroy,
+   twoQResize,
+   twoQInsert,
+   twoQTouch,
+   twoQRemove,
+   twoQNextVictim
+};
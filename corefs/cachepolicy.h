@@ -0,0 +1,85 @@
+/* cachepolicy.h -- Header file to the sector cache replacement
+   policies.
+   Copyright (C) 1999, 2001 Eelco Dolstra (eelco@cs.uu.nl).
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.  */
+
+#ifndef _CACHEPOLICY_H
+#define _CACHEPOLICY_H
+
+#include "corefs.h"
+
+
+/* Cached sectors are identified by their index in the volume's sector
+   pool.  The pool may have more entries than the cache can hold, and
+   grows and shrinks with it, so the indices go up to a bound that is
+   given separately.  Index 0 is never allocated; it serves as the
+   null link. */
+typedef uint32 SectorIndex;
+
+typedef void * (* CreatePolicyState)(unsigned int csMax);
+typedef void (* DestroyPolicyState)(void * pState);
+typedef bool (* ResizePolicyState)(void * pState, unsigned int csMax,
+   SectorIndex iMax);
+typedef void (* InsertSector)(void * pState, SectorIndex i,
+   CryptedFileID id, SectorNumber s);
+typedef void (* TouchSector)(void * pState, SectorIndex i);
+typedef void (* RemoveSector)(void * pState, SectorIndex i,
+   CryptedFileID id, SectorNumber s, bool fEvicted);
+typedef SectorIndex (* NextVictim)(void * pState, SectorIndex iSkip);
+
+struct _CachePolicy {
+      char *             pszID;
+      char *             pszDescription;
+
+      /* Create the policy's state for a cache holding at most csMax
+         sectors, with indices up to csMax.  Returns 0 if out of
+         memory. */
+      CreatePolicyState  create;
+      DestroyPolicyState destroy;
+
+      /* The cache now holds at most csMax sectors, with indices up to
+         iMax.  iMax never decreases.  Returns false if out of memory,
+         in which case sectors above the old bound must not be
+         used. */
+      ResizePolicyState  resize;
+
+      /* Sector i, which holds sector s of file id, has been added to
+         the cache after a miss. */
+      InsertSector       insertSector;
+
+      /* Sector i has been accessed (a hit). */
+      TouchSector        touchSector;
+
+      /* Sector i is being removed from the cache.  fEvicted is true
+         if it was chosen by nextVictim(), false if it was deleted
+         for another reason (e.g. the file was truncated). */
+      RemoveSector       removeSector;
+
+      /* Return the next sector to evict.  iSkip is 0 at the start of
+         a purge; otherwise it is the previous candidate, which the
+         cache did not evict (and is still in the cache). */
+      NextVictim         nextVictim;
+};
+
+
+extern CachePolicy cachePolicyLRU;
+extern CachePolicy cachePolicyCLOCK;
+extern CachePolicy cachePolicy2Q;
+
+
+#endif /* !_CACHEPOLICY_H */
@@ -27,6 +27,7 @@
 
 
 typedef struct _CryptedVolume CryptedVolume;
+typedef struct _CryptedSector CryptedSector;
 
 typedef unsigned long CryptedFileID;
 typedef unsigned long SectorNumber;
@@ -68,17 +69,26 @@ CoreResult sys2core(SysResult sr);
  * Sector data encryption/decryption
  */
 
+/* The sector size of a volume (see cbSector) is a power of 2
+   between SECTOR_SIZE and MAX_SECTOR_SIZE.  SECTOR_SIZE is the
+   default, and the size of the sector in the encrypted superblock. */
 #define SECTOR_SIZE 512
+#define MAX_SECTOR_SIZE 4096
 #define RANDOM_SIZE 4
 #define CHECKSUM_SIZE 4
 #define NONPAYLOAD_SIZE (CHECKSUM_SIZE + RANDOM_SIZE)
 #define PAYLOAD_SIZE (SECTOR_SIZE - NONPAYLOAD_SIZE)
+#define MAX_PAYLOAD_SIZE (MAX_SECTOR_SIZE - NONPAYLOAD_SIZE)
 
+/* The payload of a sector of cbSector bytes. */
+#define PAYLOAD_SIZE_OF(cbSector) ((cbSector) - NONPAYLOAD_SIZE)
+
+/* Only the first cbSector bytes of this structure are used. */
 typedef struct {
       /* random and checksum constitute a 64-bit IV. */
       octet random[RANDOM_SIZE];
       octet checksum[CHECKSUM_SIZE];
-      octet payload[PAYLOAD_SIZE];
+      octet payload[MAX_PAYLOAD_SIZE];
 } CryptedSectorData;
 
 /* Flags for encryption/decryption. */
@@ -87,11 +97,13 @@ typedef struct {
 
 /* pSrc may be equal to pabDst. */
 void coreEncryptSectorData(CryptedSectorData * pSrc,
-   octet * pabDst, Key * pKey, unsigned int flFlags);
+   octet * pabDst, unsigned int cbSector, Key * pKey,
+   unsigned int flFlags);
 
-/* pabSrc must be different from pDst. */
+/* pabSrc may be equal to pDst. */
 CoreResult coreDecryptSectorData(octet * pabSrc,
-   CryptedSectorData * pDst, Key * pKey, unsigned int flFlags);
+   CryptedSectorData * pDst, unsigned int cbSector, Key * pKey,
+   unsigned int flFlags);
 
 
 /*
@@ -100,16 +112,85 @@ CoreResult coreDecryptSectorData(octet * pabSrc,
 
 #define MAX_VOLUME_BASE_PATH_NAME 256
 
+/* Storage files are called "xxxxxxxx.enc" after their file ID.  A
+   sharded volume spreads them over two levels of 256 subdirectories
+   named after the low and the next byte of the ID, i.e.
+   "01/23/00002301.enc". */
+#define CSTOR_SHARDED 1
+
+#define MAX_STORAGE_FILE_NAME 18 /* excl. null */
+
+/* Store the name of the storage file of id, relative to the base
+   path, in pszName. */
+void coreMakeStorageFileName(unsigned int flStorageFlags,
+   CryptedFileID id, char * pszName);
+
+/* Replacement policies for the sector cache (see cachepolicy.h).
+   The table is terminated by a null pointer; the first entry is the
+   default. */
+typedef struct _CachePolicy CachePolicy;
+extern CachePolicy * cachePolicyTable[];
+CachePolicy * coreFindCachePolicy(char * pszID);
+
+/* Flags for the sector cache. */
+#define CCACHE_LOCK      1 /* lock the cache in memory */
+#define CCACHE_HUGEPAGES 2 /* back the cache with huge pages */
+#define CCACHE_IORING    4 /* submit batched I/O through an I/O ring */
+#define CCACHE_PRESSURE  8 /* shrink the cache under memory pressure */
+
 typedef struct {
       unsigned int flCryptoFlags; /* CCRYPT_* */
       unsigned int flOpenFlags; /* SOF_* */
+      unsigned int flStorageFlags; /* CSTOR_* */
+      /* Set from the superblock (see coreReadSuperBlock()). */
+      unsigned int cbSector; /* power of 2, SECTOR_SIZE..MAX_SECTOR_SIZE */
       Cred cred;
       bool fReadOnly;
+      /* Files with sectors in the cache are kept in memory even
+         beyond cMaxCryptedFiles. */
       unsigned int cMaxCryptedFiles; /* > 0 */
-      unsigned int cMaxOpenStorageFiles; /* > 0, <= cMaxCryptedFiles */
+      /* 0 = half of what the process may have open (see
+         sysQueryMaxOpenFiles()), but no more than cMaxCryptedFiles. */
+      unsigned int cMaxOpenStorageFiles; /* <= cMaxCryptedFiles */
       unsigned int csMaxCached; /* > 0 */
+      unsigned int flCacheFlags; /* CCACHE_* */
+      /* With CCACHE_PRESSURE, the writeback thread shrinks the cache
+         while the memory pressure (see sysQueryMemoryPressure()) is
+         at least this. */
+      unsigned int nMemPressure; /* 1/100 % */
+      CachePolicy * pCachePolicy; /* 0 = default */
       unsigned int csIOGranularity; /* > 0, <= csMaxCached */
       unsigned int csISFGrow; /* > 0 */
+      /* Background writeback (see coreStartWriteBack()). */
+      unsigned int cWriteBackAge; /* seconds, > 0 */
+      unsigned int nWriteBackRatio; /* % of csMaxCached, 1-100 */
+      unsigned int cbWriteBackRate; /* bytes/second, 0 = unlimited */
+      /* Readahead (see coreStartReadAhead()). */
+      unsigned int csMaxReadAhead; /* 0 = no readahead */
+      /* Reads and writes of at least this many sectors bypass the
+         cache (see coreReadFromFileEx() and coreWriteToFileEx()). */
+      unsigned int csStreamThreshold; /* 0 = never */
+      /* Batches of at least csCryptoCutoff sectors are encrypted or
+         decrypted by cCryptoThreads threads plus the caller. */
+      unsigned int cCryptoThreads; /* 0 = just the caller */
+      unsigned int csCryptoCutoff;
+      /* Number of files whose decoded info is kept in memory (see
+         coreQueryFileInfo()).  Programs that write info sectors
+         directly must set this to 0. */
+      unsigned int cInfoCache; /* 0 = none */
+      /* Number of entries of the ISF free list kept in memory (see
+         coreAllocID()).  Programs that write the free list directly
+         must set this to 0. */
+      unsigned int cFreeIDs; /* 0 = none */
+      /* Called when the volume goes from having no dirty sectors to
+         having some, and back.  It is called after the operation
+         that made the change has released the volume's lock, and by
+         one thread at a time (not necessarily the one that made the
+         change, which doesn't wait for it); fDirty is the state at
+         the time of the call, so a call may be skipped if the state
+         has flipped back in the meantime.  It may query the volume
+         (coreQueryVolumeParms(), coreQueryVolumeStats()), but must
+         not access its files or sectors. */
       void (* dirtyCallBack)(CryptedVolume * pVolume, bool fDirty);
       void * pUserData;
       CoreNameComp nameComp;
@@ -120,6 +201,8 @@ typedef struct {
       unsigned int cOpenStorageFiles;
       unsigned int csInCache;
       unsigned int csDirty;
+      unsigned long cCacheHits; /* sectors found in the cache */
+      unsigned long cCacheMisses; /* sectors read or created */
 } CryptedVolumeStats;
 
 
@@ -130,11 +213,42 @@ CoreResult coreAccessVolume(char * pszBasePath, Key * pKey,
 
 CoreResult coreDropVolume(CryptedVolume * pVolume);
 
+/* Write all dirty sectors to disk.  As with the writeback thread,
+   the sectors are encrypted and written without holding the volume
+   lock, so other threads can go on using the cache meanwhile;
+   sectors that they dirty may or may not be written by the flush. */
 CoreResult coreFlushVolume(CryptedVolume * pVolume);
 
 CoreResult coreShrinkOpenStorageFiles(CryptedVolume * pVolume,
    unsigned int cFiles);
 
+/* Change csMaxCached and cMaxCryptedFiles of a volume that is in use
+   (0 leaves a limit as it is).  When the cache shrinks, sectors are
+   evicted (dirty ones are written first) and memory that is no longer
+   needed is given back to the system; sectors that others have
+   pinned go when they are unpinned.  cMaxOpenStorageFiles is lowered
+   to cMaxCryptedFiles if necessary. */
+CoreResult coreSetVolumeCacheLimits(CryptedVolume * pVolume,
+   unsigned int csMaxCached, unsigned int cMaxCryptedFiles);
+
+/* Start/stop a thread that writes dirty sectors in the background.
+   A sector is written once it has been dirty for cWriteBackAge
+   seconds, or earlier if more than nWriteBackRatio percent of the
+   cache is dirty.  While the writeback thread is running,
+   dirtyCallBack may be called from that thread.  With
+   CCACHE_PRESSURE, it also keeps an eye on the memory pressure. */
+CoreResult coreStartWriteBack(CryptedVolume * pVolume);
+void coreStopWriteBack(CryptedVolume * pVolume);
+
+/* Start/stop a thread that reads sectors ahead of sequential readers.
+   Each file's fetches are watched; while they continue where the
+   previous one left off, the following sectors (up to csMaxReadAhead,
+   but no more than a quarter of the cache) are read and decrypted in
+   the background.  The window starts small, doubles while the reader
+   stays sequential and halves on random access. */
+CoreResult coreStartReadAhead(CryptedVolume * pVolume);
+void coreStopReadAhead(CryptedVolume * pVolume);
+
 CryptedVolumeParms * coreQueryVolumeParms(CryptedVolume * pVolume);
 
 void coreQueryVolumeStats(CryptedVolume * pVolume,
@@ -156,6 +270,14 @@ CoreResult coreFlushFile(CryptedVolume * pVolume, CryptedFileID id);
 CoreResult coreSuggestFileAllocation(CryptedVolume * pVolume,
    CryptedFileID id, SectorNumber csAllocate);
 
+/* The functions of this module can be called from several threads
+   at the same time.  Sequences of calls that must not be interleaved
+   with others on the same file (like the read-modify-write of a file's
+   info sector) are serialised by locking the file.  A thread must not
+   lock one file while holding the lock of another. */
+void coreLockFile(CryptedVolume * pVolume, CryptedFileID id);
+void coreUnlockFile(CryptedVolume * pVolume, CryptedFileID id);
+
 
 /*
  * Sectors
@@ -188,6 +310,58 @@ CoreResult coreSetSectorData(CryptedVolume * pVolume,
    CryptedFileID id, SectorNumber s, unsigned int offset,
    unsigned int bytes, unsigned int flFlags, const void * pBuffer);
 
+/* Pin the sectors sStart to sStart + csExtent - 1 of a file in the
+   cache and store them in papSectors.  A pinned sector is not
+   evicted, so its payload can be used in place instead of being
+   copied with coreQuerySectorData() and coreSetSectorData().  After
+   changing a payload, call coreDirtySector().  Serialising access to
+   the payload with other threads is up to the caller (e.g. by means
+   of coreLockFile()).  Pinned sectors take up room in the cache, and
+   others may have to wait for them, so pin a few at a time (not more
+   than csIOGranularity, say) and unpin them before calling other
+   functions of this module.  On error, nothing is left pinned,
+   unless the error is CORERC_BAD_CHECKSUM and CFETCH_ADD_BAD was
+   specified. */
+CoreResult corePinSectors(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber sStart, SectorNumber csExtent,
+   unsigned int flFlags, CryptedSector * * papSectors);
+
+void coreUnpinSectors(CryptedVolume * pVolume, SectorNumber csExtent,
+   CryptedSector * * papSectors);
+
+/* Borrow room for a list of csIOGranularity sectors to pass to
+   corePinSectors() from the volume's pool of scratch space, so that
+   the caller doesn't have to allocate it on every call.  It must be
+   given back with coreReleaseSectorList(). */
+CoreResult coreGetSectorList(CryptedVolume * pVolume,
+   CryptedSector * * * ppapSectors);
+
+void coreReleaseSectorList(CryptedVolume * pVolume,
+   CryptedSector * * papSectors);
+
+octet * coreQuerySectorPayload(CryptedVolume * pVolume,
+   CryptedSector * pSector);
+
+CoreResult coreDirtySector(CryptedVolume * pVolume,
+   CryptedSector * pSector);
+
+/* Read the payload of sectors sStart to sStart + csExtent - 1 of a
+   file into pabBuffer (PAYLOAD_SIZE_OF(cbSector) bytes per sector)
+   without adding them to the cache, for data that is read once.
+   Sectors that are in the cache are taken from there.  The caller
+   must keep others from writing to these sectors meanwhile. */
+CoreResult coreStreamSectors(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber sStart, SectorNumber csExtent,
+   octet * pabBuffer);
+
+/* The reverse: encrypt the payload of sectors sStart to sStart +
+   csExtent - 1 from pabBuffer and write them to disk right away.
+   Cached copies of the sectors are dropped.  The caller must keep
+   others from using these sectors meanwhile. */
+CoreResult coreWriteSectorsThrough(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber sStart, SectorNumber csExtent,
+   const octet * pabBuffer);
+
 
 /*
  * Info sector management
@@ -208,6 +382,18 @@ CoreResult coreSetSectorData(CryptedVolume * pVolume,
 #define INFOSECTOR_MAGIC_FREE  0x17dc3b07
 
 
+/* The volume keeps the first cFreeIDs entries of the ISF free list
+   in memory, so that allocating and freeing IDs doesn't have to walk
+   the on-disk list. */
+typedef struct _FreeIDs FreeIDs;
+
+CoreResult coreCreateFreeIDs(unsigned int cMaxIDs, FreeIDs * * ppFreeIDs);
+
+void coreDestroyFreeIDs(FreeIDs * pFreeIDs);
+
+/* Return the volume's FreeIDs, or 0 if it has none. */
+FreeIDs * coreQueryFreeIDs(CryptedVolume * pVolume);
+
 CoreResult coreInitISF(CryptedVolume * pVolume);
 
 CoreResult coreAllocID(CryptedVolume * pVolume, CryptedFileID * pid);
@@ -358,10 +544,37 @@ CoreResult coreReadFromFile(CryptedVolume * pVolume, CryptedFileID id,
    CryptedFilePos fpStart, CryptedFilePos cbLength, octet * pabBuffer,
    CryptedFilePos * pcbRead);
 
+/* Flags for coreReadFromFileEx(). */
+
+/* CREAD_STREAM: read the whole sectors of the range straight into
+   the buffer, without adding them to the cache.  This is done anyway
+   if the range covers csStreamThreshold sectors or more. */
+#define CREAD_STREAM          0x01
+
+CoreResult coreReadFromFileEx(CryptedVolume * pVolume, CryptedFileID id,
+   CryptedFilePos fpStart, CryptedFilePos cbLength, octet * pabBuffer,
+   CryptedFilePos * pcbRead, unsigned int flFlags);
+
 CoreResult coreWriteToFile(CryptedVolume * pVolume, CryptedFileID id,
    CryptedFilePos fpStart, CryptedFilePos cbLength, const octet * pabBuffer,
    CryptedFilePos * pcbWritten);
 
+/* Flags for coreWriteToFileEx(). */
+
+/* CWRITE_STREAM: write the whole sectors of the range straight to
+   disk, without going through the cache.  This is done anyway if the
+   range covers csStreamThreshold sectors or more. */
+#define CWRITE_STREAM         0x01
+
+/* CWRITE_STAMP: set the file's last-write time to the current time.
+   This happens in the same info update that records the new size, so
+   a write costs at most one change to the info sector. */
+#define CWRITE_STAMP          0x02
+
+CoreResult coreWriteToFileEx(CryptedVolume * pVolume, CryptedFileID id,
+   CryptedFilePos fpStart, CryptedFilePos cbLength, const octet * pabBuffer,
+   CryptedFilePos * pcbWritten, unsigned int flFlags);
+
 CoreResult coreSetFileSize(CryptedVolume * pVolume, CryptedFileID id,
    CryptedFilePos cbFileSize);
 
@@ -0,0 +1,43 @@
+/* crc32.h -- Header file to the 32-bit CRC calculation.
+   Copyright (C) 1999, 2001 Eelco Dolstra (eelco@cs.uu.nl).
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.  */
+
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include "sysdep.h"
+
+
+/* Return the CRC-32 (as in gzip) of the cb bytes at p.  This uses
+   the fastest implementation that the CPU supports. */
+uint32 coreCRC32(octet * p, unsigned int cb);
+
+/* The implementations, for testing and benchmarking.  They take and
+   return the CRC register, i.e., without the initial and final
+   inversion done by coreCRC32(), so they can be chained.
+   coreCRC32Folded() uses PCLMULQDQ, so it must only be called if
+   coreHaveFoldedCRC32() returns true.  (If AEFS was built without
+   support for it, it is just coreCRC32Sliced().) */
+uint32 coreCRC32Bytewise(uint32 crc, octet * p, unsigned int cb);
+uint32 coreCRC32Sliced(uint32 crc, octet * p, unsigned int cb);
+uint32 coreCRC32Folded(uint32 crc, octet * p, unsigned int cb);
+
+bool coreHaveFoldedCRC32(void);
+
+
+#endif /* !_CRC32_H */
@@ -0,0 +1,182 @@
+/* cryptpool.c -- Threads that encrypt and decrypt sectors in parallel.
+   Copyright (C) 1999, 2001 Eelco Dolstra (eelco@cs.uu.nl).
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.  */
+
+#include <stdlib.h>
+
+#include "cryptpool.h"
+
+
+/* Items are handed out this many at a time: enough to make the cost
+   of taking the pool's lock negligible next to the work, few enough
+   to spread an extent evenly. */
+#define CHUNK_SIZE 8
+
+
+struct _CryptPool {
+      SysMutex * pLock;
+      SysCond * pWake; /* a job has come in, or fStop was set */
+      SysCond * pDone; /* the last item of the job has finished */
+
+      unsigned int cThreads;
+      SysThread * * papThreads;
+      bool fStop;
+
+      /* The current job, if fBusy.  Items iNext and up have not been
+         handed out yet; cDone have finished. */
+      bool fBusy;
+      unsigned int cItems;
+      CryptItem pFunc;
+      void * pArg;
+      unsigned int iNext;
+      unsigned int cDone;
+};
+
+
+/* Run the next chunk of the current job.  The lock is released
+   meanwhile. */
+static void runChunk(CryptPool * pPool)
+{
+   CryptItem pFunc = pPool->pFunc;
+   void * pArg = pPool->pArg;
+   unsigned int iStart = pPool->iNext, iEnd, i;
+
+   iEnd = iStart + CHUNK_SIZE;
+   if (iEnd > pPool->cItems) iEnd = pPool->cItems;
+   pPool->iNext = iEnd;
+
+   sysUnlockMutex(pPool->pLock);
+   for (i = iStart; i < iEnd; i++)
+      pFunc(pArg, i);
+   sysLockMutex(pPool->pLock);
+
+   pPool->cDone += iEnd - iStart;
+   if (pPool->cDone == pPool->cItems)
+      sysSignalCond(pPool->pDone);
+}
+
+
+static void workerThread(void * pArg)
+{
+   CryptPool * pPool = pArg;
+
+   sysLockMutex(pPool->pLock);
+   while (!pPool->fStop) {
+      if (pPool->fBusy && pPool->iNext < pPool->cItems)
+         runChunk(pPool);
+      else
+         sysWaitCond(pPool->pWake, pPool->pLock, 0);
+   }
+   sysUnlockMutex(pPool->pLock);
+}
+
+
+CoreResult coreCreateCryptPool(unsigned int cThreads,
+   CryptPool * * ppPool)
+{
+   CryptPool * pPool;
+   unsigned int i;
+
+   *ppPool = 0;
+
+   pPool = malloc(sizeof(CryptPool));
+   if (!pPool) return CORERC_NOT_ENOUGH_MEMORY;
+   pPool->pLock = 0;
+   pPool->pWake = 0;
+   pPool->pDone = 0;
+   pPool->cThreads = 0;
+   pPool->fStop = false;
+   pPool->fBusy = false;
+
+   pPool->papThreads = malloc(cThreads * sizeof(SysThread *));
+   if (!pPool->papThreads ||
+       sysCreateMutex(&pPool->pLock) ||
+       sysCreateCond(&pPool->pWake) ||
+       sysCreateCond(&pPool->pDone))
+   {
+      coreDestroyCryptPool(pPool);
+      return CORERC_NOT_ENOUGH_MEMORY;
+   }
+
+   for (i = 0; i < cThreads; i++) {
+      if (sysCreateThread(workerThread, pPool,
+             &pPool->papThreads[i]))
+      {
+         coreDestroyCryptPool(pPool);
+         return CORERC_NOT_ENOUGH_MEMORY;
+      }
+      pPool->cThreads++;
+   }
+
+   *ppPool = pPool;
+   return CORERC_OK;
+}
+
+
+void coreDestroyCryptPool(CryptPool * pPool)
+{
+   unsigned int i;
+
+   if (pPool->cThreads) {
+      sysLockMutex(pPool->pLock);
+      pPool->fStop = true;
+      sysSignalCond(pPool->pWake);
+      sysUnlockMutex(pPool->pLock);
+      for (i = 0; i < pPool->cThreads; i++)
+         sysJoinThread(pPool->papThreads[i]);
+   }
+
+   if (pPool->pDone) sysDestroyCond(pPool->pDone);
+   if (pPool->pWake) sysDestroyCond(pPool->pWake);
+   if (pPool->pLock) sysDestroyMutex(pPool->pLock);
+   free(pPool->papThreads);
+   free(pPool);
+}
+
+
+void coreRunCryptJob(CryptPool * pPool, unsigned int cItems,
+   CryptItem pFunc, void * pArg)
+{
+   unsigned int i;
+
+   sysLockMutex(pPool->pLock);
+
+   if (pPool->fBusy) {
+      sysUnlockMutex(pPool->pLock);
+      for (i = 0; i < cItems; i++)
+         pFunc(pArg, i);
+      return;
+   }
+
+   pPool->fBusy = true;
+   pPool->cItems = cItems;
+   pPool->pFunc = pFunc;
+   pPool->pArg = pArg;
+   pPool->iNext = 0;
+   pPool->cDone = 0;
+   sysSignalCond(pPool->pWake);
+
+   /* Lend a hand, then wait for the chunks that others are at. */
+   while (pPool->iNext < pPool->cItems)
+      runChunk(pPool);
+   while (pPool->cDone < pPool->cItems)
+      sysWaitCond(pPool->pDone, pPool->pLock, 0);
+
+   pPool->fBusy = false;
+   sysUnlockMutex(pPool->pLock);
+}
@@ -0,0 +1,46 @@
+/* cryptpool.h -- Header file to the crypto worker pool.
+   Copyright (C) 1999, 2001 Eelco Dolstra (eelco@cs.uu.nl).
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.  */
+
+#ifndef _CRYPTPOOL_H
+#define _CRYPTPOOL_H
+
+#include "corefs.h"
+
+
+/* A pool of threads that encrypt or decrypt the sectors of an extent
+   in parallel.  A job calls pFunc(pArg, i) for every i from 0 to
+   cItems - 1; the calls must be independent of each other.  The
+   items are handed out a chunk at a time to the pool's threads and
+   to the thread that runs the job, which returns when all calls have
+   finished.  The pool runs one job at a time; if it is busy, the job
+   is simply run by the calling thread. */
+typedef struct _CryptPool CryptPool;
+
+typedef void (* CryptItem)(void * pArg, unsigned int i);
+
+CoreResult coreCreateCryptPool(unsigned int cThreads,
+   CryptPool * * ppPool);
+
+void coreDestroyCryptPool(CryptPool * pPool);
+
+void coreRunCryptJob(CryptPool * pPool, unsigned int cItems,
+   CryptItem pFunc, void * pArg);
+
+
+#endif /* !_CRYPTPOOL_H */
@@ -75,21 +75,6 @@ static CoreResult readExternalEAs(CryptedVolume * pVolume,
 }
 
 
-static CoreResult readInternalEAs(CryptedVolume * pVolume,
-   CryptedFileID id, unsigned int cbEAs, octet * pabEAs)
-{
-   CoreResult cr;
-
-   /* Read the EAs from the file's info sector. */
-   cr = coreQuerySectorData(pVolume, INFOSECTORFILE_ID,
-      coreQueryInfoSectorNumber(pVolume, id),
-      sizeof(CryptedFileInfoOnDisk) + FILEINFO_RESERVED, cbEAs,
-      0, pabEAs);
-   
-   return CORERC_OK;
-}
-
-
 static CoreResult decodeEAs(unsigned int cbEAs, octet * pabEAs,
    CryptedEA * * ppEAs)
 {
@@ -151,6 +136,30 @@ static CoreResult getInfoAndVerify(CryptedVolume * pVolume,
 }
 
 
+/* Internal EAs are decoded in place in the file's info sector.  The
+   file is locked so that nobody rewrites them while we are at it. */
+static CoreResult decodeInternalEAs(CryptedVolume * pVolume,
+   CryptedFileID id, unsigned int cbEAs, CryptedEA * * ppEAs)
+{
+   CoreResult cr;
+   CryptedSector * pSector;
+
+   coreLockFile(pVolume, id);
+   
+   cr = corePinSectors(pVolume, INFOSECTORFILE_ID,
+      coreQueryInfoSectorNumber(pVolume, id), 1, 0, &pSector);
+   if (!cr) {
+      cr = decodeEAs(cbEAs, coreQuerySectorPayload(pVolume, pSector) +
+         sizeof(CryptedFileInfoOnDisk) + FILEINFO_RESERVED, ppEAs);
+      coreUnpinSectors(pVolume, 1, &pSector);
+   }
+
+   coreUnlockFile(pVolume, id);
+
+   return cr;
+}
+
+
 CoreResult coreQueryEAs(CryptedVolume * pVolume,
    CryptedFileID id, CryptedEA * * ppEAs)
 {
@@ -179,6 +188,7 @@ CoreResult coreQueryEAs(CryptedVolume * pVolume,
 
       if (info.cbEAs > MAX_INTERNAL_EAS) return CORERC_BAD_EAS;
 
+      return decodeInternalEAs(pVolume, id, info.cbEAs, ppEAs);
    }
 
    /* Allocate a buffer for the encoded EA data. */
@@ -186,10 +196,8 @@ CoreResult coreQueryEAs(CryptedVolume * pVolume,
    if (!pabEAs) return CORERC_NOT_ENOUGH_MEMORY;
 
    /* Get the EA data. */
-   cr = info.flFlags & CFF_EXTEAS
-      ? readExternalEAs(pVolume, info.idEAFile,
-         &info2, info.cbEAs, pabEAs)
-      : readInternalEAs(pVolume, id, info.cbEAs, pabEAs);
+   cr = readExternalEAs(pVolume, info.idEAFile,
+      &info2, info.cbEAs, pabEAs);
    if (cr) {
       sysFreeSecureMem(pabEAs);
       return cr;
@@ -284,11 +292,14 @@ static CoreResult writeInternalEAs(CryptedVolume * pVolume,
 
    assert(cbEAs <= MAX_INTERNAL_EAS);
 
-   /* Write the new encoded EA set. */
+   /* Write the new encoded EA set.  Readers decode it in place (see
+      decodeInternalEAs()), so lock the file. */
+   coreLockFile(pVolume, id);
    cr = coreSetSectorData(pVolume, INFOSECTORFILE_ID,
       coreQueryInfoSectorNumber(pVolume, id),
       sizeof(CryptedFileInfoOnDisk) + FILEINFO_RESERVED, cbEAs,
       0, pabEAs);
+   coreUnlockFile(pVolume, id);
    if (cr) return cr;
    
    return CORERC_OK;
@@ -0,0 +1,170 @@
+/* infocache.c -- Cache of decoded file info.
+   Copyright (C) 1999, 2001 Eelco Dolstra (eelco@cs.uu.nl).
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.  */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "infocache.h"
+
+
+/* A slot is empty iff id is 0.  seq is incremented whenever an
+   update of a file in the slot begins or ends, or a file is
+   forgotten; cUpdating is the number of updates in progress. */
+typedef struct {
+      CryptedFileID id;
+      CryptedFileInfo info;
+      unsigned int seq;
+      unsigned int cUpdating;
+} InfoSlot;
+
+struct _InfoCache {
+      SysMutex * pLock;
+
+      /* The table has 2^cBits slots. */
+      InfoSlot * paSlots;
+      unsigned int cBits;
+};
+
+
+static inline InfoSlot * slotOf(InfoCache * pCache, CryptedFileID id)
+{
+   return &pCache->paSlots[(uint32) ((uint32) id * 2654435761U) >>
+      (32 - pCache->cBits)];
+}
+
+
+CoreResult coreCreateInfoCache(unsigned int cEntries,
+   InfoCache * * ppCache)
+{
+   InfoCache * pCache;
+
+   *ppCache = 0;
+
+   pCache = malloc(sizeof(InfoCache));
+   if (!pCache) return CORERC_NOT_ENOUGH_MEMORY;
+
+   for (pCache->cBits = 1;
+        pCache->cBits < 24 && 1U << pCache->cBits < cEntries;
+        pCache->cBits++) ;
+   pCache->pLock = 0;
+
+   pCache->paSlots = calloc(1 << pCache->cBits, sizeof(InfoSlot));
+   if (!pCache->paSlots || sysCreateMutex(&pCache->pLock)) {
+      coreDestroyInfoCache(pCache);
+      return CORERC_NOT_ENOUGH_MEMORY;
+   }
+
+   *ppCache = pCache;
+   return CORERC_OK;
+}
+
+
+void coreDestroyInfoCache(InfoCache * pCache)
+{
+   if (pCache->pLock) sysDestroyMutex(pCache->pLock);
+   free(pCache->paSlots);
+   free(pCache);
+}
+
+
+bool coreLookupInfo(InfoCache * pCache, CryptedFileID id,
+   CryptedFileInfo * pInfo, unsigned int * pSeq)
+{
+   InfoSlot * pSlot;
+   bool fFound;
+
+   sysLockMutex(pCache->pLock);
+   pSlot = slotOf(pCache, id);
+   fFound = pSlot->id == id;
+   if (fFound)
+      *pInfo = pSlot->info;
+   else
+      *pSeq = pSlot->seq;
+   sysUnlockMutex(pCache->pLock);
+
+   return fFound;
+}
+
+
+void coreStoreInfo(InfoCache * pCache, CryptedFileID id,
+   CryptedFileInfo * pInfo, unsigned int seq)
+{
+   InfoSlot * pSlot;
+
+   sysLockMutex(pCache->pLock);
+   pSlot = slotOf(pCache, id);
+   if (seq == pSlot->seq && !pSlot->cUpdating) {
+      pSlot->id = id;
+      pSlot->info = *pInfo;
+   }
+   sysUnlockMutex(pCache->pLock);
+}
+
+
+bool coreBeginInfoUpdate(InfoCache * pCache, CryptedFileID id,
+   CryptedFileInfo * pInfo, unsigned int * pSeq)
+{
+   InfoSlot * pSlot;
+   bool fSame;
+
+   sysLockMutex(pCache->pLock);
+   pSlot = slotOf(pCache, id);
+   fSame = pSlot->id == id &&
+      !memcmp(&pSlot->info, pInfo, sizeof(CryptedFileInfo));
+   if (!fSame) {
+      if (pSlot->id == id) pSlot->id = 0;
+      *pSeq = ++pSlot->seq;
+      pSlot->cUpdating++;
+   }
+   sysUnlockMutex(pCache->pLock);
+
+   return fSame;
+}
+
+
+/* The new info is only stored if nobody else has started updating
+   the slot in the meantime, or is still at it; otherwise we can't
+   tell whose info sector write came last. */
+void coreEndInfoUpdate(InfoCache * pCache, CryptedFileID id,
+   CryptedFileInfo * pInfo, unsigned int seq)
+{
+   InfoSlot * pSlot;
+
+   sysLockMutex(pCache->pLock);
+   pSlot = slotOf(pCache, id);
+   pSlot->cUpdating--;
+   if (pInfo && seq == pSlot->seq && !pSlot->cUpdating) {
+      pSlot->id = id;
+      pSlot->info = *pInfo;
+   }
+   pSlot->seq++;
+   sysUnlockMutex(pCache->pLock);
+}
+
+
+void coreForgetInfo(InfoCache * pCache, CryptedFileID id)
+{
+   InfoSlot * pSlot;
+
+   sysLockMutex(pCache->pLock);
+   pSlot = slotOf(pCache, id);
+   if (pSlot->id == id) pSlot->id = 0;
+   pSlot->seq++;
+   sysUnlockMutex(pCache->pLock);
+}
@@ -0,0 +1,75 @@
+/* infocache.h -- Header file to the cache of decoded file info.
+   Copyright (C) 1999, 2001 Eelco Dolstra (eelco@cs.uu.nl).
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.  */
+
+#ifndef _INFOCACHE_H
+#define _INFOCACHE_H
+
+#include "corefs.h"
+
+
+/* A cache of the decoded contents of info sectors, so that
+   coreQueryFileInfo() doesn't have to go to the sector cache and
+   decode the info sector every time.  It is direct-mapped: a file ID
+   can only be in one slot, and pushes out whatever was there.
+
+   The info sector remains the authority; the cache only holds copies
+   of what is in it.  The cache is not locked while info sectors are
+   read or written.  Instead, each slot has a sequence number, which
+   changes whenever an update (coreBeginInfoUpdate() ...
+   coreEndInfoUpdate()) of a file in the slot begins or ends.  A
+   lookup that misses returns it, and coreStoreInfo() checks it, so
+   that the decoded info isn't stored if there has been an update
+   since; an update only stores the new info if no other update of
+   the slot overlapped it. */
+typedef struct _InfoCache InfoCache;
+
+CoreResult coreCreateInfoCache(unsigned int cEntries,
+   InfoCache * * ppCache);
+
+void coreDestroyInfoCache(InfoCache * pCache);
+
+/* Return true and the info if the file is in the cache.  Otherwise,
+   return false and the sequence number to pass to coreStoreInfo(). */
+bool coreLookupInfo(InfoCache * pCache, CryptedFileID id,
+   CryptedFileInfo * pInfo, unsigned int * pSeq);
+
+void coreStoreInfo(InfoCache * pCache, CryptedFileID id,
+   CryptedFileInfo * pInfo, unsigned int seq);
+
+/* Return true if the cache already holds exactly *pInfo for the
+   file, i.e., there is no need to write the info sector.  Otherwise,
+   the file is removed from the cache, and the caller must write the
+   info sector and then call coreEndInfoUpdate() with the sequence
+   number returned in *pSeq, and the new info if the write succeeded
+   or 0 if it failed. */
+bool coreBeginInfoUpdate(InfoCache * pCache, CryptedFileID id,
+   CryptedFileInfo * pInfo, unsigned int * pSeq);
+
+void coreEndInfoUpdate(InfoCache * pCache, CryptedFileID id,
+   CryptedFileInfo * pInfo, unsigned int seq);
+
+/* Remove the file from the cache (e.g. when its info sector is
+   freed). */
+void coreForgetInfo(InfoCache * pCache, CryptedFileID id);
+
+/* Return the volume's cache, or 0 if it has none. */
+InfoCache * coreQueryInfoCache(CryptedVolume * pVolume);
+
+
+#endif /* !_INFOCACHE_H */
@@ -17,9 +17,56 @@
    along with this program; if not, write to the Free Software Foundation,
    Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.  */
 
+#include <stdlib.h>
 #include <assert.h>
 
 #include "corefs.h"
+#include "infocache.h"
+
+
+/* The first cIDs entries of the free list, starting at its head,
+   are paIDs[iFirst], paIDs[iFirst + 1], ... (modulo cMaxIDs).  The
+   entry after the last of them is idAfter (0 = end of list); it is
+   the head itself if cIDs is 0.  The on-disk list is kept up to date
+   with every change, but is only read when we run out of entries.
+   The structure is protected by the lock on the ISF. */
+struct _FreeIDs {
+      bool fLoaded; /* the fields below are valid */
+      SectorNumber csSize; /* as in the sentinel */
+      CryptedFileID * paIDs;
+      unsigned int cMaxIDs;
+      unsigned int iFirst;
+      unsigned int cIDs;
+      CryptedFileID idAfter;
+};
+
+
+CoreResult coreCreateFreeIDs(unsigned int cMaxIDs, FreeIDs * * ppFreeIDs)
+{
+   FreeIDs * pFreeIDs;
+
+   *ppFreeIDs = 0;
+
+   pFreeIDs = malloc(sizeof(FreeIDs));
+   if (!pFreeIDs) return CORERC_NOT_ENOUGH_MEMORY;
+   pFreeIDs->paIDs = malloc(cMaxIDs * sizeof(CryptedFileID));
+   if (!pFreeIDs->paIDs) {
+      free(pFreeIDs);
+      return CORERC_NOT_ENOUGH_MEMORY;
+   }
+   pFreeIDs->cMaxIDs = cMaxIDs;
+   pFreeIDs->fLoaded = false;
+
+   *ppFreeIDs = pFreeIDs;
+   return CORERC_OK;
+}
+
+
+void coreDestroyFreeIDs(FreeIDs * pFreeIDs)
+{
+   free(pFreeIDs->paIDs);
+   free(pFreeIDs);
+}
 
 
 CoreResult coreInitISF(CryptedVolume * pVolume)
@@ -27,6 +74,9 @@ CoreResult coreInitISF(CryptedVolume * pVolume)
    CoreResult cr;
    CryptedFileInfoFreeLink link;
 
+   if (coreQueryFreeIDs(pVolume))
+      coreQueryFreeIDs(pVolume)->fLoaded = false;
+
    int32ToBytes(INFOSECTOR_MAGIC_FREE, link.magic);
    int32ToBytes(0, link.idNextFree);
    int32ToBytes(1, link.csSize);
@@ -39,86 +89,212 @@ CoreResult coreInitISF(CryptedVolume * pVolume)
 }
 
 
-CoreResult coreAllocID(CryptedVolume * pVolume, CryptedFileID * pid)
+static CryptedFileID headOf(FreeIDs * pFreeIDs)
+{
+   return pFreeIDs->cIDs ?
+      pFreeIDs->paIDs[pFreeIDs->iFirst] : pFreeIDs->idAfter;
+}
+
+
+/* Append an entry to the in-memory part of the list. */
+static void appendID(FreeIDs * pFreeIDs, CryptedFileID id)
+{
+   assert(pFreeIDs->cIDs < pFreeIDs->cMaxIDs);
+   pFreeIDs->paIDs[(pFreeIDs->iFirst + pFreeIDs->cIDs++) %
+      pFreeIDs->cMaxIDs] = id;
+}
+
+
+/* Read the sentinel, which contains the head of the linked list of
+   free info sectors, if we haven't done so yet. */
+static CoreResult loadFreeIDs(CryptedVolume * pVolume,
+   FreeIDs * pFreeIDs)
 {
    CoreResult cr;
-   CryptedFileInfoFreeLink sentinel, link;
-   CryptedFileID idFree;
-   SectorNumber csSize;
-   CryptedFileID idNewHead;
-   SectorNumber csGrow;
-   CryptedFileID idClear;
+   CryptedFileInfoFreeLink sentinel;
 
-   *pid = 0;
+   if (pFreeIDs->fLoaded) return CORERC_OK;
 
-   /* Get the sentinel, which contains the head of the linked list of
-      free info sectors. */
    cr = coreQuerySectorData(pVolume, INFOSECTORFILE_ID, 0,
       0, sizeof(CryptedFileInfoFreeLink), 0, &sentinel);
    if (cr) return cr;
    
    if (bytesToInt32(sentinel.magic) != INFOSECTOR_MAGIC_FREE)
       return CORERC_ISF_CORRUPT;
-   idFree = bytesToInt32(sentinel.idNextFree);
-   csSize = bytesToInt32(sentinel.csSize);
-   if (idFree >= csSize) return CORERC_ISF_CORRUPT;
+   pFreeIDs->csSize = bytesToInt32(sentinel.csSize);
+   pFreeIDs->idAfter = bytesToInt32(sentinel.idNextFree);
+   if (pFreeIDs->idAfter >= pFreeIDs->csSize) return CORERC_ISF_CORRUPT;
+   pFreeIDs->iFirst = 0;
+   pFreeIDs->cIDs = 0;
+
+   pFreeIDs->fLoaded = true;
+   return CORERC_OK;
+}
+
+
+/* Walk the on-disk list to fill up the in-memory part, which is
+   empty.  This is the only time we read free list entries. */
+static CoreResult readFreeIDs(CryptedVolume * pVolume,
+   FreeIDs * pFreeIDs)
+{
+   CoreResult cr = CORERC_OK;
+   CryptedFileInfoFreeLink link;
+   CryptedFileID idNext;
+   unsigned int i;
+
+   assert(pFreeIDs->cIDs == 0);
+   pFreeIDs->iFirst = 0;
+
+   while (pFreeIDs->idAfter && pFreeIDs->cIDs < pFreeIDs->cMaxIDs) {
+
+      cr = coreQuerySectorData(pVolume, INFOSECTORFILE_ID,
+         pFreeIDs->idAfter, 0, sizeof(CryptedFileInfoFreeLink), 0,
+         &link);
+      if (cr) break;
+      
+      if (bytesToInt32(link.magic) != INFOSECTOR_MAGIC_FREE) {
+         cr = CORERC_ISF_CORRUPT;
+         break;
+      }
+      idNext = bytesToInt32(link.idNextFree);
+      if (idNext >= pFreeIDs->csSize) {
+         cr = CORERC_ISF_CORRUPT;
+         break;
+      }
+
+      /* A cycle would make us hand out IDs twice. */
+      for (i = 0; i < pFreeIDs->cIDs; i++)
+         if (pFreeIDs->paIDs[i] == pFreeIDs->idAfter) break;
+      if (i < pFreeIDs->cIDs) {
+         cr = CORERC_ISF_CORRUPT;
+         break;
+      }
+
+      appendID(pFreeIDs, pFreeIDs->idAfter);
+      pFreeIDs->idAfter = idNext;
+   }
+
+   /* If we got any entries, a bad one will be reported when we get
+      to it. */
+   return pFreeIDs->cIDs ? CORERC_OK : cr;
+}
+
+
+/* Grow the ISF by csISFGrow sectors, and put all but the first of
+   them in the free list, which is empty.  Return the first. */
+static CoreResult growISF(CryptedVolume * pVolume, FreeIDs * pFreeIDs,
+   CryptedFileID * pid)
+{
+   CoreResult cr;
+   CryptedVolumeParms * pParms = coreQueryVolumeParms(pVolume);
+   CryptedFileInfoFreeLink link;
+   SectorNumber csSize = pFreeIDs->csSize;
+   SectorNumber csGrow = pParms->csISFGrow;
+   SectorNumber sStart, csExtent;
+   CryptedFileID idClear;
+
+   assert(csGrow >= 1);
+   assert(pFreeIDs->cIDs == 0 && pFreeIDs->idAfter == 0);
    
-   if (idFree) { /* non-empty linked list */
+   cr = coreSuggestFileAllocation(pVolume, INFOSECTORFILE_ID, csSize + csGrow);
+   if (cr) return cr;
 
-      /* Now we have to find the new head of the linked list, which is
-         the successor of the current head. */
-      cr = coreQuerySectorData(pVolume, INFOSECTORFILE_ID, idFree,
-         0, sizeof(CryptedFileInfoFreeLink), 0, &link);
+   /* Add the new sectors to the cache in as few batches as
+      possible. */
+   for (sStart = csSize; sStart < csSize + csGrow; sStart += csExtent) {
+      csExtent = csSize + csGrow - sStart;
+      if (csExtent > pParms->csIOGranularity)
+         csExtent = pParms->csIOGranularity;
+      cr = coreFetchSectors(pVolume, INFOSECTORFILE_ID, sStart,
+         csExtent, CFETCH_NO_READ);
       if (cr) return cr;
-      
-      if (bytesToInt32(link.magic) != INFOSECTOR_MAGIC_FREE)
-         return CORERC_ISF_CORRUPT;
-      idNewHead = bytesToInt32(link.idNextFree);
-      if (idNewHead >= csSize) return CORERC_ISF_CORRUPT;
+   }
 
-   } else { /* empty linked list */
+   /* Link the {2..csISFGrow}th new sectors into the free list. */
+   for (idClear = csSize + 1; idClear < csSize + csGrow; idClear++)
+   {
+      int32ToBytes(INFOSECTOR_MAGIC_FREE, link.magic);
+      int32ToBytes(idClear == csSize + csGrow - 1 ?
+         0 : idClear + 1, link.idNextFree);
+      int32ToBytes(0, link.csSize);
 
-      /* Grow the ISF by csISFGrow sectors. */
-      csGrow = coreQueryVolumeParms(pVolume)->csISFGrow;
-      assert(csGrow >= 1);
-      cr = coreSuggestFileAllocation(pVolume, INFOSECTORFILE_ID, csSize + csGrow);
+      cr = coreSetSectorData(pVolume, INFOSECTORFILE_ID, idClear,
+         0, sizeof(CryptedFileInfoFreeLink), CFETCH_NO_READ, &link);
       if (cr) return cr;
+   }
 
-      /* Add the {2..csISFGrow}th new sectors to the free list. */
-      for (idClear = csSize + 1; idClear < csSize + csGrow; idClear++)
-      {
-         int32ToBytes(INFOSECTOR_MAGIC_FREE, link.magic);
-         int32ToBytes(idClear == csSize + csGrow - 1 ?
-            0 : idClear + 1, link.idNextFree);
-         int32ToBytes(0, link.csSize);
-
-         cr = coreSetSectorData(pVolume, INFOSECTORFILE_ID, idClear,
-            0, sizeof(CryptedFileInfoFreeLink), CFETCH_NO_READ, &link);
-         if (cr) return cr;
-      }
-      
-      idNewHead = csGrow > 1 ? csSize + 1 : 0;
+   /* Remember as many of them as we can. */
+   pFreeIDs->iFirst = 0;
+   for (idClear = csSize + 1;
+        idClear < csSize + csGrow && pFreeIDs->cIDs < pFreeIDs->cMaxIDs;
+        idClear++)
+      appendID(pFreeIDs, idClear);
+   pFreeIDs->idAfter = idClear < csSize + csGrow ? idClear : 0;
 
-      /* The 1st new sector is the newly allocated info sector.  Force
-         it into the cache. */
-      idFree = csSize;
-      cr = coreFetchSectors(pVolume, INFOSECTORFILE_ID, idFree, 1,
-         CFETCH_NO_READ);
+   pFreeIDs->csSize = csSize + csGrow;
+   *pid = csSize;
 
-      csSize += csGrow;
-   }
+   return CORERC_OK;
+}
 
-   /* Note that it's the caller's responsibility to do something with
-      sector idFree.  We're not even going to clear the magic
-      value. */
 
-   /* Update the sentinel. */
-   int32ToBytes(idNewHead, sentinel.idNextFree);
-   int32ToBytes(csSize, sentinel.csSize);
+/* Write the current head of the list and the size of the ISF to the
+   sentinel.  This is just a change to a cached sector; it gets to
+   disk along with everything else. */
+static CoreResult storeSentinel(CryptedVolume * pVolume,
+   FreeIDs * pFreeIDs)
+{
+   CryptedFileInfoFreeLink sentinel;
+
+   int32ToBytes(INFOSECTOR_MAGIC_FREE, sentinel.magic);
+   int32ToBytes(headOf(pFreeIDs), sentinel.idNextFree);
+   int32ToBytes(pFreeIDs->csSize, sentinel.csSize);
    
-   cr = coreSetSectorData(pVolume, INFOSECTORFILE_ID, 0,
+   return coreSetSectorData(pVolume, INFOSECTORFILE_ID, 0,
       0, sizeof(CryptedFileInfoFreeLink), 0, &sentinel);
+}
+
+
+static CoreResult allocID(CryptedVolume * pVolume, FreeIDs * pFreeIDs,
+   CryptedFileID * pid)
+{
+   CoreResult cr;
+   CryptedFileID idFree;
+
+   *pid = 0;
+
+   cr = loadFreeIDs(pVolume, pFreeIDs);
    if (cr) return cr;
+
+   if (!pFreeIDs->cIDs && (cr = readFreeIDs(pVolume, pFreeIDs)))
+      return cr;
+
+   if (pFreeIDs->cIDs) { /* non-empty linked list */
+
+      idFree = pFreeIDs->paIDs[pFreeIDs->iFirst];
+      pFreeIDs->iFirst = (pFreeIDs->iFirst + 1) % pFreeIDs->cMaxIDs;
+      pFreeIDs->cIDs--;
+
+   } else { /* empty linked list */
+
+      cr = growISF(pVolume, pFreeIDs, &idFree);
+      if (cr) {
+         pFreeIDs->fLoaded = false;
+         return cr;
+      }
+   }
+
+   /* Note that it's the caller's responsibility to do something with
+      sector idFree.  We're not even going to clear the magic value.
+      We do put it in the cache (if it isn't already there) without
+      reading it, since the caller is going to overwrite it. */
+   cr = coreFetchSectors(pVolume, INFOSECTORFILE_ID, idFree, 1,
+      CFETCH_NO_READ);
+   if (!cr) cr = storeSentinel(pVolume, pFreeIDs);
+   if (cr) {
+      pFreeIDs->fLoaded = false;
+      return cr;
+   }
    
    *pid = idFree;
    
@@ -126,41 +302,89 @@ CoreResult coreAllocID(CryptedVolume * pVolume, CryptedFileID * pid)
 }
 
 
-CoreResult coreFreeID(CryptedVolume * pVolume, CryptedFileID id)
+/* The free list is updated in several steps, so the info sector file
+   is locked while we are at it.  Without a FreeIDs structure for the
+   volume, the list is read anew every time. */
+CoreResult coreAllocID(CryptedVolume * pVolume, CryptedFileID * pid)
 {
    CoreResult cr;
-   CryptedFileInfoFreeLink sentinel, link;
-   CryptedFileID idFree;
-   SectorNumber csSize;
+   FreeIDs freeIDs, * pFreeIDs = coreQueryFreeIDs(pVolume);
+   CryptedFileID idOne;
 
-   /* Get the sentinel, which contains the head of the linked list of
-      free info sectors. */
-   cr = coreQuerySectorData(pVolume, INFOSECTORFILE_ID, 0,
-      0, sizeof(CryptedFileInfoFreeLink), 0, &sentinel);
+   if (!pFreeIDs) {
+      pFreeIDs = &freeIDs;
+      freeIDs.fLoaded = false;
+      freeIDs.paIDs = &idOne;
+      freeIDs.cMaxIDs = 1;
+   }
+   
+   coreLockFile(pVolume, INFOSECTORFILE_ID);
+   cr = allocID(pVolume, pFreeIDs, pid);
+   coreUnlockFile(pVolume, INFOSECTORFILE_ID);
+   return cr;
+}
+
+
+static CoreResult freeID(CryptedVolume * pVolume, FreeIDs * pFreeIDs,
+   CryptedFileID id)
+{
+   CoreResult cr;
+   CryptedFileInfoFreeLink link;
+
+   cr = loadFreeIDs(pVolume, pFreeIDs);
    if (cr) return cr;
 
-   if (bytesToInt32(sentinel.magic) != INFOSECTOR_MAGIC_FREE)
-      return CORERC_ISF_CORRUPT;
-   idFree = bytesToInt32(sentinel.idNextFree);
-   csSize = bytesToInt32(sentinel.csSize);
-   if ((idFree >= csSize) || (id >= csSize)) return CORERC_ISF_CORRUPT;
+   if (id >= pFreeIDs->csSize) return CORERC_ISF_CORRUPT;
 
    /* Make info sector id a free element, and make the current head of
       the list into the successor of id. */
    int32ToBytes(INFOSECTOR_MAGIC_FREE, link.magic);
-   int32ToBytes(idFree, link.idNextFree);
+   int32ToBytes(headOf(pFreeIDs), link.idNextFree);
    int32ToBytes(0, link.csSize);
    
    cr = coreSetSectorData(pVolume, INFOSECTORFILE_ID, id,
       0, sizeof(CryptedFileInfoFreeLink), 0, &link);
    if (cr) return cr;
+
+   /* Only now, so that nobody can put back what they read before. */
+   if (coreQueryInfoCache(pVolume))
+      coreForgetInfo(coreQueryInfoCache(pVolume), id);
    
-   /* Make id the new head of the list. */
-   int32ToBytes(id, sentinel.idNextFree);
+   /* Make id the new head of the list.  If there is no room, forget
+      about the last entry we know. */
+   if (pFreeIDs->cIDs == pFreeIDs->cMaxIDs)
+      pFreeIDs->idAfter = pFreeIDs->paIDs[(pFreeIDs->iFirst +
+         --pFreeIDs->cIDs) % pFreeIDs->cMaxIDs];
+   pFreeIDs->iFirst = (pFreeIDs->iFirst + pFreeIDs->cMaxIDs - 1) %
+      pFreeIDs->cMaxIDs;
+   pFreeIDs->paIDs[pFreeIDs->iFirst] = id;
+   pFreeIDs->cIDs++;
 
-   cr = coreSetSectorData(pVolume, INFOSECTORFILE_ID, 0,
-      0, sizeof(CryptedFileInfoFreeLink), 0, &sentinel);
-   if (cr) return cr;
+   cr = storeSentinel(pVolume, pFreeIDs);
+   if (cr) {
+      pFreeIDs->fLoaded = false;
+      return cr;
+   }
    
    return CORERC_OK;
 }
+
+
+CoreResult coreFreeID(CryptedVolume * pVolume, CryptedFileID id)
+{
+   CoreResult cr;
+   FreeIDs freeIDs, * pFreeIDs = coreQueryFreeIDs(pVolume);
+   CryptedFileID idOne;
+
+   if (!pFreeIDs) {
+      pFreeIDs = &freeIDs;
+      freeIDs.fLoaded = false;
+      freeIDs.paIDs = &idOne;
+      freeIDs.cMaxIDs = 1;
+   }
+   
+   coreLockFile(pVolume, INFOSECTORFILE_ID);
+   cr = freeID(pVolume, pFreeIDs, id);
+   coreUnlockFile(pVolume, INFOSECTORFILE_ID);
+   return cr;
+}
@@ -20,24 +20,142 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <math.h>
 #include <assert.h>
 
 #include "corefs.h"
+#include "cachepolicy.h"
+#include "cryptpool.h"
+#include "infocache.h"
 #include "sysdep.h"
 
 
-#define FILE_HASH_TABLE_SIZE    2048
-#define SECTOR_HASH_TABLE_SIZE  8192
-#define HASH_MULT_KNUTH         0.6180339887 /* (sqrt(5) - 1) / 2 */
-
-#define MAX_STORAGE_FILE_NAME   12
+/* The hash tables use open addressing with linear probing.  Their
+   size is a power of 2 and they are kept at most half full. */
+#define MIN_HASH_TABLE_BITS     4
+#define HASH_MULT_GOLDEN        0x9e3779b9 /* 2^32 * (sqrt(5) - 1) / 2 */
+
+/* The cached sectors are kept in slabs of 2^SECTOR_SLAB_BITS sectors
+   (i.e. 4096 * cbSector bytes of data: 2 MB with 512-byte sectors, up
+   to 16 MB with 4096-byte ones, so always a multiple of the 2 MB huge
+   page size on x86), of which a volume can have at most
+   MAX_SECTOR_SLABS. */
+#define SECTOR_SLAB_BITS        12
+#define SECTOR_SLAB_SIZE        (1 << SECTOR_SLAB_BITS)
+#define MAX_SECTOR_SLABS        4096
+#define MAX_CACHED_SECTORS      ((MAX_SECTOR_SLABS - 1) * SECTOR_SLAB_SIZE)
+
+/* With CCACHE_PRESSURE, the memory pressure is looked at this often
+   (in milliseconds).  Each time it is too high, the cache is shrunk
+   by 1/PRESSURE_SHRINK, but not below 1/PRESSURE_FLOOR of its
+   limit; when the pressure is gone, it grows back twice as fast. */
+#define PRESSURE_INTERVAL       1000
+#define PRESSURE_SHRINK         4
+#define PRESSURE_FLOOR          16
+
+/* Each file's cached sectors are indexed by a radix tree with a
+   fan-out of 2^RADIX_BITS. */
+#define RADIX_BITS              6
+#define RADIX_SIZE              (1 << RADIX_BITS)
+#define RADIX_MASK              (RADIX_SIZE - 1)
+#define RADIX_MAX_HEIGHT        ((32 + RADIX_BITS - 1) / RADIX_BITS)
+
+#define MIN_OPEN_STORAGE_FILES  8
 #define MAX_STORAGE_PATH_NAME   \
    (MAX_VOLUME_BASE_PATH_NAME + MAX_STORAGE_FILE_NAME)
 
 
 typedef struct _CryptedFile CryptedFile;
-typedef struct _CryptedSector CryptedSector;
+
+/* Flags for CryptedSector.flFlags. */
+#define CSF_DIRTY               1 /* must be written to disk */
+#define CSF_VICTIM              2 /* selected for eviction */
+#define CSF_BATCHED             4 /* in purgeCache()'s write batch */
+#define CSF_READING             8 /* being read from disk; the data is
+                                     not valid yet */
+#define CSF_STALE              16 /* deleted while pinned */
+#define CSF_PREFETCHED         32 /* read ahead, not fetched yet */
+#define CSF_WRITING            64 /* being written by flushSectors(),
+                                     and not changed since */
+
+/* Number of pending readahead requests per volume. */
+#define READAHEAD_QUEUE_SIZE    16
+
+/* Size of the volume's I/O ring; larger batches are submitted in
+   several goes. */
+#define IO_RING_ENTRIES         64
+
+/* Number of per-file locks per volume.  File IDs are hashed onto
+   them. */
+#define FILE_LOCKS              64
+
+/* Radix tree nodes are identified by their index in the volume's node
+   pool.  As with sectors, index 0 is the null link. */
+typedef uint32 NodeIndex;
+
+/* A radix tree node.  The slots of interior nodes hold the children
+   of the node, the slots of leaves hold sectors.  Bit j of aflDirty
+   is set iff the subtree (or sector) in slot j contains dirty
+   sectors.  Unused nodes are linked through aiSlots[0]. */
+typedef struct {
+      uint32 aiSlots[RADIX_SIZE];
+      uint32 aflDirty[RADIX_SIZE / 32];
+      unsigned int cUsed; /* number of non-empty slots */
+} RadixNode;
+
+/* Slots in the file and sector hash tables.  The keys are stored in
+   the slots so that probing does not have to chase pointers.  A slot
+   is empty iff its pointer (index) is 0.  File IDs and sector numbers
+   are 32 bits on disk. */
+typedef struct {
+      uint32 id;
+      CryptedFile * pFile;
+} FileHashSlot;
+
+typedef struct {
+      uint32 id;
+      uint32 sectorNumber;
+      SectorIndex iSector;
+} SectorHashSlot;
+
+/* A request to read sectors [sStart, sStart + csExtent) of a file
+   ahead. */
+typedef struct {
+      CryptedFileID id;
+      SectorNumber sStart;
+      SectorNumber csExtent;
+} ReadAheadRequest;
+
+/* A slab of the sector pool: the metadata and data of csSlab
+   sectors, of which csUsed are in use (in the cache, or deleted but
+   still pinned).  csSlab is 0 if the slab is not allocated.  A slab
+   that is being retired takes no new sectors, and is freed when its
+   last sector is. */
+typedef struct {
+      CryptedSector * paSectors;
+      octet * paData; /* cbSector bytes per sector */
+      unsigned int csSlab;
+      unsigned int csUsed;
+      bool fRetiring;
+} SectorSlab;
+
+/* Scratch space for reading, writing or flushing a batch of sectors
+   (see getScratch()).  The arrays have room for csScratch = 2 *
+   csIOBuffer entries, except paFiles (csIOBuffer) and pabCipher,
+   which holds the ciphertext of csIOBuffer sectors and is only
+   allocated by those that need it.  papSectors comes right after the
+   header (see coreReleaseSectorList()). */
+typedef struct _IOScratch IOScratch;
+struct _IOScratch {
+      IOScratch * pNext; /* in the volume's list of free ones */
+      CryptedSector * * papSectors;
+      CryptedFile * * papFiles;
+      SysIORequest * paRequests;
+      SysIOVec * paVecs;
+      SectorNumber * pasSectors;
+      CoreResult * pacr;
+      octet * pafFlags;
+      octet * pabCipher;
+};
 
 struct _CryptedVolume {
       char szBasePath[MAX_VOLUME_BASE_PATH_NAME];
@@ -48,15 +166,27 @@ struct _CryptedVolume {
       /* The parameters. */
       CryptedVolumeParms parms;
 
-      /* Hash table for finding CryptedFiles by ID. */
-      CryptedFile * FileHashTable[FILE_HASH_TABLE_SIZE];
+      /* The payload of a sector, i.e. PAYLOAD_SIZE_OF(parms.cbSector). */
+      unsigned int cbPayload;
+
+      /* Hash table for finding CryptedFiles by ID.  It has
+         2^cFileHashBits slots. */
+      FileHashSlot * paFileHash;
+      unsigned int cFileHashBits;
 
       /* Number of CryptedFiles. */
       unsigned int cCryptedFiles;
 
-      /* Head and tail of the MRU list of CryptedFiles. */
-      CryptedFile * pFirstFile;
-      CryptedFile * pLastFile;
+      /* Head and tail of the MRU list of CryptedFiles that have no
+         sectors in the cache.  Only these are dropped to stay within
+         parms.cMaxCryptedFiles (see shrinkCryptedFiles()); the others
+         live as long as their sectors do. */
+      CryptedFile * pFirstEmpty;
+      CryptedFile * pLastEmpty;
+
+      /* The directory holding the storage files, which are opened
+         in it by name. */
+      SysDir * pBaseDir;
 
       /* Number of open storage files. */
       unsigned int cOpenStorageFiles;
@@ -67,18 +197,144 @@ struct _CryptedVolume {
       CryptedFile * pLastOpen;
 
       /* Hash table for finding CryptedSectors by (file-ID,
-         sector-#). */
-      CryptedSector * SectorHashTable[SECTOR_HASH_TABLE_SIZE];
+         sector-#).  It has 2^cSectorHashBits slots. */
+      SectorHashSlot * paSectorHash;
+      unsigned int cSectorHashBits;
+
+      /* The sector pool (see allocSectorPool()).  Sector i is in
+         slab paSlabs[i >> SECTOR_SLAB_BITS].  The slabs that are not
+         being retired hold csPool sectors; iMaxSector is the highest
+         index there has ever been.  Unused entries are linked
+         through iNextDirty, starting at iFreeSector. */
+      SectorSlab * paSlabs;
+      unsigned int cRetiring;
+      unsigned int csPool;
+      SectorIndex iMaxSector;
+      SectorIndex iFreeSector;
+
+      /* The cache limit set by the user.  Under memory pressure,
+         parms.csMaxCached is lowered below it for a while. */
+      unsigned int csCacheLimit;
+      uint32 msNextPressureCheck;
+
+      /* The pool of radix tree nodes.  It grows as needed, but never
+         shrinks; unused nodes are kept on a free list. */
+      RadixNode * paNodes;
+      unsigned int cNodes;
+      NodeIndex iFreeNode;
 
       /* Total number of sectors in the cache. */
       unsigned int csInCache;
 
-      /* Head and tail of the MRU list of cached sectors. */
-      CryptedSector * pFirstSector;
-      CryptedSector * pLastSector;
+      /* The replacement policy, which decides which sectors to evict
+         from the cache, and its state. */
+      CachePolicy * pPolicy;
+      void * pPolicyState;
+
+      unsigned long cCacheHits;
+      unsigned long cCacheMisses;
       
       /* Total number of dirty sectors in the cache. */
       unsigned int csDirty;
+
+      /* List of dirty sectors, from the least to the most recently
+         dirtied. */
+      SectorIndex iFirstDirty;
+      SectorIndex iLastDirty;
+
+      /* List of CryptedFiles that have dirty sectors. */
+      unsigned int cDirtyFiles;
+      CryptedFile * pFirstDirty;
+      CryptedFile * pLastDirty;
+
+      /* Whether the volume is dirty as far as dirtyCallBack is
+         concerned.  fDirty changes under pLock, and fDirtyChanged is
+         then set; the call is made after pLock has been released
+         (see notifyDirty()).  fNotifying is set while a thread is
+         making calls; only that thread touches fDirtyReported, the
+         state last passed. */
+      bool fDirty;
+      bool fDirtyChanged;
+      bool fDirtyReported;
+      bool fNotifying;
+
+      /* pLock protects the cache and everything else in the volume.
+         It is only held for short periods: reading and decrypting
+         the sectors missing from the cache is done without it (see
+         readSectorBatch()), as is the work of the writeback and
+         readahead threads.  Sectors and CryptedFiles that are used
+         while not holding the lock are pinned.  pIOLock serialises
+         the use of pIORing. */
+      SysMutex * pLock;
+      SysMutex * pIOLock;
+
+      /* Locks that serialise sequences of operations on a file (see
+         coreLockFile()). */
+      SysMutex * apFileLocks[FILE_LOCKS];
+
+      /* Batches of I/O are at most csIOBuffer sectors.  pIORing is
+         used to submit them if the volume was accessed with
+         CCACHE_IORING and the system supports it. */
+      unsigned int csIOBuffer;
+      SysIORing * pIORing;
+
+      /* Scratch space for those that read and write without holding
+         the lock, or that may wait (see getScratch()). */
+      unsigned int csScratch;
+      IOScratch * pFreeScratch;
+
+      /* Threads that encrypt and decrypt large batches of sectors
+         (see cryptSectors()), or 0. */
+      CryptPool * pCryptPool;
+
+      /* Decoded file info (see coreQueryFileInfo()), or 0. */
+      InfoCache * pInfoCache;
+
+      /* The head of the ISF free list (see coreAllocID()), or 0. */
+      FreeIDs * pFreeIDs;
+
+      /* pIODone is signalled whenever the writeback or readahead
+         thread finishes a batch, a thread has read the sectors it was
+         missing, or pins that others may be waiting for are dropped.
+         cIOWaiters counts the threads waiting for I/O (see
+         waitForIO()); cReaders counts the threads reading sectors,
+         cWriters those writing through (see coreWriteSectorsThrough())
+         or flushing (see flushSectors()).
+         csPinned is the number of sectors pinned through
+         corePinSectors(). */
+      SysCond * pIODone;
+      unsigned int cIOWaiters;
+      unsigned int cReaders;
+      unsigned int cWriters;
+      unsigned int csPinned;
+
+      /* The writeback thread.  While it writes a batch of sectors,
+         pWriteBackFile is the file they belong to; the sectors are
+         pinned, and must not be written or closed by others. */
+      SysThread * pWriteBackThread;
+      SysCond * pWriteBackWake; /* wakes the writeback thread */
+      bool fStopWriteBack;
+      CryptedFile * pWriteBackFile;
+      unsigned int csWriteBackThreshold;
+      uint32 msNextWriteBack; /* for rate limiting */
+      SectorIndex * paiWriteBack;
+      octet * pabWriteBack;
+      SysIORequest * paWriteBackRequests;
+      SysIOVec * paWriteBackVecs;
+
+      /* The readahead thread and its queue of requests.  While it
+         reads a batch, pReadAheadFile is the file the sectors belong
+         to; the sectors are in the cache but marked CSF_READING. */
+      SysThread * pReadAheadThread;
+      SysCond * pReadAheadWake; /* wakes the readahead thread */
+      bool fStopReadAhead;
+      CryptedFile * pReadAheadFile;
+      ReadAheadRequest aReadAhead[READAHEAD_QUEUE_SIZE];
+      unsigned int iReadAheadHead; /* the oldest request */
+      unsigned int cReadAhead; /* number of requests */
+      SectorNumber csMaxReadAhead; /* largest window */
+      SectorIndex * paiReadAhead;
+      SysIOVec * paReadAheadVecs;
 };
 
 struct _CryptedFile {
@@ -86,49 +342,180 @@ struct _CryptedFile {
 
       CryptedVolume * pVolume;
 
-      CryptedFile * pNextInHash;
-      CryptedFile * pPrevInHash;
-
-      CryptedFile * pNextInMRU;
-      CryptedFile * pPrevInMRU;
+      /* Links in the volume's list of files without cached
+         sectors (valid iff iRoot is 0). */
+      CryptedFile * pNextEmpty;
+      CryptedFile * pPrevEmpty;
 
       CryptedFile * pNextOpen;
       CryptedFile * pPrevOpen;
       File * pStorageFile;
 
+      /* The file is not freed while it is pinned by operations that
+         release the volume lock.  fDropping is set while dropFile()
+         is at work; accessFile() waits until it is done. */
+      unsigned int cPins;
+      bool fDropping;
+
+      /* Number of threads reading sectors of the file, and writing
+         them through or flushing them. */
+      unsigned int cReaders;
+      unsigned int cWriters;
+
       unsigned int csDirty;
-      
-      CryptedSector * pFirstSector;
+
+      /* Links in the volume's list of files with dirty sectors. */
+      CryptedFile * pNextDirty;
+      CryptedFile * pPrevDirty;
+
+      /* Radix tree of the file's cached sectors, keyed by sector
+         number.  A tree of height h covers sector numbers below
+         2^(h * RADIX_BITS).  The tree is empty iff iRoot is 0. */
+      NodeIndex iRoot;
+      unsigned int cHeight;
+
+      /* Sequential read detection.  [sLastRead, sNextRead) is the
+         last extent fetched; a fetch starting in it (but not ending
+         in it) continues the stream.  Sectors up to sReadAhead have
+         been requested from the readahead thread; csReadAhead is the
+         current window. */
+      SectorNumber sLastRead;
+      SectorNumber sNextRead;
+      SectorNumber sReadAhead;
+      SectorNumber csReadAhead;
 };
 
+/* The metadata of a cached sector.  It is kept small (32 bytes on
+   64-bit machines) by using pool indices rather than pointers as
+   links.  The replacement policy keeps its own per-sector state. */
 struct _CryptedSector {
-      SectorNumber sectorNumber;
-      
       CryptedFile * pFile;
 
-      CryptedSector * pNextInHash;
-      CryptedSector * pPrevInHash;
+      uint32 sectorNumber;
 
-      CryptedSector * pNextInFile;
-      CryptedSector * pPrevInFile;
+      unsigned short flFlags; /* CSF_* */
 
-      CryptedSector * pNextInMRU;
-      CryptedSector * pPrevInMRU;
+      /* A pinned sector can be deleted from the cache, but its entry
+         is not reused until the last pin is dropped. */
+      unsigned short cPins;
 
-      bool fDirty;
+      /* The sector's own index. */
+      SectorIndex iSelf;
+
+      /* Links in the volume's list of dirty sectors.  Free entries
+         are never dirty, so iNextDirty also links the free list. */
+      SectorIndex iNextDirty;
+      SectorIndex iPrevDirty;
 
-      CryptedSectorData data;
+      /* When the sector was last made dirty (sysQueryMilliseconds()). */
+      uint32 msDirtied;
 };
 
 
+/* Return the sector with index i in the volume's pool, or 0 if i is
+   the null link. */
+static inline CryptedSector * sectorAt(CryptedVolume * pVolume,
+   SectorIndex i)
+{
+   return i ? &pVolume->paSlabs[i >> SECTOR_SLAB_BITS]
+      .paSectors[i & (SECTOR_SLAB_SIZE - 1)] : 0;
+}
+
+
+static inline SectorIndex sectorIndex(CryptedVolume * pVolume,
+   CryptedSector * p)
+{
+   return p->iSelf;
+}
+
+
+/* Return the data of a cached sector. */
+static inline CryptedSectorData * sectorData(CryptedVolume * pVolume,
+   CryptedSector * p)
+{
+   SectorIndex i = p->iSelf;
+   return (CryptedSectorData *) (pVolume->paSlabs[i >> SECTOR_SLAB_BITS]
+      .paData + (i & (SECTOR_SLAB_SIZE - 1)) * pVolume->parms.cbSector);
+}
+
+
+/* Record that the volume has become dirty or clean.  Called with
+   pLock held; dirtyCallBack is called later by unlockVolume(). */
+static inline void setDirtyState(CryptedVolume * pVolume, bool fDirty)
+{
+   pVolume->fDirty = fDirty;
+   pVolume->fDirtyChanged = true;
+}
+
+
+/* Pass the current state to dirtyCallBack, if it has changed since
+   the last call.  The calls are made by one thread at a time, and
+   each passes the latest state, so that a stale call cannot overtake
+   a newer one.  If another thread is already making calls, it will
+   see the change before it stops, so we leave it to that thread.
+   This also makes it safe for the callback to use functions that
+   end with unlockVolume(). */
+static void notifyDirty(CryptedVolume * pVolume)
+{
+   bool fDirty;
+
+   sysLockMutex(pVolume->pLock);
+
+   if (pVolume->fNotifying) {
+      sysUnlockMutex(pVolume->pLock);
+      return;
+   }
+   pVolume->fNotifying = true;
+
+   while (pVolume->fDirtyChanged) {
+      fDirty = pVolume->fDirty;
+      pVolume->fDirtyChanged = false;
+      sysUnlockMutex(pVolume->pLock);
+
+      if (fDirty != pVolume->fDirtyReported) {
+         pVolume->fDirtyReported = fDirty;
+         if (pVolume->parms.dirtyCallBack)
+            pVolume->parms.dirtyCallBack(pVolume, fDirty);
+      }
+
+      sysLockMutex(pVolume->pLock);
+   }
+
+   pVolume->fNotifying = false;
+   sysUnlockMutex(pVolume->pLock);
+}
+
+
+/* Release pLock, and then tell dirtyCallBack about a change of the
+   dirty state, so that the callback's I/O doesn't hold up the other
+   users of the volume. */
+static void unlockVolume(CryptedVolume * pVolume)
+{
+   bool fChanged = pVolume->fDirtyChanged;
+   sysUnlockMutex(pVolume->pLock);
+   if (fChanged) notifyDirty(pVolume);
+}
+
+
 /* Forward declarations. */
 static void deleteHighSectors(CryptedFile * pFile, SectorNumber s);
 static CoreResult closeStorageFile(CryptedFile * pFile);
 static CoreResult dropFile(CryptedFile * pFile);
-static CoreResult flushSectors(unsigned int cSectors,
-   CryptedSector * * papSectors);
+static void addFileToEmptyList(CryptedFile * p);
+static void removeFileFromEmptyList(CryptedFile * p);
+static void unpinFile(CryptedFile * pFile);
+static CoreResult flushVolume(CryptedVolume * pVolume);
+static CoreResult flushFile(CryptedFile * pFile, SectorNumber sStart,
+   SectorNumber sEnd);
+static CoreResult flushSectors(CryptedVolume * pVolume,
+   unsigned int cSectors, CryptedSector * * papSectors);
+static void unpinSector(CryptedVolume * pVolume, CryptedSector * p);
 static void dirtySector(CryptedVolume * pVolume,
    CryptedSector * pSector);
+static bool busyWithIO(CryptedVolume * pVolume, CryptedFile * pFile,
+   bool fWritesOnly);
+static void waitForIO(CryptedVolume * pVolume, CryptedFile * pFile,
+   bool fWritesOnly);
 
 
 CoreResult sys2core(SysResult sr)
@@ -142,34 +529,172 @@ CoreResult sys2core(SysResult sr)
 }
 
      
-static inline unsigned int fileHashTableHash(CryptedFileID id)
+/* Multiplicative (Fibonacci) hashing: the top bits of the product
+   are the best mixed ones. */
+static inline unsigned int fileHashTableHash(CryptedVolume * pVolume,
+   CryptedFileID id)
+{
+   return ((uint32) id * HASH_MULT_GOLDEN) >>
+      (32 - pVolume->cFileHashBits);
+}
+
+
+static inline unsigned int sectorHashTableHash(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber nr)
+{
+   return (((uint32) id * HASH_MULT_GOLDEN + (uint32) nr) *
+      HASH_MULT_GOLDEN) >> (32 - pVolume->cSectorHashBits);
+}
+
+
+/* Return the number of hash bits needed to hold c entries in a table
+   that is at most half full. */
+static unsigned int hashTableBits(unsigned int c)
+{
+   unsigned int cBits = MIN_HASH_TABLE_BITS;
+   while ((1UL << cBits) < 2 * (unsigned long) c && cBits < 31) cBits++;
+   return cBits;
+}
+
+
+/* Resize the file hash table to 2^cBits slots, rehashing all
+   entries. */
+static CoreResult resizeFileHashTable(CryptedVolume * pVolume,
+   unsigned int cBits)
+{
+   FileHashSlot * paOld = pVolume->paFileHash, * paNew;
+   unsigned int cOld = paOld ? 1 << pVolume->cFileHashBits : 0;
+   unsigned int i, j, mask = (1 << cBits) - 1;
+
+   paNew = calloc(1 << cBits, sizeof(FileHashSlot));
+   if (!paNew) return CORERC_NOT_ENOUGH_MEMORY;
+
+   pVolume->paFileHash = paNew;
+   pVolume->cFileHashBits = cBits;
+
+   for (i = 0; i < cOld; i++)
+      if (paOld[i].pFile) {
+         for (j = fileHashTableHash(pVolume, paOld[i].id);
+              paNew[j].pFile;
+              j = (j + 1) & mask) ;
+         paNew[j] = paOld[i];
+      }
+
+   free(paOld);
+   return CORERC_OK;
+}
+
+
+/* Resize the sector hash table to 2^cBits slots, rehashing all
+   entries. */
+static CoreResult resizeSectorHashTable(CryptedVolume * pVolume,
+   unsigned int cBits)
+{
+   SectorHashSlot * paOld = pVolume->paSectorHash, * paNew;
+   unsigned int cOld = paOld ? 1 << pVolume->cSectorHashBits : 0;
+   unsigned int i, j, mask = (1 << cBits) - 1;
+
+   paNew = calloc(1 << cBits, sizeof(SectorHashSlot));
+   if (!paNew) return CORERC_NOT_ENOUGH_MEMORY;
+
+   pVolume->paSectorHash = paNew;
+   pVolume->cSectorHashBits = cBits;
+
+   for (i = 0; i < cOld; i++)
+      if (paOld[i].iSector) {
+         for (j = sectorHashTableHash(pVolume,
+                 paOld[i].id, paOld[i].sectorNumber);
+              paNew[j].iSector;
+              j = (j + 1) & mask) ;
+         paNew[j] = paOld[i];
+      }
+
+   free(paOld);
+   return CORERC_OK;
+}
+
+
+/* Return the slot of the file hash table that contains the specified
+   file, or the empty slot where it would be inserted. */
+static inline FileHashSlot * findFileSlot(CryptedVolume * pVolume,
+   CryptedFileID id)
+{
+   unsigned int mask = (1 << pVolume->cFileHashBits) - 1;
+   unsigned int i = fileHashTableHash(pVolume, id);
+   while (pVolume->paFileHash[i].pFile &&
+          pVolume->paFileHash[i].id != (uint32) id)
+      i = (i + 1) & mask;
+   return &pVolume->paFileHash[i];
+}
+
+
+/* Idem for the sector hash table. */
+static inline SectorHashSlot * findSectorSlot(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber s)
+{
+   unsigned int mask = (1 << pVolume->cSectorHashBits) - 1;
+   unsigned int i = sectorHashTableHash(pVolume, id, s);
+   SectorHashSlot * pSlot;
+   while ((pSlot = &pVolume->paSectorHash[i])->iSector &&
+          (pSlot->sectorNumber != (uint32) s ||
+           pSlot->id != (uint32) id))
+      i = (i + 1) & mask;
+   return pSlot;
+}
+
+
+/* Remove the entry in slot i of the file hash table.  Subsequent
+   entries in the same cluster are shifted back so that no lookup
+   needs to probe past an empty slot. */
+static void removeFileSlot(CryptedVolume * pVolume, unsigned int i)
 {
-   double dummy;
-   return ((unsigned int) (FILE_HASH_TABLE_SIZE *
-      modf(HASH_MULT_KNUTH * id, &dummy)))
-      % FILE_HASH_TABLE_SIZE;
+   FileHashSlot * pa = pVolume->paFileHash;
+   unsigned int mask = (1 << pVolume->cFileHashBits) - 1;
+   unsigned int j = i, k;
+
+   while (1) {
+      pa[i].pFile = 0;
+      do {
+         j = (j + 1) & mask;
+         if (!pa[j].pFile) return;
+         k = fileHashTableHash(pVolume, pa[j].id);
+         /* Can the entry in j move back to i?  Only if its home slot
+            k is not cyclically in (i, j]. */
+      } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+      pa[i] = pa[j];
+      i = j;
+   }
 }
 
 
-static inline unsigned int sectorHashTableHash(CryptedFileID id,
-   SectorNumber nr)
+/* Idem for the sector hash table. */
+static void removeSectorSlot(CryptedVolume * pVolume, unsigned int i)
 {
-   double dummy;
-   return (id +
-      (unsigned int) (SECTOR_HASH_TABLE_SIZE *
-         modf(HASH_MULT_KNUTH * nr, &dummy)))
-      % SECTOR_HASH_TABLE_SIZE;
+   SectorHashSlot * pa = pVolume->paSectorHash;
+   unsigned int mask = (1 << pVolume->cSectorHashBits) - 1;
+   unsigned int j = i, k;
+
+   while (1) {
+      pa[i].iSector = 0;
+      do {
+         j = (j + 1) & mask;
+         if (!pa[j].iSector) return;
+         k = sectorHashTableHash(pVolume, pa[j].id, pa[j].sectorNumber);
+      } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+      pa[i] = pa[j];
+      i = j;
+   }
 }
 
 
 static int cmpSectors(const void * p1, const void * p2)
 {
-   int d;
    CryptedSector * s1 = * (CryptedSector * *) p1;
    CryptedSector * s2 = * (CryptedSector * *) p2;
-   d = (int) s1->pFile - (int) s2->pFile;
-   if (!d) d = s1->sectorNumber - s2->sectorNumber;
-   return d;
+   if (s1->pFile != s2->pFile) return s1->pFile < s2->pFile ? -1 : 1;
+   if (s1->sectorNumber != s2->sectorNumber)
+      return s1->sectorNumber < s2->sectorNumber ? -1 : 1;
+   return 0;
 }
 
 
@@ -180,1108 +705,3749 @@ static void sortSectorList(unsigned int csSectors,
 }
 
 
-
-/*
- * Volumes.
- */
-
-
-void coreSetDefVolumeParms(CryptedVolumeParms * pParms)
+/* Free slab k of the sector pool. */
+static void freeSlab(CryptedVolume * pVolume, unsigned int k)
 {
-   pParms->flCryptoFlags = 0;
-   pParms->flOpenFlags = SOF_READWRITE | SOF_DENYWRITE |
-      SOF_RANDOMSEQUENTIAL;
-   memset(&pParms->cred, 0, sizeof(pParms->cred));
-   pParms->fReadOnly = false;
-   pParms->cMaxCryptedFiles = 512;
-   pParms->cMaxOpenStorageFiles = 8;
-   pParms->csMaxCached = 1024;
-   pParms->csIOGranularity = 512;
-   pParms->csISFGrow = 64;
-   pParms->dirtyCallBack = 0;
-   pParms->pUserData = 0;
-   /* !!! this shouldn't be here */
-#ifdef SYSTEM_posix
-   pParms->nameComp = coreNameCompSens;
-#else
-   pParms->nameComp = coreNameCompInsens;
-#endif
+   SectorSlab * pSlab = &pVolume->paSlabs[k];
+
+   if (pSlab->fRetiring) pVolume->cRetiring--;
+   if (pSlab->paData)
+      sysFreePool(pSlab->paData,
+         pSlab->csSlab * pVolume->parms.cbSector);
+   free(pSlab->paSectors);
+   pSlab->paSectors = 0;
+   pSlab->paData = 0;
+   pSlab->csSlab = 0;
+   pSlab->csUsed = 0;
+   pSlab->fRetiring = false;
 }
 
 
-CoreResult coreAccessVolume(char * pszBasePath, Key * pKey,
-   CryptedVolumeParms * pParms, CryptedVolume * * ppVolume)
+/* Put the unused entries of slab k on the free list, so that the
+   lowest ones are used first.  Entry 0 is never used. */
+static void freeSlabEntries(CryptedVolume * pVolume, unsigned int k)
 {
-   unsigned int i;
-   CryptedVolume * pVolume;
-
-   /* Sanity checks on this build. */
-   assert(MAX_BLOCK_SIZE >= 16);
-   assert(sizeof(CryptedFileInfoOnDisk) + FILEINFO_RESERVED +
-      MAX_INTERNAL_EAS == PAYLOAD_SIZE);
-   assert(RANDOM_SIZE == 4);
+   SectorSlab * pSlab = &pVolume->paSlabs[k];
+   CryptedSector * p;
+   unsigned int j;
+
+   for (j = pSlab->csSlab; j-- > (k ? 0 : 1); ) {
+      p = &pSlab->paSectors[j];
+      if (!p->pFile && !p->flFlags) {
+         p->iNextDirty = pVolume->iFreeSector;
+         pVolume->iFreeSector = p->iSelf;
+      }
+   }
+}
 
-   *ppVolume = 0;
 
-   if (pParms->cMaxOpenStorageFiles < 1)
-      return CORERC_INVALID_PARAMETER;
-   
-   if (strlen(pszBasePath) >= MAX_VOLUME_BASE_PATH_NAME)
-      return CORERC_INVALID_PARAMETER;
+/* Allocate slab k of the sector pool, with room for csSlab sectors,
+   and put them on the free list.  csMax is the new size of the
+   cache, for the replacement policy. */
+static CoreResult allocSlab(CryptedVolume * pVolume, unsigned int k,
+   unsigned int csSlab, unsigned int csMax)
+{
+   SectorSlab * pSlab = &pVolume->paSlabs[k];
+   SectorIndex iMax = (k << SECTOR_SLAB_BITS) + csSlab - 1;
+   unsigned int j, flPool = 0;
+
+   if (pVolume->parms.flCacheFlags & CCACHE_LOCK)
+      flPool |= SAP_LOCK;
+   if (pVolume->parms.flCacheFlags & CCACHE_HUGEPAGES)
+      flPool |= SAP_HUGEPAGES;
+
+   /* The policy must know about the new sectors before they can be
+      used. */
+   if (iMax > pVolume->iMaxSector) {
+      if (!pVolume->pPolicy->resize(pVolume->pPolicyState, csMax, iMax))
+         return CORERC_NOT_ENOUGH_MEMORY;
+      pVolume->iMaxSector = iMax;
+   }
    
-   /* Allocate the CryptedVolume. */
-   pVolume = sysAllocSecureMem(sizeof(CryptedVolume));
-   if (!pVolume)
+   pSlab->csSlab = csSlab;
+   pSlab->paSectors = calloc(csSlab, sizeof(CryptedSector));
+   pSlab->paData = sysAllocPool(csSlab * pVolume->parms.cbSector,
+      flPool);
+   if (!pSlab->paSectors || !pSlab->paData) {
+      freeSlab(pVolume, k);
       return CORERC_NOT_ENOUGH_MEMORY;
+   }
 
-   /* Init the CryptedVolume. */
-   strcpy(pVolume->szBasePath, pszBasePath);
-   pVolume->pKey = pKey;
-   pVolume->parms = *pParms;
-   pVolume->cCryptedFiles = 0;
-   pVolume->pFirstFile = 0;
-   pVolume->pLastFile = 0;
-   pVolume->cOpenStorageFiles = 0;
-   pVolume->pFirstOpen = 0;
-   pVolume->pLastOpen = 0;
-   pVolume->csInCache = 0;
-   pVolume->pFirstSector = 0;
-   pVolume->pLastSector = 0;
-   pVolume->csDirty = 0;
-   
-   for (i = 0; i < FILE_HASH_TABLE_SIZE; i++)
-      pVolume->FileHashTable[i] = 0;
-   
-   for (i = 0; i < SECTOR_HASH_TABLE_SIZE; i++)
-      pVolume->SectorHashTable[i] = 0;
-
-   if (pVolume->parms.fReadOnly)
-       pVolume->parms.flOpenFlags = (pVolume->parms.flOpenFlags &
-           ~SOF_RWMASK) | SOF_READONLY;
-
-   *ppVolume = pVolume;
+   for (j = 0; j < csSlab; j++)
+      pSlab->paSectors[j].iSelf = (k << SECTOR_SLAB_BITS) + j;
+   freeSlabEntries(pVolume, k);
+   pVolume->csPool += k ? csSlab : csSlab - 1;
 
    return CORERC_OK;
 }
 
 
-/* Free the volume and all associated data from memory.  All dirty
-   sectors are flushed to disk. */
-CoreResult coreDropVolume(CryptedVolume * pVolume)
+/* Make room in the pool for csMax sectors: first take back slabs
+   that are being retired, then allocate new ones.  Only the first
+   slab can be smaller than SECTOR_SLAB_SIZE (if the cache starts out
+   small). */
+static CoreResult growSectorPool(CryptedVolume * pVolume,
+   unsigned int csMax)
 {
    CoreResult cr;
-   unsigned int i;
-   
-   /* Drop all files.  This will flush all dirty sectors and close all
-      open storage files. */
-   for (i = 0; i < FILE_HASH_TABLE_SIZE; i++) {
-      while (pVolume->FileHashTable[i]) {
-         cr = dropFile(pVolume->FileHashTable[i]);
-         if (cr) return cr; /* !!! Is this good? Drop anyway? */
+   SectorSlab * pSlab;
+   unsigned int k;
+
+   for (k = 0; k < MAX_SECTOR_SLABS && pVolume->csPool < csMax; k++) {
+      pSlab = &pVolume->paSlabs[k];
+      if (pSlab->fRetiring) {
+         pSlab->fRetiring = false;
+         pVolume->cRetiring--;
+         freeSlabEntries(pVolume, k);
+         pVolume->csPool += pSlab->csSlab;
+      } else if (!pSlab->csSlab) {
+         cr = allocSlab(pVolume, k, k || csMax >= SECTOR_SLAB_SIZE ?
+            SECTOR_SLAB_SIZE : csMax + 1, csMax);
+         if (cr) return cr;
       }
    }
 
-   assert(pVolume->csInCache == 0);
-   assert(pVolume->csDirty == 0);
-                      
-   /* Free the CryptedVolume. */
-   sysFreeSecureMem(pVolume);
-   
-   return CORERC_OK;
+   return pVolume->csPool < csMax ? CORERC_CACHE_OVERFLOW : CORERC_OK;
 }
 
 
-/* Flush all dirty sectors in the cache to disk. */
-CoreResult coreFlushVolume(CryptedVolume * pVolume)
+/* Retire the slabs at the top of the pool that are not needed to
+   hold csMax sectors, and take their entries off the free list.
+   Their sectors have to be deleted before they can be freed (see
+   releaseRetiredSectors()). */
+static void retireSlabs(CryptedVolume * pVolume, unsigned int csMax)
 {
-   CoreResult cr;
-   CryptedSector * * papDirty, * p, * * q;
-   int n, m;
+   SectorSlab * pSlab;
+   SectorIndex * pi;
+   unsigned int k, cRetired = 0;
+
+   for (k = MAX_SECTOR_SLABS - 1; k > 0; k--) {
+      pSlab = &pVolume->paSlabs[k];
+      if (!pSlab->csSlab || pSlab->fRetiring) continue;
+      if (pVolume->csPool - pSlab->csSlab < csMax) break;
+      pSlab->fRetiring = true;
+      pVolume->cRetiring++;
+      pVolume->csPool -= pSlab->csSlab;
+      cRetired++;
+   }
 
-   if (pVolume->csDirty) {
-      
-      papDirty = malloc(pVolume->csDirty * sizeof(CryptedSector *));
-      if (!papDirty) return CORERC_NOT_ENOUGH_MEMORY;
+   if (!cRetired) return;
+   
+   for (pi = &pVolume->iFreeSector; *pi; )
+      if (pVolume->paSlabs[*pi >> SECTOR_SLAB_BITS].fRetiring)
+         *pi = sectorAt(pVolume, *pi)->iNextDirty;
+      else
+         pi = &sectorAt(pVolume, *pi)->iNextDirty;
+}
 
-      for (p = pVolume->pFirstSector, q = papDirty, n = 0, m = 0; p;
-           p = p->pNextInMRU, m++)
-         if (p->fDirty) *q++ = p, n++;
-      assert(pVolume->csInCache == m);
-      assert(pVolume->csDirty == n);
 
-      sortSectorList(pVolume->csDirty, papDirty);
+/* Take a block of scratch space from the volume's free list, or
+   allocate one if the list is empty.  Since blocks are returned to
+   the list rather than freed, there are only as many as there have
+   ever been threads at work at once, and steady state I/O doesn't
+   call the memory allocator.  The caller must hold the volume lock,
+   but may release it while using the block. */
+static IOScratch * getScratch(CryptedVolume * pVolume)
+{
+   IOScratch * pScratch;
+   unsigned int c = pVolume->csScratch;
+   octet * p;
 
-      cr = flushSectors(pVolume->csDirty, papDirty);
-      free(papDirty);
-      if (cr) return cr;
-      assert(pVolume->csDirty == 0);
+   if ((pScratch = pVolume->pFreeScratch)) {
+      pVolume->pFreeScratch = pScratch->pNext;
+      return pScratch;
    }
 
-   return CORERC_OK;
+   /* One block, with the arrays in order of alignment. */
+   pScratch = malloc(sizeof(IOScratch) +
+      c * sizeof(CryptedSector *) +
+      pVolume->csIOBuffer * sizeof(CryptedFile *) +
+      c * (sizeof(SysIORequest) + sizeof(SysIOVec) +
+         sizeof(SectorNumber) + sizeof(CoreResult) + 1));
+   if (!pScratch) return 0;
+   p = (octet *) (pScratch + 1);
+   pScratch->papSectors = (CryptedSector * *) p;
+   p += c * sizeof(CryptedSector *);
+   pScratch->papFiles = (CryptedFile * *) p;
+   p += pVolume->csIOBuffer * sizeof(CryptedFile *);
+   pScratch->paRequests = (SysIORequest *) p;
+   p += c * sizeof(SysIORequest);
+   pScratch->paVecs = (SysIOVec *) p;
+   p += c * sizeof(SysIOVec);
+   pScratch->pasSectors = (SectorNumber *) p;
+   p += c * sizeof(SectorNumber);
+   pScratch->pacr = (CoreResult *) p;
+   p += c * sizeof(CoreResult);
+   pScratch->pafFlags = p;
+   pScratch->pabCipher = 0;
+   return pScratch;
 }
 
 
-/* Reduce the number of CryptedFile structures maintained in memory to
-   cFiles.  All references to CryptedFile structures on this volume
-   may be invalid after calling this function. */
-static CoreResult shrinkCryptedFiles(CryptedVolume * pVolume,
-   unsigned int cFiles)
+/* Make sure that the scratch block has a ciphertext buffer. */
+static CoreResult getCipherBuffer(CryptedVolume * pVolume,
+   IOScratch * pScratch)
 {
-   CoreResult cr;
+   if (!pScratch->pabCipher)
+      pScratch->pabCipher = malloc(pVolume->csIOBuffer * pVolume->parms.cbSector);
+   return pScratch->pabCipher ? CORERC_OK : CORERC_NOT_ENOUGH_MEMORY;
+}
 
-   while (pVolume->cCryptedFiles > cFiles) {
-      cr = dropFile(pVolume->pLastFile);
-      if (cr) return cr;
+
+/* Return a block of scratch space to the volume's free list. */
+static void putScratch(CryptedVolume * pVolume, IOScratch * pScratch)
+{
+   pScratch->pNext = pVolume->pFreeScratch;
+   pVolume->pFreeScratch = pScratch;
+}
+
+
+static void freeScratch(CryptedVolume * pVolume)
+{
+   IOScratch * pScratch;
+   while ((pScratch = pVolume->pFreeScratch)) {
+      pVolume->pFreeScratch = pScratch->pNext;
+      free(pScratch->pabCipher);
+      free(pScratch);
    }
-   
-   return CORERC_OK;
 }
 
 
-/* Reduce the number of open storage files to cFiles. */
-CoreResult coreShrinkOpenStorageFiles(CryptedVolume * pVolume,
-   unsigned int cFiles)
+CoreResult coreGetSectorList(CryptedVolume * pVolume,
+   CryptedSector * * * ppapSectors)
 {
-   CoreResult cr;
+   IOScratch * pScratch;
+   sysLockMutex(pVolume->pLock);
+   pScratch = getScratch(pVolume);
+   unlockVolume(pVolume);
+   *ppapSectors = pScratch ? pScratch->papSectors : 0;
+   return pScratch ? CORERC_OK : CORERC_NOT_ENOUGH_MEMORY;
+}
 
-   while (pVolume->cOpenStorageFiles > cFiles) {
-      cr = closeStorageFile(pVolume->pLastOpen);
-      if (cr) return cr;
-   }
-   
-   return CORERC_OK;
+
+void coreReleaseSectorList(CryptedVolume * pVolume,
+   CryptedSector * * papSectors)
+{
+   sysLockMutex(pVolume->pLock);
+   putScratch(pVolume, (IOScratch *) papSectors - 1);
+   unlockVolume(pVolume);
 }
 
 
-CryptedVolumeParms * coreQueryVolumeParms(CryptedVolume * pVolume)
+/* Free the sector pool and the I/O scratch space. */
+static void freeSectorPool(CryptedVolume * pVolume)
 {
-   return &pVolume->parms;
+   unsigned int k;
+
+   if (pVolume->paSlabs) {
+      for (k = 0; k < MAX_SECTOR_SLABS; k++)
+         if (pVolume->paSlabs[k].csSlab) freeSlab(pVolume, k);
+      free(pVolume->paSlabs);
+   }
+   freeScratch(pVolume);
+   if (pVolume->pIORing) sysDestroyIORing(pVolume->pIORing);
+   if (pVolume->pPolicyState)
+      pVolume->pPolicy->destroy(pVolume->pPolicyState);
 }
 
 
-void coreQueryVolumeStats(CryptedVolume * pVolume,
-   CryptedVolumeStats * pStats)
+/* Allocate the sector pool, with room for csMaxCached sectors (plus
+   the unused entry 0).  The slab table is allocated for the largest
+   possible cache, so that it never moves: sectors are used without
+   holding the volume lock.  Also allocate the scratch space for
+   reading and writing sectors.  After this, adding and deleting
+   sectors never calls the memory allocator, except when the cache
+   limits are changed (see coreSetVolumeCacheLimits()). */
+static CoreResult allocSectorPool(CryptedVolume * pVolume)
 {
-   pStats->cCryptedFiles = pVolume->cCryptedFiles;
-   pStats->cOpenStorageFiles = pVolume->cOpenStorageFiles;
-   pStats->csInCache = pVolume->csInCache;
-   pStats->csDirty = pVolume->csDirty;
+   pVolume->cRetiring = 0;
+   pVolume->csPool = 0;
+   pVolume->iMaxSector = pVolume->parms.csMaxCached;
+   pVolume->iFreeSector = 0;
+   pVolume->paSlabs = calloc(MAX_SECTOR_SLABS, sizeof(SectorSlab));
+   pVolume->pPolicyState = 0;
+   pVolume->csIOBuffer = pVolume->parms.csIOGranularity ?
+      pVolume->parms.csIOGranularity : 1;
+   pVolume->csScratch = 2 * pVolume->csIOBuffer;
+   pVolume->pFreeScratch = 0;
+   pVolume->pIORing = 0;
+   if (!pVolume->paSlabs) {
+      freeSectorPool(pVolume);
+      return CORERC_NOT_ENOUGH_MEMORY;
+   }
+
+   pVolume->pPolicyState = pVolume->pPolicy->create(
+      pVolume->parms.csMaxCached);
+   if (!pVolume->pPolicyState ||
+       growSectorPool(pVolume, pVolume->parms.csMaxCached)) {
+      freeSectorPool(pVolume);
+      return CORERC_NOT_ENOUGH_MEMORY;
+   }
+
+   /* Without a ring, batches are done one request at a time. */
+   if (pVolume->parms.flCacheFlags & CCACHE_IORING)
+      sysCreateIORing(IO_RING_ENTRIES, &pVolume->pIORing);
+
+   return CORERC_OK;
 }
 
 
+
 /*
- * Files.
+ * Per-file radix trees of cached sectors.
  */
 
 
-/* Add the file at the head of the MRU list of CryptedFiles. */
-static void addFileToMRUList(CryptedFile * p)
+/* Test, set and clear bit j of a node's dirty bitmap. */
+#define NODE_DIRTY(p, j) ((p)->aflDirty[(j) >> 5] & (1U << ((j) & 31)))
+#define SET_NODE_DIRTY(p, j) ((p)->aflDirty[(j) >> 5] |= 1U << ((j) & 31))
+#define CLEAR_NODE_DIRTY(p, j) \
+   ((p)->aflDirty[(j) >> 5] &= ~(1U << ((j) & 31)))
+
+
+static bool anyNodeDirty(RadixNode * p)
 {
-   CryptedVolume * v = p->pVolume;
-   p->pNextInMRU = v->pFirstFile;
-   p->pPrevInMRU = 0;
-   if (p->pNextInMRU)
-      p->pNextInMRU->pPrevInMRU = p;
-   else
-      v->pLastFile = p;
-   v->pFirstFile = p;
-   v->cCryptedFiles++;
+   unsigned int j;
+   for (j = 0; j < RADIX_SIZE / 32; j++)
+      if (p->aflDirty[j]) return true;
+   return false;
 }
 
 
-/* Remove the file from the MRU list of CryptedFiles. */
-static void removeFileFromMRUList(CryptedFile * p)
+/* Take a node from the volume's node pool, growing the pool if
+   necessary.  Returns 0 if out of memory.  Note that this may move
+   the pool, invalidating pointers to nodes. */
+static NodeIndex allocNode(CryptedVolume * pVolume)
 {
-   CryptedVolume * v = p->pVolume;
-   v->cCryptedFiles--;
-   assert(v->cCryptedFiles >= 0);
-   if (p->pPrevInMRU)
-      p->pPrevInMRU->pNextInMRU = p->pNextInMRU;
-   else
-      v->pFirstFile = p->pNextInMRU;
-   if (p->pNextInMRU)
-      p->pNextInMRU->pPrevInMRU = p->pPrevInMRU;
-   else
-      v->pLastFile = p->pPrevInMRU;
+   RadixNode * paNew;
+   unsigned int cNew, i;
+   NodeIndex n;
+   
+   if (!pVolume->iFreeNode) {
+      cNew = pVolume->cNodes ? 2 * pVolume->cNodes : RADIX_SIZE;
+      paNew = realloc(pVolume->paNodes, cNew * sizeof(RadixNode));
+      if (!paNew) return 0;
+      pVolume->paNodes = paNew;
+      for (i = cNew - 1; i >= pVolume->cNodes && i > 0; i--) {
+         paNew[i].aiSlots[0] = pVolume->iFreeNode;
+         pVolume->iFreeNode = i;
+      }
+      pVolume->cNodes = cNew;
+   }
+
+   n = pVolume->iFreeNode;
+   pVolume->iFreeNode = pVolume->paNodes[n].aiSlots[0];
+   memset(&pVolume->paNodes[n], 0, sizeof(RadixNode));
+   return n;
 }
 
 
-static void makeStoragePathName(CryptedVolume * pVolume,
-   CryptedFileID id, char * pszPathName)
+static void freeNode(CryptedVolume * pVolume, NodeIndex n)
 {
-   sprintf(pszPathName, "%s%08lx.enc", pVolume->szBasePath, id);
+   pVolume->paNodes[n].aiSlots[0] = pVolume->iFreeNode;
+   pVolume->iFreeNode = n;
 }
 
 
-/* Verify that the storage file for the specified CryptedFile
-   exists. */
-static CoreResult storageFileExists(CryptedVolume * pVolume,
-   CryptedFileID id)
+/* Does a tree of height cHeight cover sector number s? */
+static inline bool radixCovers(unsigned int cHeight, SectorNumber s)
 {
-   char szPathName[MAX_STORAGE_PATH_NAME];
-   SysResult sr;
-   bool fExists;
-   makeStoragePathName(pVolume, id, szPathName);
-   if (sr = sysFileExists(szPathName, &fExists)) return sys2core(sr);
-   return fExists ? CORERC_FILE_EXISTS : CORERC_OK;
+   return cHeight * RADIX_BITS >= 32 ||
+      (s >> (cHeight * RADIX_BITS)) == 0;
 }
 
 
-/* Add a file to the head of the MRU list of open storage files. */
-static void addFileToOpenList(CryptedFile * p)
+/* Add sector i, which holds sector s of the file, to the file's
+   radix tree. */
+static CoreResult indexSector(CryptedFile * pFile, SectorNumber s,
+   SectorIndex i)
 {
-   CryptedVolume * v = p->pVolume;
-   p->pNextOpen = v->pFirstOpen;
-   p->pPrevOpen = 0;
-   if (p->pNextOpen)
-      p->pNextOpen->pPrevOpen = p;
-   else
+   CryptedVolume * pVolume = pFile->pVolume;
+   NodeIndex n, m;
+   unsigned int h, j;
+
+   if (!pFile->iRoot) {
+      if (!(n = allocNode(pVolume))) return CORERC_NOT_ENOUGH_MEMORY;
+      removeFileFromEmptyList(pFile);
+      pFile->iRoot = n;
+      pFile->cHeight = 1;
+   }
+
+   /* Add levels at the top until the tree covers s. */
+   while (!radixCovers(pFile->cHeight, s)) {
+      if (!(n = allocNode(pVolume))) return CORERC_NOT_ENOUGH_MEMORY;
+      pVolume->paNodes[n].aiSlots[0] = pFile->iRoot;
+      pVolume->paNodes[n].cUsed = 1;
+      if (anyNodeDirty(&pVolume->paNodes[pFile->iRoot]))
+         SET_NODE_DIRTY(&pVolume->paNodes[n], 0);
+      pFile->iRoot = n;
+      pFile->cHeight++;
+   }
+
+   /* Walk down to the leaf, creating nodes as necessary. */
+   n = pFile->iRoot;
+   for (h = pFile->cHeight - 1; h > 0; h--) {
+      j = (s >> (h * RADIX_BITS)) & RADIX_MASK;
+      if (!pVolume->paNodes[n].aiSlots[j]) {
+         if (!(m = allocNode(pVolume))) return CORERC_NOT_ENOUGH_MEMORY;
+         pVolume->paNodes[n].aiSlots[j] = m;
+         pVolume->paNodes[n].cUsed++;
+      }
+      n = pVolume->paNodes[n].aiSlots[j];
+   }
+
+   j = s & RADIX_MASK;
+   assert(!pVolume->paNodes[n].aiSlots[j]);
+   pVolume->paNodes[n].aiSlots[j] = i;
+   pVolume->paNodes[n].cUsed++;
+
+   return CORERC_OK;
+}
+
+
+/* Remove sector s from the file's radix tree.  Nodes that become
+   empty are freed. */
+static void unindexSector(CryptedFile * pFile, SectorNumber s)
+{
+   CryptedVolume * pVolume = pFile->pVolume;
+   NodeIndex aPath[RADIX_MAX_HEIGHT], n;
+   unsigned int h;
+
+   assert(radixCovers(pFile->cHeight, s));
+
+   for (n = pFile->iRoot, h = pFile->cHeight; h-- > 0; ) {
+      aPath[h] = n;
+      n = pVolume->paNodes[n].aiSlots[(s >> (h * RADIX_BITS)) & RADIX_MASK];
+      assert(n);
+   }
+
+   /* Clear the slot in the leaf, then free empty nodes bottom-up.
+      The sector must not be dirty. */
+   for (h = 0; h < pFile->cHeight; h++) {
+      n = aPath[h];
+      assert(!NODE_DIRTY(&pVolume->paNodes[n],
+         (s >> (h * RADIX_BITS)) & RADIX_MASK));
+      pVolume->paNodes[n].aiSlots[(s >> (h * RADIX_BITS)) & RADIX_MASK] = 0;
+      if (--pVolume->paNodes[n].cUsed) return;
+      freeNode(pVolume, n);
+   }
+
+   pFile->iRoot = 0;
+   pFile->cHeight = 0;
+   addFileToEmptyList(pFile);
+}
+
+
+/* Return the first sector with a sector number >= s in the subtree
+   rooted at node n of height h.  s is relative to the start of the
+   subtree. */
+static SectorIndex findNextInSubtree(CryptedVolume * pVolume,
+   NodeIndex n, unsigned int h, SectorNumber s)
+{
+   unsigned int shift = (h - 1) * RADIX_BITS;
+   unsigned int j, j0 = s >> shift;
+   uint32 * aiSlots = pVolume->paNodes[n].aiSlots;
+   SectorIndex i;
+
+   if (h == 1) {
+      for (j = j0; j < RADIX_SIZE; j++)
+         if (aiSlots[j]) return aiSlots[j];
+      return 0;
+   }
+
+   for (j = j0; j < RADIX_SIZE; j++)
+      if (aiSlots[j]) {
+         i = findNextInSubtree(pVolume, aiSlots[j], h - 1,
+            j == j0 ? s & ((1UL << shift) - 1) : 0);
+         if (i) return i;
+      }
+
+   return 0;
+}
+
+
+/* Return the file's cached sector with the lowest sector number >= s,
+   or 0 if there is none. */
+static SectorIndex findNextSector(CryptedFile * pFile, SectorNumber s)
+{
+   if (!pFile->iRoot || !radixCovers(pFile->cHeight, s)) return 0;
+   return findNextInSubtree(pFile->pVolume, pFile->iRoot,
+      pFile->cHeight, s);
+}
+
+
+/* Set or clear the dirty tag of sector s (which must be in the
+   file's radix tree) and update the tags of its ancestors. */
+static void tagSector(CryptedFile * pFile, SectorNumber s, bool fDirty)
+{
+   CryptedVolume * pVolume = pFile->pVolume;
+   NodeIndex aPath[RADIX_MAX_HEIGHT], n;
+   RadixNode * p;
+   unsigned int h, j;
+
+   for (n = pFile->iRoot, h = pFile->cHeight; h-- > 0; ) {
+      aPath[h] = n;
+      n = pVolume->paNodes[n].aiSlots[(s >> (h * RADIX_BITS)) & RADIX_MASK];
+      assert(n);
+   }
+
+   for (h = 0; h < pFile->cHeight; h++) {
+      p = &pVolume->paNodes[aPath[h]];
+      j = (s >> (h * RADIX_BITS)) & RADIX_MASK;
+      if (fDirty) {
+         if (NODE_DIRTY(p, j)) return;
+         SET_NODE_DIRTY(p, j);
+      } else {
+         CLEAR_NODE_DIRTY(p, j);
+         if (anyNodeDirty(p)) return;
+      }
+   }
+}
+
+
+/* Like findNextInSubtree(), but only finds dirty sectors and skips
+   clean subtrees. */
+static SectorIndex findNextDirtyInSubtree(CryptedVolume * pVolume,
+   NodeIndex n, unsigned int h, SectorNumber s)
+{
+   unsigned int shift = (h - 1) * RADIX_BITS;
+   unsigned int j, j0 = s >> shift;
+   RadixNode * p = &pVolume->paNodes[n];
+   SectorIndex i;
+
+   for (j = j0; j < RADIX_SIZE; j++)
+      if (NODE_DIRTY(p, j)) {
+         if (h == 1) return p->aiSlots[j];
+         i = findNextDirtyInSubtree(pVolume, p->aiSlots[j], h - 1,
+            j == j0 ? s & ((1UL << shift) - 1) : 0);
+         if (i) return i;
+      }
+
+   return 0;
+}
+
+
+/* Return the file's dirty sector with the lowest sector number >= s,
+   or 0 if there is none. */
+static SectorIndex findNextDirtySector(CryptedFile * pFile,
+   SectorNumber s)
+{
+   if (!pFile->csDirty || !radixCovers(pFile->cHeight, s)) return 0;
+   return findNextDirtyInSubtree(pFile->pVolume, pFile->iRoot,
+      pFile->cHeight, s);
+}
+
+
+/* Free a subtree.  Only needed to clean up after running out of
+   memory in indexSector(); normally, deleting the sectors empties
+   the tree. */
+static void freeSubtree(CryptedVolume * pVolume, NodeIndex n,
+   unsigned int h)
+{
+   unsigned int j;
+   if (h > 1)
+      for (j = 0; j < RADIX_SIZE; j++)
+         if (pVolume->paNodes[n].aiSlots[j])
+            freeSubtree(pVolume, pVolume->paNodes[n].aiSlots[j], h - 1);
+   freeNode(pVolume, n);
+}
+
+
+
+/*
+ * Volumes.
+ */
+
+
+/* Unless told otherwise, a volume keeps up to half as many storage
+   files open as the process may have open files, leaving the rest to
+   its other users. */
+static unsigned int defaultOpenStorageFiles(CryptedVolumeParms * pParms)
+{
+   unsigned int cFiles = sysQueryMaxOpenFiles() / 2;
+   if (cFiles < MIN_OPEN_STORAGE_FILES)
+      cFiles = MIN_OPEN_STORAGE_FILES;
+   if (cFiles > pParms->cMaxCryptedFiles)
+      cFiles = pParms->cMaxCryptedFiles;
+   return cFiles;
+}
+
+
+void coreSetDefVolumeParms(CryptedVolumeParms * pParms)
+{
+   pParms->flCryptoFlags = 0;
+   pParms->flOpenFlags = SOF_READWRITE | SOF_DENYWRITE |
+      SOF_RANDOMSEQUENTIAL;
+   pParms->flStorageFlags = 0;
+   memset(&pParms->cred, 0, sizeof(pParms->cred));
+   pParms->cbSector = SECTOR_SIZE;
+   pParms->fReadOnly = false;
+   pParms->cMaxCryptedFiles = 512;
+   pParms->cMaxOpenStorageFiles = 0;
+   pParms->csMaxCached = 1024;
+   pParms->flCacheFlags = 0;
+   pParms->nMemPressure = 500;
+   pParms->pCachePolicy = 0;
+   pParms->csIOGranularity = 512;
+   pParms->csISFGrow = 256;
+   pParms->cWriteBackAge = 5;
+   pParms->nWriteBackRatio = 25;
+   pParms->cbWriteBackRate = 0;
+   pParms->csMaxReadAhead = 256;
+   pParms->csStreamThreshold = 1024;
+   pParms->cCryptoThreads = 0;
+   pParms->csCryptoCutoff = 64;
+   pParms->cInfoCache = 1024;
+   pParms->cFreeIDs = 1024;
+   pParms->dirtyCallBack = 0;
+   pParms->pUserData = 0;
+   /* !!! this shouldn't be here */
+#ifdef SYSTEM_posix
+   pParms->nameComp = coreNameCompSens;
+#else
+   pParms->nameComp = coreNameCompInsens;
+#endif
+}
+
+
+/* Scale the writeback threshold and the largest readahead window to
+   the size of the cache. */
+static void scaleToCache(CryptedVolume * pVolume)
+{
+   pVolume->csWriteBackThreshold = (unsigned int)
+      ((double) pVolume->parms.csMaxCached *
+         pVolume->parms.nWriteBackRatio / 100);
+   pVolume->csMaxReadAhead = pVolume->parms.csMaxReadAhead;
+   if (pVolume->csMaxReadAhead > pVolume->parms.csMaxCached / 4)
+      pVolume->csMaxReadAhead = pVolume->parms.csMaxCached / 4;
+}
+
+
+static void freeLocks(CryptedVolume * pVolume)
+{
+   unsigned int i;
+   if (pVolume->pLock) sysDestroyMutex(pVolume->pLock);
+   if (pVolume->pIOLock) sysDestroyMutex(pVolume->pIOLock);
+   for (i = 0; i < FILE_LOCKS; i++)
+      if (pVolume->apFileLocks[i]) sysDestroyMutex(pVolume->apFileLocks[i]);
+   if (pVolume->pWriteBackWake) sysDestroyCond(pVolume->pWriteBackWake);
+   if (pVolume->pIODone) sysDestroyCond(pVolume->pIODone);
+   if (pVolume->pReadAheadWake) sysDestroyCond(pVolume->pReadAheadWake);
+}
+
+
+CoreResult coreAccessVolume(char * pszBasePath, Key * pKey,
+   CryptedVolumeParms * pParms, CryptedVolume * * ppVolume)
+{
+   CryptedVolume * pVolume;
+   unsigned int i;
+   SysResult sr;
+
+   /* Sanity checks on this build. */
+   assert(MAX_BLOCK_SIZE >= 16);
+   assert(sizeof(CryptedFileInfoOnDisk) + FILEINFO_RESERVED +
+      MAX_INTERNAL_EAS == PAYLOAD_SIZE);
+   assert(RANDOM_SIZE == 4);
+
+   *ppVolume = 0;
+
+   if (pParms->cMaxCryptedFiles < 1 || pParms->csMaxCached < 1 ||
+       pParms->csMaxCached > MAX_CACHED_SECTORS)
+      return CORERC_INVALID_PARAMETER;
+
+   if (pParms->cWriteBackAge < 1 || pParms->nWriteBackRatio < 1 ||
+       pParms->nWriteBackRatio > 100)
+      return CORERC_INVALID_PARAMETER;
+
+   if (pParms->cbSector < SECTOR_SIZE ||
+       pParms->cbSector > MAX_SECTOR_SIZE ||
+       (pParms->cbSector & (pParms->cbSector - 1)))
+      return CORERC_INVALID_PARAMETER;
+   
+   if (strlen(pszBasePath) >= MAX_VOLUME_BASE_PATH_NAME)
+      return CORERC_INVALID_PARAMETER;
+   
+   /* Allocate the CryptedVolume. */
+   pVolume = sysAllocSecureMem(sizeof(CryptedVolume));
+   if (!pVolume)
+      return CORERC_NOT_ENOUGH_MEMORY;
+
+   /* Init the CryptedVolume. */
+   strcpy(pVolume->szBasePath, pszBasePath);
+   pVolume->pKey = pKey;
+   pVolume->parms = *pParms;
+   pVolume->cbPayload = PAYLOAD_SIZE_OF(pParms->cbSector);
+   pVolume->cCryptedFiles = 0;
+   pVolume->pFirstEmpty = 0;
+   pVolume->pLastEmpty = 0;
+   pVolume->pBaseDir = 0;
+   pVolume->cOpenStorageFiles = 0;
+   pVolume->pFirstOpen = 0;
+   pVolume->pLastOpen = 0;
+   pVolume->csInCache = 0;
+   pVolume->pPolicy = pParms->pCachePolicy ?
+      pParms->pCachePolicy : cachePolicyTable[0];
+   pVolume->cCacheHits = 0;
+   pVolume->cCacheMisses = 0;
+   pVolume->csDirty = 0;
+   pVolume->paFileHash = 0;
+   pVolume->paSectorHash = 0;
+   pVolume->paNodes = 0;
+   pVolume->cNodes = 0;
+   pVolume->iFreeNode = 0;
+   pVolume->iFirstDirty = 0;
+   pVolume->iLastDirty = 0;
+   pVolume->cDirtyFiles = 0;
+   pVolume->pFirstDirty = 0;
+   pVolume->pLastDirty = 0;
+   pVolume->fDirty = false;
+   pVolume->fDirtyChanged = false;
+   pVolume->fDirtyReported = false;
+   pVolume->fNotifying = false;
+   pVolume->pLock = 0;
+   pVolume->pIOLock = 0;
+   pVolume->pCryptPool = 0;
+   pVolume->pInfoCache = 0;
+   pVolume->pFreeIDs = 0;
+   for (i = 0; i < FILE_LOCKS; i++)
+      pVolume->apFileLocks[i] = 0;
+   pVolume->pIODone = 0;
+   pVolume->cIOWaiters = 0;
+   pVolume->cReaders = 0;
+   pVolume->cWriters = 0;
+   pVolume->csPinned = 0;
+   pVolume->pWriteBackThread = 0;
+   pVolume->pWriteBackWake = 0;
+   pVolume->pWriteBackFile = 0;
+   pVolume->pReadAheadThread = 0;
+   pVolume->pReadAheadWake = 0;
+   pVolume->pReadAheadFile = 0;
+   pVolume->iReadAheadHead = 0;
+   pVolume->cReadAhead = 0;
+   if (!pVolume->parms.cMaxOpenStorageFiles)
+      pVolume->parms.cMaxOpenStorageFiles =
+         defaultOpenStorageFiles(&pVolume->parms);
+   pVolume->csCacheLimit = pParms->csMaxCached;
+   pVolume->msNextPressureCheck = sysQueryMilliseconds();
+   scaleToCache(pVolume);
+
+   if (sysCreateMutex(&pVolume->pLock) ||
+       sysCreateMutex(&pVolume->pIOLock) ||
+       sysCreateCond(&pVolume->pIODone) ||
+       sysCreateCond(&pVolume->pWriteBackWake) ||
+       sysCreateCond(&pVolume->pReadAheadWake))
+   {
+      freeLocks(pVolume);
+      sysFreeSecureMem(pVolume);
+      return CORERC_NOT_ENOUGH_MEMORY;
+   }
+
+   for (i = 0; i < FILE_LOCKS; i++)
+      if (sysCreateMutex(&pVolume->apFileLocks[i])) {
+         freeLocks(pVolume);
+         sysFreeSecureMem(pVolume);
+         return CORERC_NOT_ENOUGH_MEMORY;
+      }
+
+   if (allocSectorPool(pVolume)) {
+      freeLocks(pVolume);
+      sysFreeSecureMem(pVolume);
+      return CORERC_NOT_ENOUGH_MEMORY;
+   }
+
+   /* Size the hash tables for the maximum number of CryptedFiles and
+      cached sectors. */
+   if (resizeFileHashTable(pVolume,
+          hashTableBits(pVolume->parms.cMaxCryptedFiles)) ||
+       resizeSectorHashTable(pVolume,
+          hashTableBits(pVolume->parms.csMaxCached)) ||
+       (pVolume->parms.cCryptoThreads &&
+        coreCreateCryptPool(pVolume->parms.cCryptoThreads,
+           &pVolume->pCryptPool)) ||
+       (pVolume->parms.cInfoCache &&
+        coreCreateInfoCache(pVolume->parms.cInfoCache,
+           &pVolume->pInfoCache)) ||
+       (pVolume->parms.cFreeIDs &&
+        coreCreateFreeIDs(pVolume->parms.cFreeIDs,
+           &pVolume->pFreeIDs)))
+   {
+      if (pVolume->pCryptPool) coreDestroyCryptPool(pVolume->pCryptPool);
+      if (pVolume->pInfoCache) coreDestroyInfoCache(pVolume->pInfoCache);
+      free(pVolume->paFileHash);
+      free(pVolume->paSectorHash);
+      freeSectorPool(pVolume);
+      freeLocks(pVolume);
+      sysFreeSecureMem(pVolume);
+      return CORERC_NOT_ENOUGH_MEMORY;
+   }
+
+   if (pVolume->parms.fReadOnly)
+       pVolume->parms.flOpenFlags = (pVolume->parms.flOpenFlags &
+           ~SOF_RWMASK) | SOF_READONLY;
+
+   /* This also takes the lock on the storage files. */
+   sr = sysOpenDir(pVolume->szBasePath, pVolume->parms.flOpenFlags,
+      pVolume->parms.cred, &pVolume->pBaseDir);
+   if (sr) {
+      if (pVolume->pCryptPool) coreDestroyCryptPool(pVolume->pCryptPool);
+      if (pVolume->pInfoCache) coreDestroyInfoCache(pVolume->pInfoCache);
+      if (pVolume->pFreeIDs) coreDestroyFreeIDs(pVolume->pFreeIDs);
+      free(pVolume->paFileHash);
+      free(pVolume->paSectorHash);
+      freeSectorPool(pVolume);
+      freeLocks(pVolume);
+      sysFreeSecureMem(pVolume);
+      return sys2core(sr);
+   }
+
+   *ppVolume = pVolume;
+
+   return CORERC_OK;
+}
+
+
+/* Free the volume and all associated data from memory.  All dirty
+   sectors are flushed to disk. */
+CoreResult coreDropVolume(CryptedVolume * pVolume)
+{
+   CoreResult cr;
+   unsigned int i;
+
+   coreStopReadAhead(pVolume);
+   coreStopWriteBack(pVolume);
+
+   /* Flush all dirty sectors in one ordered pass.  This releases
+      the lock while writing, like any other flush. */
+   sysLockMutex(pVolume->pLock);
+   cr = flushVolume(pVolume);
+   unlockVolume(pVolume);
+   if (cr) return cr;
+   
+   /* Drop all files.  This will close all open storage files.
+      Removing a file from the hash table only shifts entries into
+      slots we haven't visited yet. */
+   for (i = 0; i < 1 << pVolume->cFileHashBits; i++) {
+      while (pVolume->paFileHash[i].pFile) {
+         cr = dropFile(pVolume->paFileHash[i].pFile);
+         if (cr) return cr; /* !!! Is this good? Drop anyway? */
+      }
+   }
+
+   assert(pVolume->csInCache == 0);
+   assert(pVolume->csDirty == 0);
+   assert(pVolume->cReaders == 0);
+   assert(pVolume->cWriters == 0);
+   assert(pVolume->csPinned == 0);
+
+   sysCloseDir(pVolume->pBaseDir);
+   if (pVolume->pCryptPool) coreDestroyCryptPool(pVolume->pCryptPool);
+   if (pVolume->pInfoCache) coreDestroyInfoCache(pVolume->pInfoCache);
+   if (pVolume->pFreeIDs) coreDestroyFreeIDs(pVolume->pFreeIDs);
+   free(pVolume->paFileHash);
+   free(pVolume->paSectorHash);
+   free(pVolume->paNodes);
+   freeSectorPool(pVolume);
+   freeLocks(pVolume);
+                      
+   /* Free the CryptedVolume. */
+   sysFreeSecureMem(pVolume);
+   
+   return CORERC_OK;
+}
+
+
+static int cmpFiles(const void * p1, const void * p2)
+{
+   CryptedFile * f1 = * (CryptedFile * *) p1;
+   CryptedFile * f2 = * (CryptedFile * *) p2;
+   return f1->id < f2->id ? -1 : f1->id > f2->id ? 1 : 0;
+}
+
+
+/* Flush all dirty sectors in the cache to disk.  Only the files with
+   dirty sectors are visited, in order of file ID, and each file's
+   dirty sectors are written in order.  So the cost is proportional
+   to the number of dirty sectors, not to the size of the cache.
+   Sectors dirtied by other threads while we are at it may not be
+   flushed. */
+static CoreResult flushVolume(CryptedVolume * pVolume)
+{
+   CoreResult cr = CORERC_OK;
+   CryptedFile * * papFiles, * pFile;
+   IOScratch * pScratch;
+   unsigned int c, i;
+
+   if (!pVolume->cDirtyFiles) {
+      waitForIO(pVolume, 0, true);
+      return CORERC_OK;
+   }
+
+   /* Only a flush of very many files needs more than the scratch
+      space. */
+   if (!(pScratch = getScratch(pVolume)))
+      return CORERC_NOT_ENOUGH_MEMORY;
+   papFiles = pScratch->papFiles;
+   if (pVolume->cDirtyFiles > pVolume->csIOBuffer &&
+       !(papFiles = malloc(pVolume->cDirtyFiles * sizeof(CryptedFile *))))
+   {
+      putScratch(pVolume, pScratch);
+      return CORERC_NOT_ENOUGH_MEMORY;
+   }
+
+   /* flushFile() may wait, so keep the files pinned. */
+   for (pFile = pVolume->pFirstDirty, c = 0; pFile;
+        pFile = pFile->pNextDirty)
+   {
+      papFiles[c++] = pFile;
+      pFile->cPins++;
+   }
+   assert(c == pVolume->cDirtyFiles);
+   
+   qsort(papFiles, c, sizeof(CryptedFile *), cmpFiles);
+
+   for (i = 0; i < c && !cr; i++)
+      cr = flushFile(papFiles[i], 0, (SectorNumber) -1);
+
+   for (i = 0; i < c; i++)
+      unpinFile(papFiles[i]);
+
+   if (papFiles != pScratch->papFiles) free(papFiles);
+   putScratch(pVolume, pScratch);
+   if (cr) return cr;
+
+   /* Sectors that the writeback thread is writing are no longer
+      dirty, but they aren't on disk yet either. */
+   waitForIO(pVolume, 0, true);
+
+   return CORERC_OK;
+}
+
+
+CoreResult coreFlushVolume(CryptedVolume * pVolume)
+{
+   CoreResult cr;
+   sysLockMutex(pVolume->pLock);
+   cr = flushVolume(pVolume);
+   unlockVolume(pVolume);
+   return cr;
+}
+
+
+/* Reduce the number of CryptedFile structures maintained in memory to
+   cFiles.  Only files without sectors in the cache are dropped, so
+   that running through many files doesn't throw away cached sectors
+   the cache itself would have kept; files that are pinned are not
+   dropped either.  So there may be more than cFiles left.  All
+   references to unpinned CryptedFile structures on this volume may
+   be invalid after calling this function. */
+static CoreResult shrinkCryptedFiles(CryptedVolume * pVolume,
+   unsigned int cFiles)
+{
+   CoreResult cr;
+   CryptedFile * pFile;
+
+   while (pVolume->cCryptedFiles > cFiles) {
+      for (pFile = pVolume->pLastEmpty;
+           pFile && (pFile->cPins || pFile->fDropping);
+           pFile = pFile->pPrevEmpty) ;
+      if (!pFile) break;
+      cr = dropFile(pFile);
+      if (cr) return cr;
+   }
+   
+   return CORERC_OK;
+}
+
+
+/* Return the least recently used open storage file that nobody is
+   reading or writing, or 0 if there is none. */
+static CryptedFile * findIdleStorageFile(CryptedVolume * pVolume)
+{
+   CryptedFile * pFile;
+   for (pFile = pVolume->pLastOpen;
+        pFile && busyWithIO(pVolume, pFile, false);
+        pFile = pFile->pPrevOpen) ;
+   return pFile;
+}
+
+
+/* Reduce the number of open storage files to cFiles.  Files that are
+   in use are closed once they are idle. */
+static CoreResult shrinkOpenStorageFiles(CryptedVolume * pVolume,
+   unsigned int cFiles)
+{
+   CoreResult cr;
+   CryptedFile * pFile;
+
+   while (pVolume->cOpenStorageFiles > cFiles) {
+      pFile = findIdleStorageFile(pVolume);
+      if (!pFile) {
+         waitForIO(pVolume, 0, false);
+         continue;
+      }
+      cr = closeStorageFile(pFile);
+      if (cr) return cr;
+   }
+   
+   return CORERC_OK;
+}
+
+
+CoreResult coreShrinkOpenStorageFiles(CryptedVolume * pVolume,
+   unsigned int cFiles)
+{
+   CoreResult cr;
+   sysLockMutex(pVolume->pLock);
+   cr = shrinkOpenStorageFiles(pVolume, cFiles);
+   unlockVolume(pVolume);
+   return cr;
+}
+
+
+CryptedVolumeParms * coreQueryVolumeParms(CryptedVolume * pVolume)
+{
+   return &pVolume->parms;
+}
+
+
+InfoCache * coreQueryInfoCache(CryptedVolume * pVolume)
+{
+   return pVolume->pInfoCache;
+}
+
+
+FreeIDs * coreQueryFreeIDs(CryptedVolume * pVolume)
+{
+   return pVolume->pFreeIDs;
+}
+
+
+void coreQueryVolumeStats(CryptedVolume * pVolume,
+   CryptedVolumeStats * pStats)
+{
+   sysLockMutex(pVolume->pLock);
+   pStats->cCryptedFiles = pVolume->cCryptedFiles;
+   pStats->cOpenStorageFiles = pVolume->cOpenStorageFiles;
+   pStats->csInCache = pVolume->csInCache;
+   pStats->csDirty = pVolume->csDirty;
+   pStats->cCacheHits = pVolume->cCacheHits;
+   pStats->cCacheMisses = pVolume->cCacheMisses;
+   unlockVolume(pVolume);
+}
+
+
+/*
+ * Files.
+ */
+
+
+/* Add the file at the head of the MRU list of CryptedFiles without
+   cached sectors. */
+static void addFileToEmptyList(CryptedFile * p)
+{
+   CryptedVolume * v = p->pVolume;
+   p->pNextEmpty = v->pFirstEmpty;
+   p->pPrevEmpty = 0;
+   if (p->pNextEmpty)
+      p->pNextEmpty->pPrevEmpty = p;
+   else
+      v->pLastEmpty = p;
+   v->pFirstEmpty = p;
+}
+
+
+/* Remove the file from the MRU list of CryptedFiles without cached
+   sectors. */
+static void removeFileFromEmptyList(CryptedFile * p)
+{
+   CryptedVolume * v = p->pVolume;
+   if (p->pPrevEmpty)
+      p->pPrevEmpty->pNextEmpty = p->pNextEmpty;
+   else
+      v->pFirstEmpty = p->pNextEmpty;
+   if (p->pNextEmpty)
+      p->pNextEmpty->pPrevEmpty = p->pPrevEmpty;
+   else
+      v->pLastEmpty = p->pPrevEmpty;
+}
+
+
+void coreMakeStorageFileName(unsigned int flStorageFlags,
+   CryptedFileID id, char * pszName)
+{
+   if (flStorageFlags & CSTOR_SHARDED)
+      sprintf(pszName, "%02lx/%02lx/%08lx.enc",
+         id & 0xff, (id >> 8) & 0xff, id);
+   else
+      sprintf(pszName, "%08lx.enc", id);
+}
+
+
+static void makeStorageFileName(CryptedVolume * pVolume,
+   CryptedFileID id, char * pszFileName)
+{
+   coreMakeStorageFileName(pVolume->parms.flStorageFlags, id,
+      pszFileName);
+}
+
+
+static void makeStoragePathName(CryptedVolume * pVolume,
+   CryptedFileID id, char * pszPathName)
+{
+   strcpy(pszPathName, pVolume->szBasePath);
+   makeStorageFileName(pVolume, id, pszPathName + strlen(pszPathName));
+}
+
+
+/* Create the subdirectories that hold the storage file of id on a
+   sharded volume, if they don't exist yet. */
+static SysResult makeShardDirs(CryptedVolume * pVolume,
+   CryptedFileID id)
+{
+   char szDir[8];
+   SysResult sr;
+   
+   sprintf(szDir, "%02lx", id & 0xff);
+   sr = sysCreateDirAt(pVolume->pBaseDir, szDir, pVolume->parms.cred);
+   if (sr && sr != SYS_FILE_EXISTS) return sr;
+
+   sprintf(szDir, "%02lx/%02lx", id & 0xff, (id >> 8) & 0xff);
+   sr = sysCreateDirAt(pVolume->pBaseDir, szDir, pVolume->parms.cred);
+   if (sr && sr != SYS_FILE_EXISTS) return sr;
+
+   return SYS_OK;
+}
+
+
+/* Check whether the storage file for the specified CryptedFile
+   exists.  Only a failure to find out is an error. */
+static CoreResult storageFileExists(CryptedVolume * pVolume,
+   CryptedFileID id, bool * pfExists)
+{
+   char szPathName[MAX_STORAGE_PATH_NAME];
+   makeStoragePathName(pVolume, id, szPathName);
+   return sys2core(sysFileExists(szPathName, pfExists));
+}
+
+
+/* Add a file to the head of the MRU list of open storage files. */
+static void addFileToOpenList(CryptedFile * p)
+{
+   CryptedVolume * v = p->pVolume;
+   p->pNextOpen = v->pFirstOpen;
+   p->pPrevOpen = 0;
+   if (p->pNextOpen)
+      p->pNextOpen->pPrevOpen = p;
+   else
       v->pLastOpen = p;
    v->pFirstOpen = p;
    v->cOpenStorageFiles++;
 }
 
 
-/* Remove a file from the MRU list of open storage files. */
-static void removeFileFromOpenList(CryptedFile * p)
+/* Remove a file from the MRU list of open storage files. */
+static void removeFileFromOpenList(CryptedFile * p)
+{
+   CryptedVolume * v = p->pVolume;
+   v->cOpenStorageFiles--;
+   assert(v->cOpenStorageFiles >= 0);
+   if (p->pPrevOpen)
+      p->pPrevOpen->pNextOpen = p->pNextOpen;
+   else
+      v->pFirstOpen = p->pNextOpen;
+   if (p->pNextOpen)
+      p->pNextOpen->pPrevOpen = p->pPrevOpen;
+   else
+      v->pLastOpen = p->pPrevOpen;
+}
+
+
+/* Close a storage file.  This waits until nobody is reading or
+   writing it, so unless the file is idle, the caller must own it (see
+   dropFile()). */
+static CoreResult closeStorageFile(CryptedFile * pFile)
+{
+   File * pStorageFile;
+
+   waitForIO(pFile->pVolume, pFile, false);
+
+   pStorageFile = pFile->pStorageFile;
+
+   if (!pStorageFile) return CORERC_OK;
+
+   pFile->pStorageFile = 0;
+   
+   /* Remove the file from the list of open files. */
+   removeFileFromOpenList(pFile);
+
+   /* Close the storage file. */
+   return sys2core(sysCloseFile(pStorageFile));
+}
+
+
+/* Make sure that the storage file for the specified CryptedFile is
+   open.  If it is already open, it is moved to the head of the MRU
+   list.  If it is not open, it is opened or created. */
+static CoreResult openStorageFile(CryptedFile * pFile, bool fCreate,
+   CryptedFilePos cbInitialSize)
+{
+   CoreResult cr;
+   SysResult sr;
+   char szFileName[MAX_STORAGE_FILE_NAME + 1];
+   CryptedFile * pOther;
+   
+   if (pFile->pStorageFile) {
+      /* pFile is now the CryptedFile with the most recently used open
+         storage file, so move it to the head of the MRU list. */
+      removeFileFromOpenList(pFile);
+      addFileToOpenList(pFile);
+      return CORERC_OK;
+   }
+
+   if (pFile->pVolume->cOpenStorageFiles >=
+      pFile->pVolume->parms.cMaxOpenStorageFiles &&
+      (pOther = findIdleStorageFile(pFile->pVolume)))
+   {
+      /* We have reached the maximum number of concurrently open
+         storage files.  Close the least recently used one that is
+         idle; if they are all in use, go over the limit for now
+         rather than wait, so that this never releases the volume
+         lock. */
+      cr = closeStorageFile(pOther);
+      if (cr) return cr;
+   }
+
+   /* Open/create the storage file.  If the process has run out of
+      file descriptors (other volumes or the daemon hold the rest),
+      give back idle ones until it works. */
+   
+   makeStorageFileName(pFile->pVolume, pFile->id, szFileName);
+
+   do {
+      if (fCreate)
+         sr = sysCreateFileAt(pFile->pVolume->pBaseDir, szFileName,
+              pFile->pVolume->parms.flOpenFlags, cbInitialSize, 
+              pFile->pVolume->parms.cred, &pFile->pStorageFile);
+      else
+         sr = sysOpenFileAt(pFile->pVolume->pBaseDir, szFileName,
+              pFile->pVolume->parms.flOpenFlags,
+              pFile->pVolume->parms.cred, &pFile->pStorageFile);
+   } while (sr == SYS_TOO_MANY_FILES &&
+            (pOther = findIdleStorageFile(pFile->pVolume)) &&
+            !closeStorageFile(pOther));
+
+   /* The subdirectories of a sharded volume are created along with
+      the first file that goes into them. */
+   if (sr == SYS_FILE_NOT_FOUND && fCreate &&
+       (pFile->pVolume->parms.flStorageFlags & CSTOR_SHARDED) &&
+       !(sr = makeShardDirs(pFile->pVolume, pFile->id)))
+      sr = sysCreateFileAt(pFile->pVolume->pBaseDir, szFileName,
+         pFile->pVolume->parms.flOpenFlags, cbInitialSize, 
+         pFile->pVolume->parms.cred, &pFile->pStorageFile);
+   
+   if (sr) return sys2core(sr);
+
+   /* Add at the head of the MRU list. */
+   addFileToOpenList(pFile);
+   
+   return CORERC_OK;
+}
+
+
+/* Create a CryptedFile object for the specified file ID (or return it
+   if it already exists).  This function does not check that the
+   associated storage file exists and is readable.  The file is
+   pinned; the caller must unpin it when done. */
+static CoreResult accessFile(CryptedVolume * pVolume,
+   CryptedFileID id, CryptedFile * * ppFile)
+{
+   FileHashSlot * pSlot;
+   CryptedFile * pFile;
+   bool fShrunk = false;
+
+   *ppFile = 0;
+
+   if (id == 0) return CORERC_INVALID_PARAMETER;
+
+   /* Search in the volume's CryptedFile hash table for a CryptedFile
+      with the specified file ID.  Dropping files may wait, so look
+      again afterwards. */
+   while (true) {
+      pSlot = findFileSlot(pVolume, id);
+      pFile = pSlot->pFile;
+      if (pFile && pFile->fDropping) {
+         /* Wait until dropFile() is done with it. */
+         sysWaitCond(pVolume->pIODone, pVolume->pLock, 0);
+         continue;
+      }
+      if (pFile) {
+         /* Move file to front of MRU list.  (Files with cached
+            sectors are kept alive by those.) */
+         if (!pFile->iRoot) {
+            removeFileFromEmptyList(pFile);
+            addFileToEmptyList(pFile);
+         }
+         pFile->cPins++;
+         *ppFile = pFile;
+         return CORERC_OK;
+      }
+      if (fShrunk ||
+          pVolume->cCryptedFiles < pVolume->parms.cMaxCryptedFiles)
+         break;
+      shrinkCryptedFiles(pVolume, pVolume->parms.cMaxCryptedFiles - 1);
+      fShrunk = true;
+   }
+
+   /* Keep the hash table at most half full. */
+   if (2 * (pVolume->cCryptedFiles + 1) > 1 << pVolume->cFileHashBits &&
+       resizeFileHashTable(pVolume, pVolume->cFileHashBits + 1))
+      return CORERC_NOT_ENOUGH_MEMORY;
+   
+   /* Didn't find anything, so we create a new CryptedFile. */
+   pFile = sysAllocSecureMem(sizeof(CryptedFile));
+   if (!pFile)
+      return CORERC_NOT_ENOUGH_MEMORY;
+
+   /* Init it. */
+   pFile->pVolume = pVolume;
+   pFile->id = id;
+   pFile->pNextOpen = 0;
+   pFile->pPrevOpen = 0;
+   pFile->pStorageFile = 0;
+   pFile->cPins = 1;
+   pFile->fDropping = false;
+   pFile->cReaders = 0;
+   pFile->cWriters = 0;
+   pFile->csDirty = 0;
+   pFile->pNextDirty = 0;
+   pFile->pPrevDirty = 0;
+   pFile->iRoot = 0;
+   pFile->cHeight = 0;
+   pFile->sLastRead = 0;
+   pFile->sNextRead = 0;
+   pFile->sReadAhead = 0;
+   pFile->csReadAhead = 0;
+
+   /* Add the file to the volume's MRU list. */
+   addFileToEmptyList(pFile);
+   pVolume->cCryptedFiles++;
+      
+   /* Add the file to the volume's CryptedFile hash table.  Resizing
+      it above may have moved the slot. */
+   pSlot = findFileSlot(pVolume, id);
+   pSlot->id = id;
+   pSlot->pFile = pFile;
+
+   *ppFile = pFile;
+
+   return CORERC_OK;
+}
+
+
+/* Unpin a file that was pinned by accessFile() or by incrementing
+   its cPins. */
+static void unpinFile(CryptedFile * pFile)
+{
+   assert(pFile->cPins > 0);
+   if (--pFile->cPins == 0 && pFile->fDropping)
+      sysSignalCond(pFile->pVolume->pIODone);
+}
+
+
+/* Remove the CryptedFile from memory.  All dirty sectors are flushed
+   to disk and removed from the cache.  This waits until the file is
+   no longer pinned; meanwhile accessFile() keeps others out. */
+static CoreResult dropFile(CryptedFile * pFile)
+{
+   CryptedVolume * pVolume = pFile->pVolume;
+   CoreResult cr;
+
+   assert(!pFile->fDropping);
+   pFile->fDropping = true;
+   while (pFile->cPins)
+      sysWaitCond(pVolume->pIODone, pVolume->pLock, 0);
+
+   cr = flushFile(pFile, 0, (SectorNumber) -1);
+   if (!cr) {
+      /* Let the background threads finish with the file first. */
+      waitForIO(pVolume, pFile, false);
+
+      /* Delete all sectors from the cache. */
+      deleteHighSectors(pFile, 0);
+      if (pFile->iRoot) {
+         freeSubtree(pVolume, pFile->iRoot, pFile->cHeight);
+         pFile->iRoot = 0;
+         pFile->cHeight = 0;
+         addFileToEmptyList(pFile);
+      }
+
+      /* Close the storage file, if we have one. */
+      cr = closeStorageFile(pFile);
+   }
+
+   /* Those flushing sectors of ours may have pinned the file while
+      we were waiting. */
+   while (pFile->cPins)
+      sysWaitCond(pVolume->pIODone, pVolume->pLock, 0);
+
+   if (cr) {
+      pFile->fDropping = false;
+      sysSignalCond(pVolume->pIODone);
+      return cr; /* !!! */
+   }
+   
+   /* Remove the file from the volume's MRU list. */
+   assert(!pFile->iRoot);
+   removeFileFromEmptyList(pFile);
+   pVolume->cCryptedFiles--;
+   
+   /* Remove the CryptedFile from the volume's file hash table. */
+   removeFileSlot(pFile->pVolume,
+      findFileSlot(pFile->pVolume, pFile->id) -
+      pFile->pVolume->paFileHash);
+
+   /* Free the CryptedFile. */
+   sysFreeSecureMem(pFile);
+
+   /* Let those waiting for the file in accessFile() go on. */
+   sysSignalCond(pVolume->pIODone);
+
+   return CORERC_OK;
+}
+
+
+/* Create a file with the given ID and initial size. The content of
+   the allocated sectors is undefined (and reading them will give a
+   CRC error with high probability).  The initial size is advisory
+   only (see coreSuggestFileSize). */
+static CoreResult createFile(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber csPreallocate)
+{
+   CoreResult cr;
+   CryptedFile * pFile;
+   bool fExists;
+
+   if (pVolume->parms.fReadOnly) return CORERC_READ_ONLY;
+
+   /* Creating the storage file fails if it exists, but a file that
+      we already have in memory may have an open storage file. */
+   if (findFileSlot(pVolume, id)->pFile) {
+      cr = storageFileExists(pVolume, id, &fExists);
+      if (cr) return cr;
+      if (fExists) return CORERC_ID_EXISTS;
+   }
+
+   /* Create a CryptedFile for this file. */
+   cr = accessFile(pVolume, id, &pFile);
+   if (cr) return cr;
+
+   /* Create a storage file. */
+   cr = openStorageFile(pFile, true, csPreallocate * pVolume->parms.cbSector);
+   unpinFile(pFile);
+   if (cr) {
+      dropFile(pFile);
+      return cr == CORERC_SYS + SYS_FILE_EXISTS ? CORERC_ID_EXISTS : cr;
+   }
+
+   return CORERC_OK;
+}
+
+
+CoreResult coreCreateFile(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber csPreallocate)
+{
+   CoreResult cr;
+   sysLockMutex(pVolume->pLock);
+   cr = createFile(pVolume, id, csPreallocate);
+   unlockVolume(pVolume);
+   return cr;
+}
+
+
+/* Destroy the specified file.  This means freeing all the file's
+   resources in memory (see dropFile()) and deleting the
+   associated storage file. */
+static CoreResult destroyFile(CryptedVolume * pVolume, CryptedFileID id)
+{
+   CoreResult cr;
+   char szFileName[MAX_STORAGE_FILE_NAME + 1];
+   CryptedFile * pFile;
+
+   if (pVolume->parms.fReadOnly) return CORERC_READ_ONLY;
+
+   cr = accessFile(pVolume, id, &pFile);
+   if (cr) return cr;
+
+   makeStorageFileName(pVolume, pFile->id, szFileName);
+
+   /* Delete all the file's sectors from the cache without flushing to
+      disk. */
+   deleteHighSectors(pFile, 0);
+   unpinFile(pFile);
+   
+   /* Drop the crypted file.  This will close the storage file. */
+   cr = dropFile(pFile);
+   if (cr) return cr;
+
+   /* Delete the storage file. */
+   return sys2core(sysDeleteFileAt(pVolume->pBaseDir, szFileName,
+      true, pVolume->parms.cred));
+}
+
+
+CoreResult coreDestroyFile(CryptedVolume * pVolume, CryptedFileID id)
+{
+   CoreResult cr;
+   sysLockMutex(pVolume->pLock);
+   cr = destroyFile(pVolume, id);
+   unlockVolume(pVolume);
+   return cr;
+}
+
+
+/* Flush the file's dirty sectors in the range [sStart, sEnd] to
+   disk.  The radix tree yields them in order (skipping clean
+   subtrees), so adjacent sectors are written together without
+   sorting.  They are collected a scratch list's worth at a time; sectors
+   that others dirty behind us meanwhile may not be flushed. */
+static CoreResult flushFile(CryptedFile * pFile, SectorNumber sStart,
+   SectorNumber sEnd)
+{
+   CryptedVolume * pVolume = pFile->pVolume;
+   CoreResult cr = CORERC_OK;
+   CryptedSector * * papDirty, * p;
+   IOScratch * pScratch;
+   unsigned int n, j;
+   SectorIndex i;
+   bool fDone = false;
+
+   if (!pFile->csDirty) return CORERC_OK;
+
+   if (!(pScratch = getScratch(pVolume)))
+      return CORERC_NOT_ENOUGH_MEMORY;
+   papDirty = pScratch->papSectors;
+
+   while (!fDone && !cr) {
+      n = 0;
+      fDone = true;
+      for (i = findNextDirtySector(pFile, sStart); i; ) {
+         p = sectorAt(pVolume, i);
+         if (p->sectorNumber > sEnd) break;
+         if (n == pVolume->csScratch) {
+            sStart = p->sectorNumber;
+            fDone = false;
+            break;
+         }
+         papDirty[n++] = p;
+         p->cPins++;
+         if (p->sectorNumber == 0xffffffff) break;
+         i = findNextDirtySector(pFile, p->sectorNumber + 1);
+      }
+
+      /* flushSectors() may wait, so the sectors are pinned. */
+      cr = flushSectors(pVolume, n, papDirty);
+      for (j = 0; j < n; j++)
+         unpinSector(pVolume, papDirty[j]);
+      if (n) sysSignalCond(pVolume->pIODone);
+   }
+
+   putScratch(pVolume, pScratch);
+   return cr;
+}
+
+
+/* Flush all dirty sectors. */
+CoreResult coreFlushFile(CryptedVolume * pVolume, CryptedFileID id)
+{
+   CoreResult cr;
+   CryptedFile * pFile;
+
+   sysLockMutex(pVolume->pLock);
+
+   cr = accessFile(pVolume, id, &pFile);
+   if (!cr) {
+      cr = flushFile(pFile, 0, (SectorNumber) -1);
+      if (!cr) waitForIO(pVolume, pFile, true);
+      unpinFile(pFile);
+   }
+
+   unlockVolume(pVolume);
+   return cr;
+}
+
+
+/* Suggest that the size of the storage file be increased or decreased
+   to the specified number of sectors.  This can be used to improve
+   performance and reduce fragmentation on certain systems (like
+   OS/2). */
+static CoreResult suggestFileAllocation(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber csAllocate)
+{
+   CoreResult cr;
+   FilePos cbNewSize;
+   CryptedFile * pFile;
+
+   if (pVolume->parms.fReadOnly) return CORERC_READ_ONLY;
+
+   cr = accessFile(pVolume, id, &pFile);
+   if (cr) return cr;
+
+   deleteHighSectors(pFile, csAllocate);
+
+   /* Don't let the writeback thread write deleted sectors beyond the
+      new end of the file. */
+   waitForIO(pVolume, pFile, true);
+   
+   /* Make sure the storage file for this CryptedFile is open. */
+   cr = openStorageFile(pFile, false, 0);
+
+   /* Set the new file size.  The semantics of sysSetFileSize() do not
+      guarantee that growing a file will work (and it doesn't, in
+      general, on POSIX).  */
+   if (!cr) {
+      cbNewSize = pVolume->parms.cbSector * (CryptedFilePos) csAllocate;
+      cr = sys2core(sysSetFileSize(pFile->pStorageFile, cbNewSize));
+   }
+
+   unpinFile(pFile);
+   return cr;
+}
+
+
+CoreResult coreSuggestFileAllocation(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber csAllocate)
+{
+   CoreResult cr;
+   sysLockMutex(pVolume->pLock);
+   cr = suggestFileAllocation(pVolume, id, csAllocate);
+   unlockVolume(pVolume);
+   return cr;
+}
+
+
+/* Several file IDs share each lock, which is why a thread may hold
+   only one of them. */
+void coreLockFile(CryptedVolume * pVolume, CryptedFileID id)
+{
+   sysLockMutex(pVolume->apFileLocks[id % FILE_LOCKS]);
+}
+
+
+void coreUnlockFile(CryptedVolume * pVolume, CryptedFileID id)
+{
+   sysUnlockMutex(pVolume->apFileLocks[id % FILE_LOCKS]);
+}
+
+
+/*
+ * Sectors & cache management.
+ */
+
+
+/* Clear the dirty flag of the specified sector. */
+static void clearDirtyFlag(CryptedSector * p)
+{
+   CryptedFile * pFile = p->pFile;
+   CryptedVolume * pVolume = pFile->pVolume;
+   if (p->flFlags & CSF_DIRTY) {
+      p->flFlags &= ~CSF_DIRTY;
+      tagSector(pFile, p->sectorNumber, false);
+
+      /* Remove from the list of dirty sectors. */
+      if (p->iPrevDirty)
+         sectorAt(pVolume, p->iPrevDirty)->iNextDirty = p->iNextDirty;
+      else
+         pVolume->iFirstDirty = p->iNextDirty;
+      if (p->iNextDirty)
+         sectorAt(pVolume, p->iNextDirty)->iPrevDirty = p->iPrevDirty;
+      else
+         pVolume->iLastDirty = p->iPrevDirty;
+
+      assert(pFile->csDirty > 0);
+      if (--pFile->csDirty == 0) {
+         /* Remove from the list of dirty files. */
+         if (pFile->pPrevDirty)
+            pFile->pPrevDirty->pNextDirty = pFile->pNextDirty;
+         else
+            pVolume->pFirstDirty = pFile->pNextDirty;
+         if (pFile->pNextDirty)
+            pFile->pNextDirty->pPrevDirty = pFile->pPrevDirty;
+         else
+            pVolume->pLastDirty = pFile->pPrevDirty;
+         pVolume->cDirtyFiles--;
+      }
+      
+      /* If the writeback thread is busy, it will make the call when
+         the sectors are actually on disk. */
+      pVolume->csDirty--;
+      assert(pVolume->csDirty >= 0);
+      if (pVolume->csDirty == 0 && !pVolume->pWriteBackFile)
+         setDirtyState(pVolume, false);
+   }
+}
+
+
+/* Add a sector to the cache.  The sector data is undefined.  The
+   dirty flag is initially false.  The caller must have made room in
+   the cache (see purgeCache()). */
+static CoreResult addSector(CryptedFile * pFile, SectorNumber s,
+   CryptedSector * * ppSector)
+{
+   CryptedVolume * pVolume = pFile->pVolume;
+   CryptedSector * pSector;
+   SectorHashSlot * pSlot;
+   SectorIndex i;
+
+   *ppSector = 0;
+
+   /* Keep the hash table at most half full. */
+   if (2 * (pVolume->csInCache + 1) > 1 << pVolume->cSectorHashBits &&
+       resizeSectorHashTable(pVolume, pVolume->cSectorHashBits + 1))
+      return CORERC_NOT_ENOUGH_MEMORY;
+   
+   /* Take a sector from the free list. */
+   i = pVolume->iFreeSector;
+   if (!i) return CORERC_CACHE_OVERFLOW;
+
+   /* Insert it into this file's radix tree. */
+   if (indexSector(pFile, s, i)) return CORERC_NOT_ENOUGH_MEMORY;
+   
+   pSector = sectorAt(pVolume, i);
+   pVolume->iFreeSector = pSector->iNextDirty;
+   pVolume->paSlabs[i >> SECTOR_SLAB_BITS].csUsed++;
+
+   pSector->pFile = pFile;
+   pSector->sectorNumber = s;
+   pSector->flFlags = 0;
+   pSector->cPins = 0;
+
+   pVolume->csInCache++;
+   
+   pVolume->pPolicy->insertSector(pVolume->pPolicyState, i,
+      pFile->id, s);
+
+   /* Add to the volume's sector hash table. */
+   pSlot = findSectorSlot(pVolume, pFile->id, s);
+   assert(!pSlot->iSector);
+   pSlot->id = pFile->id;
+   pSlot->sectorNumber = s;
+   pSlot->iSector = i;
+
+   *ppSector = pSector;
+
+   return CORERC_OK;
+}
+
+
+/* Return a sector from the cache, or 0 if the sector is not presently
+   in the cache.  If the sector is being read, wait for it. */
+static CryptedSector * findCachedSector(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber sectorNumber)
+{
+   CryptedSector * pSector;
+   CryptedFile * pFile;
+
+   /* Search in the volume's sector hash table. */
+   while ((pSector = sectorAt(pVolume,
+              findSectorSlot(pVolume, id, sectorNumber)->iSector)) &&
+          (pSector->flFlags & CSF_READING))
+   {
+      pFile = pSector->pFile;
+      pFile->cPins++;
+      waitForIO(pVolume, pFile, false);
+      unpinFile(pFile);
+   }
+
+   return pSector;
+}
+
+
+/* Return a sector to the free list.  If its slab is being retired,
+   the slab is freed once this was its last sector. */
+static void freeSector(CryptedVolume * pVolume, CryptedSector * p)
+{
+   SectorIndex i = sectorIndex(pVolume, p);
+   SectorSlab * pSlab = &pVolume->paSlabs[i >> SECTOR_SLAB_BITS];
+   
+   p->pFile = 0;
+   p->flFlags = 0;
+
+   pVolume->csInCache--;
+   assert(pVolume->csInCache >= 0);
+
+   pSlab->csUsed--;
+   if (!pSlab->fRetiring) {
+      p->iNextDirty = pVolume->iFreeSector;
+      pVolume->iFreeSector = i;
+   } else if (!pSlab->csUsed)
+      freeSlab(pVolume, i >> SECTOR_SLAB_BITS);
+}
+
+
+/* Unpin a sector.  If it was deleted while pinned, it is freed now. */
+static void unpinSector(CryptedVolume * pVolume, CryptedSector * p)
+{
+   assert(p->cPins > 0);
+   if (--p->cPins == 0 && (p->flFlags & CSF_STALE))
+      freeSector(pVolume, p);
+}
+
+
+/* Delete the specified sector from the cache.  fEvicted specifies
+   whether it was chosen for eviction by the replacement policy.  A
+   pinned sector disappears from the cache right away, but it is only
+   marked CSF_STALE; its entry is freed when the last pin goes. */
+static void deleteSector(CryptedSector * p, bool fEvicted)
+{
+   CryptedVolume * pVolume = p->pFile->pVolume;
+
+   if (p->flFlags & CSF_DIRTY) clearDirtyFlag(p);
+
+   pVolume->pPolicy->removeSector(pVolume->pPolicyState,
+      sectorIndex(pVolume, p), p->pFile->id, p->sectorNumber, fEvicted);
+
+   /* Remove the sector from the volume's sector hash table. */
+   removeSectorSlot(pVolume,
+      findSectorSlot(pVolume, p->pFile->id, p->sectorNumber) -
+      pVolume->paSectorHash);
+   
+   /* Remove the sector from the file's radix tree. */
+   unindexSector(p->pFile, p->sectorNumber);
+
+   if (p->cPins) {
+      p->pFile = 0;
+      p->flFlags = CSF_STALE;
+   } else
+      freeSector(pVolume, p);
+}
+
+
+/* Delete all the file's sectors with sector numbers >= s from the
+   cache, without flushing dirty sectors to disk. */
+static void deleteHighSectors(CryptedFile * pFile, SectorNumber s)
+{
+   SectorIndex i;
+   
+   while ((i = findNextSector(pFile, s)))
+      deleteSector(sectorAt(pFile->pVolume, i), false);
+}
+
+
+/* Delete sectors from the cache to make room for csReq new sectors,
+   flushing dirty sectors to disk if necessary.  Do not delete sectors
+   in the exclusion region (i.e. the sectors being fetched by
+   coreFetchSectors()).  This may make less room if others are using
+   the cache, so the caller must check again afterwards. */
+static CoreResult purgeCache(CryptedVolume * pVolume, unsigned int csReq,
+   CryptedFile * pExclFile, SectorNumber sExclStart,
+   SectorNumber sExclExtent)
 {
-   CryptedVolume * v = p->pVolume;
-   v->cOpenStorageFiles--;
-   assert(v->cOpenStorageFiles >= 0);
-   if (p->pPrevOpen)
-      p->pPrevOpen->pNextOpen = p->pNextOpen;
+   CryptedSector * p, * * papDirty;
+   IOScratch * pScratch;
+   SectorIndex i, iSkip = 0;
+   unsigned int csFound = 0, csDirty = 0, csBatch, j, csSkipped = 0;
+   CoreResult cr = CORERC_OK;
+   bool fEvict;
+
+   /* We delete the sectors chosen by the replacement policy from the
+      cache (skipping sectors in the exclusion region, and pinned
+      sectors, which others are using).  Clean sectors are deleted
+      right away.  Dirty ones are only marked and pinned; they are
+      written in one sorted batch (so that adjacent sectors are
+      written together) and deleted afterwards.  Other dirty sectors
+      are left alone, so the cost of a purge is proportional to
+      csReq. */
+
+   csBatch = pVolume->parms.csIOGranularity;
+   if (!(pScratch = getScratch(pVolume)))
+      return CORERC_NOT_ENOUGH_MEMORY;
+   papDirty = pScratch->papSectors;
+   if (csReq + csBatch > pVolume->csScratch &&
+       !(papDirty = malloc((csReq + csBatch) * sizeof(CryptedSector *))))
+   {
+      putScratch(pVolume, pScratch);
+      return CORERC_NOT_ENOUGH_MEMORY;
+   }
+
+   while (csFound < csReq) {
+      
+      /* Some policies go round in circles rather than run out of
+         candidates, so also stop after skipping every sector. */
+      i = pVolume->pPolicy->nextVictim(pVolume->pPolicyState, iSkip);
+      if (!i || csSkipped > pVolume->csInCache) {
+         /* Everything else is pinned or excluded.  Write the victims
+            we have; failing that, wait for others to drop their pins,
+            if there is anybody to do so.  Others may have made room
+            meanwhile, so return after waiting and let the caller
+            look again. */
+         if (csDirty || csFound) break;
+         if (!busyWithIO(pVolume, 0, false) && !pVolume->cIOWaiters &&
+             !pVolume->csPinned)
+            cr = CORERC_CACHE_OVERFLOW;
+         else
+            sysWaitCond(pVolume->pIODone, pVolume->pLock, 0);
+         break;
+      }
+      p = sectorAt(pVolume, i);
+
+      if (p->cPins ||
+          ((p->pFile == pExclFile) &&
+           (p->sectorNumber >= sExclStart) &&
+           (p->sectorNumber < sExclStart + sExclExtent)))
+         iSkip = i, csSkipped++;
+      else if (p->flFlags & CSF_DIRTY) {
+         p->flFlags |= CSF_VICTIM | CSF_BATCHED;
+         p->cPins++;
+         papDirty[csDirty++] = p;
+         iSkip = i;
+         csFound++;
+         csSkipped = 0;
+      } else {
+         deleteSector(p, true);
+         csFound++;
+         csSkipped = 0;
+      }
+   }
+
+   if (!csDirty) goto done;
+
+   /* Since we have to write anyway, also write (but don't evict) the
+      dirty sectors that are next in line for eviction, up to a batch
+      of csIOGranularity sectors.  Otherwise a stream of single-sector
+      misses would become a stream of single-sector writes. */
+   for (j = 0; j < csBatch && csDirty < csBatch; j++) {
+      i = pVolume->pPolicy->nextVictim(pVolume->pPolicyState, iSkip);
+      if (!i) break;
+      p = sectorAt(pVolume, i);
+      if ((p->flFlags & (CSF_DIRTY | CSF_BATCHED)) == CSF_DIRTY) {
+         p->flFlags |= CSF_BATCHED;
+         p->cPins++;
+         papDirty[csDirty++] = p;
+      }
+      iSkip = i;
+   }
+
+   sortSectorList(csDirty, papDirty);
+   cr = flushSectors(pVolume, csDirty, papDirty);
+
+   /* flushSectors() has released the lock, and meanwhile others may
+      have deleted, dirtied or pinned the victims.  Only evict those
+      that are still clean and unused. */
+   for (j = 0; j < csDirty; j++) {
+      p = papDirty[j];
+      fEvict = (p->flFlags & CSF_VICTIM) && !cr;
+      p->flFlags &= ~(CSF_BATCHED | CSF_VICTIM);
+      unpinSector(pVolume, p);
+      if (fEvict && !p->cPins && !(p->flFlags & CSF_DIRTY))
+         deleteSector(p, true);
+   }
+   sysSignalCond(pVolume->pIODone);
+
+ done:
+   if (papDirty != pScratch->papSectors) free(papDirty);
+   putScratch(pVolume, pScratch);
+   return cr;
+}
+
+
+/* Delete the sectors in the slabs that are being retired, so that
+   the slabs can be freed.  Pinned sectors are left to their pinners.
+   Dirty sectors are written first if fFlush is set, and left for the
+   writeback thread otherwise. */
+static CoreResult releaseRetiredSectors(CryptedVolume * pVolume,
+   bool fFlush)
+{
+   CoreResult cr = CORERC_OK;
+   CryptedSector * p, * * papDirty = 0;
+   SectorSlab * pSlab;
+   unsigned int k, j, csDirty = 0;
+   bool fDelete;
+
+   if (fFlush && pVolume->csDirty) {
+      papDirty = malloc(pVolume->csDirty * sizeof(CryptedSector *));
+      if (!papDirty) return CORERC_NOT_ENOUGH_MEMORY;
+   }
+
+   /* Deleting the last sector of a slab frees it, which ends the
+      inner loop. */
+   for (k = 1; k < MAX_SECTOR_SLABS && pVolume->cRetiring; k++) {
+      pSlab = &pVolume->paSlabs[k];
+      if (!pSlab->fRetiring) continue;
+      for (j = 0; j < pSlab->csSlab; j++) {
+         p = &pSlab->paSectors[j];
+         if (!p->pFile || p->cPins) continue;
+         if (!(p->flFlags & CSF_DIRTY))
+            deleteSector(p, false);
+         else if (papDirty) {
+            p->cPins++;
+            papDirty[csDirty++] = p;
+         }
+      }
+      if (pSlab->fRetiring && !pSlab->csUsed) freeSlab(pVolume, k);
+   }
+
+   if (!papDirty) return CORERC_OK;
+
+   /* flushSectors() may wait, so the sectors are pinned.  Others may
+      have used them in the meantime. */
+   sortSectorList(csDirty, papDirty);
+   cr = flushSectors(pVolume, csDirty, papDirty);
+   for (j = 0; j < csDirty; j++) {
+      p = papDirty[j];
+      fDelete = p->cPins == 1 &&
+         !(p->flFlags & (CSF_DIRTY | CSF_STALE));
+      unpinSector(pVolume, p);
+      if (fDelete) deleteSector(p, false);
+   }
+   if (csDirty) sysSignalCond(pVolume->pIODone);
+   
+   free(papDirty);
+   return cr;
+}
+
+
+/* Evict clean sectors chosen by the replacement policy until there
+   are at most csMax sectors in the cache, or only dirty and pinned
+   ones are left. */
+static void evictCleanSectors(CryptedVolume * pVolume,
+   unsigned int csMax)
+{
+   CryptedSector * p;
+   SectorIndex i, iSkip = 0;
+   unsigned int csSkipped = 0;
+
+   while (pVolume->csInCache > csMax &&
+          csSkipped <= pVolume->csInCache &&
+          (i = pVolume->pPolicy->nextVictim(pVolume->pPolicyState,
+              iSkip)))
+   {
+      p = sectorAt(pVolume, i);
+      if (p->cPins || (p->flFlags & CSF_DIRTY))
+         iSkip = i, csSkipped++;
+      else
+         deleteSector(p, true);
+   }
+}
+
+
+/* Change the maximum number of sectors in the cache.  When it
+   shrinks, the slabs that are no longer needed are retired and
+   sectors are evicted.  Dirty sectors are written if fFlush is set;
+   otherwise only clean sectors are evicted, and the rest have to wait
+   until the writeback thread has written them.  Either way, there
+   may be more sectors in the cache than csMax for a while; they are
+   evicted as new ones come in. */
+static CoreResult setCacheLimit(CryptedVolume * pVolume,
+   unsigned int csMax, bool fFlush)
+{
+   CoreResult cr;
+
+   if (csMax > pVolume->csPool) {
+      cr = growSectorPool(pVolume, csMax);
+      if (cr) return cr;
+   }
+
+   pVolume->parms.csMaxCached = csMax;
+   pVolume->pPolicy->resize(pVolume->pPolicyState, csMax,
+      pVolume->iMaxSector);
+   scaleToCache(pVolume);
+
+   retireSlabs(pVolume, csMax);
+   if (pVolume->cRetiring) {
+      cr = releaseRetiredSectors(pVolume, fFlush);
+      if (cr) return cr;
+   }
+
+   if (pVolume->csInCache <= csMax) return CORERC_OK;
+   if (!fFlush) {
+      evictCleanSectors(pVolume, csMax);
+      return CORERC_OK;
+   }
+   cr = purgeCache(pVolume, pVolume->csInCache - csMax, 0, 0, 0);
+   return cr == CORERC_CACHE_OVERFLOW ? CORERC_OK : cr;
+}
+
+
+CoreResult coreSetVolumeCacheLimits(CryptedVolume * pVolume,
+   unsigned int csMaxCached, unsigned int cMaxCryptedFiles)
+{
+   CoreResult cr = CORERC_OK;
+
+   if (csMaxCached && (csMaxCached > MAX_CACHED_SECTORS ||
+                       csMaxCached < pVolume->parms.csIOGranularity))
+      return CORERC_INVALID_PARAMETER;
+   
+   sysLockMutex(pVolume->pLock);
+
+   if (csMaxCached) {
+      pVolume->csCacheLimit = csMaxCached;
+      cr = setCacheLimit(pVolume, csMaxCached, true);
+   }
+
+   if (!cr && cMaxCryptedFiles) {
+      pVolume->parms.cMaxCryptedFiles = cMaxCryptedFiles;
+      if (pVolume->parms.cMaxOpenStorageFiles > cMaxCryptedFiles)
+         pVolume->parms.cMaxOpenStorageFiles = cMaxCryptedFiles;
+      cr = shrinkCryptedFiles(pVolume, cMaxCryptedFiles);
+   }
+
+   unlockVolume(pVolume);
+   return cr;
+}
+
+
+/* Append a sector buffer to a list of I/O vectors.  Sectors that
+   are adjacent in the pool are merged into a single vector. */
+static void addIOVec(CryptedVolume * pVolume, SysIOVec * paVecs,
+   unsigned int * pcVecs, CryptedSectorData * pData)
+{
+   octet * pab = (octet *) pData;
+   SysIOVec * pLast = *pcVecs ? &paVecs[*pcVecs - 1] : 0;
+
+   if (pLast && pLast->pabBuffer + pLast->cbLength == pab)
+      pLast->cbLength += pVolume->parms.cbSector;
+   else {
+      paVecs[*pcVecs].pabBuffer = pab;
+      paVecs[*pcVecs].cbLength = pVolume->parms.cbSector;
+      (*pcVecs)++;
+   }
+}
+
+
+/* Submit a batch of requests, through the volume's I/O ring if it
+   has one. */
+static void submitIOBatch(CryptedVolume * pVolume, unsigned int cRequests,
+   SysIORequest * paRequests)
+{
+   if (!pVolume->pIORing) {
+      sysSubmitIOBatch(0, cRequests, paRequests);
+      return;
+   }
+   sysLockMutex(pVolume->pIOLock);
+   sysSubmitIOBatch(pVolume->pIORing, cRequests, paRequests);
+   sysUnlockMutex(pVolume->pIOLock);
+}
+
+
+/* Return the outcome of a request as a CoreResult. */
+static CoreResult queryIOResult(SysIORequest * pReq)
+{
+   FilePos cbTotal = 0;
+   unsigned int i;
+   
+   if (pReq->sr) return sys2core(pReq->sr);
+   for (i = 0; i < pReq->cVecs; i++)
+      cbTotal += pReq->paVecs[i].cbLength;
+   if (pReq->cbDone == cbTotal) return CORERC_OK;
+   return pReq->fWrite ? CORERC_SYS + SYS_IO : CORERC_SHORT_FILE;
+}
+
+
+/* A batch of sectors to be encrypted or decrypted by cryptSectors().
+   The plaintext of sector i is that of papSectors[i], or if
+   papSectors is 0, at i * cbSector in pabBuffer.  Its ciphertext
+   is at i * cbSector in pabBuffer, or if pabBuffer is 0, in place
+   of the plaintext.  When decrypting, the plaintext can be left out
+   of the cache and just its payload copied to i * cbPayload in
+   pabPayload; the results are stored in pacr, if not 0; and sectors
+   for which pafSkip[i] is set are left alone. */
+typedef struct {
+      CryptedVolume * pVolume;
+      bool fEncrypt;
+      CryptedSector * * papSectors;
+      octet * pabBuffer;
+      octet * pabPayload;
+      octet * pafSkip;
+      CoreResult * pacr;
+} CryptJob;
+
+
+static void cryptSector(void * pArg, unsigned int i)
+{
+   CryptJob * pJob = pArg;
+   CryptedVolume * pVolume = pJob->pVolume;
+   CryptedSectorData data, * pData;
+   octet * pabCipher;
+   CoreResult cr;
+
+   if (pJob->pafSkip && pJob->pafSkip[i]) return;
+   
+   if (pJob->papSectors)
+      pData = sectorData(pVolume, pJob->papSectors[i]);
+   else if (pJob->pabPayload)
+      pData = &data;
    else
-      v->pFirstOpen = p->pNextOpen;
-   if (p->pNextOpen)
-      p->pNextOpen->pPrevOpen = p->pPrevOpen;
+      pData = (CryptedSectorData *) (pJob->pabBuffer + i * pVolume->parms.cbSector);
+   pabCipher = pJob->pabBuffer ?
+      pJob->pabBuffer + i * pVolume->parms.cbSector : (octet *) pData;
+
+   if (pJob->fEncrypt) {
+      coreEncryptSectorData(pData, pabCipher, pVolume->parms.cbSector,
+         pVolume->pKey, pVolume->parms.flCryptoFlags);
+      return;
+   }
+   
+   cr = coreDecryptSectorData(pabCipher, pData, pVolume->parms.cbSector,
+      pVolume->pKey, pVolume->parms.flCryptoFlags);
+   if (pJob->pacr) pJob->pacr[i] = cr;
+   if (pData == &data) {
+      memcpy(pJob->pabPayload + i * pVolume->cbPayload, data.payload,
+         pVolume->cbPayload);
+      memset(&data, 0, pVolume->parms.cbSector);
+   }
+}
+
+
+/* Encrypt or decrypt a batch of cSectors sectors.  Batches of
+   csCryptoCutoff sectors or more are spread over the volume's crypto
+   threads.  The caller must keep the sectors from being changed or
+   deleted meanwhile; the volume lock is not needed. */
+static void cryptSectors(CryptJob * pJob, unsigned int cSectors)
+{
+   CryptedVolume * pVolume = pJob->pVolume;
+   unsigned int i;
+
+   if (pVolume->pCryptPool &&
+       cSectors >= pVolume->parms.csCryptoCutoff)
+      coreRunCryptJob(pVolume->pCryptPool, cSectors, cryptSector, pJob);
    else
-      v->pLastOpen = p->pPrevOpen;
+      for (i = 0; i < cSectors; i++)
+         cryptSector(pJob, i);
 }
 
 
-/* Close a storage file. */
-static CoreResult closeStorageFile(CryptedFile * pFile)
+/* Read at most csIOBuffer sectors of a file into the cache.  The
+   sectors are added to the cache marked CSF_READING and pinned, and
+   the volume lock is released while they are read and decrypted, so
+   that other threads can use the cache meanwhile.  Each run of
+   adjacent sectors is read in one request, and the requests are
+   submitted as one batch.  The ciphertext is read straight into the
+   buffers of the new sectors and decrypted in place.  The sector
+   numbers are in pScratch->pasSectors, and the rest of the scratch
+   block is used for the batch.  The storage file must be open. */
+static CoreResult readSectorBatch(CryptedFile * pFile,
+   unsigned int csRead, IOScratch * pScratch, unsigned int flFlags)
 {
-   File * pStorageFile;
+   CryptedVolume * pVolume = pFile->pVolume;
+   CoreResult cr = CORERC_OK, crReq = CORERC_OK, crfinal = CORERC_OK;
+   CoreResult * pacrRead = pScratch->pacr;
+   CryptedSector * * papRead = pScratch->papSectors;
+   SectorNumber * pasRead = pScratch->pasSectors;
+   SysIORequest * paRequests = pScratch->paRequests, * pReq = 0;
+   SysIOVec * paVecs = pScratch->paVecs;
+   CryptJob job;
+   unsigned int i, cRequests = 0, cVecs = 0;
+
+   assert(csRead <= pVolume->csIOBuffer && pFile->pStorageFile);
+
+   for (i = 0; i < csRead; i++) {
+      cr = addSector(pFile, pasRead[i], &papRead[i]);
+      if (cr) {
+         while (i--) deleteSector(papRead[i], false);
+         return cr;
+      }
+      if (!i || pasRead[i] != pasRead[i - 1] + 1) {
+         pReq = &paRequests[cRequests++];
+         pReq->pFile = pFile->pStorageFile;
+         pReq->ibPos = pVolume->parms.cbSector * (CryptedFilePos) pasRead[i];
+         pReq->cVecs = 0;
+         pReq->paVecs = &paVecs[cVecs];
+         pReq->fWrite = false;
+      }
+      cVecs -= pReq->cVecs;
+      addIOVec(pVolume, pReq->paVecs, &pReq->cVecs,
+         sectorData(pVolume, papRead[i]));
+      cVecs += pReq->cVecs;
+   }
 
-   pStorageFile = pFile->pStorageFile;
+   for (i = 0; i < csRead; i++) {
+      papRead[i]->flFlags = CSF_READING;
+      papRead[i]->cPins++;
+   }
+   pFile->cReaders++;
+   pVolume->cReaders++;
+   unlockVolume(pVolume);
+
+   submitIOBatch(pVolume, cRequests, paRequests);
+
+   /* Decrypt the sectors, and remember which ones failed.  Sectors
+      that could not be read are decrypted too, which is harmless. */
+   job.pVolume = pVolume;
+   job.fEncrypt = false;
+   job.papSectors = papRead;
+   job.pabBuffer = 0;
+   job.pabPayload = 0;
+   job.pafSkip = 0;
+   job.pacr = pacrRead;
+   cryptSectors(&job, csRead);
+   
+   for (i = 0, pReq = paRequests; i < csRead; i++) {
+      if (!i || pasRead[i] != pasRead[i - 1] + 1) {
+         if (i) pReq++;
+         crReq = queryIOResult(pReq);
+         if (crReq && !cr) cr = crReq;
+      }
+      if (crReq)
+         pacrRead[i] = crReq;
+      else {
+         if (pacrRead[i] && (flFlags & CFETCH_ADD_BAD)) {
+            crfinal = pacrRead[i];
+            pacrRead[i] = CORERC_OK;
+         } else if (pacrRead[i] && !cr)
+            cr = pacrRead[i];
+      }
+   }
 
-   if (!pStorageFile) return CORERC_OK;
+   /* Delete the sectors that failed.  Sectors that others deleted
+      while we were reading them are freed as we unpin them. */
+   sysLockMutex(pVolume->pLock);
+   for (i = 0; i < csRead; i++) {
+      if (!(papRead[i]->flFlags & CSF_STALE)) {
+         papRead[i]->flFlags &= ~CSF_READING;
+         if (pacrRead[i]) deleteSector(papRead[i], false);
+      }
+      unpinSector(pVolume, papRead[i]);
+   }
+   pFile->cReaders--;
+   pVolume->cReaders--;
+   sysSignalCond(pVolume->pIODone);
 
-   pFile->pStorageFile = 0;
+   return cr ? cr : crfinal;
+}
+
+
+/* Watch the fetches of a file for sequential reading.  While they
+   continue where the previous one left off, the window grows, and the
+   readahead thread is asked to keep that many sectors ahead of the
+   reader.  A fetch elsewhere halves the window. */
+static void readAhead(CryptedFile * pFile, SectorNumber sStart,
+   SectorNumber csExtent)
+{
+   CryptedVolume * pVolume = pFile->pVolume;
+   SectorNumber sEnd = sStart + csExtent;
+   ReadAheadRequest * pReq;
+
+   /* coreReadFromFile() fetches each sector of an extent again; that
+      says nothing about the access pattern. */
+   if (sStart >= pFile->sLastRead && sEnd <= pFile->sNextRead)
+      return;
+
+   /* The start may overlap the previous extent, since successive
+      reads need not end on a sector boundary. */
+   if (sStart < pFile->sLastRead || sStart > pFile->sNextRead) {
+      pFile->csReadAhead /= 2;
+      pFile->sLastRead = sStart;
+      pFile->sNextRead = sEnd;
+      pFile->sReadAhead = sEnd;
+      return;
+   }
+
+   pFile->csReadAhead = pFile->csReadAhead ?
+      2 * pFile->csReadAhead : 4 * csExtent;
+   if (pFile->csReadAhead > pVolume->csMaxReadAhead)
+      pFile->csReadAhead = pVolume->csMaxReadAhead;
+   pFile->sLastRead = sStart;
+   pFile->sNextRead = sEnd;
+   if (pFile->sReadAhead < sEnd) pFile->sReadAhead = sEnd;
+
+   /* Top up the window once half of it has been consumed, so that
+      the reader doesn't catch up with the readahead thread. */
+   if (!pFile->csReadAhead ||
+       pFile->sReadAhead - sEnd > pFile->csReadAhead / 2 ||
+       sEnd + pFile->csReadAhead < sEnd ||
+       pVolume->cReadAhead == READAHEAD_QUEUE_SIZE)
+      return;
+
+   pReq = &pVolume->aReadAhead[(pVolume->iReadAheadHead +
+      pVolume->cReadAhead++) % READAHEAD_QUEUE_SIZE];
+   pReq->id = pFile->id;
+   pReq->sStart = pFile->sReadAhead;
+   pReq->csExtent = sEnd + pFile->csReadAhead - pFile->sReadAhead;
+   pFile->sReadAhead = sEnd + pFile->csReadAhead;
+
+   sysSignalCond(pVolume->pReadAheadWake);
+}
+
+
+/* Fetch sectors from the specified file.  csExtent may not be larger
+   than the maximum cache size.  The missing sectors are read up to
+   csIOBuffer at a time without holding the volume lock (see
+   readSectorBatch()), so everything is looked at again after each
+   batch.  Since other threads may be at work, the sectors are not
+   guaranteed to be still in the cache when the caller gets to them. */
+static CoreResult fetchSectors(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber sStart, SectorNumber csExtent,
+   unsigned int flFlags)
+{
+   CoreResult cr = CORERC_OK, crfinal = CORERC_OK;
+   SectorNumber i;
+   unsigned int csMissing, csFetched = 0, c;
+   SectorNumber * pasMissing;
+   IOScratch * pScratch;
+   CryptedFile * pFile;
+   CryptedSector * pSector;
+
+   cr = accessFile(pVolume, id, &pFile);
+   if (cr) return cr;
+
+   if (!csExtent || csExtent > pVolume->parms.csMaxCached) {
+      unpinFile(pFile);
+      return csExtent ? CORERC_CACHE_OVERFLOW : CORERC_OK;
+   }
    
-   /* Remove the file from the list of open files. */
-   removeFileFromOpenList(pFile);
+   if (!(pScratch = getScratch(pVolume))) {
+      unpinFile(pFile);
+      return CORERC_NOT_ENOUGH_MEMORY;
+   }
+   pasMissing = pScratch->pasSectors;
+
+   while (true) {
+
+      /* Determine which sectors are not in the cache.  If others are
+         reading some of them, wait and start over.  Only the first
+         csIOBuffer missing ones are remembered, since that is all
+         that is read (or added) in one go. */
+      csMissing = 0;
+      for (i = 0; i < csExtent; i++) {
+         pSector = sectorAt(pVolume,
+            findSectorSlot(pVolume, id, sStart + i)->iSector);
+         if (!pSector) {
+            if (csMissing < pVolume->csIOBuffer)
+               pasMissing[csMissing] = sStart + i;
+            csMissing++;
+         } else if (pSector->flFlags & CSF_READING)
+            break;
+         else {
+            pVolume->pPolicy->touchSector(pVolume->pPolicyState,
+               sectorIndex(pVolume, pSector));
+            if (pSector->flFlags & CSF_PREFETCHED) {
+               pSector->flFlags &= ~CSF_PREFETCHED;
+               /* Only trust read-ahead data if the caller would have
+                  read it; beyond the initialised sectors of a file it
+                  may be stale. */
+               if (flFlags & CFETCH_NO_READ) {
+                  dirtySector(pVolume, pSector);
+                  memset(sectorData(pVolume, pSector), 0,
+                     pVolume->parms.cbSector);
+               }
+            }
+         }
+      }
+      if (i < csExtent) {
+         waitForIO(pVolume, pFile, false);
+         continue;
+      }
 
-   /* Close the storage file. */
-   return sys2core(sysCloseFile(pStorageFile));
+      if (!csMissing) break;
+      
+      /* Make sure that there is enough room in the cache.  Purging
+         may wait, so look again afterwards. */
+      if (pVolume->csInCache + csMissing > pVolume->parms.csMaxCached) {
+         cr = purgeCache(pVolume,
+            pVolume->csInCache -
+            (pVolume->parms.csMaxCached - csMissing),
+            pFile, sStart, csExtent);
+         if (cr) break;
+         continue;
+      }
+
+      c = csMissing;
+      if (c > pVolume->csIOBuffer) c = pVolume->csIOBuffer;
+      csFetched += c;
+
+      if (flFlags & CFETCH_NO_READ) {
+         for (i = 0; i < c && !cr; i++) {
+            cr = addSector(pFile, pasMissing[i], &pSector);
+            if (cr) break;
+            dirtySector(pVolume, pSector);
+            memset(sectorData(pVolume, pSector), 0,
+               pVolume->parms.cbSector);
+         }
+         if (cr || c == csMissing) break;
+         continue;
+      }
+
+      cr = openStorageFile(pFile, false, 0);
+      if (cr) break;
+
+      cr = readSectorBatch(pFile, c, pScratch, flFlags);
+      if (cr) {
+         if ((cr != CORERC_BAD_CHECKSUM) || !(flFlags & CFETCH_ADD_BAD))
+            break;
+         crfinal = cr;
+         cr = CORERC_OK;
+      }
+      if (c == csMissing) break;
+   }
+
+   if (csFetched > csExtent) csFetched = csExtent;
+   pVolume->cCacheHits += csExtent - csFetched;
+   pVolume->cCacheMisses += csFetched;
+
+   putScratch(pVolume, pScratch);
+
+   if (!cr && !(flFlags & CFETCH_NO_READ) && pVolume->pReadAheadThread)
+      readAhead(pFile, sStart, csExtent);
+
+   unpinFile(pFile);
+   
+   return cr ? cr : crfinal;
 }
 
 
-/* Make sure that the storage file for the specified CryptedFile is
-   open.  If it is already open, it is moved to the head of the MRU
-   list.  If it is not open, it is opened or created. */
-static CoreResult openStorageFile(CryptedFile * pFile, bool fCreate,
-   CryptedFilePos cbInitialSize)
+CoreResult coreFetchSectors(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber sStart, SectorNumber csExtent,
+   unsigned int flFlags)
 {
    CoreResult cr;
-   SysResult sr;
-   char szPathName[MAX_STORAGE_PATH_NAME];
-   
-   if (pFile->pStorageFile) {
-      /* pFile is now the CryptedFile with the most recently used open
-         storage file, so move it to the head of the MRU list. */
-      removeFileFromOpenList(pFile);
-      addFileToOpenList(pFile);
-      return CORERC_OK;
+   sysLockMutex(pVolume->pLock);
+   cr = fetchSectors(pVolume, id, sStart, csExtent, flFlags);
+   unlockVolume(pVolume);
+   return cr;
+}
+
+
+/* Read the payload of sectors of a file that are not in the cache,
+   without adding them to it.  The ciphertext of up to csIOBuffer
+   sectors is read into the scratch block's cipher buffer without
+   holding the volume lock and decrypted into the caller's buffer;
+   sectors that are in the cache (because they are dirty, say) are
+   copied from there instead.  The caller must keep others from
+   writing the sectors meanwhile. */
+static CoreResult streamSectorBatch(CryptedFile * pFile,
+   SectorNumber sStart, unsigned int csExtent, octet * pabBuffer,
+   IOScratch * pScratch)
+{
+   CryptedVolume * pVolume = pFile->pVolume;
+   CoreResult cr = CORERC_OK, * pacrSector = pScratch->pacr;
+   CryptedSector * pSector;
+   SysIORequest * paRequests = pScratch->paRequests, * pReq = 0;
+   SysIOVec * paVecs = pScratch->paVecs;
+   CryptJob job;
+   unsigned int i, cRequests = 0;
+   octet * pabCached = pScratch->pafFlags;
+   octet * pabCipher = pScratch->pabCipher;
+
+   for (i = 0; i < csExtent; i++) {
+      pSector = sectorAt(pVolume,
+         findSectorSlot(pVolume, pFile->id, sStart + i)->iSector);
+      /* A sector that is being read will be what is on disk. */
+      pabCached[i] = pSector && !(pSector->flFlags & CSF_READING);
+      if (pabCached[i]) {
+         memcpy(pabBuffer + i * pVolume->cbPayload,
+            sectorData(pVolume, pSector)->payload, pVolume->cbPayload);
+         pVolume->cCacheHits++;
+         continue;
+      }
+      pVolume->cCacheMisses++;
+      if (!i || pabCached[i - 1]) {
+         pReq = &paRequests[cRequests];
+         pReq->pFile = pFile->pStorageFile;
+         pReq->ibPos = pVolume->parms.cbSector * (CryptedFilePos) (sStart + i);
+         pReq->cVecs = 1;
+         pReq->paVecs = &paVecs[cRequests];
+         pReq->paVecs->pabBuffer = pabCipher + i * pVolume->parms.cbSector;
+         pReq->paVecs->cbLength = 0;
+         pReq->fWrite = false;
+         cRequests++;
+      }
+      pReq->paVecs->cbLength += pVolume->parms.cbSector;
+   }
+
+   if (!cRequests) return CORERC_OK;
+
+   pFile->cReaders++;
+   pVolume->cReaders++;
+   unlockVolume(pVolume);
+
+   submitIOBatch(pVolume, cRequests, paRequests);
+
+   for (i = 0, pReq = paRequests; i < cRequests; i++, pReq++)
+      if (!cr) cr = queryIOResult(pReq);
+
+   if (!cr) {
+      job.pVolume = pVolume;
+      job.fEncrypt = false;
+      job.papSectors = 0;
+      job.pabBuffer = pabCipher;
+      job.pabPayload = pabBuffer;
+      job.pafSkip = pabCached;
+      job.pacr = pacrSector;
+      cryptSectors(&job, csExtent);
+      for (i = 0; i < csExtent; i++)
+         if (!pabCached[i] && pacrSector[i] && !cr) cr = pacrSector[i];
+   }
+
+   sysLockMutex(pVolume->pLock);
+   pFile->cReaders--;
+   pVolume->cReaders--;
+   sysSignalCond(pVolume->pIODone);
+
+   return cr;
+}
+
+
+/* Read sectors of a file straight into a buffer, bypassing the cache
+   (see coreStreamSectors()). */
+static CoreResult streamSectors(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber sStart, SectorNumber csExtent,
+   octet * pabBuffer)
+{
+   CoreResult cr;
+   CryptedFile * pFile;
+   IOScratch * pScratch;
+   unsigned int c, csBatch = pVolume->csIOBuffer;
+
+   cr = accessFile(pVolume, id, &pFile);
+   if (cr) return cr;
+
+   if (!(pScratch = getScratch(pVolume))) {
+      unpinFile(pFile);
+      return CORERC_NOT_ENOUGH_MEMORY;
+   }
+   cr = getCipherBuffer(pVolume, pScratch);
+
+   while (csExtent && !cr) {
+      c = csExtent > csBatch ? csBatch : csExtent;
+      
+      cr = openStorageFile(pFile, false, 0);
+      if (cr) break;
+      
+      cr = streamSectorBatch(pFile, sStart, c, pabBuffer, pScratch);
+      if (cr) break;
+
+      sStart += c;
+      csExtent -= c;
+      pabBuffer += c * pVolume->cbPayload;
    }
 
-   if (pFile->pVolume->cOpenStorageFiles >=
-      pFile->pVolume->parms.cMaxOpenStorageFiles) {
-      /* We have reached the maximum number of concurrently open
-         storage files.  Close the least recently used. */
-      cr = coreShrinkOpenStorageFiles(pFile->pVolume,
-         pFile->pVolume->parms.cMaxOpenStorageFiles - 1);
-      if (cr) return cr;
+   putScratch(pVolume, pScratch);
+   unpinFile(pFile);
+   
+   return cr;
+}
+
+
+CoreResult coreStreamSectors(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber sStart, SectorNumber csExtent,
+   octet * pabBuffer)
+{
+   CoreResult cr;
+   sysLockMutex(pVolume->pLock);
+   cr = streamSectors(pVolume, id, sStart, csExtent, pabBuffer);
+   unlockVolume(pVolume);
+   return cr;
+}
+
+
+/* Encrypt the payload of csExtent sectors from the caller's buffer
+   and write them, without holding the volume lock.  The sectors must
+   not be in the cache. */
+static CoreResult writeSectorBatch(CryptedFile * pFile,
+   SectorNumber sStart, unsigned int csExtent, const octet * pabBuffer,
+   octet * pabCipher)
+{
+   CryptedVolume * pVolume = pFile->pVolume;
+   CryptedSectorData * pData;
+   SysIORequest req;
+   SysIOVec vec;
+   CryptJob job;
+   unsigned int i;
+
+   req.pFile = pFile->pStorageFile;
+   req.ibPos = pVolume->parms.cbSector * (CryptedFilePos) sStart;
+   req.cVecs = 1;
+   req.paVecs = &vec;
+   req.fWrite = true;
+   vec.pabBuffer = pabCipher;
+   vec.cbLength = csExtent * pVolume->parms.cbSector;
+
+   pFile->cWriters++;
+   pVolume->cWriters++;
+   unlockVolume(pVolume);
+
+   /* The payload is copied into place and encrypted there. */
+   for (i = 0; i < csExtent; i++) {
+      pData = (CryptedSectorData *) (pabCipher + i * pVolume->parms.cbSector);
+      memcpy(pData->payload, pabBuffer + i * pVolume->cbPayload, pVolume->cbPayload);
    }
+   job.pVolume = pVolume;
+   job.fEncrypt = true;
+   job.papSectors = 0;
+   job.pabBuffer = pabCipher;
+   job.pabPayload = 0;
+   job.pafSkip = 0;
+   job.pacr = 0;
+   cryptSectors(&job, csExtent);
+
+   submitIOBatch(pVolume, 1, &req);
+
+   sysLockMutex(pVolume->pLock);
+   pFile->cWriters--;
+   pVolume->cWriters--;
+   sysSignalCond(pVolume->pIODone);
+
+   return queryIOResult(&req);
+}
 
-   /* Open/create the storage file. */
-   
-   makeStoragePathName(pFile->pVolume, pFile->id, szPathName);
-
-   if (fCreate)
-      sr = sysCreateFile(szPathName,
-           pFile->pVolume->parms.flOpenFlags, cbInitialSize, 
-           pFile->pVolume->parms.cred, &pFile->pStorageFile);
-   else
-      sr = sysOpenFile(szPathName,
-           pFile->pVolume->parms.flOpenFlags,
-           pFile->pVolume->parms.cred, &pFile->pStorageFile);
-   
-   if (sr) return sys2core(sr);
 
-   /* Add at the head of the MRU list. */
-   addFileToOpenList(pFile);
+/* Delete the cached copies of sectors of a file.  Pinned ones (the
+   readahead thread may be reading them) are left to their pinners as
+   stale. */
+static void invalidateSectors(CryptedFile * pFile, SectorNumber sStart,
+   SectorNumber csExtent)
+{
+   CryptedVolume * pVolume = pFile->pVolume;
+   CryptedSector * pSector;
+   SectorNumber i;
    
-   return CORERC_OK;
+   for (i = 0; i < csExtent; i++) {
+      pSector = sectorAt(pVolume,
+         findSectorSlot(pVolume, pFile->id, sStart + i)->iSector);
+      if (pSector) deleteSector(pSector, false);
+   }
 }
 
 
-/* Create a CryptedFile object for the specified file ID (or return it
-   if it already exists).  This function does not check that the
-   associated storage file exists and is readable. */
-static CoreResult accessFile(CryptedVolume * pVolume,
-   CryptedFileID id, CryptedFile * * ppFile)
+/* Write sectors of a file straight from a buffer, bypassing the
+   cache (see coreWriteSectorsThrough()). */
+static CoreResult writeSectorsThrough(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber sStart, SectorNumber csExtent,
+   const octet * pabBuffer)
 {
-   unsigned int hash;
+   CoreResult cr;
    CryptedFile * pFile;
+   IOScratch * pScratch;
+   unsigned int c, csBatch = pVolume->csIOBuffer;
 
-   if (id == 0) return CORERC_INVALID_PARAMETER;
-   
-   /* Search in the volume's CryptedFile hash table for a CryptedFile
-      with the specified file ID. */
-   hash = fileHashTableHash(id);
-   for (*ppFile = pVolume->FileHashTable[hash];
-        *ppFile;
-        *ppFile = (*ppFile)->pNextInHash)
-      if ((*ppFile)->id == id) {
-         /* Move file to front of MRU list. */
-         removeFileFromMRUList(*ppFile);
-         addFileToMRUList(*ppFile);
-         return CORERC_OK;
-      }
+   if (pVolume->parms.fReadOnly) return CORERC_READ_ONLY;
 
-   *ppFile = 0;
+   cr = accessFile(pVolume, id, &pFile);
+   if (cr) return cr;
 
-   if (pVolume->cCryptedFiles >= pVolume->parms.cMaxCryptedFiles)
-      shrinkCryptedFiles(pVolume, pVolume->parms.cMaxCryptedFiles - 1);
-   
-   /* Didn't find anything, so we create a new CryptedFile. */
-   pFile = sysAllocSecureMem(sizeof(CryptedFile));
-   if (!pFile)
+   if (!(pScratch = getScratch(pVolume))) {
+      unpinFile(pFile);
       return CORERC_NOT_ENOUGH_MEMORY;
+   }
+   cr = getCipherBuffer(pVolume, pScratch);
 
-   /* Init it. */
-   pFile->pVolume = pVolume;
-   pFile->id = id;
-   pFile->pNextOpen = 0;
-   pFile->pPrevOpen = 0;
-   pFile->pStorageFile = 0;
-   pFile->csDirty = 0;
-   pFile->pFirstSector = 0;
+   while (csExtent && !cr) {
+      c = csExtent > csBatch ? csBatch : csExtent;
 
-   /* Add the file to the volume's MRU list. */
-   addFileToMRUList(pFile);
+      /* The writeback thread may be writing older versions of these
+         sectors; let it finish, or it might overwrite ours.  Then
+         drop the cached copies, so that nobody else writes them. */
+      waitForIO(pVolume, pFile, true);
+      invalidateSectors(pFile, sStart, c);
       
-   /* Add the file to the volume's CryptedFile hash table. */
-   pFile->pNextInHash = pVolume->FileHashTable[hash];
-   if (pFile->pNextInHash)
-      pFile->pNextInHash->pPrevInHash = pFile;
-   pFile->pPrevInHash = 0;
-   pVolume->FileHashTable[hash] = pFile;
+      cr = openStorageFile(pFile, false, 0);
+      if (cr) break;
 
-   *ppFile = pFile;
+      cr = writeSectorBatch(pFile, sStart, c, pabBuffer,
+         pScratch->pabCipher);
 
-   return CORERC_OK;
+      /* The readahead thread may have read some of the sectors
+         meanwhile. */
+      invalidateSectors(pFile, sStart, c);
+      if (cr) break;
+
+      sStart += c;
+      csExtent -= c;
+      pabBuffer += c * pVolume->cbPayload;
+   }
+
+   putScratch(pVolume, pScratch);
+   unpinFile(pFile);
+   
+   return cr;
 }
 
 
-/* Remove the CryptedFile from memory.  All dirty sectors are flushed
-   to disk and removed from the cache. */
-static CoreResult dropFile(CryptedFile * pFile)
+CoreResult coreWriteSectorsThrough(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber sStart, SectorNumber csExtent,
+   const octet * pabBuffer)
 {
    CoreResult cr;
+   sysLockMutex(pVolume->pLock);
+   cr = writeSectorsThrough(pVolume, id, sStart, csExtent, pabBuffer);
+   unlockVolume(pVolume);
+   return cr;
+}
 
-   cr = coreFlushFile(pFile->pVolume, pFile->id);
-   if (cr) return cr; /* !!! */
-   
-   /* Delete all sectors from the cache. */
-   deleteHighSectors(pFile, 0);
-
-   /* Close the storage file, if we have one. */
-   cr = closeStorageFile(pFile);
-   if (cr) return cr; /* !!! */
-   
-   /* Remove the file from the volume's MRU list. */
-   removeFileFromMRUList(pFile);
-   
-   /* Remove the CryptedFile from the volume's file hash table. */
-   if (pFile->pPrevInHash)
-      pFile->pPrevInHash->pNextInHash = pFile->pNextInHash;
-   else
-      pFile->pVolume->FileHashTable[fileHashTableHash(pFile->id)] =
-         pFile->pNextInHash;
-   if (pFile->pNextInHash)
-      pFile->pNextInHash->pPrevInHash = pFile->pPrevInHash;
 
-   /* Free the CryptedFile. */
-   sysFreeSecureMem(pFile);
+/* Write the batch that flushSectors() has collected in pScratch:
+   cRequests requests, for the files in papFiles, writing the csBatch
+   sectors in papSectors, whose plaintext has been copied to
+   pabCipher.  The files count as being written (see busyWithIO()),
+   so nobody else writes or closes them meanwhile, and the volume lock
+   is released while the sectors are encrypted and written.  The
+   sectors are marked CSF_WRITING, which dirtySector() clears, and
+   only those that still have the mark afterwards are marked clean.
+   If any write fails, all of them stay dirty. */
+static CoreResult submitWrites(CryptedVolume * pVolume,
+   IOScratch * pScratch, unsigned int cRequests, unsigned int csBatch)
+{
+   CoreResult cr = CORERC_OK;
+   CryptedSector * p;
+   CryptJob job;
+   unsigned int i;
 
-   return CORERC_OK;
-}
+   for (i = 0; i < cRequests; i++) {
+      pScratch->papFiles[i]->cWriters++;
+      pVolume->cWriters++;
+   }
+   for (i = 0; i < csBatch; i++)
+      pScratch->papSectors[i]->flFlags |= CSF_WRITING;
 
+   unlockVolume(pVolume);
 
-/* Create a file with the given ID and initial size. The content of
-   the allocated sectors is undefined (and reading them will give a
-   CRC error with high probability).  The initial size is advisory
-   only (see coreSuggestFileSize). */
-CoreResult coreCreateFile(CryptedVolume * pVolume,
-   CryptedFileID id, SectorNumber csPreallocate)
-{
-   CoreResult cr;
-   CryptedFile * pFile;
+   job.pVolume = pVolume;
+   job.fEncrypt = true;
+   job.papSectors = 0;
+   job.pabBuffer = pScratch->pabCipher;
+   job.pabPayload = 0;
+   job.pafSkip = 0;
+   job.pacr = 0;
+   cryptSectors(&job, csBatch);
 
-   if (pVolume->parms.fReadOnly) return CORERC_READ_ONLY;
+   submitIOBatch(pVolume, cRequests, pScratch->paRequests);
+   for (i = 0; i < cRequests && !cr; i++)
+      cr = queryIOResult(&pScratch->paRequests[i]);
 
-   if (storageFileExists(pVolume, id)) return CORERC_ID_EXISTS;
+   sysLockMutex(pVolume->pLock);
 
-   /* Create a CryptedFile for this file. */
-   cr = accessFile(pVolume, id, &pFile);
-   if (cr) return cr;
+   for (i = 0; i < cRequests; i++) {
+      pScratch->papFiles[i]->cWriters--;
+      pVolume->cWriters--;
+   }
 
-   /* Create a storage file. */
-   cr = openStorageFile(pFile, true, csPreallocate * SECTOR_SIZE);
-   if (cr) {
-      dropFile(pFile);
-      return cr;
+   /* Sectors that have been changed or deleted in the meantime have
+      lost the mark. */
+   for (i = 0; i < csBatch; i++) {
+      p = pScratch->papSectors[i];
+      if (!cr && (p->flFlags & CSF_WRITING)) clearDirtyFlag(p);
+      p->flFlags &= ~CSF_WRITING;
    }
 
-   return CORERC_OK;
+   sysSignalCond(pVolume->pIODone);
+   return cr;
 }
 
 
-/* Destroy the specified file.  This means freeing all the file's
-   resources in memory (see dropFile()) and deleting the
-   associated storage file. */
-CoreResult coreDestroyFile(CryptedVolume * pVolume, CryptedFileID id)
+/* Flush the specified sectors to disk.  Clean sectors are ignored.
+   It is advisable to sort the list of sectors by file and sector
+   number, since adjacent sectors in the list are written in one write
+   operation.  The writes of up to csIOBuffer sectors are submitted as
+   one batch, without holding the volume lock (see submitWrites()).
+   The sectors must be pinned, since others may use the cache
+   meanwhile. */
+static CoreResult flushSectors(CryptedVolume * pVolume,
+   unsigned int cSectors, CryptedSector * * papSectors)
 {
    CoreResult cr;
-   char szPathName[MAX_STORAGE_PATH_NAME];
+   CryptedSector * pStart;
    CryptedFile * pFile;
+   IOScratch * pScratch;
+   SysIORequest * pReq;
+   unsigned int c, i, cRequests = 0, csBatch = 0;
+   unsigned int cbSector = pVolume->parms.cbSector;
+   octet * p;
 
-   if (pVolume->parms.fReadOnly) return CORERC_READ_ONLY;
+   if (!cSectors) return CORERC_OK;
 
-   cr = accessFile(pVolume, id, &pFile);
-   if (cr) return cr;
+   if (!(pScratch = getScratch(pVolume)))
+      return CORERC_NOT_ENOUGH_MEMORY;
+   cr = getCipherBuffer(pVolume, pScratch);
 
-   makeStoragePathName(pVolume, pFile->id, szPathName);
+   while (cSectors && !cr) {
 
-   /* Delete all the file's sectors from the cache without flushing to
-      disk. */
-   deleteHighSectors(pFile, 0);
-   
-   /* Drop the crypted file.  This will close the storage file. */
-   cr = dropFile(pFile);
-   if (cr) return cr;
+      pStart = *papSectors;
 
-   /* Delete the storage file. */
-   return sys2core(sysDeleteFile(szPathName, true, pVolume->parms.cred));
+      /* Don't overtake an older version of these sectors that
+         somebody else is writing.  Write what we have first, so that
+         nobody waits for us while we wait.  The file is pinned while
+         we wait, and the sector looked at again afterwards, since it
+         may have been deleted or written in the meantime. */
+      while (!cr && (pStart->flFlags & CSF_DIRTY) &&
+             busyWithIO(pVolume, pStart->pFile, true))
+      {
+         if (cRequests) {
+            cr = submitWrites(pVolume, pScratch, cRequests, csBatch);
+            cRequests = 0;
+            csBatch = 0;
+         } else {
+            pFile = pStart->pFile;
+            pFile->cPins++;
+            waitForIO(pVolume, pFile, true);
+            unpinFile(pFile);
+         }
+      }
+      if (cr) break;
+      
+      if (pStart->flFlags & CSF_DIRTY) {
+
+         /* How many adjacent sectors? */
+         for (c = 1;
+              (c < cSectors) && (c < pVolume->csIOBuffer) &&
+                 (papSectors[c]->flFlags & CSF_DIRTY) &&
+                 (papSectors[c]->pFile == pStart->pFile) &&
+                 (papSectors[c]->sectorNumber ==
+                    pStart->sectorNumber + c);
+              c++);
+
+         /* Write what we have if the buffer is full, or if the
+            storage file has to be opened, since that may close the
+            storage files of the pending writes.  Then look at the
+            sector again. */
+         if (cRequests && (csBatch + c > pVolume->csIOBuffer ||
+                           !pStart->pFile->pStorageFile))
+         {
+            cr = submitWrites(pVolume, pScratch, cRequests, csBatch);
+            cRequests = 0;
+            csBatch = 0;
+            continue;
+         }
+
+         cr = openStorageFile(pStart->pFile, false, 0);
+         if (cr) break;
+
+         /* Copy the plaintext into the batch, and add a request to
+            write it.  It is encrypted in place by submitWrites(). */
+         p = pScratch->pabCipher + csBatch * cbSector;
+         for (i = 0; i < c; i++) {
+            pScratch->papSectors[csBatch + i] = papSectors[i];
+            memcpy(p + i * cbSector, sectorData(pVolume, papSectors[i]),
+               cbSector);
+         }
+
+         assert(!pVolume->parms.fReadOnly);
+         pScratch->papFiles[cRequests] = pStart->pFile;
+         pReq = &pScratch->paRequests[cRequests];
+         pReq->pFile = pStart->pFile->pStorageFile;
+         pReq->ibPos = cbSector * (CryptedFilePos) pStart->sectorNumber;
+         pReq->cVecs = 1;
+         pReq->paVecs = &pScratch->paVecs[cRequests];
+         pReq->paVecs->pabBuffer = p;
+         pReq->paVecs->cbLength = cbSector * c;
+         pReq->fWrite = true;
+         cRequests++;
+         csBatch += c;
+         
+      } else c = 1;
+      
+      cSectors -= c;
+      papSectors += c;
+   }
+
+   if (cRequests && !cr)
+      cr = submitWrites(pVolume, pScratch, cRequests, csBatch);
+
+   putScratch(pVolume, pScratch);
+   return cr;
 }
 
 
-/* Flush all dirty sectors. */
-CoreResult coreFlushFile(CryptedVolume * pVolume, CryptedFileID id)
+/* Flush the specified sector to disk, if it's in the cache and
+   dirty.  Otherwise, do nothing and return CORERC_OK. */
+CoreResult coreFlushSector(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber s)
 {
    CoreResult cr;
-   CryptedSector * * papDirty, * p, * * q;
+   CryptedSector * pSector;
    CryptedFile * pFile;
-   int n;
-
+   sysLockMutex(pVolume->pLock);
    cr = accessFile(pVolume, id, &pFile);
-   if (cr) return cr;
+   if (!cr) {
+      pSector = findCachedSector(pVolume, id, s);
+      if (pSector) {
+         pSector->cPins++;
+         cr = flushSectors(pVolume, 1, &pSector);
+         unpinSector(pVolume, pSector);
+         if (!cr) waitForIO(pVolume, pFile, true);
+      }
+      unpinFile(pFile);
+   }
+   unlockVolume(pVolume);
+   return cr;
+}
 
-   if (pFile->csDirty) {
 
-      papDirty = malloc(pFile->csDirty * sizeof(CryptedSector *));
-      if (!papDirty) return CORERC_NOT_ENOUGH_MEMORY;
+/* Set the sector's dirty flag. */
+static void dirtySector(CryptedVolume * pVolume,
+   CryptedSector * pSector)
+{
+   CryptedFile * pFile = pSector->pFile;
+   SectorIndex i = sectorIndex(pVolume, pSector);
+   
+   pSector->msDirtied = sysQueryMilliseconds();
+   pSector->flFlags &= ~CSF_WRITING;
+
+   if (!(pSector->flFlags & CSF_DIRTY)) {
+      pSector->flFlags |= CSF_DIRTY;
+      tagSector(pFile, pSector->sectorNumber, true);
+
+      /* Append to the list of dirty sectors. */
+      pSector->iNextDirty = 0;
+      pSector->iPrevDirty = pVolume->iLastDirty;
+      if (pVolume->iLastDirty)
+         sectorAt(pVolume, pVolume->iLastDirty)->iNextDirty = i;
+      else
+         pVolume->iFirstDirty = i;
+      pVolume->iLastDirty = i;
+
+      if (pFile->csDirty++ == 0) {
+         /* Append to the list of dirty files. */
+         pFile->pNextDirty = 0;
+         pFile->pPrevDirty = pVolume->pLastDirty;
+         if (pVolume->pLastDirty)
+            pVolume->pLastDirty->pNextDirty = pFile;
+         else
+            pVolume->pFirstDirty = pFile;
+         pVolume->pLastDirty = pFile;
+         pVolume->cDirtyFiles++;
+      }
+      
+      pVolume->csDirty++;
+      if (pVolume->csDirty == 1) setDirtyState(pVolume, true);
+
+      /* Tell the writeback thread when it has something to do. */
+      if (pVolume->pWriteBackThread &&
+          (pVolume->csDirty == 1 ||
+           pVolume->csDirty == pVolume->csWriteBackThreshold + 1))
+         sysSignalCond(pVolume->pWriteBackWake);
+   }
+}
 
-      for (p = pFile->pFirstSector, q = papDirty, n = 0; p;
-           p = p->pNextInFile)
-         if (p->fDirty) *q++ = p, n++;
-      assert(pFile->csDirty == n);
 
-      sortSectorList(pFile->csDirty, papDirty);
+/* Store a range of bytes from a file sector into the specified
+   buffer. */
+static CoreResult querySectorData(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber s, unsigned int offset,
+   unsigned int bytes, unsigned int flFlags, void * pBuffer)
+{
+   CoreResult cr;
+   CryptedSector * pSector;
+   
+   if (offset + bytes > pVolume->cbPayload)
+      return CORERC_INVALID_PARAMETER;
 
-      cr = flushSectors(pFile->csDirty, papDirty);
-      free(papDirty);
-      if (cr) return cr;
-      assert(pFile->csDirty == 0);
-   }
+   /* The sector may have been deleted again by the time
+      fetchSectors() returns. */
+   do {
+      cr = fetchSectors(pVolume, id, s, 1, flFlags);
+      if (cr && (cr != CORERC_BAD_CHECKSUM ||
+         !(flFlags & CFETCH_ADD_BAD)))
+         return cr;
+   } while (!(pSector = findCachedSector(pVolume, id, s)));
 
-   return CORERC_OK;
+   memcpy(pBuffer, sectorData(pVolume, pSector)->payload + offset, bytes);
+   
+   return cr;
 }
 
 
-/* Suggest that the size of the storage file be increased or decreased
-   to the specified number of sectors.  This can be used to improve
-   performance and reduce fragmentation on certain systems (like
-   OS/2). */
-CoreResult coreSuggestFileAllocation(CryptedVolume * pVolume,
-   CryptedFileID id, SectorNumber csAllocate)
+CoreResult coreQuerySectorData(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber s, unsigned int offset,
+   unsigned int bytes, unsigned int flFlags, void * pBuffer)
 {
    CoreResult cr;
-   FilePos cbNewSize;
-   CryptedFile * pFile;
+   sysLockMutex(pVolume->pLock);
+   cr = querySectorData(pVolume, id, s, offset, bytes, flFlags,
+      pBuffer);
+   unlockVolume(pVolume);
+   return cr;
+}
 
+
+/* Store the specified buffer into a range of bytes of a file sector.
+   The sector is marked dirty.  If bytes == 0, the sector is marked
+   dirty only if it is in the cache; no error is returned in either
+   case. */
+static CoreResult setSectorData(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber s, unsigned int offset,
+   unsigned int bytes, unsigned int flFlags, const void * pBuffer)
+{
+   CoreResult cr;
+   CryptedSector * pSector;
+   
    if (pVolume->parms.fReadOnly) return CORERC_READ_ONLY;
 
-   cr = accessFile(pVolume, id, &pFile);
-   if (cr) return cr;
+   if (offset + bytes > pVolume->cbPayload)
+      return CORERC_INVALID_PARAMETER;
 
-   deleteHighSectors(pFile, csAllocate);
+   if (bytes == 0) {
+      pSector = findCachedSector(pVolume, id, s);
+      if (pSector) dirtySector(pVolume, pSector);
+      return CORERC_OK;
+   }
    
-   /* Make sure the storage file for this CryptedFile is open. */
-   cr = openStorageFile(pFile, false, 0);
-   if (cr) return cr;
-
-   /* Set the new file size.  The semantics of sysSetFileSize() do not
-      guarantee that growing a file will work (and it doesn't, in
-      general, on POSIX).  */
-   cbNewSize = SECTOR_SIZE * (CryptedFilePos) csAllocate;
-   return sys2core(sysSetFileSize(pFile->pStorageFile, cbNewSize));
-}
+   do {
+      cr = fetchSectors(pVolume, id, s, 1, flFlags);
+      if (cr && (cr != CORERC_BAD_CHECKSUM ||
+         !(flFlags & CFETCH_ADD_BAD)))
+         return cr;
+   } while (!(pSector = findCachedSector(pVolume, id, s)));
 
+   memcpy(sectorData(pVolume, pSector)->payload + offset, pBuffer, bytes);
 
-/*
- * Sectors & cache management.
- */
+   dirtySector(pVolume, pSector);
+   
+   return cr;
+}
 
 
-/* Clear the dirty flag of the specified sector. */
-static void clearDirtyFlag(CryptedSector * p)
+CoreResult coreSetSectorData(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber s, unsigned int offset,
+   unsigned int bytes, unsigned int flFlags, const void * pBuffer)
 {
-   CryptedVolume * pVolume = p->pFile->pVolume;
-   if (p->fDirty) {
-      p->fDirty = false;
-      p->pFile->csDirty--;
-      pVolume->csDirty--;
-      assert(p->pFile->csDirty >= 0);
-      assert(pVolume->csDirty >= 0);
-      if (pVolume->csDirty == 0 && pVolume->parms.dirtyCallBack)
-         pVolume->parms.dirtyCallBack(pVolume, false);
-   }
+   CoreResult cr;
+   sysLockMutex(pVolume->pLock);
+   cr = setSectorData(pVolume, id, s, offset, bytes, flFlags,
+      pBuffer);
+   unlockVolume(pVolume);
+   return cr;
 }
 
 
-/* Add the sector at the head of the MRU list of cached sectors. */
-static void addSectorToMRUList(CryptedSector * p)
+/* Pin the sectors of an extent.  Since others may wait in
+   purgeCache() for these pins to be dropped, the pins must never be
+   held while waiting; so the sectors are only pinned when all of
+   them are in the cache. */
+static CoreResult pinSectors(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber sStart, SectorNumber csExtent,
+   unsigned int flFlags, CryptedSector * * papSectors)
 {
-   CryptedVolume * v = p->pFile->pVolume;
-   p->pNextInMRU = v->pFirstSector;
-   p->pPrevInMRU = 0;
-   if (p->pNextInMRU)
-      p->pNextInMRU->pPrevInMRU = p;
-   else
-      v->pLastSector = p;
-   v->pFirstSector = p;
+   CoreResult cr, crfinal = CORERC_OK;
+   CryptedSector * pSector;
+   SectorNumber i;
+
+   do {
+      
+      cr = fetchSectors(pVolume, id, sStart, csExtent, flFlags);
+      if (cr) {
+         if ((cr != CORERC_BAD_CHECKSUM) || !(flFlags & CFETCH_ADD_BAD))
+            return cr;
+         crfinal = cr;
+      }
+
+      /* fetchSectors() may have waited after getting some of the
+         sectors, and those may have been deleted or (by the readahead
+         thread) re-added since.  Then start over. */
+      for (i = 0; i < csExtent; i++) {
+         pSector = sectorAt(pVolume,
+            findSectorSlot(pVolume, id, sStart + i)->iSector);
+         if (!pSector ||
+             (pSector->flFlags & (CSF_READING | CSF_PREFETCHED)))
+            break;
+         papSectors[i] = pSector;
+      }
+      
+   } while (i < csExtent);
+
+   for (i = 0; i < csExtent; i++)
+      papSectors[i]->cPins++;
+   pVolume->csPinned += csExtent;
+
+   return crfinal;
 }
 
 
-/* Remove the sector from the MRU list of cached sectors. */
-static void removeSectorFromMRUList(CryptedSector * p)
+CoreResult corePinSectors(CryptedVolume * pVolume,
+   CryptedFileID id, SectorNumber sStart, SectorNumber csExtent,
+   unsigned int flFlags, CryptedSector * * papSectors)
 {
-   CryptedVolume * v = p->pFile->pVolume;
-   if (p->pPrevInMRU)
-      p->pPrevInMRU->pNextInMRU = p->pNextInMRU;
-   else
-      v->pFirstSector = p->pNextInMRU;
-   if (p->pNextInMRU)
-      p->pNextInMRU->pPrevInMRU = p->pPrevInMRU;
-   else
-      v->pLastSector = p->pPrevInMRU;
+   CoreResult cr;
+   sysLockMutex(pVolume->pLock);
+   cr = pinSectors(pVolume, id, sStart, csExtent, flFlags,
+      papSectors);
+   unlockVolume(pVolume);
+   return cr;
 }
 
 
-/* Add a sector to the cache.  The sector data is undefined.  The
-   dirty flag is initially false. */
-static CoreResult addSector(CryptedFile * pFile, SectorNumber s,
-   CryptedSector * * ppSector)
+static void unpinSectors(CryptedVolume * pVolume, SectorNumber csExtent,
+   CryptedSector * * papSectors)
 {
-   CryptedSector * pSector;
-   unsigned int hash;
-
-   *ppSector = 0;
-   
-   pSector = sysAllocSecureMem(sizeof(CryptedSector));
-   if (!pSector) return CORERC_NOT_ENOUGH_MEMORY;
-
-   pSector->pFile = pFile;
-   pSector->sectorNumber = s;
-   pSector->fDirty = false;
-
-   pFile->pVolume->csInCache++;
+   SectorNumber i;
    
-   addSectorToMRUList(pSector);
-
-   /* Insert the newly created CryptedSector into the linked
-      list of this file's CryptedSectors. */
-   pSector->pNextInFile = pFile->pFirstSector;
-   pSector->pPrevInFile = 0;
-   if (pSector->pNextInFile)
-      pSector->pNextInFile->pPrevInFile = pSector;
-   pFile->pFirstSector = pSector;
-
-   /* Add to the volume's CryptedFile hash table. */
-   hash = sectorHashTableHash(pFile->id, s);
-   pSector->pNextInHash = pFile->pVolume->SectorHashTable[hash];
-   if (pSector->pNextInHash)
-      pSector->pNextInHash->pPrevInHash = pSector;
-   pSector->pPrevInHash = 0;
-   pFile->pVolume->SectorHashTable[hash] = pSector;
-
-   *ppSector = pSector;
+   for (i = 0; i < csExtent; i++)
+      unpinSector(pVolume, papSectors[i]);
+   pVolume->csPinned -= csExtent;
 
-   return CORERC_OK;
+   /* Somebody may be waiting in purgeCache() for these. */
+   if (csExtent) sysSignalCond(pVolume->pIODone);
 }
 
 
-/* Return a sector from the cache.  The sector is moved to the head of
-   the MRU list.  Return 0 if the sector is not presently in the
-   cache. */
-static CryptedSector * queryCachedSector(CryptedVolume * pVolume,
-   CryptedFileID id, SectorNumber sectorNumber)
+void coreUnpinSectors(CryptedVolume * pVolume, SectorNumber csExtent,
+   CryptedSector * * papSectors)
 {
-   unsigned int hash;
-   CryptedSector * pSector;
+   sysLockMutex(pVolume->pLock);
+   unpinSectors(pVolume, csExtent, papSectors);
+   unlockVolume(pVolume);
+}
 
-   /* Search in the volume's CryptedFile hash table for a CryptedFile
-      with the specified file ID. */
-   hash = sectorHashTableHash(id, sectorNumber);
-   for (pSector = pVolume->SectorHashTable[hash];
-        pSector;
-        pSector = pSector->pNextInHash)
-      if ((pSector->sectorNumber == sectorNumber) &&
-          (pSector->pFile->id == id))
-      {
-         removeSectorFromMRUList(pSector);
-         addSectorToMRUList(pSector);
-         return pSector;
-      }
 
-   return 0; /* sector not in cache */
+/* The payload of a pinned sector stays where it is until the sector
+   is unpinned, so this doesn't need the volume lock. */
+octet * coreQuerySectorPayload(CryptedVolume * pVolume,
+   CryptedSector * pSector)
+{
+   return sectorData(pVolume, pSector)->payload;
 }
 
 
-/* Delete the specified sector from the cache. */
-static void deleteSector(CryptedSector * p)
+/* Mark a pinned sector dirty.  If the sector has been deleted since
+   it was pinned (because its file was truncated or destroyed), the
+   change is simply lost. */
+CoreResult coreDirtySector(CryptedVolume * pVolume,
+   CryptedSector * pSector)
 {
-   if (p->fDirty) clearDirtyFlag(p);
+   if (pVolume->parms.fReadOnly) return CORERC_READ_ONLY;
+   sysLockMutex(pVolume->pLock);
+   assert(pSector->cPins);
+   if (!(pSector->flFlags & CSF_STALE))
+      dirtySector(pVolume, pSector);
+   unlockVolume(pVolume);
+   return CORERC_OK;
+}
 
-   p->pFile->pVolume->csInCache--;
-   assert(p->pFile->pVolume->csInCache >= 0);
 
-   removeSectorFromMRUList(p);
+/*
+ * Background writeback and readahead.
+ */
 
-   /* Remove the sector from the volume's sector hash table. */
-   if (p->pPrevInHash)
-      p->pPrevInHash->pNextInHash = p->pNextInHash;
-   else
-      p->pFile->pVolume->SectorHashTable[sectorHashTableHash(
-         p->pFile->id, p->sectorNumber)] = p->pNextInHash;
-   if (p->pNextInHash)
-      p->pNextInHash->pPrevInHash = p->pPrevInHash;
-   
-   /* Remove the sector from the file's linked list of sectors. */
-   if (p->pPrevInFile)
-      p->pPrevInFile->pNextInFile = p->pNextInFile;
-   else
-      p->pFile->pFirstSector = p->pNextInFile;
-   if (p->pNextInFile)
-      p->pNextInFile->pPrevInFile = p->pPrevInFile;
 
-   /* Free the sector. */
-   sysFreeSecureMem(p);
+/* Is anybody reading or writing sectors of pFile (or of any file if
+   pFile is 0) without holding the volume lock?  That is the writeback
+   thread and threads writing sectors through, and unless
+   fWritesOnly, the readahead thread and the threads reading missing
+   sectors. */
+static bool busyWithIO(CryptedVolume * pVolume, CryptedFile * pFile,
+   bool fWritesOnly)
+{
+   if (!pFile)
+      return pVolume->pWriteBackFile || pVolume->cWriters ||
+         (!fWritesOnly && (pVolume->pReadAheadFile || pVolume->cReaders));
+   return pVolume->pWriteBackFile == pFile || pFile->cWriters ||
+      (!fWritesOnly &&
+         (pVolume->pReadAheadFile == pFile || pFile->cReaders));
 }
 
 
-/* Delete all the file's sectors with sector numbers >= s from the
-   cache, without flushing dirty sectors to disk. */
-static void deleteHighSectors(CryptedFile * pFile, SectorNumber s)
+/* Wait until busyWithIO() is false.  The volume lock is released
+   while waiting, but neither background thread starts a new batch
+   until all waiters have woken up.  pFile must be pinned or
+   otherwise kept alive by the caller. */
+static void waitForIO(CryptedVolume * pVolume, CryptedFile * pFile,
+   bool fWritesOnly)
 {
-   CryptedSector * p, * pnext;
-   for (p = pFile->pFirstSector; p; p = pnext) {
-      pnext = p->pNextInFile;
-      if (p->sectorNumber >= s) deleteSector(p);
+   if (!busyWithIO(pVolume, pFile, fWritesOnly)) return;
+
+   pVolume->cIOWaiters++;
+   while (busyWithIO(pVolume, pFile, fWritesOnly))
+      sysWaitCond(pVolume->pIODone, pVolume->pLock, 0);
+   if (--pVolume->cIOWaiters == 0) {
+      sysSignalCond(pVolume->pWriteBackWake);
+      sysSignalCond(pVolume->pReadAheadWake);
    }
 }
 
 
-/* Delete sectors from the cache to make room for csReq new sectors,
-   flushing dirty sectors to disk if necessary.  Do not delete sectors
-   in the exclusion region (i.e. the sectors being fetched by
-   coreFetchSectors()). */
-static CoreResult purgeCache(CryptedVolume * pVolume, unsigned int csReq,
-   CryptedFile * pExclFile, SectorNumber sExclStart,
-   SectorNumber sExclExtent)
+/* Write a batch of dirty sectors: the oldest dirty sector and the
+   dirty sectors following it in the same file, up to
+   csIOGranularity.  The plaintext is copied while holding the volume
+   lock; encryption and writing happen without it.  Returns with the
+   lock held. */
+static void writeBackBatch(CryptedVolume * pVolume)
 {
-   CryptedSector * p = pVolume->pLastSector, * pnext;
+   CryptedSector * p = sectorAt(pVolume, pVolume->iFirstDirty);
+   CryptedFile * pFile = p->pFile;
+   unsigned int c = 0, i, j, cRequests;
+   SectorIndex iSector;
+   octet * pab = pVolume->pabWriteBack;
+   File * pStorageFile;
+   SysIORequest * pReq;
+   SysResult sr;
    CoreResult cr;
+   CryptJob job;
+   uint32 msNow;
+
+   /* Others may be flushing older versions of these sectors (see
+      flushSectors()); don't overtake them. */
+   if (pFile->cWriters) {
+      pFile->cPins++;
+      waitForIO(pVolume, pFile, true);
+      unpinFile(pFile);
+      return;
+   }
 
-   /* We simply delete the least recently used sectors from the cache
-      (skipping sectors in the exclusion region).  If any of those
-      sectors is dirty, *all* dirty sectors in the cache are flushed
-      to disk. */
-
-   while (csReq--) {
-
-      while (
-         p &&
-         (p->pFile == pExclFile) &&
-         (p->sectorNumber >= sExclStart) &&
-         (p->sectorNumber < sExclStart + sExclExtent))
-         p = p->pPrevInMRU;
-      assert(p);
-
-      if (p->fDirty) { /* should happen at most once */ 
-         cr = coreFlushVolume(pVolume);
-         if (cr) return cr;
-      }
+   cr = openStorageFile(pFile, false, 0);
+   if (cr) {
+      /* Try again later. */
+      pVolume->msNextWriteBack = sysQueryMilliseconds() +
+         pVolume->parms.cWriteBackAge * 1000;
+      return;
+   }
+   pStorageFile = pFile->pStorageFile;
 
-      pnext = p->pPrevInMRU;
-      deleteSector(p);
-      p = pnext;
+   for (iSector = findNextDirtySector(pFile, p->sectorNumber);
+        iSector && c < pVolume->parms.csIOGranularity; )
+   {
+      p = sectorAt(pVolume, iSector);
+      pVolume->paiWriteBack[c] = iSector;
+      memcpy(pab + c * pVolume->parms.cbSector, sectorData(pVolume, p),
+         pVolume->parms.cbSector);
+      c++;
+      if (p->sectorNumber == 0xffffffff) break;
+      iSector = findNextDirtySector(pFile, p->sectorNumber + 1);
    }
 
-   return CORERC_OK;
-}
+   pVolume->pWriteBackFile = pFile;
+   for (i = 0; i < c; i++) {
+      p = sectorAt(pVolume, pVolume->paiWriteBack[i]);
+      p->cPins++;
+      clearDirtyFlag(p);
+   }
 
+   /* Write runs of adjacent sectors, in one batch. */
+   for (i = 0, cRequests = 0; i < c; i = j) {
+      p = sectorAt(pVolume, pVolume->paiWriteBack[i]);
+      for (j = i + 1;
+           j < c && sectorAt(pVolume,
+              pVolume->paiWriteBack[j])->sectorNumber == p->sectorNumber + (j - i);
+           j++) ;
+      pReq = &pVolume->paWriteBackRequests[cRequests];
+      pReq->pFile = pStorageFile;
+      pReq->ibPos = pVolume->parms.cbSector * (CryptedFilePos) p->sectorNumber;
+      pReq->cVecs = 1;
+      pReq->paVecs = &pVolume->paWriteBackVecs[cRequests];
+      pReq->paVecs->pabBuffer = pab + i * pVolume->parms.cbSector;
+      pReq->paVecs->cbLength = pVolume->parms.cbSector * (j - i);
+      pReq->fWrite = true;
+      cRequests++;
+   }
 
-/* Read ciphertext from the specified location. */
-static CoreResult readBuffer(CryptedFile * pFile,
-   SectorNumber sStart, SectorNumber csExtent, octet * pabBuffer)
-{
-   CoreResult cr;
-   SysResult sr;
-   FilePos cbRead;
+   unlockVolume(pVolume);
+
+   job.pVolume = pVolume;
+   job.fEncrypt = true;
+   job.papSectors = 0;
+   job.pabBuffer = pab;
+   job.pabPayload = 0;
+   job.pafSkip = 0;
+   job.pacr = 0;
+   cryptSectors(&job, c);
+
+   submitIOBatch(pVolume, cRequests, pVolume->paWriteBackRequests);
+   for (i = 0, sr = 0; i < cRequests && !sr; i++)
+      if (queryIOResult(&pVolume->paWriteBackRequests[i]))
+         sr = SYS_IO;
+
+   sysLockMutex(pVolume->pLock);
+
+   /* If the write failed, the sectors are dirty again, unless they
+      have been deleted in the meantime. */
+   for (i = 0; i < c; i++) {
+      p = sectorAt(pVolume, pVolume->paiWriteBack[i]);
+      if (sr && !(p->flFlags & CSF_STALE)) dirtySector(pVolume, p);
+      unpinSector(pVolume, p);
+   }
 
-   cr = openStorageFile(pFile, false, 0);
-   if (cr) return cr;
-         
-   if (sr = sysSetFilePos(pFile->pStorageFile, SECTOR_SIZE *
-      (CryptedFilePos) sStart))
-      return sys2core(sr);
-   
-   if (sr = sysReadFromFile(pFile->pStorageFile,
-       SECTOR_SIZE * csExtent, pabBuffer, &cbRead))
-       return sys2core(sr);
+   pVolume->pWriteBackFile = 0;
+   sysSignalCond(pVolume->pIODone);
 
-   if (cbRead != SECTOR_SIZE * csExtent)
-      return CORERC_SHORT_FILE;
+   msNow = sysQueryMilliseconds();
+   if (sr)
+      pVolume->msNextWriteBack = msNow +
+         pVolume->parms.cWriteBackAge * 1000;
+   else if (pVolume->parms.cbWriteBackRate)
+      pVolume->msNextWriteBack = msNow + (uint32)
+         ((double) c * pVolume->parms.cbSector * 1000 /
+            pVolume->parms.cbWriteBackRate);
 
-   return CORERC_OK;
+   if (pVolume->csDirty == 0) setDirtyState(pVolume, false);
 }
 
-   
-/* Read an extent of sectors into the cache. */
-static CoreResult readSectorExtent(CryptedFile * pFile,
-   SectorNumber sStart, SectorNumber csExtent, unsigned int flFlags)
+
+/* Shrink the cache if the system is short of memory, and let it
+   grow back towards its limit when it is not (see CCACHE_PRESSURE).
+   Only clean sectors are evicted; dirty ones go once they have been
+   written. */
+static void checkMemoryPressure(CryptedVolume * pVolume)
 {
-   CoreResult cr, crfinal = CORERC_OK;
-   octet * pabBuffer, * p;
-   SectorNumber i;
-   CryptedSector * pSector;
-   
-   pabBuffer = malloc(csExtent * SECTOR_SIZE);
-   if (!pabBuffer) return CORERC_NOT_ENOUGH_MEMORY;
+   unsigned int nPressure, csMax = pVolume->parms.csMaxCached, csMin;
 
-   cr = readBuffer(pFile, sStart, csExtent, pabBuffer);
-   if (cr) {
-      free(pabBuffer);
-      return cr;
-   }
+   if (sysQueryMemoryPressure(&nPressure)) return;
 
-   for (i = sStart, p = pabBuffer;
-        i < sStart + csExtent;
-        i++, p += SECTOR_SIZE)
-   {
-      cr = addSector(pFile, i, &pSector);
-      if (cr) {
-         free(pabBuffer);
-         return cr;
-      }
+   csMin = pVolume->csCacheLimit / PRESSURE_FLOOR;
+   if (csMin < pVolume->parms.csIOGranularity)
+      csMin = pVolume->parms.csIOGranularity;
+   if (csMin < 1) csMin = 1;
 
-      cr = coreDecryptSectorData(p, &pSector->data,
-         pFile->pVolume->pKey, pFile->pVolume->parms.flCryptoFlags);
-      if (cr) {
-         if (flFlags & CFETCH_ADD_BAD)
-            crfinal = cr;
-         else {
-            deleteSector(pSector);
-            free(pabBuffer);
-            return cr;
-         }
-      }
+   if (nPressure >= pVolume->parms.nMemPressure) {
+      csMax -= csMax / PRESSURE_SHRINK;
+      if (csMax < csMin) csMax = csMin;
+   } else if (nPressure < pVolume->parms.nMemPressure / 2) {
+      csMax = csMax * 2;
+      if (csMax > pVolume->csCacheLimit) csMax = pVolume->csCacheLimit;
    }
-   
-   free(pabBuffer);
-   return crfinal;
+
+   if (csMax != pVolume->parms.csMaxCached)
+      setCacheLimit(pVolume, csMax, false);
+   else if (pVolume->cRetiring)
+      releaseRetiredSectors(pVolume, false);
 }
 
 
-/* Read the specified sectors of the specified file into the cache.
-   Adjacent sectors are read in a single read operation. */
-static CoreResult readSectors(CryptedFile * pFile,
-   unsigned int csRead, SectorNumber * pasRead, unsigned int flFlags)
+static void writeBackThread(void * pArg)
 {
-   CoreResult cr, crfinal = CORERC_OK;
-   CryptedSector * pSector;
-   unsigned int c;
-   
-   while (csRead) {
+   CryptedVolume * pVolume = pArg;
+   uint32 msNow, msAge, msMaxAge;
+   unsigned int msWait;
+   bool fPressure;
 
-      if (flFlags & CFETCH_NO_READ) {
+   msMaxAge = pVolume->parms.cWriteBackAge * 1000;
+   fPressure = pVolume->parms.flCacheFlags & CCACHE_PRESSURE;
 
-         cr = addSector(pFile, *pasRead, &pSector);
-         if (cr) return cr;
+   sysLockMutex(pVolume->pLock);
 
-         dirtySector(pFile->pVolume, pSector);
-         memset(&pSector->data, 0, sizeof(CryptedSectorData));
-         
-         c = 1;
-         
-      } else {
-      
-         /* How many adjacent sectors? */
-         for (c = 1;
-              (c < csRead) && (pasRead[c] == *pasRead + c);
-              c++);
+   while (!pVolume->fStopWriteBack) {
 
-         cr = readSectorExtent(pFile, *pasRead, c, flFlags);
-         if (cr) {
-            if ((cr == CORERC_BAD_CHECKSUM) &&
-               (flFlags & CFETCH_ADD_BAD))
-               crfinal = cr;
-            else
-               return cr;
-         }
+      msNow = sysQueryMilliseconds();
+
+      if (fPressure &&
+          (int) (msNow - pVolume->msNextPressureCheck) >= 0) {
+         checkMemoryPressure(pVolume);
+         pVolume->msNextPressureCheck = msNow + PRESSURE_INTERVAL;
       }
+
+      /* Figure out whether to write now, or how long to sleep (0 =
+         until woken up). */
+      msWait = 0;
       
-      csRead -= c, pasRead += c;
+      if (pVolume->cIOWaiters || !pVolume->iFirstDirty)
+         ;
+      else if ((int) (pVolume->msNextWriteBack - msNow) > 0)
+         msWait = pVolume->msNextWriteBack - msNow;
+      else if (pVolume->csDirty <= pVolume->csWriteBackThreshold) {
+         msAge = msNow -
+            sectorAt(pVolume, pVolume->iFirstDirty)->msDirtied;
+         if (msAge < msMaxAge) msWait = msMaxAge - msAge;
+         else {
+            writeBackBatch(pVolume);
+            continue;
+         }
+      } else {
+         writeBackBatch(pVolume);
+         continue;
+      }
+
+      if (fPressure &&
+          (!msWait ||
+           msWait > pVolume->msNextPressureCheck - msNow))
+         msWait = pVolume->msNextPressureCheck - msNow;
+
+      sysWaitCond(pVolume->pWriteBackWake, pVolume->pLock, msWait);
    }
 
-   return crfinal;
+   unlockVolume(pVolume);
 }
 
 
-/* Fetch sectors from the specified file.  csExtent may not be larger
-   than the maximum cache size. */
-CoreResult coreFetchSectors(CryptedVolume * pVolume,
-   CryptedFileID id, SectorNumber sStart, SectorNumber csExtent,
-   unsigned int flFlags)
+static void freeWriteBackBuffers(CryptedVolume * pVolume)
 {
-   CoreResult cr;
-   SectorNumber i;
-   unsigned int csMissing;
-   SectorNumber * pasMissing;
-   CryptedFile * pFile;
+   free(pVolume->paiWriteBack);
+   if (pVolume->pabWriteBack) sysFreeSecureMem(pVolume->pabWriteBack);
+   free(pVolume->paWriteBackRequests);
+   free(pVolume->paWriteBackVecs);
+}
 
-   cr = accessFile(pVolume, id, &pFile);
-   if (cr) return cr;
+
+CoreResult coreStartWriteBack(CryptedVolume * pVolume)
+{
+   SysResult sr;
    
-   if (!csExtent) return CORERC_OK;
-   if (csExtent > pFile->pVolume->parms.csMaxCached)
-      return CORERC_CACHE_OVERFLOW;
-
-   /* Determine which sectors are not in the cache. */
-   pasMissing = malloc(csExtent * sizeof(SectorNumber *));
-   if (!pasMissing) return CORERC_NOT_ENOUGH_MEMORY;
-   csMissing = 0;
-   for (i = 0; i < csExtent; i++)
-      if (!queryCachedSector(pVolume, id, sStart + i)) 
-         pasMissing[csMissing++] = sStart + i;
+   if (pVolume->parms.fReadOnly) return CORERC_READ_ONLY;
 
-   if (!csMissing) { /* everything already in cache */
-      free(pasMissing);
-      return CORERC_OK;
+   if (pVolume->pWriteBackThread) return CORERC_OK;
+
+   /* The batch buffer holds plaintext. */
+   pVolume->paiWriteBack = malloc(pVolume->parms.csIOGranularity *
+      sizeof(SectorIndex));
+   pVolume->pabWriteBack = sysAllocSecureMem(
+      pVolume->parms.csIOGranularity * pVolume->parms.cbSector);
+   pVolume->paWriteBackRequests = malloc(
+      pVolume->parms.csIOGranularity * sizeof(SysIORequest));
+   pVolume->paWriteBackVecs = malloc(
+      pVolume->parms.csIOGranularity * sizeof(SysIOVec));
+   if (!pVolume->paiWriteBack || !pVolume->pabWriteBack ||
+       !pVolume->paWriteBackRequests || !pVolume->paWriteBackVecs) {
+      freeWriteBackBuffers(pVolume);
+      return CORERC_NOT_ENOUGH_MEMORY;
    }
 
-   /* Make sure that there is enough room in the cache. */
-   if (pFile->pVolume->csInCache + csMissing >
-      pFile->pVolume->parms.csMaxCached)
-   {
-      cr = purgeCache(pFile->pVolume,
-         pFile->pVolume->csInCache -
-         (pFile->pVolume->parms.csMaxCached - csMissing),
-         pFile, sStart, csExtent);
-      if (cr) {
-         free(pasMissing);
-         return cr;
-      }
+   pVolume->fStopWriteBack = false;
+   pVolume->msNextWriteBack = sysQueryMilliseconds();
+
+   sr = sysCreateThread(writeBackThread, pVolume,
+      &pVolume->pWriteBackThread);
+   if (sr) {
+      freeWriteBackBuffers(pVolume);
+      return sys2core(sr);
    }
 
-   cr = readSectors(pFile, csMissing, pasMissing, flFlags);
-   free(pasMissing);
-   return cr;
+   return CORERC_OK;
 }
 
 
-/* Write ciphertext to the specified location. */
-static CoreResult writeBuffer(CryptedSector * pStart, unsigned int c,
-   octet * pabBuffer)
+/* Stop the writeback thread.  Dirty sectors stay in the cache. */
+void coreStopWriteBack(CryptedVolume * pVolume)
 {
-   CoreResult cr;
-   SysResult sr;
-   FilePos cbWritten;
-   
-   assert(!pStart->pFile->pVolume->parms.fReadOnly);
-
-   cr = openStorageFile(pStart->pFile, false, 0);
-   if (cr) return cr;
-         
-   if (sr = sysSetFilePos(pStart->pFile->pStorageFile, SECTOR_SIZE *
-      (CryptedFilePos) pStart->sectorNumber))
-      return sys2core(sr);
+   if (!pVolume->pWriteBackThread) return;
 
-   if (sr = sysWriteToFile(pStart->pFile->pStorageFile,
-      SECTOR_SIZE * c, pabBuffer, &cbWritten) ||
-      (cbWritten != SECTOR_SIZE * c))
-      return sys2core(sr);
+   sysLockMutex(pVolume->pLock);
+   pVolume->fStopWriteBack = true;
+   sysSignalCond(pVolume->pWriteBackWake);
+   unlockVolume(pVolume);
 
-   return CORERC_OK;
+   sysJoinThread(pVolume->pWriteBackThread);
+   pVolume->pWriteBackThread = 0;
+   
+   freeWriteBackBuffers(pVolume);
 }
 
 
-/* Flush the specified sectors to disk.  Dirty sectors are ignored.
-   It is advisable to sort the list of sectors by file and sector
-   number, since adjacent sectors in the list are written in one write
-   operation. */
-static CoreResult flushSectors(unsigned int cSectors,
-   CryptedSector * * papSectors)
+static void dequeueReadAhead(CryptedVolume * pVolume)
 {
-   CoreResult cr;
-   CryptedSector * pStart;
-   unsigned int c, i;
-   octet * pabBuffer, * p;
+   pVolume->iReadAheadHead =
+      (pVolume->iReadAheadHead + 1) % READAHEAD_QUEUE_SIZE;
+   pVolume->cReadAhead--;
+}
 
-   while (cSectors) {
 
-      if ((pStart = *papSectors)->fDirty) {
+/* Read the next batch of the oldest readahead request: the first run
+   of sectors that are not in the cache, up to csIOGranularity.  The
+   sectors are added to the cache marked CSF_READING while holding
+   the volume lock; reading and decryption happen without it.
+   Returns with the lock held. */
+static void readAheadBatch(CryptedVolume * pVolume)
+{
+   ReadAheadRequest * pReq =
+      &pVolume->aReadAhead[pVolume->iReadAheadHead];
+   CryptedFile * pFile;
+   CryptedSector * p;
+   SectorNumber sStart, csSkip;
+   SectorIndex iSkip, iVictim;
+   unsigned int c, csMax, csRead, i, cVecs = 0;
+   CryptedSectorData * pData;
+   File * pStorageFile;
+   FilePos cbRead;
+   SysResult sr;
+   bool fDone;
+
+   /* Drop the request if the file is gone or the reader has moved
+      elsewhere; skip what the reader has already fetched. */
+   pFile = findFileSlot(pVolume, pReq->id)->pFile;
+   if (!pFile || pFile->fDropping || pReq->sStart >= pFile->sReadAhead) {
+      dequeueReadAhead(pVolume);
+      return;
+   }
+   if (pReq->sStart < pFile->sNextRead) {
+      csSkip = pFile->sNextRead - pReq->sStart;
+      if (csSkip > pReq->csExtent) csSkip = pReq->csExtent;
+      pReq->sStart += csSkip;
+      pReq->csExtent -= csSkip;
+   }
+   while (pReq->csExtent &&
+          findSectorSlot(pVolume, pReq->id, pReq->sStart)->iSector)
+      pReq->sStart++, pReq->csExtent--;
+
+   /* Leave at least half of the cache for the extent the reader is
+      working on and everything else. */
+   csMax = pVolume->parms.csMaxCached / 2;
+   if (csMax <= pFile->sNextRead - pFile->sLastRead) {
+      dequeueReadAhead(pVolume);
+      return;
+   }
+   csMax -= pFile->sNextRead - pFile->sLastRead;
+
+   /* Fill the window in a few batches, so that a reader that catches
+      up doesn't have to wait for all of it. */
+   if (csMax > pVolume->csMaxReadAhead / 4)
+      csMax = pVolume->csMaxReadAhead / 4;
+   if (csMax > pVolume->csIOBuffer)
+      csMax = pVolume->csIOBuffer;
+   if (!csMax) csMax = 1;
+   
+   for (c = 0;
+        c < pReq->csExtent && c < csMax &&
+           !findSectorSlot(pVolume, pReq->id, pReq->sStart + c)->iSector;
+        c++) ;
+   if (!c) {
+      dequeueReadAhead(pVolume);
+      return;
+   }
 
-         /* How many adjacent sectors? */
-         for (c = 1;
-              (c < cSectors) &&
-                 (papSectors[c]->fDirty) &&
-                 (papSectors[c]->pFile == pStart->pFile) &&
-                 (papSectors[c]->sectorNumber ==
-                    pStart->sectorNumber + c);
-              c++);
+   /* Make room by evicting clean sectors that nobody is using, but not
+      the extent the reader is working on.  Unlike purgeCache() this
+      never writes or waits. */
+   for (csSkip = 0, iSkip = 0;
+        pVolume->csInCache + c > pVolume->parms.csMaxCached &&
+           csSkip < 4 * c; )
+   {
+      iVictim = pVolume->pPolicy->nextVictim(pVolume->pPolicyState,
+         iSkip);
+      if (!iVictim) break;
+      p = sectorAt(pVolume, iVictim);
+      if ((p->flFlags & CSF_DIRTY) || p->cPins ||
+          ((p->pFile == pFile) &&
+           (p->sectorNumber >= pFile->sLastRead) &&
+           (p->sectorNumber < pFile->sNextRead)))
+         iSkip = iVictim, csSkip++;
+      else
+         deleteSector(p, true);
+   }
+   
+   pVolume->pReadAheadFile = pFile;
+   
+   if (openStorageFile(pFile, false, 0)) {
+      dequeueReadAhead(pVolume);
+      goto done;
+   }
 
-         /* Write c sectors to disk at once.  Allocate a buffer to
-            hold the ciphertext, encrypt the sectors into the buffer,
-            and write the buffer. */
+   /* If anyone had to wait in the meantime, let them go first, so
+      that we don't add sectors under their feet. */
+   if (pVolume->cIOWaiters) goto done;
 
-         while (1) {
-            pabBuffer = malloc(SECTOR_SIZE * c);
-            if (pabBuffer) break;
-            if (--c) return CORERC_NOT_ENOUGH_MEMORY;
-         }
+   sStart = pReq->sStart;
+   for (i = 0;
+        i < c && pVolume->csInCache < pVolume->parms.csMaxCached &&
+           !findSectorSlot(pVolume, pReq->id, sStart + i)->iSector;
+        i++)
+   {
+      if (addSector(pFile, sStart + i, &p)) break;
+      p->flFlags = CSF_READING;
+      p->cPins++;
+      pVolume->paiReadAhead[i] = sectorIndex(pVolume, p);
+      addIOVec(pVolume, pVolume->paReadAheadVecs, &cVecs, sectorData(pVolume, p));
+   }
+   c = i;
+   if (!c) {
+      dequeueReadAhead(pVolume);
+      goto done;
+   }
 
-         for (i = 0, p = pabBuffer; i < c; i++, p += SECTOR_SIZE) {
-            coreEncryptSectorData(&papSectors[i]->data, p,
-               pStart->pFile->pVolume->pKey,
-               pStart->pFile->pVolume->parms.flCryptoFlags);
-         }
+   pReq->sStart += c;
+   pReq->csExtent -= c;
+   fDone = !pReq->csExtent;
+   if (fDone) dequeueReadAhead(pVolume);
+   
+   pStorageFile = pFile->pStorageFile;
+   
+   unlockVolume(pVolume);
+
+   /* Read straight into the sectors.  Their entries cannot be reused
+      while they are pinned. */
+   sr = sysReadFileV(pStorageFile, pVolume->parms.cbSector * (CryptedFilePos) sStart,
+      cVecs, pVolume->paReadAheadVecs, &cbRead);
+   csRead = sr ? 0 : cbRead / pVolume->parms.cbSector;
+
+   /* Stop at the first sector that doesn't decrypt (or beyond the end
+      of the file); the reader will get the error when it reads the
+      sector itself. */
+   for (i = 0; i < csRead; i++) {
+      pData = sectorData(pVolume,
+         sectorAt(pVolume, pVolume->paiReadAhead[i]));
+      if (coreDecryptSectorData((octet *) pData, pData,
+             pVolume->parms.cbSector, pVolume->pKey,
+             pVolume->parms.flCryptoFlags))
+         break;
+   }
+   csRead = i;
 
-         cr = writeBuffer(pStart, c, pabBuffer);
-         free(pabBuffer);
-         if (cr) return cr;
+   sysLockMutex(pVolume->pLock);
 
-         for (i = 0; i < c; i++)
-            clearDirtyFlag(papSectors[i]);
-         
-      } else c = 1;
-      
-      while (c) c--, cSectors--, papSectors++;
+   for (i = 0; i < c; i++) {
+      p = sectorAt(pVolume, pVolume->paiReadAhead[i]);
+      if (!(p->flFlags & CSF_STALE)) {
+         p->flFlags = i < csRead ? CSF_PREFETCHED : 0;
+         if (i >= csRead) deleteSector(p, false);
+      }
+      unpinSector(pVolume, p);
    }
 
-   return CORERC_OK;
+   if (csRead < c && !fDone) dequeueReadAhead(pVolume);
+
+ done:
+   pVolume->pReadAheadFile = 0;
+   sysSignalCond(pVolume->pIODone);
 }
 
 
-/* Flush the specified sector to disk, if it's in the cache and
-   dirty.  Otherwise, do nothing and return CORERC_OK. */
-CoreResult coreFlushSector(CryptedVolume * pVolume,
-   CryptedFileID id, SectorNumber s)
+static void readAheadThread(void * pArg)
 {
-   CryptedSector * pSector;
-   pSector = queryCachedSector(pVolume, id, s);
-   return pSector ? flushSectors(1, &pSector) : CORERC_OK;
-}
+   CryptedVolume * pVolume = pArg;
 
+   sysLockMutex(pVolume->pLock);
 
-/* Set the sector's dirty flag. */
-static void dirtySector(CryptedVolume * pVolume,
-   CryptedSector * pSector)
-{
-   if (!pSector->fDirty) {
-      pSector->fDirty = true;
-      pSector->pFile->csDirty++;
-      pVolume->csDirty++;
-      if (pVolume->csDirty == 1 && pVolume->parms.dirtyCallBack)
-         pVolume->parms.dirtyCallBack(pVolume, true);
+   while (!pVolume->fStopReadAhead) {
+      if (pVolume->cIOWaiters || !pVolume->cReadAhead)
+         sysWaitCond(pVolume->pReadAheadWake, pVolume->pLock, 0);
+      else
+         readAheadBatch(pVolume);
    }
+
+   unlockVolume(pVolume);
 }
 
 
-/* Store a range of bytes from a file sector into the specified
-   buffer. */
-CoreResult coreQuerySectorData(CryptedVolume * pVolume,
-   CryptedFileID id, SectorNumber s, unsigned int offset,
-   unsigned int bytes, unsigned int flFlags, void * pBuffer)
+CoreResult coreStartReadAhead(CryptedVolume * pVolume)
 {
-   CoreResult cr;
-   CryptedSector * pSector;
-   
-   if (offset + bytes > PAYLOAD_SIZE)
-      return CORERC_INVALID_PARAMETER;
-   
-   cr = coreFetchSectors(pVolume, id, s, 1, flFlags);
-   if (cr && ((cr != CORERC_BAD_CHECKSUM) |
-      !(flFlags & CFETCH_ADD_BAD)))
-      return cr;
+   SysResult sr;
    
-   pSector = queryCachedSector(pVolume, id, s);
-   assert(pSector);
+   if (pVolume->pReadAheadThread || !pVolume->parms.csMaxReadAhead)
+      return CORERC_OK;
 
-   memcpy(pBuffer, pSector->data.payload + offset, bytes);
-   
-   return cr;
-}
+   pVolume->paiReadAhead = malloc(pVolume->csIOBuffer *
+      sizeof(SectorIndex));
+   pVolume->paReadAheadVecs = malloc(pVolume->csIOBuffer *
+      sizeof(SysIOVec));
+   if (!pVolume->paiReadAhead || !pVolume->paReadAheadVecs) {
+      free(pVolume->paiReadAhead);
+      free(pVolume->paReadAheadVecs);
+      return CORERC_NOT_ENOUGH_MEMORY;
+   }
 
+   pVolume->fStopReadAhead = false;
 
-/* Store the specified buffer into a range of bytes of a file sector.
-   The sector is marked dirty.  If bytes == 0, the sector is marked
-   dirty only if it is in the cache; no error is returned in either
-   case. */
-CoreResult coreSetSectorData(CryptedVolume * pVolume,
-   CryptedFileID id, SectorNumber s, unsigned int offset,
-   unsigned int bytes, unsigned int flFlags, const void * pBuffer)
-{
-   CoreResult cr;
-   CryptedSector * pSector;
-   
-   if (pVolume->parms.fReadOnly) return CORERC_READ_ONLY;
+   sr = sysCreateThread(readAheadThread, pVolume,
+      &pVolume->pReadAheadThread);
+   if (sr) {
+      free(pVolume->paiReadAhead);
+      free(pVolume->paReadAheadVecs);
+      return sys2core(sr);
+   }
 
-   if (offset + bytes > PAYLOAD_SIZE)
-      return CORERC_INVALID_PARAMETER;
+   return CORERC_OK;
+}
 
-   if (bytes == 0) {
-      pSector = queryCachedSector(pVolume, id, s);
-      if (pSector) dirtySector(pVolume, pSector);
-      return CORERC_OK;
-   }
-   
-   cr = coreFetchSectors(pVolume, id, s, 1, flFlags);
-   if (cr && ((cr != CORERC_BAD_CHECKSUM) ||
-      !(flFlags & CFETCH_ADD_BAD)))
-      return cr;
-   
-   pSector = queryCachedSector(pVolume, id, s);
-   assert(pSector);
 
-   memcpy(pSector->data.payload + offset, pBuffer, bytes);
+/* Stop the readahead thread.  Pending requests are dropped; sectors
+   that have been read ahead stay in the cache. */
+void coreStopReadAhead(CryptedVolume * pVolume)
+{
+   if (!pVolume->pReadAheadThread) return;
 
-   dirtySector(pVolume, pSector);
+   sysLockMutex(pVolume->pLock);
+   pVolume->fStopReadAhead = true;
+   sysSignalCond(pVolume->pReadAheadWake);
+   unlockVolume(pVolume);
+
+   sysJoinThread(pVolume->pReadAheadThread);
+   pVolume->pReadAheadThread = 0;
+   pVolume->cReadAhead = 0;
    
-   return cr;
+   free(pVolume->paiReadAhead);
+   free(pVolume->paReadAheadVecs);
 }
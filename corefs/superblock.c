@@ -184,6 +184,8 @@ static CoreResult readSuperBlock1(SuperBlock * pSuperBlock,
    Key * pPassKey;
 
    pSuperBlock->fEncryptedKey = false;
+   pParms->flStorageFlags &= ~CSTOR_SHARDED;
+   pParms->cbSector = SECTOR_SIZE; /* if there is no sector-size line */
 
    /* Read the unencrypted superblock. */
    sprintf(szFileName, "%s" SUPERBLOCK1_NAME, pSuperBlock->szBasePath);
@@ -225,6 +227,12 @@ static CoreResult readSuperBlock1(SuperBlock * pSuperBlock,
                pParms->flCryptoFlags &= ~CCRYPT_USE_CBC;
          } else if (strcmp(szName, "encrypted-key") == 0) {
             pSuperBlock->fEncryptedKey = strcmp(szValue, "1") == 0;
+         } else if (strcmp(szName, "sharded-storage") == 0) {
+            if (strcmp(szValue, "1") == 0)
+               pParms->flStorageFlags |= CSTOR_SHARDED;
+         } else if (strcmp(szName, "sector-size") == 0) {
+            if (sscanf(szValue, "%u", &pParms->cbSector) != 1)
+               pParms->cbSector = 0; /* coreAccessVolume() rejects it */
          }
       }
        
@@ -308,7 +316,7 @@ static CoreResult readSuperBlock2(SuperBlock * pSuperBlock,
        abSector, &cbRead)) 
       return sys2core(sr);
    
-   cr = coreDecryptSectorData(abSector, &sector,
+   cr = coreDecryptSectorData(abSector, &sector, SECTOR_SIZE,
       pSuperBlock->pDataKey, pParms->flCryptoFlags);
    
    pSuperBlock->magic = bytesToInt32(pOnDisk->magic);
@@ -414,12 +422,16 @@ CoreResult coreWriteSuperBlock(SuperBlock * pSuperBlock,
       if (snprintf(szBuffer, sizeof(szBuffer),
          "cipher: %s-%d-%d\n"
          "use-cbc: %d\n"
-         "encrypted-key: %d\n", 
+         "encrypted-key: %d\n"
+         "sharded-storage: %d\n"
+         "sector-size: %d\n", 
          pSuperBlock->pDataKey->pCipher->pszID,
          pSuperBlock->pDataKey->cbKey * 8,
          pSuperBlock->pDataKey->cbBlock * 8,
          pParms->flCryptoFlags & CCRYPT_USE_CBC,
-         pSuperBlock->fEncryptedKey) >= sizeof(szBuffer))
+         pSuperBlock->fEncryptedKey,
+         (pParms->flStorageFlags & CSTOR_SHARDED) != 0,
+         pParms->cbSector) >= sizeof(szBuffer))
          return CORERC_INVALID_PARAMETER;
 
       sprintf(szFileName, "%s" SUPERBLOCK1_NAME, pSuperBlock->szBasePath);
@@ -453,7 +465,7 @@ CoreResult coreWriteSuperBlock(SuperBlock * pSuperBlock,
    strcpy((char *) pOnDisk->szLabel, pSuperBlock->szLabel);
    strcpy((char *) pOnDisk->szDescription, pSuperBlock->szDescription);
    
-   coreEncryptSectorData(&sector, (octet *) &sector,
+   coreEncryptSectorData(&sector, (octet *) &sector, SECTOR_SIZE,
       pSuperBlock->pDataKey, pParms->flCryptoFlags);
 
    cr = openSuperBlock2(pSuperBlock, pParms, true);
@@ -463,7 +475,7 @@ CoreResult coreWriteSuperBlock(SuperBlock * pSuperBlock,
        return sys2core(sr);
    
    if (sr = sysWriteToFile(pSuperBlock->pSB2File, 
-       sizeof(sector), (octet *) &sector, &cbWritten))
+       SECTOR_SIZE, (octet *) &sector, &cbWritten))
        return sys2core(sr);
 
    pSuperBlock->version = SBV_CURRENT;
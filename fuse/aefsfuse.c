@@ -24,6 +24,7 @@
 #include <signal.h>
 #include <assert.h>
 #include <errno.h>
+#include <ctype.h>
 #include <string.h>
 #include <limits.h>
 #include <time.h>
@@ -49,7 +50,7 @@
 #include <fuse/fuse_lowlevel.h>
 
 
-void commitVolume();
+CoreResult commitVolume();
 
 
 char * pszProgramName;
@@ -64,11 +65,75 @@ static char szBasePath[PATH_MAX + 1];
 static char szMountPoint[PATH_MAX + 1];
 static int fdRes[2];
 static char * pszMountOptions = 0;
+static CachePolicy * pCachePolicy = 0;
+static bool fIORing = false;
+static unsigned int csCacheSize = 0; /* 0 = default */
+static unsigned int cMaxFiles = 0; /* 0 = default */
+static bool fMemPressure = false;
 
 
-/* For communication with lazy writer thread. */
-volatile int wantFlush = 0;
-volatile int isDirty = 0;
+/* Serialises updates of the superblock's dirty flag, which happen
+   on the FUSE threads and on the corefs writeback thread. */
+static pthread_mutex_t superBlockLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* The FUSE session is multithreaded.  corefs serialises operations
+   on a single file, but changing the directory tree or a file's info
+   takes several of them.  Requests that do that hold treeLock
+   exclusively; all others that touch files hold it shared. */
+static pthread_rwlock_t treeLock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+/* Each FUSE thread keeps the buffer of its last read, so that reads
+   don't call the memory allocator once it is large enough. */
+typedef struct {
+    size_t size;
+    octet * data;
+} ReadBuffer;
+
+static pthread_key_t readBufferKey;
+static pthread_once_t readBufferOnce = PTHREAD_ONCE_INIT;
+
+
+static void freeReadBuffer(void * p)
+{
+    ReadBuffer * rb = p;
+    free(rb->data);
+    free(rb);
+}
+
+
+static void createReadBufferKey()
+{
+    pthread_key_create(&readBufferKey, freeReadBuffer);
+}
+
+
+static octet * getReadBuffer(size_t size)
+{
+    ReadBuffer * rb;
+    octet * data;
+
+    pthread_once(&readBufferOnce, createReadBufferKey);
+
+    rb = pthread_getspecific(readBufferKey);
+    if (!rb) {
+        rb = malloc(sizeof(ReadBuffer));
+        if (!rb) return 0;
+        rb->size = 0;
+        rb->data = 0;
+        pthread_setspecific(readBufferKey, rb);
+    }
+
+    if (rb->size < size) {
+        data = realloc(rb->data, size);
+        if (!data) return 0;
+        rb->size = size;
+        rb->data = data;
+    }
+
+    return rb->data;
+}
 
 
 static int core2sys(CoreResult cr)
@@ -112,30 +177,33 @@ static void storeAttr(CryptedFileID idFile, CryptedFileInfo * info,
     st->st_gid = info->gid;
     st->st_rdev = 0;
     st->st_size = info->cbFileSize;
-    st->st_blksize = SECTOR_SIZE;
-    st->st_blocks = info->csSet;
+    st->st_blksize = coreQueryVolumeParms(pVolume)->cbSector;
+    st->st_blocks = info->csSet * (st->st_blksize / 512);
     st->st_atime = info->timeAccess;
     st->st_mtime = info->timeWrite;
     st->st_ctime = info->timeAccess; /* !!! */
 }
 
 
-/* Stamp a file's mtime. */
+/* Stamp a file's mtime.  The file is locked, since a concurrent
+   write may change the rest of its info. */
 static CoreResult stampFile(CryptedFileID idFile)
 {
     CoreResult cr;
     CryptedFileInfo info;
 
+    coreLockFile(pVolume, idFile);
+
     /* Update the directory's last-written (mtime) timestamp. */
     cr = coreQueryFileInfo(pVolume, idFile, &info);
-    if (cr) return cr;
-    
-    info.timeWrite = time(0);
-    
-    cr = coreSetFileInfo(pVolume, idFile, &info);
-    if (cr) return cr;
+    if (!cr) {
+        info.timeWrite = time(0);
+        cr = coreSetFileInfo(pVolume, idFile, &info);
+    }
 
-    return CORERC_OK;
+    coreUnlockFile(pVolume, idFile);
+
+    return cr;
 }
 
 
@@ -146,7 +214,7 @@ static void fillEntryOut(struct fuse_entry_param * out,
     CryptedFileID idFile, CryptedFileInfo * info)
 {
     out->ino = idFile;
-    out->generation = generation++;
+    out->generation = __atomic_fetch_add(&generation, 1, __ATOMIC_RELAXED);
     out->entry_timeout = 1.0; /* sec */
     out->attr_timeout = 1.0; /* sec */
     storeAttr(idFile, info, &out->attr);
@@ -161,10 +229,10 @@ static void do_lookup(fuse_req_t req, fuse_ino_t parent, const char * name)
 
     logMsg(LOG_DEBUG, "lookup %ld %s", idDir, name);
 
+    pthread_rwlock_rdlock(&treeLock);
     cr = coreQueryIDFromPath(pVolume, idDir, name, &idFile, 0);
-    if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
-
-    cr = coreQueryFileInfo(pVolume, idFile, &info);
+    if (!cr) cr = coreQueryFileInfo(pVolume, idFile, &info);
+    pthread_rwlock_unlock(&treeLock);
     if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
 
     struct fuse_entry_param entry;
@@ -174,17 +242,14 @@ static void do_lookup(fuse_req_t req, fuse_ino_t parent, const char * name)
 }
 
 
-static void do_setattr(fuse_req_t req, fuse_ino_t ino, struct stat * attr,
-    int to_set, struct fuse_file_info * fi)
+static CoreResult setAttr(CryptedFileID idFile, struct stat * attr,
+    int to_set, CryptedFileInfo * pInfo)
 {
     CoreResult cr;
-    CryptedFileID idFile = ino;
     CryptedFileInfo info;
 
-    logMsg(LOG_DEBUG, "setattr %ld", idFile);
-
     cr = coreQueryFileInfo(pVolume, idFile, &info);
-    if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
+    if (cr) return cr;
 
     if (to_set & FUSE_SET_ATTR_MODE) {
 	logMsg(LOG_DEBUG, "set mode %od", attr->st_mode);
@@ -208,16 +273,35 @@ static void do_setattr(fuse_req_t req, fuse_ino_t ino, struct stat * attr,
     }
 
     cr = coreSetFileInfo(pVolume, idFile, &info);
-    if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
+    if (cr) return cr;
 
     if (to_set & FUSE_SET_ATTR_SIZE) {
 	logMsg(LOG_DEBUG, "set size %zd", attr->st_size);
 	cr = coreSetFileSize(pVolume, idFile, attr->st_size);
-	if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
+	if (cr) return cr;
 	cr = coreQueryFileInfo(pVolume, idFile, &info);
-	if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
+	if (cr) return cr;
     }
 
+    *pInfo = info;
+    return CORERC_OK;
+}
+
+
+static void do_setattr(fuse_req_t req, fuse_ino_t ino, struct stat * attr,
+    int to_set, struct fuse_file_info * fi)
+{
+    CoreResult cr;
+    CryptedFileID idFile = ino;
+    CryptedFileInfo info;
+
+    logMsg(LOG_DEBUG, "setattr %ld", idFile);
+
+    pthread_rwlock_wrlock(&treeLock);
+    cr = setAttr(idFile, attr, to_set, &info);
+    pthread_rwlock_unlock(&treeLock);
+    if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
+
     struct stat st;
     storeAttr(idFile, &info, &st);
 
@@ -233,20 +317,14 @@ static void do_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi
 
     logMsg(LOG_DEBUG, "getattr %ld", idFile);
 
+    pthread_rwlock_rdlock(&treeLock);
     cr = coreQueryFileInfo(pVolume, idFile, &info);
+    pthread_rwlock_unlock(&treeLock);
     if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
 
     struct stat st;
     storeAttr(idFile, &info, &st);
 
-    /* Hack: the lazy writer thread stat()s the root directory of the
-       file system to signal the main thread to synchronously write
-       dirty sectors to disk. */
-    if ((ino == pSuperBlock->idRoot) && wantFlush) {
-        commitVolume();
-        wantFlush = 0;
-    }
-    
     fuse_reply_attr(req, &st, 1.0);
 }
 
@@ -259,7 +337,9 @@ static void do_readlink(fuse_req_t req, fuse_ino_t ino)
     logMsg(LOG_DEBUG, "readlink %ld", idLink);
 
     char link[PATH_MAX + 1];
+    pthread_rwlock_rdlock(&treeLock);
     cr = coreReadSymlink(pVolume, idLink, PATH_MAX, link);
+    pthread_rwlock_unlock(&treeLock);
     if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
 
     fuse_reply_readlink(req, link);
@@ -361,7 +441,10 @@ static void do_readdir(fuse_req_t req, fuse_ino_t ino,
     /* An offset of zero means that we need to reload the directory
        contents. */
     if (off == 0) {
-        if (cr = resetDir(req, idDir, contents)) {
+        pthread_rwlock_rdlock(&treeLock);
+        cr = resetDir(req, idDir, contents);
+        pthread_rwlock_unlock(&treeLock);
+        if (cr) {
             fuse_reply_err(req, core2sys(cr));
             return;
         }
@@ -448,7 +531,9 @@ static void do_mknod(fuse_req_t req, fuse_ino_t parent,
     const char * name, mode_t mode, dev_t rdev)
 {
     struct fuse_entry_param entry;
+    pthread_rwlock_wrlock(&treeLock);
     int res = createFile(req, parent, name, mode, fuse_req_ctx(req), &entry);
+    pthread_rwlock_unlock(&treeLock);
     if (res)
         fuse_reply_err(req, res);
     else
@@ -460,7 +545,9 @@ static void do_mkdir(fuse_req_t req, fuse_ino_t parent,
     const char * name, mode_t mode)
 {
     struct fuse_entry_param entry;
+    pthread_rwlock_wrlock(&treeLock);
     int res = createFile(req, parent, name, mode | CFF_IFDIR, fuse_req_ctx(req), &entry);
+    pthread_rwlock_unlock(&treeLock);
     if (res)
         fuse_reply_err(req, res);
     else
@@ -511,7 +598,9 @@ static void do_unlink(fuse_req_t req, fuse_ino_t parent, const char * pszName)
 {
     logMsg(LOG_DEBUG, "remove %ld %s", parent, pszName);
 
+    pthread_rwlock_wrlock(&treeLock);
     int res = removeFile(parent, pszName);
+    pthread_rwlock_unlock(&treeLock);
     fuse_reply_err(req, res);
 }
 
@@ -530,17 +619,21 @@ static void do_link(fuse_req_t req, fuse_ino_t ino,
     
     logMsg(LOG_DEBUG, "link %ld %ld %s", ino, targetDir, pszName);
 
+    pthread_rwlock_wrlock(&treeLock);
+
     CryptedFileInfo info;
     cr = coreQueryFileInfo(pVolume, idFile, &info);
-    if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
 
     /* Add an entry for the newly created file to the directory. */
-    cr = coreAddEntryToDir(pVolume, idDir, pszName, idFile, 0);
-    if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
+    if (!cr) cr = coreAddEntryToDir(pVolume, idDir, pszName, idFile, 0);
 
     /* Increase the reference count of the file. */
-    info.cRefs++;
-    cr = coreSetFileInfo(pVolume, idFile, &info);
+    if (!cr) {
+        info.cRefs++;
+        cr = coreSetFileInfo(pVolume, idFile, &info);
+    }
+
+    pthread_rwlock_unlock(&treeLock);
     if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
 
     struct fuse_entry_param entry;
@@ -558,46 +651,57 @@ static void do_symlink(fuse_req_t req, const char * pszTarget,
     logMsg(LOG_DEBUG, "symlink %ld %s", parent, pszName);
     
     struct fuse_entry_param entry;
+    pthread_rwlock_wrlock(&treeLock);
     int res = createFile(req, parent, pszName, 0777 | CFF_IFLNK, fuse_req_ctx(req), &entry);
+    if (!res) {
+        cr = coreWriteSymlink(pVolume, entry.ino, pszTarget);
+        res = core2sys(cr);
+    }
+    pthread_rwlock_unlock(&treeLock);
     if (res)
         fuse_reply_err(req, res);
-    else {
-        cr = coreWriteSymlink(pVolume, entry.ino, pszTarget);
-        if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
-        
+    else
         fuse_reply_entry(req, &entry);
-    }
 }
 
 
-static void do_rename(fuse_req_t req, fuse_ino_t parent, const char * pszFrom,
-    fuse_ino_t newparent, const char * pszTo)
+static int renameFile(CryptedFileID idFrom, const char * pszFrom,
+    CryptedFileID idTo, const char * pszTo)
 {
     CoreResult cr;
-    CryptedFileID idFrom = parent, idTo = newparent;
     int res;
 
-    logMsg(LOG_DEBUG, "rename %ld %s %ld %s", idFrom, pszFrom, idTo, pszTo);
-
     /* Remove the to-name, if it exists. */
     res = removeFile(idTo, pszTo);
-    if (res && res != ENOENT) { fuse_reply_err(req, res); return; }
+    if (res && res != ENOENT) return res;
     
     /* Rename. */
     cr = coreMoveDirEntry(pVolume,
         pszFrom, idFrom,
         pszTo, idTo);
-    if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
+    if (cr) return core2sys(cr);
 
     /* Stamp the mtimes of the directories. */
     if ((cr = stampFile(idFrom)) ||
         ((idFrom != idTo) && (cr = stampFile(idTo))))
-    {
-        fuse_reply_err(req, core2sys(cr));
-        return;
-    }
+        return core2sys(cr);
 
-    fuse_reply_err(req, 0);
+    return 0;
+}
+
+
+static void do_rename(fuse_req_t req, fuse_ino_t parent, const char * pszFrom,
+    fuse_ino_t newparent, const char * pszTo)
+{
+    CryptedFileID idFrom = parent, idTo = newparent;
+
+    logMsg(LOG_DEBUG, "rename %ld %s %ld %s", idFrom, pszFrom, idTo, pszTo);
+
+    pthread_rwlock_wrlock(&treeLock);
+    int res = renameFile(idFrom, pszFrom, idTo, pszTo);
+    pthread_rwlock_unlock(&treeLock);
+
+    fuse_reply_err(req, res);
 }
 
 
@@ -609,7 +713,9 @@ static void do_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
 
     logMsg(LOG_DEBUG, "open %ld", idFile);
 
+    pthread_rwlock_rdlock(&treeLock);
     cr = coreQueryFileInfo(pVolume, idFile, &info);
+    pthread_rwlock_unlock(&treeLock);
     if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
 
     fi->keep_cache = 1; /* !!! doesn't seem to work */
@@ -627,14 +733,15 @@ static void do_read(fuse_req_t req, fuse_ino_t ino,
 
     logMsg(LOG_DEBUG, "read %ld %zd %zd", idFile, off, size);
 
-    octet * buffer = malloc(size);
+    octet * buffer = getReadBuffer(size);
     if (!buffer) { fuse_reply_err(req, ENOMEM); return; }
 
+    pthread_rwlock_rdlock(&treeLock);
     cr = coreReadFromFile(pVolume, idFile, off, size, buffer, &cbRead);
-    if (cr) { free(buffer); fuse_reply_err(req, core2sys(cr)); return; }
+    pthread_rwlock_unlock(&treeLock);
+    if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
 
     fuse_reply_buf(req, (char *) buffer, cbRead);
-    free(buffer);
 }
 
 
@@ -647,13 +754,11 @@ static void do_write(fuse_req_t req, fuse_ino_t ino, const char * buf,
 
     logMsg(LOG_DEBUG, "write %ld %zd %zd", idFile, off, size);
 
-    cr = coreWriteToFile(pVolume, idFile, 
-        off, size, (const octet *) buf, &cbWritten);
-    if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
-    
-    if (size != cbWritten) abort(); /* can't happen */
-    
-    cr = stampFile(idFile);
+    pthread_rwlock_rdlock(&treeLock);
+    cr = coreWriteToFileEx(pVolume, idFile, 
+        off, size, (const octet *) buf, &cbWritten, CWRITE_STAMP);
+    if (!cr && size != cbWritten) abort(); /* can't happen */
+    pthread_rwlock_unlock(&treeLock);
     if (cr) { fuse_reply_err(req, core2sys(cr)); return; }
 
     fuse_reply_write(req, cbWritten);
@@ -689,10 +794,11 @@ static void do_statfs(fuse_req_t req, fuse_ino_t ino)
 
     struct statvfs st2;
     memset(&st2, 0, sizeof(struct statvfs));
-    st2.f_bsize = PAYLOAD_SIZE;
-    st2.f_blocks = (st.f_bsize * (unsigned long long) st.f_blocks) / PAYLOAD_SIZE;
-    st2.f_bfree = (st.f_bsize * (unsigned long long) st.f_bfree) / PAYLOAD_SIZE;
-    st2.f_bavail = (st.f_bsize * (unsigned long long) st.f_bavail) / PAYLOAD_SIZE;
+    st2.f_bsize = PAYLOAD_SIZE_OF(coreQueryVolumeParms(pVolume)->cbSector);
+    st2.f_frsize = st2.f_bsize;
+    st2.f_blocks = (st.f_frsize * (unsigned long long) st.f_blocks) / st2.f_bsize;
+    st2.f_bfree = (st.f_frsize * (unsigned long long) st.f_bfree) / st2.f_bsize;
+    st2.f_bavail = (st.f_frsize * (unsigned long long) st.f_bavail) / st2.f_bsize;
     st2.f_files = st.f_files; /* nonsensical */
     st2.f_ffree = st.f_ffree; /* idem */
     st2.f_favail = st.f_favail; /* idem */
@@ -702,37 +808,44 @@ static void do_statfs(fuse_req_t req, fuse_ino_t ino)
 }
 
 
-/* Called by corefs whenever it marks a sector as dirty. */
-
-static void dirtyCallBack(CryptedVolume * pVolume, bool fDirty)
+/* Set or clear the dirty flag in the superblock. */
+static void setDirtyFlag(bool fDirty)
 {
     CoreResult cr;
-    
-    logMsg(LOG_DEBUG, "dirtyCallBack, fDirty=%d", fDirty);
 
-    if (fDirty) { /* the volume now has dirty sectors */
+    pthread_mutex_lock(&superBlockLock);
 
-        isDirty = 1;
-        
-        if (!(pSuperBlock->flFlags & SBF_DIRTY)) {
-            pSuperBlock->flFlags |= SBF_DIRTY;
-            cr = coreWriteSuperBlock(pSuperBlock,
-                CWS_NOWRITE_SUPERBLOCK1);
-            if (cr)
-                logMsg(LOG_ERR, "error setting dirty flag, cr=%d", cr);
+    if (fDirty != ((pSuperBlock->flFlags & SBF_DIRTY) != 0)) {
+        pSuperBlock->flFlags ^= SBF_DIRTY;
+        cr = coreWriteSuperBlock(pSuperBlock,
+            CWS_NOWRITE_SUPERBLOCK1);
+        if (cr) {
+            logMsg(LOG_ERR, "error %s dirty flag, cr=%d",
+                fDirty ? "setting" : "clearing", cr);
+            if (!fDirty)
+                pSuperBlock->flFlags |= SBF_DIRTY; /* retry */
         }
-
-    } else { /* the volume now has no dirty sectors */
-        /* Do nothing.  The superblock's dirty flag is periodically
-           cleared by the lazy writer or by volumeDirty(). */
-        isDirty = 0;
     }
 
+    pthread_mutex_unlock(&superBlockLock);
 }
 
 
-/* Flush all dirty data on a volume, clear the dirty bit. */
-void commitVolume()
+/* Called by corefs whenever the volume goes from clean to dirty or
+   vice versa.  The latter happens when the writeback thread or a
+   flush has written the last dirty sector. */
+static void dirtyCallBack(CryptedVolume * pVolume, bool fDirty)
+{
+    logMsg(LOG_DEBUG, "dirtyCallBack, fDirty=%d", fDirty);
+    setDirtyFlag(fDirty);
+}
+
+
+/* Flush all dirty data on a volume.  The dirty bit is cleared by
+   dirtyCallBack() when the last dirty sector has been written; we
+   can't clear it here, since other requests may have dirtied
+   sectors since the flush. */
+CoreResult commitVolume()
 {
     CoreResult cr;
 
@@ -740,36 +853,10 @@ void commitVolume()
 
     /* Flush dirty data. */
     cr = coreFlushVolume(pVolume);
-    if (cr) {
+    if (cr)
         logMsg(LOG_ERR, "error flushing volume, cr=%d", cr);
-	return;
-    }
-
-    /* Clear the dirty bit in the superblock. */
-    if (pSuperBlock->flFlags & SBF_DIRTY) {
-        pSuperBlock->flFlags &= ~SBF_DIRTY;
-        cr = coreWriteSuperBlock(pSuperBlock,
-            CWS_NOWRITE_SUPERBLOCK1);
-        if (cr) {
-            logMsg(LOG_ERR, "error clearing dirty flag, cr=%d", cr);
-            pSuperBlock->flFlags |= SBF_DIRTY; /* retry */
-	    return;
-        }
-    }
-}
-
 
-void * lazyWriter(void * arg)
-{
-    while (1) {
-        if (isDirty) {
-            struct stat st;
-            wantFlush = 1;
-            stat(szMountPoint, &st);
-        }
-        sleep(10);
-    }
-    return 0;
+    return cr;
 }
 
 
@@ -803,6 +890,44 @@ static struct fuse_lowlevel_ops aefs_oper = {
 };
 
 
+/* SIGUSR1 doubles the sector cache, SIGUSR2 halves it.  The signals
+   are blocked in all threads and taken by this one, so that the cache
+   is never resized from a signal handler. */
+static void * resizeThread(void * pArg)
+{
+    sigset_t * pSigs = pArg;
+    unsigned int csNew;
+    CoreResult cr;
+    int sig;
+
+    while (sigwait(pSigs, &sig) == 0) {
+        csNew = sig == SIGUSR1 ? csCacheSize * 2 : csCacheSize / 2;
+        if (!csNew) continue;
+        cr = coreSetVolumeCacheLimits(pVolume, csNew, 0);
+        if (cr) {
+            logMsg(LOG_ERR, "cannot resize cache to %u sectors: %s",
+                csNew, core2str(cr));
+            continue;
+        }
+        csCacheSize = csNew;
+        logMsg(LOG_INFO, "cache resized to %u sectors", csCacheSize);
+    }
+
+    return 0;
+}
+
+
+static bool parseCount(char * pszArg, unsigned int * pc)
+{
+    char * pszEnd;
+    unsigned long c;
+    c = strtoul(pszArg, &pszEnd, 10);
+    if (*pszEnd || !isdigit(*pszArg) || c == 0 || c > UINT_MAX) return false;
+    *pc = c;
+    return true;
+}
+
+
 /* Return true iff somebody unmounted us. */
 static void run(char * pszPassPhrase)
 {
@@ -831,6 +956,16 @@ static void run(char * pszPassPhrase)
     coreSetDefVolumeParms(&parms);
     parms.fReadOnly = fReadOnly;
     parms.dirtyCallBack = dirtyCallBack;
+    parms.pCachePolicy = pCachePolicy;
+    if (fIORing) parms.flCacheFlags |= CCACHE_IORING;
+    if (fMemPressure) parms.flCacheFlags |= CCACHE_PRESSURE;
+    if (csCacheSize) parms.csMaxCached = csCacheSize;
+    if (cMaxFiles) {
+        parms.cMaxCryptedFiles = cMaxFiles;
+        if (parms.cMaxOpenStorageFiles > cMaxFiles)
+            parms.cMaxOpenStorageFiles = cMaxFiles;
+    }
+    csCacheSize = parms.csMaxCached;
 
     /* Read the superblock, initialize volume structures.  Note: we
        cannot call daemon() after coreReadSuperBlock(), since daemon()
@@ -878,19 +1013,49 @@ retry:
         if (session) {
 
             if (fuse_set_signal_handlers(session) != -1) {
+                sigset_t sigs;
+                pthread_t resizer;
+                bool fResizer;
+                
                 error = 0;
                 
                 writeResult(CORERC_OK);
 
-                /* Start the lazy writer thread. */
-                pthread_t lazyWriterThread;
-                pthread_create(&lazyWriterThread, 0, lazyWriter, 0);
+                /* Block the resize signals before any other thread is
+                   started, so that they all inherit the mask. */
+                sigemptyset(&sigs);
+                sigaddset(&sigs, SIGUSR1);
+                sigaddset(&sigs, SIGUSR2);
+                pthread_sigmask(SIG_BLOCK, &sigs, 0);
+                fResizer = pthread_create(&resizer, 0,
+                    resizeThread, &sigs) == 0;
+                if (!fResizer)
+                    logMsg(LOG_ERR, "cannot start the resize thread");
+
+                /* Write dirty sectors in the background. */
+                if (!parms.fReadOnly) {
+                    cr = coreStartWriteBack(pVolume);
+                    if (cr)
+                        logMsg(LOG_ERR, "cannot start writeback: %s",
+                            core2str(cr));
+                }
+
+                /* Read ahead of sequential readers. */
+                cr = coreStartReadAhead(pVolume);
+                if (cr)
+                    logMsg(LOG_ERR, "cannot start readahead: %s",
+                        core2str(cr));
     
                 fuse_session_add_chan(session, channel);
                 
-                fuse_session_loop(session);
+                fuse_session_loop_mt(session);
 
                 logMsg(LOG_DEBUG, "shutting down");
+
+                if (fResizer) {
+                    pthread_cancel(resizer);
+                    pthread_join(resizer, 0);
+                }
                 
                 fuse_remove_signal_handlers(session);
                 fuse_session_remove_chan(channel);
@@ -904,7 +1069,12 @@ retry:
     
     fuse_opt_free_args(&args);
     
-    commitVolume();
+    coreStopReadAhead(pVolume);
+    coreStopWriteBack(pVolume);
+
+    /* Nobody else uses the volume any more, so now the dirty bit
+       can be cleared (again, if clearing it failed before). */
+    if (!commitVolume()) setDirtyFlag(false);
     coreDropSuperBlock(pSuperBlock);
 
     if (error) {
@@ -933,6 +1103,17 @@ Mount the AEFS volume stored in AEFS-PATH onto MOUNT-POINT.\n\
   -k, --key=KEY       use specified passphrase, do not ask\n\
   -o, --options=OPTS  pass mount options to fusermount\n\
   -r, --readonly      mount read-only\n\
+      --cache-policy=POLICY\n\
+                      sector cache replacement policy\n\
+                      (lru (default), clock or 2q)\n\
+      --io-ring       submit batched storage I/O through io_uring,\n\
+                      if the kernel supports it\n\
+      --cache-size=N  cache N sectors (SIGUSR1 doubles the cache\n\
+                      at runtime, SIGUSR2 halves it)\n\
+      --max-files=N   keep at most N files open\n\
+      --memory-pressure\n\
+                      shrink the cache when the system is short of\n\
+                      memory\n\
       --help          display this help and exit\n\
       --version       output version information and exit\n\
 \n\
@@ -959,6 +1140,11 @@ int main(int argc, char * * argv)
         { "options", required_argument, 0, 'o' },
         { "force", no_argument, 0, 'f' },
         { "readonly", no_argument, 0, 'r' },
+        { "cache-policy", required_argument, 0, 3 },
+        { "io-ring", no_argument, 0, 4 },
+        { "cache-size", required_argument, 0, 5 },
+        { "max-files", required_argument, 0, 6 },
+        { "memory-pressure", no_argument, 0, 7 },
         { 0, 0, 0, 0 } 
     };      
 
@@ -982,6 +1168,39 @@ int main(int argc, char * * argv)
                 exit(0);
                 break;
 
+            case 3: /* --cache-policy */
+                pCachePolicy = coreFindCachePolicy(optarg);
+                if (!pCachePolicy) {
+                    fprintf(stderr, "%s: unknown cache policy `%s'\n",
+                        pszProgramName, optarg);
+                    printUsage(1);
+                }
+                break;
+
+            case 4: /* --io-ring */
+                fIORing = true;
+                break;
+
+            case 5: /* --cache-size */
+                if (!parseCount(optarg, &csCacheSize)) {
+                    fprintf(stderr, "%s: invalid cache size `%s'\n",
+                        pszProgramName, optarg);
+                    printUsage(1);
+                }
+                break;
+
+            case 6: /* --max-files */
+                if (!parseCount(optarg, &cMaxFiles)) {
+                    fprintf(stderr, "%s: invalid number of files `%s'\n",
+                        pszProgramName, optarg);
+                    printUsage(1);
+                }
+                break;
+
+            case 7: /* --memory-pressure */
+                fMemPressure = true;
+                break;
+
             case 'd': /* --debug */
                 fDebug = true;
                 break;
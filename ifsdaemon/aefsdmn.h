@@ -150,7 +150,7 @@ USHORT makeDOSAttr(bool fHidden, CryptedFileInfo * pInfo);
 void extractDOSAttr(USHORT fsAttr, CryptedFileInfo * pInfo);
 
 APIRET storeFileInfo(
-   CryptedVolume * pVolume, /* DosFindXXX level 3 only */
+   CryptedVolume * pVolume,
    CryptedFileID idFile, /* DosFindXXX level 3 only */
    PGEALIST pgeas, /* DosFindXXX level 3 only */
    char * pszFileName, /* DosFindXXX only */
@@ -415,6 +415,8 @@ static APIRET getSetAllocInfo(ServerData * pServerData,
    FSALLOCATE fsallocReal;
    APIRET rc;
    uint64 cbUnit, cbTotal = 1 << 30, cbAvail = cbTotal / 2;
+   unsigned int cbPayload = PAYLOAD_SIZE_OF(coreQueryVolumeParms(
+      pVolData->pSuperBlock->pVolume)->cbSector);
    
    if (pfsinfo->fsFlag == INFO_RETRIEVE) {
       
@@ -437,9 +439,9 @@ static APIRET getSetAllocInfo(ServerData * pServerData,
       pfsalloc = (PFSALLOCATE) pServerData->pData;
       pfsalloc->idFileSystem = 0;
       pfsalloc->cSectorUnit = 1;
-      pfsalloc->cUnit = cbTotal / PAYLOAD_SIZE;
-      pfsalloc->cUnitAvail = cbAvail / PAYLOAD_SIZE;
-      pfsalloc->cbSector = PAYLOAD_SIZE;
+      pfsalloc->cUnit = cbTotal / cbPayload;
+      pfsalloc->cUnitAvail = cbAvail / cbPayload;
+      pfsalloc->cbSector = cbPayload;
       return NO_ERROR;
       
    } else {
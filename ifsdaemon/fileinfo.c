@@ -23,7 +23,7 @@
 
 
 APIRET storeFileInfo(
-   CryptedVolume * pVolume, /* DosFindXXX level 3 only */
+   CryptedVolume * pVolume,
    CryptedFileID idFile, /* DosFindXXX level 3 only */
    PGEALIST pgeas, /* DosFindXXX level 3 only */
    char * pszFileName, /* DosFindXXX only */
@@ -64,7 +64,8 @@ APIRET storeFileInfo(
       pBuf->cbFileAlloc = 0;
    } else {
       pBuf->cbFile = pInfo->cbFileSize;
-      pBuf->cbFileAlloc = (pInfo->csSet + 1) * SECTOR_SIZE; 
+      pBuf->cbFileAlloc = (pInfo->csSet + 1) *
+         coreQueryVolumeParms(pVolume)->cbSector;
    }
    pBuf->attrFile = makeDOSAttr(fHidden, pInfo);
    *ppData += sizeof(FILESTATUS);
@@ -354,7 +355,7 @@ APIRET doFileInfo(struct sffsi * psffsi,
          case FIL_QUERYEASIZE: /* Query level 1 or 2 file info. */
             
             memset(pData, 0, cbData);
-            return storeFileInfo(0, 0, 0, 0,
+            return storeFileInfo(pVolume, 0, 0, 0,
                fHidden,
                &info,
                &pData,
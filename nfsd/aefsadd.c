@@ -23,6 +23,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <pwd.h>
 #include <grp.h>
 #include <sys/types.h>
@@ -61,6 +62,8 @@ for the specified path.\n\
   -r, --readonly          load read-only\n\
   -u, --user=USER[.GROUP] set ownership of all files\n\
   -s, --stor=USER[.GROUP] user ID to use for ciphertext access\n\
+      --cache-size=N      cache N sectors of the file system\n\
+      --max-files=N       keep at most N of its files open\n\
 \n\
 " STANDARD_KEY_HELP "\
 \n\
@@ -81,6 +84,10 @@ that is setuid root.\n\
 If the GROUP is omitted in `--user' or `--stor', the group ID of the\n\
 user is extracted from the password file.\n\
 \n\
+`--cache-size' and `--max-files' may also be given for a file system\n\
+that the server already has the key for; its cache is then resized\n\
+on the fly.\n\
+\n\
 The default for `--user' is `-1.-1', which means use the file\n\
 ownership as stored in the file system.  The default for `--stor' is\n\
 `root.root'.  The default for `--mode' is 0600.\n\
@@ -95,6 +102,19 @@ Examples:\n\
 }
 
 
+/* Parse a positive number that fits in the int fields of
+   setcacheargs. */
+static bool parseCount(char * pszArg, int * pc)
+{
+    char * pszEnd;
+    unsigned long c;
+    c = strtoul(pszArg, &pszEnd, 10);
+    if (*pszEnd || !isdigit(*pszArg) || c == 0 || c > INT_MAX) return false;
+    *pc = c;
+    return true;
+}
+
+
 static int parseUGID(char * param, uid_t * puid, gid_t * pgid)
 {
     char * p, * q, * sep;
@@ -174,6 +194,9 @@ int main(int argc, char * * argv)
     uid_t user_uid = -1, stor_uid = 0;
     gid_t user_gid = -1, stor_gid = 0;
     int mode = 0600;
+    int csCache = 0, cMaxFiles = 0;
+    setcacheargs cacheArgs;
+    setcacheres * cacheRes;
 
     struct option const options[] = {
         { "help", no_argument, 0, 1 },
@@ -185,6 +208,8 @@ int main(int argc, char * * argv)
         { "lazy", required_argument, 0, 11 },
         { "user", required_argument, 0, 'u' },
         { "stor", required_argument, 0, 's' },
+        { "cache-size", required_argument, 0, 12 },
+        { "max-files", required_argument, 0, 13 },
         { 0, 0, 0, 0 } 
     };      
 
@@ -239,6 +264,22 @@ int main(int argc, char * * argv)
                 }
                 break;
 
+            case 12: /* --cache-size */
+                if (!parseCount(optarg, &csCache)) {
+                    fprintf(stderr, "%s: invalid cache size `%s'\n",
+                        pszProgramName, optarg);
+                    printUsage(1);
+                }
+                break;
+
+            case 13: /* --max-files */
+                if (!parseCount(optarg, &cMaxFiles)) {
+                    fprintf(stderr, "%s: invalid number of files `%s'\n",
+                        pszProgramName, optarg);
+                    printUsage(1);
+                }
+                break;
+
             case 'u': /* --user */
                 if (parseUGID(optarg, &user_uid, &user_gid))
                     printUsage(1);
@@ -338,6 +379,32 @@ int main(int argc, char * * argv)
                 pszProgramName, res->stat);
     }
 
+    if (ret || (!csCache && !cMaxFiles)) goto end;
+
+    cacheArgs.path = pszBasePath;
+    cacheArgs.cache_sectors = csCache;
+    cacheArgs.max_files = cMaxFiles;
+    cacheRes = aefsctrlproc_setcache_1(&cacheArgs, clnt);
+    if (!cacheRes) {
+        clnt_perror(clnt, "unable to set the cache limits");
+        ret = 1;
+        goto end;
+    }
+
+    switch (cacheRes->stat) {
+        case SETCACHE_OK:
+            break;
+        case SETCACHE_CORE:
+            fprintf(stderr, "%s: cannot set the cache limits: %s\n",
+                pszProgramName, core2str(cacheRes->cr));
+            ret = 1;
+            break;
+        default:
+            fprintf(stderr, "%s: aefsnfsd returned error %d\n",
+                pszProgramName, cacheRes->stat);
+            ret = 1;
+    }
+
 end:
     auth_destroy(clnt->cl_auth);
     clnt_destroy(clnt);
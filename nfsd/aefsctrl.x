@@ -51,10 +51,29 @@ struct addfsres {
         int cr; /* see ../corefs/corefs.h */
 };
 
+struct setcacheargs {
+        string path<AEFSCTRL_MAXPATHLEN>;
+        int cache_sectors; /* 0 = unchanged */
+        int max_files; /* 0 = unchanged */
+};
+
+enum setcachestat {
+    SETCACHE_OK = 0,    /* the limits have been changed */
+    SETCACHE_NO_FS = 1, /* the daemon has no key for the path */
+    SETCACHE_CORE = 2,  /* corefs error, consult cr */
+    SETCACHE_PERM = 3   /* you don't have permission to talk */
+};
+
+struct setcacheres {
+        setcachestat stat;
+        int cr; /* see ../corefs/corefs.h */
+};
+
 program AEFSCTRL_PROGRAM {
     version AEFSCTRL_VERSION_1 {
         void AEFSCTRLPROC_NULL(void) = 0;
         addfsres AEFSCTRLPROC_ADDFS(addfsargs) = 1;
+        setcacheres AEFSCTRLPROC_SETCACHE(setcacheargs) = 2;
 	void AEFSCTRLPROC_FLUSH(void) = 123;
     } = 1;
 } = 101438;
@@ -24,12 +24,15 @@
 #include <assert.h>
 #include <errno.h>
 #include <signal.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <sys/statvfs.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #define PORTMAP /* enables backward compatibility under Solaris */
 #include <rpc/rpc.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "getopt.h"
 
@@ -69,6 +72,10 @@ typedef struct {
 
 Filesystem * apFilesystems[MAX_FILESYSTEMS];
 
+/* Serialises updates of the superblocks' dirty flags, which happen
+   on the main thread and on the corefs writeback threads. */
+static pthread_mutex_t superBlockLock = PTHREAD_MUTEX_INITIALIZER;
+
 
 typedef struct {
         int uid, gid;
@@ -88,6 +95,8 @@ int voidthing;
 
 bool fTerminate = false;
 
+static bool fMemPressure = false;
+
 
 /* Construct an NFS file handle from a file system identifier and a
    file identifier. */
@@ -200,7 +209,7 @@ static nfsstat storeAttr(fattr * pAttr, fsid fs, CryptedFileID idFile)
     pAttr->uid = info.uid;
     pAttr->gid = info.gid;
     pAttr->size = info.cbFileSize;
-    pAttr->blocksize = SECTOR_SIZE;
+    pAttr->blocksize = coreQueryVolumeParms(GET_VOLUME(fs))->cbSector;
     pAttr->rdev = 0;
     pAttr->blocks = info.csSet;
     pAttr->fsid = 0;
@@ -456,30 +465,43 @@ static nfsstat havePerm2(unsigned int what, User * pUser, fsid fs,
 }
 
 
-/* Called by corefs whenever it marks a sector as dirty. */
+/* Set or clear the dirty flag in the superblock. */
+static CoreResult setDirtyFlag(SuperBlock * pSuperBlock, bool fDirty)
+{
+    CoreResult cr = CORERC_OK;
+
+    pthread_mutex_lock(&superBlockLock);
+
+    if (fDirty != ((pSuperBlock->flFlags & SBF_DIRTY) != 0)) {
+        pSuperBlock->flFlags ^= SBF_DIRTY;
+        cr = coreWriteSuperBlock(pSuperBlock,
+            CWS_NOWRITE_SUPERBLOCK1);
+        if (cr) {
+            logMsg(LOG_ERR, "error %s dirty flag, cr=%d",
+                fDirty ? "setting" : "clearing", cr);
+            if (!fDirty)
+                pSuperBlock->flFlags |= SBF_DIRTY; /* retry */
+        }
+    }
+
+    pthread_mutex_unlock(&superBlockLock);
+
+    return cr;
+}
+
+
+/* Called by corefs whenever the volume goes from clean to dirty or
+   vice versa.  The latter happens when the writeback thread has
+   written the last dirty sector (if lazy writing is enabled), or
+   when volumeDirty() flushes the volume (if not). */
 static void dirtyCallBack(CryptedVolume * pVolume, bool fDirty)
 {
-    CoreResult cr;
     Filesystem * pFS = apFilesystems[(fsid)
         coreQueryVolumeParms(pVolume)->pUserData];
     
     logMsg(LOG_DEBUG, "dirtyCallBack, fDirty=%d", fDirty);
 
-    if (fDirty) { /* the volume now has dirty sectors */
-
-        if (!(pFS->pSuperBlock->flFlags & SBF_DIRTY)) {
-            pFS->pSuperBlock->flFlags |= SBF_DIRTY;
-            cr = coreWriteSuperBlock(pFS->pSuperBlock,
-                CWS_NOWRITE_SUPERBLOCK1);
-            if (cr)
-                logMsg(LOG_ERR, "error setting dirty flag, cr=%d", cr);
-        }
-
-    } else { /* the volume now has no dirty sectors */
-        /* Do nothing.  The superblock's dirty flag is periodically
-           cleared by the lazy writer or by volumeDirty(). */
-    }
-
+    setDirtyFlag(pFS->pSuperBlock, fDirty);
 }
 
 
@@ -505,16 +527,8 @@ static nfsstat commitVolume(fsid fs)
        sensible in this regard, so we don't do that here. */
 
     /* Clear the dirty bit in the superblock. */
-    if (GET_SUPERBLOCK(fs)->flFlags & SBF_DIRTY) {
-        GET_SUPERBLOCK(fs)->flFlags &= ~SBF_DIRTY;
-        cr = coreWriteSuperBlock(GET_SUPERBLOCK(fs),
-            CWS_NOWRITE_SUPERBLOCK1);
-        if (cr) {
-            logMsg(LOG_ERR, "error clearing dirty flag, cr=%d", cr);
-            GET_SUPERBLOCK(fs)->flFlags |= SBF_DIRTY; /* retry */
-            return core2nfsstat(cr);
-        }
-    }
+    cr = setDirtyFlag(GET_SUPERBLOCK(fs), false);
+    if (cr) return core2nfsstat(cr);
 
     return NFS_OK;
 }
@@ -531,7 +545,9 @@ static void commitAll()
 
 
 /* Should be called when the volume has changed.  If lazy writing is
-   enabled, flush all dirty data.  Otherwise, do nothing. */
+   disabled, flush all dirty data.  Otherwise, do nothing.  The flush
+   doesn't hold up the writeback and readahead threads (see
+   coreFlushVolume()). */
 static nfsstat volumeDirty(fsid fs)
 {
     if (!apFilesystems[fs]->fLazyWrite) 
@@ -622,6 +638,9 @@ Start the AEFS NFS server.\n\
   -d, --debug        don't demonize, print debug info\n\
   -l, --lock         lock daemon memory (disable swapping)\n\
   -r, --register     register with portmapper\n\
+      --memory-pressure\n\
+                     shrink the caches of lazily written file\n\
+                     systems when the system is short of memory\n\
 ",
          pszProgramName);
    }
@@ -640,13 +659,12 @@ static void sigHandler(int signo)
 
 
 /* Process RPC requests.  This is what svc_run() does, but we
-   implement our own loop so that we can do lazy writing. */
+   implement our own loop so that we can stop on a signal.  Lazy
+   writing is done by the corefs writeback threads. */
 static int run()
 {
     fd_set readfds;
-    struct timeval timeout;
     int err = 0, max, res, i;
-    time_t maxAge = 5, timeFlush = time(0), timeCur;
     struct sigaction act, oldact1, oldact2;
 
     act.sa_handler = sigHandler;
@@ -665,20 +683,8 @@ static int run()
         for (i = max = 0; i < FD_SETSIZE; i++)
             if (FD_ISSET(i, &readfds)) max = i;
         
-        /* Lazy writer.  Should we flush now?  Determine the time-out
-           for select(). */
-        timeCur = time(0);
-        if (timeCur >= timeFlush + maxAge) {
-            logMsg(LOG_DEBUG, "flushing everything");
-            commitAll();
-            timeFlush = timeCur;
-            timeout.tv_sec = maxAge;
-        } else
-            timeout.tv_sec = timeFlush + maxAge - timeCur;
-        timeout.tv_usec = 0;
-
-        /* Sleep until we get some input, or until we should flush. */
-        res = select(max + 1, &readfds, 0, 0, &timeout);
+        /* Sleep until we get some input. */
+        res = select(max + 1, &readfds, 0, 0, 0);
         if (res == -1 && errno != EINTR) {
             logMsg(LOG_ALERT, "error from select: %s",
                 strerror(errno));
@@ -709,6 +715,7 @@ int main(int argc, char * * argv)
         { "help", no_argument, 0, 1 },
         { "version", no_argument, 0, 2 },
         { "debug", no_argument, 0, 'd' },
+        { "memory-pressure", no_argument, 0, 3 },
         { 0, 0, 0, 0 } 
     };      
 
@@ -730,6 +737,10 @@ int main(int argc, char * * argv)
                 exit(0);
                 break;
 
+            case 3: /* --memory-pressure */
+                fMemPressure = true;
+                break;
+
             case 'd': /* --debug */
                 fDebug = true;
                 break;
@@ -1097,18 +1108,15 @@ attrstat * nfsproc_write_2_svc(writeargs * args, struct svc_req * rqstp)
     res.status = havePerm2(2, &user, fs, idFile);
     if (res.status) return &res;
 
-    cr = coreWriteToFile(GET_VOLUME(fs), idFile, args->offset,
+    /* Write the data and stamp the mtime. */
+    cr = coreWriteToFileEx(GET_VOLUME(fs), idFile, args->offset,
         args->data.data_len, (octet *) args->data.data_val, 
-        &cbWritten);
+        &cbWritten, CWRITE_STAMP);
     if (cr) {
         res.status = core2nfsstat(cr);
         return &res;
     }
 
-    /* Stamp the mtime. */
-    res.status = stampFile(fs, idFile);
-    if (res.status) return &res;
-
     res.status = volumeDirty(fs);
     if (res.status) return &res;
 
@@ -1632,16 +1640,38 @@ readdirres * nfsproc_readdir_2_svc(readdirargs * args, struct svc_req * rqstp)
 }
 
 
+/* Convert a block count of the storage file system to one in units
+   of bsize, as far as it fits. */
+static unsigned int scaleBlocks(struct statvfs * pst,
+    unsigned long long cBlocks, unsigned int bsize)
+{
+    cBlocks = (pst->f_frsize * cBlocks) / bsize;
+    return cBlocks > UINT_MAX ? UINT_MAX : cBlocks;
+}
+
+
+/* The sizes are those of the storage file system, in blocks of one
+   sector's payload, as in the FUSE front-end. */
 statfsres * nfsproc_statfs_2_svc(nfs_fh * fh, struct svc_req * rqstp)
 {
     static statfsres res;
+    fsid fs;
+    CryptedFileID id;
+    struct statvfs st;
+    unsigned int bsize;
     logMsg(LOG_DEBUG, "nfsproc_statfs");
-    res.status = NFS_OK;
+    res.status = decodeFH(fh, &fs, &id);
+    if (res.status) return &res;
+    if (statvfs(GET_SUPERBLOCK(fs)->szBasePath, &st)) {
+        res.status = NFSERR_IO;
+        return &res;
+    }
+    bsize = PAYLOAD_SIZE_OF(coreQueryVolumeParms(GET_VOLUME(fs))->cbSector);
     res.statfsres_u.reply.tsize = 4096;
-    res.statfsres_u.reply.bsize = SECTOR_SIZE;
-    res.statfsres_u.reply.tsize = 1000000;
-    res.statfsres_u.reply.tsize = 500000;
-    res.statfsres_u.reply.tsize = 500000;
+    res.statfsres_u.reply.bsize = bsize;
+    res.statfsres_u.reply.blocks = scaleBlocks(&st, st.f_blocks, bsize);
+    res.statfsres_u.reply.bfree = scaleBlocks(&st, st.f_bfree, bsize);
+    res.statfsres_u.reply.bavail = scaleBlocks(&st, st.f_bavail, bsize);
     return &res;
 }
 
@@ -1717,6 +1747,8 @@ void * mountproc_umnt_1_svc(dirpath * path, struct svc_req * rqstp)
             if (pFS->cRefs <= 0) {
                 logMsg(LOG_DEBUG, "dropping volume");
                 dirtyDir(i, 0);
+                coreStopReadAhead(GET_VOLUME(i));
+                coreStopWriteBack(GET_VOLUME(i));
                 commitVolume(i);
                 coreDropSuperBlock(GET_SUPERBLOCK(i));
                 free(pFS);
@@ -1820,6 +1852,7 @@ addfsres * aefsctrlproc_addfs_1_svc(addfsargs * args, struct svc_req * rqstp)
     parms.fReadOnly = args->flags & AF_READONLY;
     parms.dirtyCallBack = dirtyCallBack;
     parms.pUserData = (void *) i; /* hack! */
+    if (fMemPressure) parms.flCacheFlags |= CCACHE_PRESSURE;
 #ifdef SYSTEM_posix
     parms.cred.fEnforce = true;
     parms.cred.uid = args->stor_uid;
@@ -1865,11 +1898,68 @@ retry:
     apFilesystems[i]->cRefs = 0;
     apFilesystems[i]->fLazyWrite = args->flags & AF_LAZYWRITE;;
 
+    /* With lazy writing, dirty sectors are written in the
+       background. */
+    if (apFilesystems[i]->fLazyWrite && !parms.fReadOnly) {
+        cr = coreStartWriteBack(pSuperBlock->pVolume);
+        if (cr)
+            logMsg(LOG_ERR, "cannot start writeback, cr=%d", cr);
+    }
+
+    /* Read ahead of sequential readers. */
+    cr = coreStartReadAhead(pSuperBlock->pVolume);
+    if (cr)
+        logMsg(LOG_ERR, "cannot start readahead, cr=%d", cr);
+
     res.stat = ADDFS_OK;
     return &res;
 }
 
 
+setcacheres * aefsctrlproc_setcache_1_svc(setcacheargs * args,
+    struct svc_req * rqstp)
+{
+    static setcacheres res;
+    char szCanon[AEFSCTRL_MAXPATHLEN + 16];
+    User user;
+    CoreResult cr;
+    unsigned int i;
+
+    logMsg(LOG_DEBUG, "aefsctrlproc_setcache");
+
+    res.cr = 0;
+
+    if (authCaller(rqstp, &user)) {
+        res.stat = SETCACHE_PERM;
+        return &res;
+    }
+
+    canonicalizePath(args->path, szCanon);
+
+    for (i = 0; i < MAX_FILESYSTEMS; i++)
+        if (apFilesystems[i] &&
+            (strcmp(szCanon, GET_SUPERBLOCK(i)->szBasePath) == 0))
+            break;
+
+    if (i >= MAX_FILESYSTEMS) {
+        res.stat = SETCACHE_NO_FS;
+        return &res;
+    }
+
+    cr = coreSetVolumeCacheLimits(GET_VOLUME(i),
+        args->cache_sectors > 0 ? args->cache_sectors : 0,
+        args->max_files > 0 ? args->max_files : 0);
+    if (cr) {
+        res.stat = SETCACHE_CORE;
+        res.cr = cr;
+        return &res;
+    }
+
+    res.stat = SETCACHE_OK;
+    return &res;
+}
+
+
 void * aefsctrlproc_flush_1_svc(void * v, struct svc_req * rqstp)
 {
     User user;
@@ -19,9 +19,14 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <assert.h>
 #define INCL_DOSERRORS
+#define INCL_DOSMEMMGR
+#define INCL_DOSPROCESS
+#define INCL_DOSSEMAPHORES
+#define INCL_DOSMISC
 #include <os2.h>
 
 #include "sysdep.h"
@@ -29,6 +34,34 @@
 
 struct _File {
       HFILE h;
+      HMTX hmtx; /* serialises the users of the file pointer */
+};
+
+
+/* OS/2 has no way to open a file relative to a directory handle, and
+   DosOpen() locks each file anyway; a directory is just its path. */
+struct _SysDir {
+      char szPath[CCHMAXPATH]; /* ends in a backslash, or empty */
+};
+
+
+struct _SysThread {
+      TID tid;
+      void (* pFunc)(void * pArg);
+      void * pArg;
+};
+
+
+struct _SysMutex {
+      HMTX hmtx;
+};
+
+
+/* Condition variables are built on event semaphores.  A waiter
+   resets the semaphore before releasing the mutex, so a post cannot
+   get lost in between. */
+struct _SysCond {
+      HEV hev;
 };
 
 
@@ -55,6 +88,7 @@ static SysResult os2sys(APIRET rc)
       case ERROR_SHARING_VIOLATION:
       case ERROR_LOCK_VIOLATION:
          return SYS_LOCKED;
+      case ERROR_TOO_MANY_OPEN_FILES: return SYS_TOO_MANY_FILES;
       default: return SYS_UNKNOWN;
    }
 }
@@ -93,6 +127,29 @@ static ULONG makeOS2Flags(int flFlags)
 }
 
 
+static SysResult allocFile(HFILE h, File * * ppFile)
+{
+   APIRET rc;
+   File * pFile;
+
+   pFile = malloc(sizeof(File));
+   if (!pFile) {
+      DosClose(h);
+      return SYS_NOT_ENOUGH_MEMORY;
+   }
+   pFile->h = h;
+
+   if (rc = DosCreateMutexSem(0, &pFile->hmtx, 0, FALSE)) {
+      free(pFile);
+      DosClose(h);
+      return os2sys(rc);
+   }
+
+   *ppFile = pFile;
+   return SYS_OK;
+}
+
+
 SysResult sysOpenFile(char * pszName, int flFlags, Cred cred, 
     File * * ppFile)
 {
@@ -118,15 +175,7 @@ SysResult sysOpenFile(char * pszName, int flFlags, Cred cred,
       g, f | OPEN_FLAGS_FAIL_ON_ERROR | OPEN_FLAGS_NOINHERIT, 0)))
       return os2sys(rc);
    
-   pFile = malloc(sizeof(File));
-   if (!pFile) {
-      DosClose(h);
-      return SYS_NOT_ENOUGH_MEMORY;
-   }
-   pFile->h = h;
-
-   *ppFile = pFile;
-   return SYS_OK;
+   return allocFile(h, ppFile);
 }
 
 
@@ -145,23 +194,17 @@ SysResult sysCreateFile(char * pszName, int flFlags,
       FILE_NORMAL | FILE_ARCHIVED,
       OPEN_ACTION_CREATE_IF_NEW | OPEN_ACTION_FAIL_IF_EXISTS,
       f | OPEN_FLAGS_FAIL_ON_ERROR | OPEN_FLAGS_NOINHERIT, 0)))
-      return os2sys(rc);
+      /* That's what DosOpen() says if the file exists. */
+      return rc == ERROR_OPEN_FAILED ? SYS_FILE_EXISTS : os2sys(rc);
    
-   pFile = malloc(sizeof(File));
-   if (!pFile) {
-      DosClose(h);
-      return SYS_NOT_ENOUGH_MEMORY;
-   }
-   pFile->h = h;
-
-   *ppFile = pFile;
-   return SYS_OK;
+   return allocFile(h, ppFile);
 }
 
 
 SysResult sysCloseFile(File * pFile)
 {
    int h = pFile->h;
+   DosCloseMutexSem(pFile->hmtx);
    free(pFile);
    return os2sys(DosClose(h));
 }
@@ -198,6 +241,78 @@ SysResult sysWriteToFile(File * pFile, FilePos cbLength,
 }
 
 
+/* OS/2 has no vectored I/O, so transfer the buffers one at a
+   time. */
+SysResult sysReadFileV(File * pFile, FilePos ibPos,
+   unsigned int cVecs, SysIOVec * paVecs, FilePos * pcbRead)
+{
+   APIRET rc;
+   ULONG ibActual, cbActual;
+   *pcbRead = 0;
+   DosRequestMutexSem(pFile->hmtx, SEM_INDEFINITE_WAIT);
+   rc = DosSetFilePtr(pFile->h, ibPos, FILE_BEGIN, &ibActual);
+   for ( ; !rc && cVecs; cVecs--, paVecs++) {
+      rc = DosRead(pFile->h, paVecs->pabBuffer, paVecs->cbLength,
+         &cbActual);
+      if (rc) break;
+      *pcbRead += cbActual;
+      if (cbActual != paVecs->cbLength) break;
+   }
+   DosReleaseMutexSem(pFile->hmtx);
+   return os2sys(rc);
+}
+
+
+SysResult sysWriteFileV(File * pFile, FilePos ibPos,
+   unsigned int cVecs, SysIOVec * paVecs, FilePos * pcbWritten)
+{
+   APIRET rc;
+   ULONG ibActual, cbActual;
+   *pcbWritten = 0;
+   DosRequestMutexSem(pFile->hmtx, SEM_INDEFINITE_WAIT);
+   rc = DosSetFilePtr(pFile->h, ibPos, FILE_BEGIN, &ibActual);
+   for ( ; !rc && cVecs; cVecs--, paVecs++) {
+      rc = DosWrite(pFile->h, paVecs->pabBuffer, paVecs->cbLength,
+         &cbActual);
+      if (rc) break;
+      *pcbWritten += cbActual;
+      if (cbActual != paVecs->cbLength) break;
+   }
+   DosReleaseMutexSem(pFile->hmtx);
+   return os2sys(rc);
+}
+
+
+SysResult sysCreateIORing(unsigned int cEntries, SysIORing * * ppRing)
+{
+   *ppRing = 0;
+   return SYS_UNKNOWN;
+}
+
+
+void sysDestroyIORing(SysIORing * pRing)
+{
+}
+
+
+SysResult sysSubmitIOBatch(SysIORing * pRing, unsigned int cRequests,
+   SysIORequest * paRequests)
+{
+   SysResult srFirst = SYS_OK;
+   SysIORequest * pReq;
+   for ( ; cRequests; cRequests--, paRequests++) {
+      pReq = paRequests;
+      pReq->sr = pReq->fWrite
+         ? sysWriteFileV(pReq->pFile, pReq->ibPos, pReq->cVecs,
+              pReq->paVecs, &pReq->cbDone)
+         : sysReadFileV(pReq->pFile, pReq->ibPos, pReq->cVecs,
+              pReq->paVecs, &pReq->cbDone);
+      if (pReq->sr && !srFirst) srFirst = pReq->sr;
+   }
+   return srFirst;
+}
+
+
 SysResult sysSetFileSize(File * pFile, FilePos cbSize)
 {
    return os2sys(DosSetFileSize(pFile->h, cbSize));
@@ -245,6 +360,94 @@ int cSecureAlloced;
 int cSecureFreed;
 
 
+SysResult sysOpenDir(char * pszName, int flFlags, Cred cred,
+    SysDir * * ppDir)
+{
+   SysDir * pDir;
+   int cch = strlen(pszName);
+   *ppDir = 0;
+   if (cch + 2 > CCHMAXPATH) return SYS_INVALID_PARAMETER;
+   pDir = malloc(sizeof(SysDir));
+   if (!pDir) return SYS_NOT_ENOUGH_MEMORY;
+   strcpy(pDir->szPath, pszName);
+   if (cch && pszName[cch - 1] != '\\' && pszName[cch - 1] != '/' &&
+       pszName[cch - 1] != ':')
+      strcat(pDir->szPath, "\\");
+   *ppDir = pDir;
+   return SYS_OK;
+}
+
+
+SysResult sysCloseDir(SysDir * pDir)
+{
+   free(pDir);
+   return SYS_OK;
+}
+
+
+static bool makePathIn(SysDir * pDir, char * pszName, char * pszPath)
+{
+   if (strlen(pDir->szPath) + strlen(pszName) >= CCHMAXPATH)
+      return false;
+   strcpy(pszPath, pDir->szPath);
+   strcat(pszPath, pszName);
+   return true;
+}
+
+
+SysResult sysOpenFileAt(SysDir * pDir, char * pszName, int flFlags,
+    Cred cred, File * * ppFile)
+{
+   char szPath[CCHMAXPATH];
+   *ppFile = 0;
+   if (!makePathIn(pDir, pszName, szPath)) return SYS_INVALID_PARAMETER;
+   return sysOpenFile(szPath, flFlags, cred, ppFile);
+}
+
+
+SysResult sysCreateFileAt(SysDir * pDir, char * pszName, int flFlags,
+    FilePos cbInitialSize, Cred cred, File * * ppFile)
+{
+   char szPath[CCHMAXPATH];
+   *ppFile = 0;
+   if (!makePathIn(pDir, pszName, szPath)) return SYS_INVALID_PARAMETER;
+   return sysCreateFile(szPath, flFlags, cbInitialSize, cred, ppFile);
+}
+
+
+SysResult sysDeleteFileAt(SysDir * pDir, char * pszName,
+    bool fFastDelete, Cred cred)
+{
+   char szPath[CCHMAXPATH];
+   if (!makePathIn(pDir, pszName, szPath)) return SYS_INVALID_PARAMETER;
+   return sysDeleteFile(szPath, fFastDelete, cred);
+}
+
+
+SysResult sysCreateDirAt(SysDir * pDir, char * pszName, Cred cred)
+{
+   char szPath[CCHMAXPATH];
+   APIRET rc;
+   FILESTATUS3 info;
+   if (!makePathIn(pDir, pszName, szPath)) return SYS_INVALID_PARAMETER;
+   rc = DosCreateDir((PSZ) szPath, 0);
+   /* DosCreateDir() says "access denied" if the directory exists. */
+   if (rc == ERROR_ACCESS_DENIED &&
+       !DosQueryPathInfo((PSZ) szPath, FIL_STANDARD, &info, sizeof(info)))
+      return SYS_FILE_EXISTS;
+   return os2sys(rc);
+}
+
+
+unsigned int sysQueryMaxOpenFiles()
+{
+   LONG cReqCount = 0;
+   ULONG cCurMaxFH;
+   if (DosSetRelMaxFH(&cReqCount, &cCurMaxFH)) return 0;
+   return cCurMaxFH;
+}
+
+
 void * sysAllocSecureMem(int cbSize)
 {
    /* not thread safe! */
@@ -278,12 +481,169 @@ void sysFreeSecureMem(void * pMem)
 }
 
 
+void * sysAllocPool(unsigned int cbSize, unsigned int flFlags)
+{
+   void * pMem;
+   /* Locking and huge pages are not supported. */
+   if (DosAllocMem(&pMem, cbSize, PAG_COMMIT | PAG_READ | PAG_WRITE))
+      return 0;
+   return pMem;
+}
+
+
+void sysFreePool(void * pMem, unsigned int cbSize)
+{
+   wipe((uint32 *) pMem, cbSize); /* burn */
+   DosFreeMem(pMem);
+}
+
+
+SysResult sysQueryMemoryPressure(unsigned int * pnPressure)
+{
+   *pnPressure = 0;
+   return SYS_UNKNOWN;
+}
+
+
 void sysLockMem()
 {
    fprintf(stderr, "locking is NOT available!\n");
 }
 
 
+static void threadMain(void * arg)
+{
+   SysThread * pThread = arg;
+   pThread->pFunc(pThread->pArg);
+}
+
+
+SysResult sysCreateThread(void (* pFunc)(void * pArg), void * pArg,
+   SysThread * * ppThread)
+{
+   SysThread * pThread;
+   int tid;
+
+   *ppThread = 0;
+   
+   pThread = malloc(sizeof(SysThread));
+   if (!pThread) return SYS_NOT_ENOUGH_MEMORY;
+   pThread->pFunc = pFunc;
+   pThread->pArg = pArg;
+
+   tid = _beginthread(threadMain, 0, 65536, pThread);
+   if (tid == -1) {
+      free(pThread);
+      return SYS_UNKNOWN;
+   }
+   pThread->tid = tid;
+
+   *ppThread = pThread;
+   return SYS_OK;
+}
+
+
+void sysJoinThread(SysThread * pThread)
+{
+   DosWaitThread(&pThread->tid, DCWW_WAIT);
+   free(pThread);
+}
+
+
+SysResult sysCreateMutex(SysMutex * * ppMutex)
+{
+   APIRET rc;
+   *ppMutex = malloc(sizeof(SysMutex));
+   if (!*ppMutex) return SYS_NOT_ENOUGH_MEMORY;
+   if (rc = DosCreateMutexSem(0, &(*ppMutex)->hmtx, 0, FALSE)) {
+      free(*ppMutex);
+      *ppMutex = 0;
+      return os2sys(rc);
+   }
+   return SYS_OK;
+}
+
+
+void sysDestroyMutex(SysMutex * pMutex)
+{
+   DosCloseMutexSem(pMutex->hmtx);
+   free(pMutex);
+}
+
+
+void sysLockMutex(SysMutex * pMutex)
+{
+   DosRequestMutexSem(pMutex->hmtx, SEM_INDEFINITE_WAIT);
+}
+
+
+void sysUnlockMutex(SysMutex * pMutex)
+{
+   DosReleaseMutexSem(pMutex->hmtx);
+}
+
+
+SysResult sysCreateCond(SysCond * * ppCond)
+{
+   APIRET rc;
+   *ppCond = malloc(sizeof(SysCond));
+   if (!*ppCond) return SYS_NOT_ENOUGH_MEMORY;
+   if (rc = DosCreateEventSem(0, &(*ppCond)->hev, 0, FALSE)) {
+      free(*ppCond);
+      *ppCond = 0;
+      return os2sys(rc);
+   }
+   return SYS_OK;
+}
+
+
+void sysDestroyCond(SysCond * pCond)
+{
+   DosCloseEventSem(pCond->hev);
+   free(pCond);
+}
+
+
+void sysWaitCond(SysCond * pCond, SysMutex * pMutex,
+   unsigned int msTimeout)
+{
+   ULONG cPosts;
+   DosResetEventSem(pCond->hev, &cPosts);
+   DosReleaseMutexSem(pMutex->hmtx);
+   DosWaitEventSem(pCond->hev,
+      msTimeout ? msTimeout : SEM_INDEFINITE_WAIT);
+   DosRequestMutexSem(pMutex->hmtx, SEM_INDEFINITE_WAIT);
+}
+
+
+void sysSignalCond(SysCond * pCond)
+{
+   DosPostEventSem(pCond->hev);
+}
+
+
+/* Other threads are suspended while pFunc runs, which is fine for
+   the short initialisations this is used for. */
+void sysCallOnce(bool * pfDone, void (* pFunc)(void))
+{
+   if (*(volatile bool *) pfDone) return;
+   DosEnterCritSec();
+   if (!*pfDone) {
+      pFunc();
+      *(volatile bool *) pfDone = true;
+   }
+   DosExitCritSec();
+}
+
+
+uint32 sysQueryMilliseconds()
+{
+   ULONG ms;
+   DosQuerySysInfo(QSV_MS_COUNT, QSV_MS_COUNT, &ms, sizeof(ms));
+   return ms;
+}
+
+
 /* The following PRNG (BSD) is not very good, cryptographically, but
    then we don't really need cryptographically strong PRNs yet.  */
 
@@ -21,6 +21,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <assert.h>
 #include <unistd.h>
@@ -28,12 +29,24 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#ifdef HAVE_FLOCK
+#include <sys/file.h>
+#endif
+#include <limits.h>
+#include <pthread.h>
 #ifdef HAVE_SETFSUID
 #include <sys/fsuid.h>
 #endif
-#ifdef HAVE_MLOCKALL
+#if defined(HAVE_MLOCKALL) || defined(HAVE_MMAP) || defined(ENABLE_IO_URING)
 #include <sys/mman.h>
 #endif
+#ifdef ENABLE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 
 #ifndef O_BINARY
@@ -42,6 +55,13 @@
 #ifndef O_SYNC
 #define O_SYNC 0
 #endif
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+
+#if defined(HAVE_OPENAT) && defined(HAVE_UNLINKAT) && defined(HAVE_MKDIRAT)
+#define USE_AT_FUNCS
+#endif
 
 
 struct _File {
@@ -49,6 +69,57 @@ struct _File {
 };
 
 
+struct _SysDir {
+      int h;
+#ifndef USE_AT_FUNCS
+      char szPath[PATH_MAX + 1]; /* ends in a slash */
+#endif
+};
+
+
+struct _SysIORing {
+#ifdef ENABLE_IO_URING
+      int fd;
+      unsigned int cEntries;
+      
+      /* The submission queue ring and its entries. */
+      void * pSQRing;
+      size_t cbSQRing;
+      unsigned int * pSQHead, * pSQTail, * pSQMask, * paSQArray;
+      struct io_uring_sqe * paSQEs;
+      size_t cbSQEs;
+
+      /* The completion queue ring.  It may share the mapping of the
+         submission queue ring. */
+      void * pCQRing;
+      size_t cbCQRing;
+      unsigned int * pCQHead, * pCQTail, * pCQMask;
+      struct io_uring_cqe * paCQEs;
+
+      /* The kernel's view of the buffers of the requests in flight. */
+      struct iovec * paiov;
+      unsigned int ciov;
+#endif
+};
+
+
+struct _SysThread {
+      pthread_t thread;
+      void (* pFunc)(void * pArg);
+      void * pArg;
+};
+
+
+struct _SysMutex {
+      pthread_mutex_t mutex;
+};
+
+
+struct _SysCond {
+      pthread_cond_t cond;
+};
+
+
 static SysResult unix2sys()
 {
    switch (errno) {
@@ -60,6 +131,8 @@ static SysResult unix2sys()
       case EEXIST: return SYS_FILE_EXISTS;
       case EINVAL: return SYS_INVALID_PARAMETER;
       case EROFS: return SYS_ROFS;
+      case EMFILE: return SYS_TOO_MANY_FILES;
+      case ENFILE: return SYS_TOO_MANY_FILES;
       default: return SYS_UNKNOWN;
    }
 }
@@ -112,8 +185,41 @@ static int canAccess(uid_t uid, gid_t gid, Cred cred)
 #endif
 
 
-SysResult sysOpenFile(char * pszName, int flFlags, Cred cred, 
-    File * * ppFile)
+/* Open pszName in pDir, or relative to the current directory if pDir
+   is 0. */
+static int openIn(SysDir * pDir, char * pszName, int f, int pmode)
+{
+#ifndef USE_AT_FUNCS
+   char szPath[PATH_MAX + 1];
+#endif
+   if (!pDir) return open(pszName, f, pmode);
+#ifdef USE_AT_FUNCS
+   return openat(pDir->h, pszName, f, pmode);
+#else
+   if (strlen(pDir->szPath) + strlen(pszName) > PATH_MAX) {
+      errno = ENAMETOOLONG;
+      return -1;
+   }
+   strcpy(szPath, pDir->szPath);
+   strcat(szPath, pszName);
+   return open(szPath, f, pmode);
+#endif
+}
+
+
+/* Lock a file that has been opened in pDir, unless the lock on the
+   directory covers it. */
+static SysResult lockIn(SysDir * pDir, int h, int flFlags)
+{
+#ifdef HAVE_FLOCK
+   if (pDir) return SYS_OK;
+#endif
+   return lock(h, flFlags);
+}
+
+
+static SysResult openFile(SysDir * pDir, char * pszName, int flFlags,
+   Cred cred, File * * ppFile)
 {
    int h;
    int f = makeUnixFlags(flFlags);
@@ -136,7 +242,7 @@ SysResult sysOpenFile(char * pszName, int flFlags, Cred cred,
    }
 #endif
 
-   h = open(pszName, f, pmode);
+   h = openIn(pDir, pszName, f, pmode);
 #ifdef HAVE_SETFSUID
    if (cred.fEnforce) {
       setfsuid(euid); setfsgid(egid);
@@ -161,7 +267,7 @@ SysResult sysOpenFile(char * pszName, int flFlags, Cred cred,
    }
 #endif
 
-   if (sr = lock(h, flFlags)) {
+   if (sr = lockIn(pDir, h, flFlags)) {
       close(h);
       return sr;
    }
@@ -178,8 +284,22 @@ SysResult sysOpenFile(char * pszName, int flFlags, Cred cred,
 }
 
 
-SysResult sysCreateFile(char * pszName, int flFlags, 
-    FilePos cbInitialSize, Cred cred, File * * ppFile)
+SysResult sysOpenFile(char * pszName, int flFlags, Cred cred, 
+    File * * ppFile)
+{
+   return openFile(0, pszName, flFlags, cred, ppFile);
+}
+
+
+SysResult sysOpenFileAt(SysDir * pDir, char * pszName, int flFlags,
+    Cred cred, File * * ppFile)
+{
+   return openFile(pDir, pszName, flFlags, cred, ppFile);
+}
+
+
+static SysResult createFile(SysDir * pDir, char * pszName, int flFlags,
+   FilePos cbInitialSize, Cred cred, File * * ppFile)
 {
    int h;
    int f = makeUnixFlags(flFlags);
@@ -211,7 +331,7 @@ SysResult sysCreateFile(char * pszName, int flFlags,
 
    if (cred.fEnforce) umask(0077);
 
-   h = open(pszName, f, pmode);
+   h = openIn(pDir, pszName, f, pmode);
 #ifdef HAVE_SETFSUID
    if (cred.fEnforce) {
       setfsuid(euid); setfsgid(egid);
@@ -232,7 +352,7 @@ SysResult sysCreateFile(char * pszName, int flFlags,
       }
    }
 
-   if (sr = lock(h, flFlags)) {
+   if (sr = lockIn(pDir, h, flFlags)) {
       close(h);
       return sr;
    }
@@ -249,6 +369,20 @@ SysResult sysCreateFile(char * pszName, int flFlags,
 }
 
 
+SysResult sysCreateFile(char * pszName, int flFlags, 
+    FilePos cbInitialSize, Cred cred, File * * ppFile)
+{
+   return createFile(0, pszName, flFlags, cbInitialSize, cred, ppFile);
+}
+
+
+SysResult sysCreateFileAt(SysDir * pDir, char * pszName, int flFlags,
+    FilePos cbInitialSize, Cred cred, File * * ppFile)
+{
+   return createFile(pDir, pszName, flFlags, cbInitialSize, cred, ppFile);
+}
+
+
 SysResult sysCloseFile(File * pFile)
 {
    int h = pFile->h;
@@ -299,6 +433,350 @@ SysResult sysWriteToFile(File * pFile, FilePos cbLength,
 }
 
 
+/* At most this many buffers are passed to the kernel at once. */
+#if !defined(IOV_MAX) || IOV_MAX > 1024
+#undef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#if !defined(HAVE_PREADV) || !defined(HAVE_PWRITEV)
+/* Without positional I/O, seeking and transferring must not be
+   interleaved with other threads doing the same. */
+static pthread_mutex_t filePosLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static SysResult transferFileV(File * pFile, FilePos ibPos,
+   unsigned int cVecs, SysIOVec * paVecs, FilePos * pcbDone,
+   bool fWrite)
+{
+   struct iovec aiov[IOV_MAX];
+   unsigned int iVec = 0, c;
+   FilePos ibVec = 0, cbLeft;
+   ssize_t r;
+
+   *pcbDone = 0;
+
+   while (iVec < cVecs) {
+
+      /* Describe the remaining buffers to the kernel; the first one
+         may have been partially transferred already. */
+      for (c = 0; c < IOV_MAX && iVec + c < cVecs; c++) {
+         aiov[c].iov_base = paVecs[iVec + c].pabBuffer;
+         aiov[c].iov_len = paVecs[iVec + c].cbLength;
+      }
+      aiov[0].iov_base = (octet *) aiov[0].iov_base + ibVec;
+      aiov[0].iov_len -= ibVec;
+
+#if defined(HAVE_PREADV) && defined(HAVE_PWRITEV)
+      r = fWrite
+         ? pwritev(pFile->h, aiov, c, ibPos)
+         : preadv(pFile->h, aiov, c, ibPos);
+#else
+      pthread_mutex_lock(&filePosLock);
+      r = lseek(pFile->h, ibPos, SEEK_SET);
+      if (r != -1)
+         r = fWrite
+            ? writev(pFile->h, aiov, c)
+            : readv(pFile->h, aiov, c);
+      pthread_mutex_unlock(&filePosLock);
+#endif
+      if (r == -1) {
+         if (errno == EINTR) continue;
+         return unix2sys();
+      }
+      if (r == 0) break;
+
+      ibPos += r;
+      *pcbDone += r;
+
+      /* Skip over the buffers that are done. */
+      while (r && iVec < cVecs) {
+         cbLeft = paVecs[iVec].cbLength - ibVec;
+         if (r < cbLeft) {
+            ibVec += r;
+            r = 0;
+         } else {
+            r -= cbLeft;
+            iVec++;
+            ibVec = 0;
+         }
+      }
+   }
+   
+   return SYS_OK;
+}
+
+
+SysResult sysReadFileV(File * pFile, FilePos ibPos,
+   unsigned int cVecs, SysIOVec * paVecs, FilePos * pcbRead)
+{
+   return transferFileV(pFile, ibPos, cVecs, paVecs, pcbRead, false);
+}
+
+
+SysResult sysWriteFileV(File * pFile, FilePos ibPos,
+   unsigned int cVecs, SysIOVec * paVecs, FilePos * pcbWritten)
+{
+   return transferFileV(pFile, ibPos, cVecs, paVecs, pcbWritten, true);
+}
+
+
+SysResult sysCreateIORing(unsigned int cEntries, SysIORing * * ppRing)
+{
+#ifdef ENABLE_IO_URING
+   struct io_uring_params params;
+   SysIORing * pRing;
+   SysResult sr;
+
+   *ppRing = 0;
+
+   pRing = calloc(1, sizeof(SysIORing));
+   if (!pRing) return SYS_NOT_ENOUGH_MEMORY;
+
+   memset(&params, 0, sizeof(params));
+   pRing->fd = syscall(__NR_io_uring_setup, cEntries, &params);
+   if (pRing->fd == -1) {
+      sr = unix2sys();
+      free(pRing);
+      return sr;
+   }
+   pRing->cEntries = params.sq_entries;
+
+   /* Map the rings and the submission queue entries. */
+   pRing->cbSQRing = params.sq_off.array +
+      params.sq_entries * sizeof(unsigned int);
+   pRing->cbCQRing = params.cq_off.cqes +
+      params.cq_entries * sizeof(struct io_uring_cqe);
+   if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      if (pRing->cbCQRing > pRing->cbSQRing)
+         pRing->cbSQRing = pRing->cbCQRing;
+      pRing->cbCQRing = 0;
+   }
+   pRing->cbSQEs = params.sq_entries * sizeof(struct io_uring_sqe);
+
+   pRing->pSQRing = mmap(0, pRing->cbSQRing, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, pRing->fd, IORING_OFF_SQ_RING);
+   pRing->pCQRing = pRing->cbCQRing
+      ? mmap(0, pRing->cbCQRing, PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE, pRing->fd, IORING_OFF_CQ_RING)
+      : pRing->pSQRing;
+   pRing->paSQEs = mmap(0, pRing->cbSQEs, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, pRing->fd, IORING_OFF_SQES);
+   if (pRing->pSQRing == MAP_FAILED || pRing->pCQRing == MAP_FAILED ||
+       pRing->paSQEs == MAP_FAILED)
+   {
+      sr = unix2sys();
+      if (pRing->pSQRing == MAP_FAILED) pRing->pSQRing = 0;
+      if (pRing->pCQRing == MAP_FAILED) pRing->pCQRing = 0;
+      if (pRing->paSQEs == MAP_FAILED) pRing->paSQEs = 0;
+      sysDestroyIORing(pRing);
+      return sr;
+   }
+
+   pRing->pSQHead = (unsigned int *)
+      ((octet *) pRing->pSQRing + params.sq_off.head);
+   pRing->pSQTail = (unsigned int *)
+      ((octet *) pRing->pSQRing + params.sq_off.tail);
+   pRing->pSQMask = (unsigned int *)
+      ((octet *) pRing->pSQRing + params.sq_off.ring_mask);
+   pRing->paSQArray = (unsigned int *)
+      ((octet *) pRing->pSQRing + params.sq_off.array);
+   pRing->pCQHead = (unsigned int *)
+      ((octet *) pRing->pCQRing + params.cq_off.head);
+   pRing->pCQTail = (unsigned int *)
+      ((octet *) pRing->pCQRing + params.cq_off.tail);
+   pRing->pCQMask = (unsigned int *)
+      ((octet *) pRing->pCQRing + params.cq_off.ring_mask);
+   pRing->paCQEs = (struct io_uring_cqe *)
+      ((octet *) pRing->pCQRing + params.cq_off.cqes);
+
+   *ppRing = pRing;
+   return SYS_OK;
+#else
+   *ppRing = 0;
+   return SYS_UNKNOWN;
+#endif
+}
+
+
+void sysDestroyIORing(SysIORing * pRing)
+{
+#ifdef ENABLE_IO_URING
+   if (pRing->paSQEs) munmap(pRing->paSQEs, pRing->cbSQEs);
+   if (pRing->cbCQRing && pRing->pCQRing)
+      munmap(pRing->pCQRing, pRing->cbCQRing);
+   if (pRing->pSQRing) munmap(pRing->pSQRing, pRing->cbSQRing);
+   close(pRing->fd);
+   free(pRing->paiov);
+#endif
+   free(pRing);
+}
+
+
+static void transferRequest(SysIORequest * pReq)
+{
+   pReq->sr = transferFileV(pReq->pFile, pReq->ibPos,
+      pReq->cVecs, pReq->paVecs, &pReq->cbDone, pReq->fWrite);
+}
+
+
+#ifdef ENABLE_IO_URING
+/* Store the outcome of the completed requests in the ring, and
+   return how many there were. */
+static unsigned int reapCompletions(SysIORing * pRing,
+   SysIORequest * paRequests)
+{
+   struct io_uring_cqe * pCQE;
+   SysIORequest * pReq;
+   unsigned int iHead, cDone = 0;
+
+   iHead = *pRing->pCQHead;
+   while (iHead != __atomic_load_n(pRing->pCQTail, __ATOMIC_ACQUIRE)) {
+      pCQE = &pRing->paCQEs[iHead & *pRing->pCQMask];
+      pReq = &paRequests[pCQE->user_data];
+      if (pCQE->res < 0) {
+         errno = -pCQE->res;
+         pReq->sr = unix2sys();
+      } else
+         pReq->cbDone = pCQE->res;
+      iHead++;
+      cDone++;
+   }
+   __atomic_store_n(pRing->pCQHead, iHead, __ATOMIC_RELEASE);
+
+   return cDone;
+}
+
+
+/* Submit up to cEntries requests to the ring and wait for them to
+   complete.  If the ring fails, the requests that the kernel has
+   taken are still waited for, and the others are taken back; the
+   number taken is stored in *pcSubmitted (on success, all of them),
+   and the caller has to do the rest itself. */
+static SysResult submitToRing(SysIORing * pRing,
+   unsigned int cRequests, SysIORequest * paRequests,
+   unsigned int * pcSubmitted)
+{
+   struct io_uring_sqe * pSQE;
+   SysIORequest * pReq;
+   unsigned int i, j, ciov, iFirst, iTail, cSubmitted, cDone;
+   FilePos cbTotal;
+   SysResult sr = SYS_OK;
+   int r;
+
+   *pcSubmitted = 0;
+
+   /* Translate the buffers. */
+   for (i = 0, ciov = 0; i < cRequests; i++)
+      ciov += paRequests[i].cVecs;
+   if (ciov > pRing->ciov) {
+      free(pRing->paiov);
+      pRing->paiov = malloc(ciov * sizeof(struct iovec));
+      pRing->ciov = pRing->paiov ? ciov : 0;
+      if (!pRing->paiov) return SYS_NOT_ENOUGH_MEMORY;
+   }
+
+   iFirst = iTail = *pRing->pSQTail;
+   for (i = 0, ciov = 0; i < cRequests; i++) {
+      pReq = &paRequests[i];
+      for (j = 0; j < pReq->cVecs; j++) {
+         pRing->paiov[ciov + j].iov_base = pReq->paVecs[j].pabBuffer;
+         pRing->paiov[ciov + j].iov_len = pReq->paVecs[j].cbLength;
+      }
+      pSQE = &pRing->paSQEs[iTail & *pRing->pSQMask];
+      memset(pSQE, 0, sizeof(*pSQE));
+      pSQE->opcode = pReq->fWrite ? IORING_OP_WRITEV : IORING_OP_READV;
+      pSQE->fd = pReq->pFile->h;
+      pSQE->off = pReq->ibPos;
+      pSQE->addr = (unsigned long) &pRing->paiov[ciov];
+      pSQE->len = pReq->cVecs;
+      pSQE->user_data = i;
+      pRing->paSQArray[iTail & *pRing->pSQMask] =
+         iTail & *pRing->pSQMask;
+      iTail++;
+      ciov += pReq->cVecs;
+      pReq->sr = SYS_OK;
+      pReq->cbDone = 0;
+   }
+   __atomic_store_n(pRing->pSQTail, iTail, __ATOMIC_RELEASE);
+
+   /* Submit everything and reap the completions.  The kernel takes
+      the entries in order, so the first cSubmitted requests are the
+      ones it has.  Interruptions and temporary shortages are tried
+      again (after reaping, which is what EBUSY asks for); anything
+      else is given up on. */
+   for (cSubmitted = 0, cDone = 0; cDone < cRequests; ) {
+
+      r = syscall(__NR_io_uring_enter, pRing->fd,
+         cRequests - cSubmitted, cRequests - cDone,
+         IORING_ENTER_GETEVENTS, 0, 0);
+      cSubmitted = __atomic_load_n(pRing->pSQHead, __ATOMIC_ACQUIRE) -
+         iFirst;
+      if (r == -1 && errno != EINTR && errno != EAGAIN &&
+          errno != EBUSY)
+      {
+         sr = unix2sys();
+         break;
+      }
+
+      cDone += reapCompletions(pRing, paRequests);
+   }
+
+   if (sr) {
+      /* Take back the entries that the kernel hasn't taken.  The
+         requests it has taken complete without our help, and their
+         buffers are in use until then, so wait for them by watching
+         the completion queue. */
+      __atomic_store_n(pRing->pSQTail, iFirst + cSubmitted,
+         __ATOMIC_RELEASE);
+      while ((cDone += reapCompletions(pRing, paRequests)) < cSubmitted)
+         usleep(1000);
+   }
+
+   /* The kernel may transfer less than asked for; finish those the
+      slow way (a short read is usually the end of the file, though). */
+   for (i = 0; i < cSubmitted; i++) {
+      pReq = &paRequests[i];
+      for (j = 0, cbTotal = 0; j < pReq->cVecs; j++)
+         cbTotal += pReq->paVecs[j].cbLength;
+      if (!pReq->sr && pReq->cbDone < cbTotal)
+         transferRequest(pReq);
+   }
+
+   *pcSubmitted = cSubmitted;
+   return sr;
+}
+#endif
+
+
+SysResult sysSubmitIOBatch(SysIORing * pRing, unsigned int cRequests,
+   SysIORequest * paRequests)
+{
+   unsigned int i = 0;
+   
+#ifdef ENABLE_IO_URING
+   unsigned int c, cSubmitted;
+   for ( ; pRing && i < cRequests; i += c) {
+      c = cRequests - i;
+      if (c > pRing->cEntries) c = pRing->cEntries;
+      if (submitToRing(pRing, c, paRequests + i, &cSubmitted)) {
+         i += cSubmitted;
+         break;
+      }
+   }
+#endif
+
+   /* Without a ring, or if the ring failed. */
+   for ( ; i < cRequests; i++)
+      transferRequest(&paRequests[i]);
+
+   for (i = 0; i < cRequests; i++)
+      if (paRequests[i].sr) return paRequests[i].sr;
+
+   return SYS_OK;
+}
+
+
 SysResult sysSetFileSize(File * pFile, FilePos cbSize)
 {
    struct stat s;
@@ -354,6 +832,180 @@ SysResult sysFileExists(char * pszName, bool * pfExists)
 }
 
 
+SysResult sysOpenDir(char * pszName, int flFlags, Cred cred,
+    SysDir * * ppDir)
+{
+   SysDir * pDir;
+   int euid = 0, egid = 0;
+   int h;
+#ifdef HAVE_FLOCK
+   int op;
+#endif
+
+   *ppDir = 0;
+
+#ifdef HAVE_FLOCK
+   switch (flFlags & SOF_SHMASK) {
+      case SOF_DENYALL: op = LOCK_EX; break;
+      case SOF_DENYWRITE: op = LOCK_SH; break;
+      case SOF_DENYNONE: op = 0; break;
+      default: return SYS_INVALID_PARAMETER;
+   }
+#endif
+
+#ifndef USE_AT_FUNCS
+   if (strlen(pszName) + 1 > PATH_MAX) return SYS_INVALID_PARAMETER;
+#endif
+
+#ifdef HAVE_SETFSUID
+   if (cred.fEnforce) {
+      euid = geteuid(); egid = getegid();
+      setfsuid(cred.uid); setfsgid(cred.gid);
+   }
+#endif
+
+   h = open(*pszName ? pszName : ".", O_RDONLY | O_DIRECTORY);
+#ifdef HAVE_SETFSUID
+   if (cred.fEnforce) {
+      setfsuid(euid); setfsgid(egid);
+   }
+#endif
+   if (h == -1) return unix2sys();
+
+#ifdef HAVE_FLOCK
+   if (op && flock(h, op | LOCK_NB) == -1) {
+      SysResult sr = errno == EWOULDBLOCK ? SYS_LOCKED : unix2sys();
+      close(h);
+      return sr;
+   }
+#endif
+
+   pDir = malloc(sizeof(SysDir));
+   if (!pDir) {
+      close(h);
+      return SYS_NOT_ENOUGH_MEMORY;
+   }
+   pDir->h = h;
+#ifndef USE_AT_FUNCS
+   strcpy(pDir->szPath, pszName);
+   if (*pszName && pszName[strlen(pszName) - 1] != '/')
+      strcat(pDir->szPath, "/");
+#endif
+
+   *ppDir = pDir;
+   return SYS_OK;
+}
+
+
+SysResult sysCloseDir(SysDir * pDir)
+{
+   int h = pDir->h;
+   free(pDir);
+   if (close(h) == -1) return unix2sys();
+   return SYS_OK;
+}
+
+
+SysResult sysDeleteFileAt(SysDir * pDir, char * pszName,
+    bool fFastDelete, Cred cred)
+{
+   int euid = 0, egid = 0;
+   int r;
+#ifndef USE_AT_FUNCS
+   char szPath[PATH_MAX + 1];
+#endif
+
+#ifdef HAVE_SETFSUID
+   if (cred.fEnforce) {
+      euid = geteuid(); egid = getegid();
+      setfsuid(cred.uid); setfsgid(cred.gid);
+   }
+#endif
+
+#ifdef USE_AT_FUNCS
+   r = unlinkat(pDir->h, pszName, 0);
+#else
+   if (strlen(pDir->szPath) + strlen(pszName) > PATH_MAX) {
+      errno = ENAMETOOLONG;
+      r = -1;
+   } else {
+      strcpy(szPath, pDir->szPath);
+      strcat(szPath, pszName);
+      r = unlink(szPath);
+   }
+#endif
+
+#ifdef HAVE_SETFSUID
+   if (cred.fEnforce) {
+      setfsuid(euid); setfsgid(egid);
+   }
+#endif
+
+   return r == -1 ? unix2sys() : SYS_OK;
+}
+
+
+SysResult sysCreateDirAt(SysDir * pDir, char * pszName, Cred cred)
+{
+   int euid = 0, egid = 0;
+   int r;
+#ifndef USE_AT_FUNCS
+   char szPath[PATH_MAX + 1];
+#endif
+
+#ifdef HAVE_SETFSUID
+   if (cred.fEnforce) {
+      euid = geteuid(); egid = getegid();
+      setfsuid(cred.uid); setfsgid(cred.gid);
+   }
+#endif
+
+#ifdef USE_AT_FUNCS
+   r = mkdirat(pDir->h, pszName, 0700);
+#else
+   if (strlen(pDir->szPath) + strlen(pszName) > PATH_MAX) {
+      errno = ENAMETOOLONG;
+      r = -1;
+   } else {
+      strcpy(szPath, pDir->szPath);
+      strcat(szPath, pszName);
+      r = mkdir(szPath, 0700);
+   }
+#endif
+
+#ifdef HAVE_SETFSUID
+   if (cred.fEnforce) {
+      setfsuid(euid); setfsgid(egid);
+   }
+#endif
+
+   if (r == -1) return unix2sys();
+
+#if !defined(HAVE_SETFSUID) && defined(HAVE_CHOWN)
+   if (cred.fEnforce) {
+#ifdef USE_AT_FUNCS
+      r = fchownat(pDir->h, pszName, cred.uid, cred.gid, 0);
+#else
+      r = chown(szPath, cred.uid, cred.gid);
+#endif
+      if (r == -1) return unix2sys();
+   }
+#endif
+
+   return SYS_OK;
+}
+
+
+unsigned int sysQueryMaxOpenFiles()
+{
+   struct rlimit limit;
+   if (getrlimit(RLIMIT_NOFILE, &limit) == -1) return 0;
+   if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > UINT_MAX)
+      return UINT_MAX;
+   return limit.rlim_cur;
+}
+
+
 void * sysAllocSecureMem(int cbSize)
 {
    /* !!! Use mlock if available? */
@@ -367,6 +1019,99 @@ void sysFreeSecureMem(void * pMem)
 }
 
 
+void * sysAllocPool(unsigned int cbSize, unsigned int flFlags)
+{
+   void * pMem;
+#ifdef HAVE_MMAP
+   pMem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+   /* Explicit huge pages only work if the administrator has reserved
+      some, so fall back to normal pages. */
+   if ((flFlags & SAP_HUGEPAGES) && (cbSize % (2 << 20) == 0))
+      pMem = mmap(0, cbSize, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+   if (pMem == MAP_FAILED) {
+      pMem = mmap(0, cbSize, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (pMem == MAP_FAILED) return 0;
+#if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+      if (flFlags & SAP_HUGEPAGES)
+         madvise(pMem, cbSize, MADV_HUGEPAGE);
+#endif
+   }
+#else
+   pMem = malloc(cbSize);
+   if (!pMem) return 0;
+#endif
+#ifdef HAVE_MLOCK
+   if ((flFlags & SAP_LOCK) && mlock(pMem, cbSize) == -1)
+      fprintf(stderr, "cannot lock memory!\n");
+#endif
+   return pMem;
+}
+
+
+void sysFreePool(void * pMem, unsigned int cbSize)
+{
+   memset(pMem, 0, cbSize); /* burn */
+#ifdef HAVE_MMAP
+   munmap(pMem, cbSize);
+#else
+   free(pMem);
+#endif
+}
+
+
+/* Read the "some" line of a Linux PSI file: "some avg10=1.23 ...". */
+static SysResult readPressureFile(char * pszFile,
+   unsigned int * pnPressure)
+{
+   FILE * f;
+   unsigned int nInt, nFrac;
+   int c;
+
+   f = fopen(pszFile, "r");
+   if (!f) return SYS_FILE_NOT_FOUND;
+   c = fscanf(f, "some avg10=%u.%2u", &nInt, &nFrac);
+   fclose(f);
+   if (c != 2) return SYS_UNKNOWN;
+   *pnPressure = nInt * 100 + nFrac;
+   return SYS_OK;
+}
+
+
+/* Under cgroup v2, use the pressure of our own cgroup, so that a
+   memory limit on the cgroup is taken into account; otherwise, that
+   of the whole system. */
+SysResult sysQueryMemoryPressure(unsigned int * pnPressure)
+{
+   char szLine[PATH_MAX], szFile[PATH_MAX + 64];
+   FILE * f;
+   size_t cb;
+
+   *pnPressure = 0;
+
+   f = fopen("/proc/self/cgroup", "r");
+   if (f) {
+      while (fgets(szLine, sizeof(szLine), f))
+         if (strncmp(szLine, "0::", 3) == 0) {
+            cb = strlen(szLine);
+            if (cb && szLine[cb - 1] == '\n') szLine[cb - 1] = 0;
+            snprintf(szFile, sizeof(szFile),
+               "/sys/fs/cgroup%s/memory.pressure", szLine + 3);
+            if (!readPressureFile(szFile, pnPressure)) {
+               fclose(f);
+               return SYS_OK;
+            }
+         }
+      fclose(f);
+   }
+
+   return readPressureFile("/proc/pressure/memory", pnPressure);
+}
+
+
 void sysLockMem()
 {
 #ifdef HAVE_MLOCKALL
@@ -379,6 +1124,153 @@ void sysLockMem()
 }
 
 
+static void * threadMain(void * arg)
+{
+   SysThread * pThread = arg;
+   pThread->pFunc(pThread->pArg);
+   return 0;
+}
+
+
+SysResult sysCreateThread(void (* pFunc)(void * pArg), void * pArg,
+   SysThread * * ppThread)
+{
+   SysThread * pThread;
+
+   *ppThread = 0;
+   
+   pThread = malloc(sizeof(SysThread));
+   if (!pThread) return SYS_NOT_ENOUGH_MEMORY;
+   pThread->pFunc = pFunc;
+   pThread->pArg = pArg;
+
+   if (pthread_create(&pThread->thread, 0, threadMain, pThread)) {
+      free(pThread);
+      return SYS_UNKNOWN;
+   }
+
+   *ppThread = pThread;
+   return SYS_OK;
+}
+
+
+void sysJoinThread(SysThread * pThread)
+{
+   pthread_join(pThread->thread, 0);
+   free(pThread);
+}
+
+
+SysResult sysCreateMutex(SysMutex * * ppMutex)
+{
+   *ppMutex = malloc(sizeof(SysMutex));
+   if (!*ppMutex) return SYS_NOT_ENOUGH_MEMORY;
+   if (pthread_mutex_init(&(*ppMutex)->mutex, 0)) {
+      free(*ppMutex);
+      *ppMutex = 0;
+      return SYS_UNKNOWN;
+   }
+   return SYS_OK;
+}
+
+
+void sysDestroyMutex(SysMutex * pMutex)
+{
+   pthread_mutex_destroy(&pMutex->mutex);
+   free(pMutex);
+}
+
+
+void sysLockMutex(SysMutex * pMutex)
+{
+   pthread_mutex_lock(&pMutex->mutex);
+}
+
+
+void sysUnlockMutex(SysMutex * pMutex)
+{
+   pthread_mutex_unlock(&pMutex->mutex);
+}
+
+
+SysResult sysCreateCond(SysCond * * ppCond)
+{
+   *ppCond = malloc(sizeof(SysCond));
+   if (!*ppCond) return SYS_NOT_ENOUGH_MEMORY;
+   if (pthread_cond_init(&(*ppCond)->cond, 0)) {
+      free(*ppCond);
+      *ppCond = 0;
+      return SYS_UNKNOWN;
+   }
+   return SYS_OK;
+}
+
+
+void sysDestroyCond(SysCond * pCond)
+{
+   pthread_cond_destroy(&pCond->cond);
+   free(pCond);
+}
+
+
+void sysWaitCond(SysCond * pCond, SysMutex * pMutex,
+   unsigned int msTimeout)
+{
+   struct timeval now;
+   struct timespec abstime;
+
+   if (!msTimeout) {
+      pthread_cond_wait(&pCond->cond, &pMutex->mutex);
+      return;
+   }
+
+   /* pthread_cond_timedwait() wants an absolute time of day. */
+   gettimeofday(&now, 0);
+   abstime.tv_sec = now.tv_sec + msTimeout / 1000;
+   abstime.tv_nsec = now.tv_usec * 1000 + (msTimeout % 1000) * 1000000;
+   if (abstime.tv_nsec >= 1000000000) {
+      abstime.tv_sec++;
+      abstime.tv_nsec -= 1000000000;
+   }
+   pthread_cond_timedwait(&pCond->cond, &pMutex->mutex, &abstime);
+}
+
+
+void sysSignalCond(SysCond * pCond)
+{
+   pthread_cond_broadcast(&pCond->cond);
+}
+
+
+static pthread_mutex_t onceLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void sysCallOnce(bool * pfDone, void (* pFunc)(void))
+{
+   if (__atomic_load_n(pfDone, __ATOMIC_ACQUIRE)) return;
+   pthread_mutex_lock(&onceLock);
+   if (!*pfDone) {
+      pFunc();
+      __atomic_store_n(pfDone, true, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&onceLock);
+}
+
+
+uint32 sysQueryMilliseconds()
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+   struct timeval tv;
+   gettimeofday(&tv, 0);
+   return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+
 /* We use the standard C PRNG, so it's very bad. */
 
 
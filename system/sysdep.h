@@ -30,6 +30,12 @@ typedef struct _File File;
 typedef unsigned long FilePos;
 typedef unsigned int SysResult;
 
+/* A buffer for sysReadFileV() and sysWriteFileV(). */
+typedef struct {
+      octet * pabBuffer;
+      FilePos cbLength;
+} SysIOVec;
+
 
 /* Error codes for sys*(). */
 #define SYS_OK                 0  /* No errors. */
@@ -42,6 +48,7 @@ typedef unsigned int SysResult;
 #define SYS_UNKNOWN            7  /* Misc. error. */
 #define SYS_NOT_ENOUGH_MEMORY  8  /* Not enough memory. */
 #define SYS_INVALID_PARAMETER  9  /* Invalid parameter. */
+#define SYS_TOO_MANY_FILES     10 /* Too many open files. */
 
 
 /* Flags for sysOpenFile() (equal to the DosOpen() flags). */
@@ -78,15 +85,119 @@ SysResult sysReadFromFile(File * pFile, FilePos cbLength,
    octet * pabBuffer, FilePos * pcbRead);
 SysResult sysWriteToFile(File * pFile, FilePos cbLength,
    octet * pabBuffer, FilePos * pcbWritten);
+/* Read into or write from a list of buffers at the given position,
+   without going through the file pointer.  A short read means end
+   of file.  The file pointer is left undefined.  Several threads may
+   do this on the same file at the same time. */
+SysResult sysReadFileV(File * pFile, FilePos ibPos,
+   unsigned int cVecs, SysIOVec * paVecs, FilePos * pcbRead);
+SysResult sysWriteFileV(File * pFile, FilePos ibPos,
+   unsigned int cVecs, SysIOVec * paVecs, FilePos * pcbWritten);
+
+/* A read or write for sysSubmitIOBatch(), and its outcome. */
+typedef struct {
+      File * pFile;
+      FilePos ibPos;
+      unsigned int cVecs;
+      SysIOVec * paVecs;
+      bool fWrite;
+      SysResult sr; /* set by sysSubmitIOBatch() */
+      FilePos cbDone; /* idem */
+} SysIORequest;
+
+/* An I/O ring submits a batch of requests to the kernel at once and
+   reaps their completions (io_uring on Linux).  sysCreateIORing()
+   fails if the system or the kernel has no such thing.  A ring must
+   not be used by several threads at the same time. */
+typedef struct _SysIORing SysIORing;
+
+SysResult sysCreateIORing(unsigned int cEntries, SysIORing * * ppRing);
+void sysDestroyIORing(SysIORing * pRing);
+
+/* Perform a batch of requests, through pRing if it is not 0, or one
+   after another otherwise.  The requests may complete in any order,
+   so they should not overlap.  The outcome of each request is stored
+   in it; the result is that of the first failed request. */
+SysResult sysSubmitIOBatch(SysIORing * pRing, unsigned int cRequests,
+   SysIORequest * paRequests);
+
 SysResult sysSetFileSize(File * pFile, FilePos cbSize);
 SysResult sysQueryFileSize(File * pFile, FilePos * pcbSize);
 SysResult sysDeleteFile(char * pszName, bool fFastDelete, Cred cred);
 SysResult sysFileExists(char * pszName, bool * pfExists);
 
+/* A directory that files can be opened in by their name alone, which
+   saves looking up the directory's path each time.  sysOpenDir()
+   locks the directory according to the SOF_SHMASK bits of flFlags;
+   where the system supports that, the files that are opened in it
+   are covered by this lock and are not locked one by one. */
+typedef struct _SysDir SysDir;
+
+SysResult sysOpenDir(char * pszName, int flFlags, Cred cred,
+    SysDir * * ppDir);
+SysResult sysCloseDir(SysDir * pDir);
+SysResult sysOpenFileAt(SysDir * pDir, char * pszName, int flFlags,
+    Cred cred, File * * ppFile);
+SysResult sysCreateFileAt(SysDir * pDir, char * pszName, int flFlags,
+    FilePos cbInitialSize, Cred cred, File * * ppFile);
+SysResult sysDeleteFileAt(SysDir * pDir, char * pszName,
+    bool fFastDelete, Cred cred);
+SysResult sysCreateDirAt(SysDir * pDir, char * pszName, Cred cred);
+
+/* The number of files that the process may have open, or 0 if
+   unknown. */
+unsigned int sysQueryMaxOpenFiles();
+
 void * sysAllocSecureMem(int cbSize);
 void sysFreeSecureMem(void * pMem);
 void sysLockMem(); /* disable swapping for future allocations */
 
+/* Flags for sysAllocPool(). */
+#define SAP_LOCK               0x0001 /* lock in memory */
+#define SAP_HUGEPAGES          0x0002 /* use huge pages if possible */
+
+/* Allocate/free a large, page-aligned block of secure memory. */
+void * sysAllocPool(unsigned int cbSize, unsigned int flFlags);
+void sysFreePool(void * pMem, unsigned int cbSize);
+
+/* Return how short of memory the system (or the part of it we run
+   in) is: the share of the last few seconds during which tasks were
+   stalled waiting for memory, in hundredths of a percent.  Fails if
+   the system doesn't keep track of this. */
+SysResult sysQueryMemoryPressure(unsigned int * pnPressure);
+
+/* Threads and synchronisation.  Mutexes are not recursive.
+   sysWaitCond() atomically unlocks the mutex and waits until the
+   condition is signalled or msTimeout milliseconds have passed (0
+   means forever); it may also return spuriously. */
+typedef struct _SysThread SysThread;
+typedef struct _SysMutex SysMutex;
+typedef struct _SysCond SysCond;
+
+SysResult sysCreateThread(void (* pFunc)(void * pArg), void * pArg,
+   SysThread * * ppThread);
+void sysJoinThread(SysThread * pThread); /* also frees pThread */
+
+SysResult sysCreateMutex(SysMutex * * ppMutex);
+void sysDestroyMutex(SysMutex * pMutex);
+void sysLockMutex(SysMutex * pMutex);
+void sysUnlockMutex(SysMutex * pMutex);
+
+SysResult sysCreateCond(SysCond * * ppCond);
+void sysDestroyCond(SysCond * pCond);
+void sysWaitCond(SysCond * pCond, SysMutex * pMutex,
+   unsigned int msTimeout);
+void sysSignalCond(SysCond * pCond); /* wakes all waiters */
+
+/* Call pFunc(), unless it has already been called for the same flag
+   (which must initially be false).  Threads that come in while the
+   call is in progress return after it has finished. */
+void sysCallOnce(bool * pfDone, void (* pFunc)(void));
+
+/* A millisecond clock that is not affected by changes to the time of
+   day.  It wraps around, so only differences are meaningful. */
+uint32 sysQueryMilliseconds();
+
 void sysInitPRNG();
 void sysGetRandomBits(int bits, octet * dst);
 
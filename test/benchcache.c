@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "ciphertable.h"
+#include "corefs.h"
+#include "coreutils.h"
+#include "superblock.h"
+
+
+/* Measure the cost of a sector cache lookup (a cache hit through
+   coreQuerySectorData()) as a function of the number of cached
+   sectors. */
+
+
+#define LOOKUPS 2000000
+
+
+static void bench(unsigned int csCached)
+{
+    CryptedVolumeParms parms;
+    CoreResult cr;
+
+    SuperBlock * pSuperBlock;
+    CryptedVolume * pVolume;
+
+    CryptedFileInfo info;
+    CryptedFileID idFile;
+    SectorNumber s, csExtent;
+    octet buf[16];
+    clock_t t1, t2;
+    unsigned long i, r = 12345;
+
+    coreSetDefVolumeParms(&parms);
+    parms.csMaxCached = csCached;
+    parms.csIOGranularity = csCached < 512 ? csCached : 512;
+    parms.cMaxCryptedFiles = 16;
+
+    cr = coreReadSuperBlock(TESTVOL "/", TESTPW,
+        cipherTable, &parms, &pSuperBlock);
+    assert(cr == CORERC_OK);
+
+    pVolume = pSuperBlock->pVolume;
+
+    memset(&info, 0, sizeof(info));
+    info.flFlags = CFF_IFREG;
+    info.cRefs = 1;
+    cr = coreCreateBaseFile(pVolume, &info, &idFile);
+    assert(cr == CORERC_OK);
+
+    /* Fill the cache with zero-filled sectors of one file, leaving
+       room for the info sector file. */
+    for (s = 0; s < csCached - 4; s += csExtent) {
+        csExtent = csCached - 4 - s;
+        if (csExtent > parms.csIOGranularity)
+            csExtent = parms.csIOGranularity;
+        cr = coreFetchSectors(pVolume, idFile, s, csExtent,
+            CFETCH_NO_READ);
+        assert(cr == CORERC_OK);
+    }
+
+    t1 = clock();
+    for (i = 0; i < LOOKUPS; i++) {
+        r = r * 1103515245 + 12345;
+        cr = coreQuerySectorData(pVolume, idFile,
+            (r >> 8) % (csCached - 4), 0, sizeof(buf), 0, buf);
+        assert(cr == CORERC_OK);
+    }
+    t2 = clock();
+
+    printf("%8u cached sectors: %6.1f ns/lookup\n", csCached,
+        (t2 - t1) * 1e9 / CLOCKS_PER_SEC / LOOKUPS);
+
+    /* Throw away the dirty sectors instead of writing them. */
+    cr = coreDestroyBaseFile(pVolume, idFile);
+    assert(cr == CORERC_OK);
+
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+}
+
+
+int main(int argc, char * * argv)
+{
+    sysInitPRNG();
+
+    bench(1000);
+    bench(100000);
+    bench(1000000);
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "sysdep.h"
+#include "corefs.h"
+#include "crc32.h"
+
+
+/* Measure the throughput of the CRC-32 implementations over sector
+   payloads, after checking that they agree with the byte-at-a-time
+   one (which is what existing volumes were written with).  With -c,
+   only check. */
+
+
+#define BYTES (256 * 1024 * 1024)
+
+
+typedef uint32 (* CRCFunction)(uint32 crc, octet * p, unsigned int cb);
+
+
+static void check(CRCFunction f, char * pszName, octet * buf)
+{
+    unsigned int i, cb;
+
+    /* The CRC of "123456789" is 0xcbf43926. */
+    assert((f(0xffffffff, (octet *) "123456789", 9) ^ 0xffffffff) ==
+        0xcbf43926);
+
+    for (i = 0; i < 16; i++)
+        for (cb = 0; cb <= 1024; cb++)
+            if (f(0xffffffff, buf + i, cb) !=
+                coreCRC32Bytewise(0xffffffff, buf + i, cb))
+            {
+                printf("%s: wrong CRC at offset %d, length %d\n",
+                    pszName, i, cb);
+                exit(1);
+            }
+}
+
+
+static void bench(CRCFunction f, char * pszName, octet * buf,
+    unsigned int cbSector)
+{
+    unsigned int cb = PAYLOAD_SIZE_OF(cbSector);
+    unsigned long i, n = BYTES / cb;
+    uint32 crc = 0;
+    clock_t t1, t2;
+
+    t1 = clock();
+    for (i = 0; i < n; i++)
+        crc = f(crc, buf + NONPAYLOAD_SIZE, cb);
+    t2 = clock();
+
+    printf("%-9s %4d-byte sectors: %7.1f MB/s, %6.1f ns/sector (%08x)\n",
+        pszName, cbSector,
+        (double) n * cb / 1e6 / ((t2 - t1) / (double) CLOCKS_PER_SEC),
+        (t2 - t1) * 1e9 / CLOCKS_PER_SEC / n, crc);
+}
+
+
+int main(int argc, char * * argv)
+{
+    static octet buf[MAX_SECTOR_SIZE + 1024];
+    unsigned int cbSector;
+
+    sysInitPRNG();
+    sysGetRandomBits(8 * sizeof(buf), buf);
+
+    check(coreCRC32Sliced, "sliced", buf);
+    if (coreHaveFoldedCRC32())
+        check(coreCRC32Folded, "folded", buf);
+    else
+        printf("folded: not supported by this CPU or build\n");
+
+    if (argc > 1 && !strcmp(argv[1], "-c")) return 0;
+
+    for (cbSector = SECTOR_SIZE; cbSector <= MAX_SECTOR_SIZE;
+         cbSector *= 8)
+    {
+        bench(coreCRC32Bytewise, "bytewise", buf, cbSector);
+        bench(coreCRC32Sliced, "sliced", buf, cbSector);
+        if (coreHaveFoldedCRC32())
+            bench(coreCRC32Folded, "folded", buf, cbSector);
+    }
+
+    return 0;
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "ciphertable.h"
+#include "corefs.h"
+#include "coreutils.h"
+#include "superblock.h"
+#include "cachepolicy.h"
+
+
+/* Replay a mixed workload against the sector cache with each
+   replacement policy and report the hit rates.  Random accesses to a
+   set of hot sectors (think info sectors and directories) are
+   interleaved with a sequential scan through a file that is much
+   larger than the cache (think `aefsutil cat' or a backup); one in
+   four accesses goes to the hot set. */
+
+
+#define CACHE_SECTORS 1024
+#define HOT_SECTORS   640
+#define SCAN_SECTORS  16384
+#define WARMUP        20000
+#define ACCESSES      200000
+
+
+static CryptedFileID createFile(CryptedVolume * pVolume,
+    SectorNumber csFile)
+{
+    CryptedFileInfo info;
+    CryptedFileID id;
+    CoreResult cr;
+    SectorNumber s, c;
+
+    memset(&info, 0, sizeof(info));
+    info.flFlags = CFF_IFREG;
+    info.cRefs = 1;
+    cr = coreCreateBaseFile(pVolume, &info, &id);
+    assert(cr == CORERC_OK);
+
+    for (s = 0; s < csFile; s += c) {
+        c = csFile - s;
+        if (c > CACHE_SECTORS / 2) c = CACHE_SECTORS / 2;
+        cr = coreFetchSectors(pVolume, id, s, c, CFETCH_NO_READ);
+        assert(cr == CORERC_OK);
+        cr = coreFlushVolume(pVolume);
+        assert(cr == CORERC_OK);
+    }
+
+    return id;
+}
+
+
+static CryptedVolume * openVolume(CachePolicy * pPolicy,
+    SuperBlock * * ppSuperBlock)
+{
+    CryptedVolumeParms parms;
+    CoreResult cr;
+
+    coreSetDefVolumeParms(&parms);
+    parms.csMaxCached = CACHE_SECTORS;
+    parms.pCachePolicy = pPolicy;
+
+    cr = coreReadSuperBlock(TESTVOL "/", TESTPW,
+        cipherTable, &parms, ppSuperBlock);
+    assert(cr == CORERC_OK);
+
+    return (*ppSuperBlock)->pVolume;
+}
+
+
+static void bench(CachePolicy * pPolicy,
+    CryptedFileID idHot, CryptedFileID idScan)
+{
+    SuperBlock * pSuperBlock;
+    CryptedVolume * pVolume;
+    CryptedVolumeStats stats;
+    CoreResult cr;
+    unsigned long i, r = 12345, cHits, cHot = 0, cHotHits = 0;
+    unsigned long cHitsStart = 0, cMissesStart = 0;
+    SectorNumber sScan = 0;
+    bool fHot;
+
+    pVolume = openVolume(pPolicy, &pSuperBlock);
+
+    for (i = 0; i < WARMUP + ACCESSES; i++) {
+
+        if (i == WARMUP) {
+            coreQueryVolumeStats(pVolume, &stats);
+            cHitsStart = stats.cCacheHits;
+            cMissesStart = stats.cCacheMisses;
+        }
+
+        r = r * 1103515245 + 12345;
+        fHot = ((r >> 16) & 3) == 0;
+
+        coreQueryVolumeStats(pVolume, &stats);
+        cHits = stats.cCacheHits;
+
+        if (fHot)
+            cr = coreFetchSectors(pVolume, idHot,
+                (r >> 8) % HOT_SECTORS, 1, 0);
+        else {
+            cr = coreFetchSectors(pVolume, idScan, sScan, 1, 0);
+            sScan = (sScan + 1) % SCAN_SECTORS;
+        }
+        assert(cr == CORERC_OK);
+
+        if (fHot && i >= WARMUP) {
+            coreQueryVolumeStats(pVolume, &stats);
+            cHot++;
+            if (stats.cCacheHits > cHits) cHotHits++;
+        }
+    }
+
+    coreQueryVolumeStats(pVolume, &stats);
+    printf("%-8s overall hit rate %5.1f%%, hot set hit rate %5.1f%%\n",
+        pPolicy->pszID,
+        100.0 * (stats.cCacheHits - cHitsStart) /
+        (stats.cCacheHits - cHitsStart +
+            stats.cCacheMisses - cMissesStart),
+        100.0 * cHotHits / cHot);
+
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+}
+
+
+int main(int argc, char * * argv)
+{
+    SuperBlock * pSuperBlock;
+    CryptedVolume * pVolume;
+    CryptedFileID idHot, idScan;
+    CachePolicy * * ppPolicy;
+    CoreResult cr;
+
+    sysInitPRNG();
+
+    pVolume = openVolume(0, &pSuperBlock);
+    idHot = createFile(pVolume, HOT_SECTORS);
+    idScan = createFile(pVolume, SCAN_SECTORS);
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+
+    for (ppPolicy = cachePolicyTable; *ppPolicy; ppPolicy++)
+        bench(*ppPolicy, idHot, idScan);
+
+    pVolume = openVolume(0, &pSuperBlock);
+    cr = coreDestroyBaseFile(pVolume, idHot);
+    assert(cr == CORERC_OK);
+    cr = coreDestroyBaseFile(pVolume, idScan);
+    assert(cr == CORERC_OK);
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "ciphertable.h"
+#include "corefs.h"
+#include "coreutils.h"
+#include "superblock.h"
+
+
+/* Measure the throughput of a cold sequential read through
+   coreReadFromFile(), in 128 KiB requests like those of the FUSE
+   daemon, with and without the readahead thread, and bypassing the
+   cache, and compare it to the speed of decryption alone. */
+
+
+#define FILE_SIZE   (32 * 1024 * 1024)
+#define REQUEST     (128 * 1024)
+#define DECRYPTS    65536
+
+
+static CryptedVolume * openVolume(SuperBlock * * ppSuperBlock,
+    unsigned int cCryptoThreads)
+{
+    CryptedVolumeParms parms;
+    CoreResult cr;
+
+    coreSetDefVolumeParms(&parms);
+    parms.csMaxCached = 4096;
+    parms.cCryptoThreads = cCryptoThreads;
+
+    cr = coreReadSuperBlock(TESTVOL "/", TESTPW,
+        cipherTable, &parms, ppSuperBlock);
+    assert(cr == CORERC_OK);
+
+    return (*ppSuperBlock)->pVolume;
+}
+
+
+static void benchRead(CryptedFileID id, octet * pabBuffer,
+    bool fReadAhead, unsigned int flFlags, unsigned int cCryptoThreads)
+{
+    SuperBlock * pSuperBlock;
+    CryptedVolume * pVolume;
+    CryptedFilePos fp, cbRead;
+    CoreResult cr;
+    uint32 ms;
+
+    pVolume = openVolume(&pSuperBlock, cCryptoThreads);
+
+    if (fReadAhead) {
+        cr = coreStartReadAhead(pVolume);
+        assert(cr == CORERC_OK);
+    }
+
+    ms = sysQueryMilliseconds();
+    for (fp = 0; fp < FILE_SIZE; fp += REQUEST) {
+        cr = coreReadFromFileEx(pVolume, id, fp, REQUEST,
+            pabBuffer, &cbRead, flFlags);
+        assert(cr == CORERC_OK && cbRead == REQUEST);
+    }
+    ms = sysQueryMilliseconds() - ms;
+
+    if (cCryptoThreads)
+        printf("streaming, %u crypto threads   ", cCryptoThreads);
+    else if (flFlags & CREAD_STREAM)
+        printf("sequential read, streaming    ");
+    else
+        printf("sequential read, readahead %-3s", fReadAhead ? "on" : "off");
+    printf("%7.1f MB/s\n", FILE_SIZE / 1048576.0 / (ms ? ms : 1) * 1000);
+
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+}
+
+
+static void benchDecrypt(SuperBlock * pSuperBlock)
+{
+    unsigned int flFlags =
+        coreQueryVolumeParms(pSuperBlock->pVolume)->flCryptoFlags;
+    unsigned int cbSector =
+        coreQueryVolumeParms(pSuperBlock->pVolume)->cbSector;
+    CryptedSectorData data;
+    octet abCipher[MAX_SECTOR_SIZE];
+    CoreResult cr;
+    unsigned int i;
+    uint32 ms;
+
+    memset(&data, 0, sizeof(data));
+    coreEncryptSectorData(&data, abCipher, cbSector,
+        pSuperBlock->pDataKey, flFlags);
+
+    ms = sysQueryMilliseconds();
+    for (i = 0; i < DECRYPTS; i++) {
+        cr = coreDecryptSectorData(abCipher, &data, cbSector,
+            pSuperBlock->pDataKey, flFlags);
+        assert(cr == CORERC_OK);
+    }
+    ms = sysQueryMilliseconds() - ms;
+
+    printf("decryption alone              %7.1f MB/s\n",
+        DECRYPTS * (double) PAYLOAD_SIZE_OF(cbSector) / 1048576.0 /
+        (ms ? ms : 1) * 1000);
+}
+
+
+int main(int argc, char * * argv)
+{
+    SuperBlock * pSuperBlock;
+    CryptedVolume * pVolume;
+    CryptedFileInfo info;
+    CryptedFileID id;
+    CryptedFilePos fp, cbWritten;
+    octet * pabBuffer;
+    CoreResult cr;
+
+    sysInitPRNG();
+
+    pabBuffer = malloc(REQUEST);
+    assert(pabBuffer);
+    memset(pabBuffer, 0xaa, REQUEST);
+
+    pVolume = openVolume(&pSuperBlock, 0);
+    memset(&info, 0, sizeof(info));
+    info.flFlags = CFF_IFREG;
+    info.cRefs = 1;
+    cr = coreCreateBaseFile(pVolume, &info, &id);
+    assert(cr == CORERC_OK);
+    for (fp = 0; fp < FILE_SIZE; fp += REQUEST) {
+        cr = coreWriteToFile(pVolume, id, fp, REQUEST,
+            pabBuffer, &cbWritten);
+        assert(cr == CORERC_OK);
+    }
+    benchDecrypt(pSuperBlock);
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+
+    benchRead(id, pabBuffer, false, 0, 0);
+    benchRead(id, pabBuffer, true, 0, 0);
+    benchRead(id, pabBuffer, false, CREAD_STREAM, 0);
+    benchRead(id, pabBuffer, false, CREAD_STREAM, 3);
+
+    pVolume = openVolume(&pSuperBlock, 0);
+    cr = coreDestroyBaseFile(pVolume, id);
+    assert(cr == CORERC_OK);
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+
+    free(pabBuffer);
+
+    return 0;
+}
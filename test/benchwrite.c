@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "ciphertable.h"
+#include "corefs.h"
+#include "coreutils.h"
+#include "superblock.h"
+
+
+/* Measure the throughput of a sequential write through
+   coreWriteToFileEx(), in 128 KiB requests like those of the FUSE
+   daemon, through the cache and written through, and compare it to
+   the speed of encryption alone.  The time to flush the volume
+   counts. */
+
+
+#define FILE_SIZE   (32 * 1024 * 1024)
+#define REQUEST     (128 * 1024)
+#define ENCRYPTS    65536
+
+
+static void benchWrite(octet * pabBuffer, unsigned int flFlags)
+{
+    CryptedVolumeParms parms;
+    SuperBlock * pSuperBlock;
+    CryptedVolume * pVolume;
+    CryptedFileInfo info;
+    CryptedFileID id;
+    CryptedFilePos fp, cbWritten;
+    CoreResult cr;
+    uint32 ms;
+
+    coreSetDefVolumeParms(&parms);
+    parms.csMaxCached = 4096;
+    parms.csStreamThreshold = 0;
+
+    cr = coreReadSuperBlock(TESTVOL "/", TESTPW,
+        cipherTable, &parms, &pSuperBlock);
+    assert(cr == CORERC_OK);
+    pVolume = pSuperBlock->pVolume;
+
+    memset(&info, 0, sizeof(info));
+    info.flFlags = CFF_IFREG;
+    info.cRefs = 1;
+    cr = coreCreateBaseFile(pVolume, &info, &id);
+    assert(cr == CORERC_OK);
+
+    ms = sysQueryMilliseconds();
+    for (fp = 0; fp < FILE_SIZE; fp += REQUEST) {
+        cr = coreWriteToFileEx(pVolume, id, fp, REQUEST,
+            pabBuffer, &cbWritten, flFlags);
+        assert(cr == CORERC_OK && cbWritten == REQUEST);
+    }
+    cr = coreFlushVolume(pVolume);
+    assert(cr == CORERC_OK);
+    ms = sysQueryMilliseconds() - ms;
+
+    printf("sequential write, %-13s%7.1f MB/s\n",
+        flFlags & CWRITE_STREAM ? "write-through" : "cached",
+        FILE_SIZE / 1048576.0 / (ms ? ms : 1) * 1000);
+
+    cr = coreDestroyBaseFile(pVolume, id);
+    assert(cr == CORERC_OK);
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+}
+
+
+static void benchEncrypt(void)
+{
+    CryptedVolumeParms parms;
+    SuperBlock * pSuperBlock;
+    CryptedSectorData data;
+    octet abCipher[MAX_SECTOR_SIZE];
+    unsigned int flFlags, cbSector;
+    CoreResult cr;
+    unsigned int i;
+    uint32 ms;
+
+    coreSetDefVolumeParms(&parms);
+    cr = coreReadSuperBlock(TESTVOL "/", TESTPW,
+        cipherTable, &parms, &pSuperBlock);
+    assert(cr == CORERC_OK);
+    flFlags = coreQueryVolumeParms(pSuperBlock->pVolume)->flCryptoFlags;
+    cbSector = coreQueryVolumeParms(pSuperBlock->pVolume)->cbSector;
+
+    memset(&data, 0, sizeof(data));
+
+    ms = sysQueryMilliseconds();
+    for (i = 0; i < ENCRYPTS; i++)
+        coreEncryptSectorData(&data, abCipher, cbSector,
+            pSuperBlock->pDataKey, flFlags);
+    ms = sysQueryMilliseconds() - ms;
+
+    printf("encryption alone              %7.1f MB/s\n",
+        ENCRYPTS * (double) PAYLOAD_SIZE_OF(cbSector) / 1048576.0 /
+        (ms ? ms : 1) * 1000);
+
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+}
+
+
+int main(int argc, char * * argv)
+{
+    octet * pabBuffer;
+
+    sysInitPRNG();
+
+    pabBuffer = malloc(REQUEST);
+    assert(pabBuffer);
+    memset(pabBuffer, 0xaa, REQUEST);
+
+    benchEncrypt();
+    benchWrite(pabBuffer, 0);
+    benchWrite(pabBuffer, CWRITE_STREAM);
+
+    free(pabBuffer);
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <assert.h>
+#include <string.h>
+
+#include "ciphertable.h"
+#include "corefs.h"
+#include "coreutils.h"
+#include "superblock.h"
+
+
+/* Create and destroy many more files than fit in the in-memory part
+   of the info sector free list (see coreCreateFreeIDs()), so that
+   freeID() has to forget entries when it is full, allocID() has to
+   walk the on-disk list to refill it, and growISF() has to add
+   sectors in several batches.  The volume is remounted between
+   rounds, with different sizes of the in-memory part.  IDs must
+   never be handed out twice, and freed ones must be used again
+   before the ISF grows; `check-freeids' runs aefsck afterwards to
+   check the list itself. */
+
+
+#define FILES 300
+#define ROUNDS 6
+#define ISF_GROW 20
+
+
+static CryptedFileID aidFiles[FILES];
+static char afUsed[FILES + 4 * ISF_GROW];
+
+static unsigned long r = 8191;
+
+
+static unsigned long rnd(unsigned long n)
+{
+    r = r * 1103515245 + 12345;
+    return (r >> 8) % n;
+}
+
+
+static void createFile(CryptedVolume * pVolume, unsigned int i)
+{
+    CoreResult cr;
+    CryptedFileInfo info;
+
+    memset(&info, 0, sizeof(info));
+    info.flFlags = CFF_IFREG | (i & 0777);
+    info.cRefs = 1;
+    cr = coreCreateBaseFile(pVolume, &info, &aidFiles[i]);
+    assert(cr == CORERC_OK);
+
+    /* Freed IDs are used first, so the ISF never gets much larger
+       than the number of files in it. */
+    assert(aidFiles[i] < sizeof(afUsed));
+    assert(!afUsed[aidFiles[i]]);
+    afUsed[aidFiles[i]] = 1;
+}
+
+
+static void destroyFile(CryptedVolume * pVolume, unsigned int i)
+{
+    CoreResult cr;
+
+    cr = coreDestroyBaseFile(pVolume, aidFiles[i]);
+    assert(cr == CORERC_OK);
+    afUsed[aidFiles[i]] = 0;
+    aidFiles[i] = 0;
+}
+
+
+static SuperBlock * mount(unsigned int cFreeIDs)
+{
+    CryptedVolumeParms parms;
+    CoreResult cr;
+    SuperBlock * pSuperBlock;
+
+    coreSetDefVolumeParms(&parms);
+    parms.cFreeIDs = cFreeIDs;
+    parms.csISFGrow = ISF_GROW;
+    parms.csIOGranularity = 8;
+
+    cr = coreReadSuperBlock(TESTVOL "/", TESTPW,
+        cipherTable, &parms, &pSuperBlock);
+    assert(cr == CORERC_OK);
+
+    return pSuperBlock;
+}
+
+
+int main(int argc, char * * argv)
+{
+    static unsigned int acFreeIDs[ROUNDS] = { 4, 4, 0, 1, 4, 64 };
+    CoreResult cr;
+    SuperBlock * pSuperBlock;
+    CryptedVolume * pVolume;
+    CryptedFileInfo info;
+    CryptedFileID id;
+    unsigned int i, round;
+
+    sysInitPRNG();
+
+    /* The root directory and such are already there. */
+    pSuperBlock = mount(4);
+    for (id = 0; id < sizeof(afUsed); id++)
+        if (coreQueryFileInfo(pSuperBlock->pVolume, id, &info) ==
+            CORERC_OK && info.flFlags)
+            afUsed[id] = 1;
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+
+    for (round = 0; round < ROUNDS; round++) {
+        pSuperBlock = mount(acFreeIDs[round]);
+        pVolume = pSuperBlock->pVolume;
+
+        /* The files of the previous round must still be there. */
+        for (i = 0; i < FILES; i++)
+            if (aidFiles[i]) {
+                cr = coreQueryFileInfo(pVolume, aidFiles[i], &info);
+                assert(cr == CORERC_OK);
+                assert(info.flFlags == (CFF_IFREG | (i & 0777)));
+            }
+
+        /* Destroy many files in a row, then create many in a row,
+           then mix them. */
+        for (i = 0; i < FILES; i++)
+            if (aidFiles[i] && rnd(3)) destroyFile(pVolume, i);
+        for (i = 0; i < FILES; i++)
+            if (!aidFiles[i] && rnd(3)) createFile(pVolume, i);
+        for (i = 0; i < 4 * FILES; i++) {
+            unsigned int j = rnd(FILES);
+            if (aidFiles[j]) destroyFile(pVolume, j);
+            else createFile(pVolume, j);
+        }
+
+        cr = coreDropSuperBlock(pSuperBlock);
+        assert(cr == CORERC_OK);
+    }
+
+    /* Leave an empty volume for aefsck. */
+    pSuperBlock = mount(4);
+    for (i = 0; i < FILES; i++)
+        if (aidFiles[i]) destroyFile(pSuperBlock->pVolume, i);
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+
+    return 0;
+}
@@ -0,0 +1,180 @@
+#include <assert.h>
+#include <string.h>
+
+#include "ciphertable.h"
+#include "corefs.h"
+#include "coreutils.h"
+#include "superblock.h"
+
+
+/* Grow and shrink the cache of a volume in use (see
+   coreSetVolumeCacheLimits()) while sectors are dirty or pinned.
+   The file is larger than a slab of the sector pool, and the cache
+   is filled before it is shrunk, so that whole slabs are retired
+   while some of their sectors are still pinned.  With fBackground,
+   the writeback and readahead threads run as well. */
+
+
+#define SECTORS 10000
+#define PINNED 8
+
+
+static CryptedVolume * pVolume;
+static CryptedFileID idFile;
+static unsigned int cbPayload;
+
+static octet abShadow[SECTORS * PAYLOAD_SIZE];
+static octet abBuffer[SECTORS * PAYLOAD_SIZE];
+
+static unsigned long r = 1234;
+
+
+static unsigned long rnd(unsigned long n)
+{
+    r = r * 1103515245 + 12345;
+    return (r >> 8) % n;
+}
+
+
+static void writeRange(CryptedFilePos fpStart, CryptedFilePos cb)
+{
+    CoreResult cr;
+    CryptedFilePos cbWritten, i;
+    octet b = rnd(256);
+
+    for (i = 0; i < cb; i++)
+        abBuffer[i] = b + i;
+    cr = coreWriteToFile(pVolume, idFile, fpStart, cb, abBuffer,
+        &cbWritten);
+    assert(cr == CORERC_OK && cbWritten == cb);
+    memcpy(abShadow + fpStart, abBuffer, cb);
+}
+
+
+static void checkRange(CryptedFilePos fpStart, CryptedFilePos cb)
+{
+    CoreResult cr;
+    CryptedFilePos cbRead;
+
+    memset(abBuffer, 0x55, cb);
+    cr = coreReadFromFile(pVolume, idFile, fpStart, cb, abBuffer,
+        &cbRead);
+    assert(cr == CORERC_OK && cbRead == cb);
+    assert(memcmp(abBuffer, abShadow + fpStart, cb) == 0);
+}
+
+
+static void test(bool fBackground)
+{
+    static unsigned int acsSizes[] = {
+        20000, 100, 9000, 16, 5000, 64, 12000, 32
+    };
+    CryptedVolumeParms parms;
+    CoreResult cr;
+    SuperBlock * pSuperBlock;
+    CryptedFileInfo info;
+    CryptedSector * apPinned[PINNED];
+    SectorNumber asPinned[PINNED];
+    octet * pabPayload;
+    unsigned int i, j;
+
+    coreSetDefVolumeParms(&parms);
+    parms.csMaxCached = 64;
+    parms.csIOGranularity = 8;
+    parms.nWriteBackRatio = 1;
+    parms.csStreamThreshold = 0;
+
+    cr = coreReadSuperBlock(TESTVOL "/", TESTPW,
+        cipherTable, &parms, &pSuperBlock);
+    assert(cr == CORERC_OK);
+
+    pVolume = pSuperBlock->pVolume;
+    cbPayload = PAYLOAD_SIZE_OF(coreQueryVolumeParms(pVolume)->cbSector);
+    assert(cbPayload == PAYLOAD_SIZE);
+
+    if (fBackground) {
+        cr = coreStartWriteBack(pVolume);
+        assert(cr == CORERC_OK);
+        cr = coreStartReadAhead(pVolume);
+        assert(cr == CORERC_OK);
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.flFlags = CFF_IFREG;
+    info.cRefs = 1;
+    cr = coreCreateBaseFile(pVolume, &info, &idFile);
+    assert(cr == CORERC_OK);
+
+    writeRange(0, sizeof(abShadow));
+
+    for (i = 0; i < sizeof(acsSizes) / sizeof(acsSizes[0]); i++) {
+
+        /* Fill the cache as far as it goes (the previous limit). */
+        checkRange(0, sizeof(abShadow));
+
+        /* Dirty some sectors, and pin some all over the file (and
+           so, all over the pool). */
+        for (j = 0; j < 16; j++)
+            writeRange(rnd(sizeof(abShadow) - 2 * cbPayload),
+                1 + rnd(2 * cbPayload));
+        for (j = 0; j < PINNED; j++) {
+            asPinned[j] = j * (SECTORS / PINNED) + rnd(SECTORS / PINNED);
+            cr = corePinSectors(pVolume, idFile, asPinned[j], 1, 0,
+                &apPinned[j]);
+            assert(cr == CORERC_OK);
+        }
+
+        cr = coreSetVolumeCacheLimits(pVolume, acsSizes[i], 0);
+        assert(cr == CORERC_OK);
+
+        /* The pinned sectors must have survived, even if their slab
+           is being retired; change them. */
+        for (j = 0; j < PINNED; j++) {
+            pabPayload = coreQuerySectorPayload(pVolume, apPinned[j]);
+            assert(memcmp(pabPayload,
+                abShadow + asPinned[j] * cbPayload, cbPayload) == 0);
+            memset(pabPayload, i + j, cbPayload);
+            memset(abShadow + asPinned[j] * cbPayload, i + j, cbPayload);
+            cr = coreDirtySector(pVolume, apPinned[j]);
+            assert(cr == CORERC_OK);
+        }
+
+        for (j = 0; j < 16; j++)
+            checkRange(rnd(sizeof(abShadow) - 2 * cbPayload),
+                1 + rnd(2 * cbPayload));
+
+        for (j = 0; j < PINNED; j++)
+            coreUnpinSectors(pVolume, 1, &apPinned[j]);
+
+        checkRange(0, sizeof(abShadow));
+    }
+
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+
+    /* Everything should have made it to disk. */
+    coreSetDefVolumeParms(&parms);
+    cr = coreReadSuperBlock(TESTVOL "/", TESTPW,
+        cipherTable, &parms, &pSuperBlock);
+    assert(cr == CORERC_OK);
+    pVolume = pSuperBlock->pVolume;
+
+    checkRange(0, sizeof(abShadow));
+
+    cr = coreDestroyBaseFile(pVolume, idFile);
+    assert(cr == CORERC_OK);
+
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+}
+
+
+int main(int argc, char * * argv)
+{
+    sysInitPRNG();
+
+    test(false);
+    test(true);
+
+    return 0;
+}
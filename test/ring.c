@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "sysdep.h"
+
+
+/* Make the I/O ring fail while a batch is in flight, and check that
+   sysSubmitIOBatch() waits for the requests that the kernel has taken
+   (one of them a read from a FIFO that nobody writes to until later)
+   without spinning, and then does the rest itself.  The ring is
+   broken by putting /dev/null in place of its file descriptor and
+   interrupting the wait, after which io_uring_enter() keeps
+   failing. */
+
+
+#define DATAFILE "./ring.dat"
+#define FIFO "./ring.fifo"
+
+#define WRITES 4
+#define CB_WRITE 4096
+
+
+static int fdRing;
+static pthread_t threadMain;
+
+
+static void onSignal(int sig)
+{
+}
+
+
+static double cpuTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void * breakRing(void * pArg)
+{
+    int fd;
+
+    /* By now, the batch has been submitted, and its completion is
+       being waited for. */
+    usleep(200000);
+    fd = open("/dev/null", O_RDONLY);
+    assert(fd != -1);
+    assert(dup2(fd, fdRing) == fdRing);
+    close(fd);
+    pthread_kill(threadMain, SIGUSR1);
+
+    /* Now let the read from the FIFO complete. */
+    usleep(500000);
+    fd = open(FIFO, O_WRONLY);
+    assert(fd != -1);
+    assert(write(fd, "x", 1) == 1);
+    close(fd);
+
+    return 0;
+}
+
+
+static void makeRequests(SysIORequest * paReqs, SysIOVec * paVecs,
+    File * pFile, octet * pabBuffer, bool fWrite)
+{
+    unsigned int i;
+
+    for (i = 0; i < WRITES; i++) {
+        paReqs[i].pFile = pFile;
+        paReqs[i].ibPos = i * 2 * CB_WRITE;
+        paReqs[i].cVecs = 1;
+        paReqs[i].paVecs = &paVecs[i];
+        paReqs[i].fWrite = fWrite;
+        paVecs[i].pabBuffer = pabBuffer + i * CB_WRITE;
+        paVecs[i].cbLength = CB_WRITE;
+    }
+}
+
+
+int main(int argc, char * * argv)
+{
+    static octet abData[WRITES * CB_WRITE], abRead[WRITES * CB_WRITE];
+    SysIORing * pRing;
+    SysIORequest aReqs[WRITES + 1];
+    SysIOVec aVecs[WRITES + 1];
+    File * pData, * pFifo;
+    Cred cred;
+    struct sigaction sa;
+    pthread_t thread;
+    char szPath[64], szLink[64];
+    octet b;
+    ssize_t cb;
+    double t;
+    unsigned int i;
+
+    /* The ring gets the lowest free file descriptor. */
+    fdRing = open("/dev/null", O_RDONLY);
+    assert(fdRing != -1);
+    close(fdRing);
+    if (sysCreateIORing(16, &pRing)) {
+        printf("ring: no I/O ring, nothing to test\n");
+        return 0;
+    }
+    sprintf(szPath, "/proc/self/fd/%d", fdRing);
+    cb = readlink(szPath, szLink, sizeof(szLink) - 1);
+    assert(cb > 0);
+    szLink[cb] = 0;
+    assert(strstr(szLink, "io_uring"));
+
+    memset(&cred, 0, sizeof(cred));
+    unlink(DATAFILE);
+    unlink(FIFO);
+    assert(mkfifo(FIFO, 0600) == 0);
+    assert(sysCreateFile(DATAFILE, SOF_READWRITE | SOF_DENYNONE, 0,
+        cred, &pData) == SYS_OK);
+    assert(sysOpenFile(FIFO, SOF_READWRITE | SOF_DENYNONE,
+        cred, &pFifo) == SYS_OK);
+
+    for (i = 0; i < sizeof(abData); i++)
+        abData[i] = i * 7 + i / 256;
+
+    /* The writes complete right away; the read waits for the
+       thread. */
+    makeRequests(aReqs, aVecs, pData, abData, true);
+    aReqs[WRITES].pFile = pFifo;
+    aReqs[WRITES].ibPos = 0;
+    aReqs[WRITES].cVecs = 1;
+    aReqs[WRITES].paVecs = &aVecs[WRITES];
+    aReqs[WRITES].fWrite = false;
+    aVecs[WRITES].pabBuffer = &b;
+    aVecs[WRITES].cbLength = 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onSignal;
+    sigaction(SIGUSR1, &sa, 0);
+    threadMain = pthread_self();
+    assert(pthread_create(&thread, 0, breakRing, 0) == 0);
+
+    t = cpuTime();
+    sysSubmitIOBatch(pRing, WRITES + 1, aReqs);
+    t = cpuTime() - t;
+    pthread_join(thread, 0);
+
+    /* Waiting for the read took half a second; it shouldn't have
+       taken much of the CPU. */
+    printf("ring: %.3f s of CPU while waiting\n", t);
+    assert(t < 0.1);
+    for (i = 0; i < WRITES; i++)
+        assert(aReqs[i].sr == SYS_OK && aReqs[i].cbDone == CB_WRITE);
+
+    /* The ring is broken for good now, so everything is done without
+       it. */
+    makeRequests(aReqs, aVecs, pData, abRead, false);
+    assert(sysSubmitIOBatch(pRing, WRITES, aReqs) == SYS_OK);
+    for (i = 0; i < WRITES; i++)
+        assert(aReqs[i].cbDone == CB_WRITE);
+    assert(memcmp(abRead, abData, sizeof(abData)) == 0);
+
+    sysDestroyIORing(pRing);
+    sysCloseFile(pFifo);
+    sysCloseFile(pData);
+    unlink(FIFO);
+    unlink(DATAFILE);
+
+    return 0;
+}
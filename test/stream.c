@@ -0,0 +1,178 @@
+#include <assert.h>
+#include <string.h>
+
+#include "ciphertable.h"
+#include "corefs.h"
+#include "coreutils.h"
+#include "superblock.h"
+
+
+/* Exercise the paths that bypass the cache: large reads are streamed
+   (coreStreamSectors()) and large writes are written through
+   (coreWriteSectorsThrough()), and the sectors are encrypted and
+   decrypted by the crypto pool.  The ranges have unaligned heads and
+   tails, which go through the cache, and are mixed with small writes
+   that leave dirty sectors in the cache, which a streamed read must
+   see and a write-through must replace.  With fBackground, the
+   writeback and readahead threads run as well. */
+
+
+#define SECTORS 200
+#define ROUNDS 40
+
+
+static CryptedVolume * pVolume;
+static CryptedFileID idFile;
+static unsigned int cbPayload;
+static CryptedFilePos cbFile;
+
+static octet abShadow[SECTORS * MAX_PAYLOAD_SIZE];
+static octet abBuffer[SECTORS * MAX_PAYLOAD_SIZE];
+
+static unsigned long r = 4711;
+
+
+static unsigned long rnd(unsigned long n)
+{
+    r = r * 1103515245 + 12345;
+    return (r >> 8) % n;
+}
+
+
+static void writeRange(CryptedFilePos fpStart, CryptedFilePos cb)
+{
+    CoreResult cr;
+    CryptedFilePos cbWritten, i;
+    octet b = rnd(256);
+
+    for (i = 0; i < cb; i++)
+        abBuffer[i] = b + i;
+    cr = coreWriteToFile(pVolume, idFile, fpStart, cb, abBuffer,
+        &cbWritten);
+    assert(cr == CORERC_OK && cbWritten == cb);
+
+    memcpy(abShadow + fpStart, abBuffer, cb);
+    if (fpStart + cb > cbFile) cbFile = fpStart + cb;
+}
+
+
+static void checkRange(CryptedFilePos fpStart, CryptedFilePos cb)
+{
+    CoreResult cr;
+    CryptedFilePos cbRead;
+
+    if (fpStart + cb > cbFile) cb = cbFile - fpStart;
+    memset(abBuffer, 0x55, cb);
+    cr = coreReadFromFile(pVolume, idFile, fpStart, cb, abBuffer,
+        &cbRead);
+    assert(cr == CORERC_OK && cbRead == cb);
+    assert(memcmp(abBuffer, abShadow + fpStart, cb) == 0);
+}
+
+
+/* A range of at least the stream threshold, not starting or ending
+   on a sector boundary. */
+static void largeRange(CryptedFilePos * pfpStart, CryptedFilePos * pcb)
+{
+    *pfpStart = rnd(SECTORS / 4) * cbPayload + 1 + rnd(cbPayload - 1);
+    *pcb = (SECTORS / 2 + rnd(SECTORS / 4 - 2)) * cbPayload + 1 +
+        rnd(cbPayload - 1);
+}
+
+
+static void test(bool fBackground)
+{
+    CryptedVolumeParms parms;
+    CryptedVolumeStats stats;
+    CoreResult cr;
+    SuperBlock * pSuperBlock;
+    CryptedFileInfo info;
+    CryptedFilePos fpStart, cb;
+    int i, j;
+
+    coreSetDefVolumeParms(&parms);
+    parms.csMaxCached = 64;
+    parms.csIOGranularity = 8;
+    parms.nWriteBackRatio = 1;
+    parms.csStreamThreshold = 8;
+    parms.cCryptoThreads = 2;
+    parms.csCryptoCutoff = 4;
+
+    cr = coreReadSuperBlock(TESTVOL "/", TESTPW,
+        cipherTable, &parms, &pSuperBlock);
+    assert(cr == CORERC_OK);
+
+    pVolume = pSuperBlock->pVolume;
+    cbPayload = PAYLOAD_SIZE_OF(coreQueryVolumeParms(pVolume)->cbSector);
+
+    if (fBackground) {
+        cr = coreStartWriteBack(pVolume);
+        assert(cr == CORERC_OK);
+        cr = coreStartReadAhead(pVolume);
+        assert(cr == CORERC_OK);
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.flFlags = CFF_IFREG;
+    info.cRefs = 1;
+    cr = coreCreateBaseFile(pVolume, &info, &idFile);
+    assert(cr == CORERC_OK);
+    cbFile = 0;
+
+    writeRange(0, SECTORS * cbPayload);
+
+    for (i = 0; i < ROUNDS; i++) {
+
+        /* Leave some dirty sectors in the cache. */
+        for (j = 0; j < 8; j++)
+            writeRange(rnd(SECTORS - 2) * cbPayload + rnd(cbPayload),
+                1 + rnd(cbPayload));
+
+        if (!fBackground) {
+            coreQueryVolumeStats(pVolume, &stats);
+            assert(stats.csDirty > 0);
+        }
+
+        /* Stream them together with uncached ones. */
+        largeRange(&fpStart, &cb);
+        checkRange(fpStart, cb);
+
+        /* Write through them. */
+        largeRange(&fpStart, &cb);
+        writeRange(fpStart, cb);
+
+        /* And read them back through the cache and streamed. */
+        for (j = 0; j < 4; j++)
+            checkRange(rnd(cbFile - 1), 1 + rnd(2 * cbPayload));
+        checkRange(0, cbFile);
+    }
+
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+
+    /* Everything should have made it to disk. */
+    coreSetDefVolumeParms(&parms);
+    cr = coreReadSuperBlock(TESTVOL "/", TESTPW,
+        cipherTable, &parms, &pSuperBlock);
+    assert(cr == CORERC_OK);
+    pVolume = pSuperBlock->pVolume;
+
+    checkRange(0, cbFile);
+
+    cr = coreDestroyBaseFile(pVolume, idFile);
+    assert(cr == CORERC_OK);
+
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+}
+
+
+int main(int argc, char * * argv)
+{
+    sysInitPRNG();
+
+    test(false);
+    test(true);
+
+    return 0;
+}
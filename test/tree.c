@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "ciphertable.h"
+#include "corefs.h"
+#include "coreutils.h"
+#include "superblock.h"
+
+
+/* `tree make PREFIX' creates files PREFIX0, PREFIX1, ... in the root
+   directory of the test volume, each holding a few sectors of data
+   derived from its name; `tree check PREFIX' reads them back.  The
+   file IDs run through many storage file shards, so this is used to
+   test sharded volumes (see the check-shard target). */
+
+
+#define FILES 300
+
+
+static void makeData(char * pszName, octet * pabData, unsigned int cb)
+{
+    unsigned int i, n = strlen(pszName);
+    for (i = 0; i < cb; i++)
+        pabData[i] = pszName[i % n] + i / n;
+}
+
+
+int main(int argc, char * * argv)
+{
+    CryptedVolumeParms parms;
+    CoreResult cr;
+    SuperBlock * pSuperBlock;
+    CryptedVolume * pVolume;
+    CryptedFileInfo info;
+    CryptedFileID idFile;
+    CryptedFilePos cb;
+    char szName[64];
+    static octet abData[4 * PAYLOAD_SIZE], abRead[4 * PAYLOAD_SIZE];
+    unsigned int i, cbData;
+    bool fMake;
+
+    if (argc != 3 || strlen(argv[2]) > 32 ||
+        (strcmp(argv[1], "make") && strcmp(argv[1], "check")))
+    {
+        fprintf(stderr, "usage: %s make|check PREFIX\n", argv[0]);
+        return 1;
+    }
+    fMake = strcmp(argv[1], "make") == 0;
+
+    sysInitPRNG();
+
+    coreSetDefVolumeParms(&parms);
+    cr = coreReadSuperBlock(TESTVOL "/", TESTPW,
+        cipherTable, &parms, &pSuperBlock);
+    assert(cr == CORERC_OK);
+    pVolume = pSuperBlock->pVolume;
+
+    for (i = 0; i < FILES; i++) {
+        sprintf(szName, "%s%d", argv[2], i);
+        cbData = 1 + i * 7 % sizeof(abData);
+        makeData(szName, abData, cbData);
+
+        if (fMake) {
+            memset(&info, 0, sizeof(info));
+            info.flFlags = CFF_IFREG | 0600;
+            info.cRefs = 1;
+            cr = coreCreateBaseFile(pVolume, &info, &idFile);
+            assert(cr == CORERC_OK);
+            cr = coreAddEntryToDir(pVolume, pSuperBlock->idRoot,
+                szName, idFile, 0);
+            assert(cr == CORERC_OK);
+            cr = coreWriteToFile(pVolume, idFile, 0, cbData, abData, &cb);
+            assert(cr == CORERC_OK && cb == cbData);
+        } else {
+            cr = coreQueryIDFromPath(pVolume, pSuperBlock->idRoot,
+                szName, &idFile, 0);
+            assert(cr == CORERC_OK);
+            cr = coreReadFromFile(pVolume, idFile, 0, sizeof(abRead),
+                abRead, &cb);
+            assert(cr == CORERC_OK && cb == cbData);
+            assert(memcmp(abRead, abData, cbData) == 0);
+        }
+    }
+
+    cr = coreDropSuperBlock(pSuperBlock);
+    assert(cr == CORERC_OK);
+
+    return 0;
+}
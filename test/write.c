@@ -7,7 +7,12 @@
 #include "superblock.h"
 
 
-int main(int argc, char * * argv)
+/* Write and read back a file through a very small cache, using the
+   given replacement policy.  With fBackground, the writeback and
+   readahead threads run; the writeback thread is told to write dirty
+   sectors as soon as it can, so that both race with the writes and
+   reads. */
+static void test(CachePolicy * pPolicy, bool fBackground)
 {
     CryptedVolumeParms parms;
     CoreResult cr;
@@ -22,11 +27,11 @@ int main(int argc, char * * argv)
     octet buf[100000];
     int i;
 
-    sysInitPRNG();
-
     coreSetDefVolumeParms(&parms);
     parms.csMaxCached = 10;
     parms.csIOGranularity = 5;
+    parms.pCachePolicy = pPolicy;
+    parms.nWriteBackRatio = 1;
    
     cr = coreReadSuperBlock(TESTVOL "/", TESTPW,
         cipherTable, &parms, &pSuperBlock);
@@ -34,6 +39,13 @@ int main(int argc, char * * argv)
 
     pVolume = pSuperBlock->pVolume;
 
+    if (fBackground) {
+        cr = coreStartWriteBack(pVolume);
+        assert(cr == CORERC_OK);
+        cr = coreStartReadAhead(pVolume);
+        assert(cr == CORERC_OK);
+    }
+
     memset(&info, 0, sizeof(info));
     info.flFlags = CFF_IFREG;
     info.cRefs = 1;
@@ -58,8 +70,24 @@ int main(int argc, char * * argv)
     for (i = 0; i < sizeof(buf); i++)
         assert(buf[i] == 0xaa);
     
+    cr = coreDestroyBaseFile(pVolume, idFile);
+    assert(cr == CORERC_OK);
+    
     cr = coreDropSuperBlock(pSuperBlock);
     assert(cr == CORERC_OK);
+}
+
+
+int main(int argc, char * * argv)
+{
+    CachePolicy * * ppPolicy;
+
+    sysInitPRNG();
+
+    for (ppPolicy = cachePolicyTable; *ppPolicy; ppPolicy++) {
+        test(*ppPolicy, false);
+        test(*ppPolicy, true);
+    }
 
     return 0;
 }
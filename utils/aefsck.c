@@ -90,6 +90,7 @@ typedef struct {
       
       SuperBlock * pSuperBlock;
       CryptedVolume * pVolume; /* convenience */
+      unsigned int cbSector; /* idem */
       
       FSItem * fsihashtab[FSIHASHTAB];
       
@@ -343,31 +344,48 @@ static char * printFileName(State * pState, CryptedFileID id)
 }
 
 
+static unsigned int storageFlags(State * pState)
+{
+   return coreQueryVolumeParms(pState->pVolume)->flStorageFlags;
+}
+
+
 static void makeStorageName(State * pState, CryptedFileID id,
    char * szBuffer)
 {
-   sprintf(szBuffer, "%s%08lx.enc",
-      pState->pSuperBlock->szBasePath, id);
+   strcpy(szBuffer, pState->pSuperBlock->szBasePath);
+   coreMakeStorageFileName(storageFlags(pState), id,
+      szBuffer + strlen(szBuffer));
 }
 
 
-/* Read the storage directory and look for storage files.  Add them to
-   the file hash table. */
-static int addFiles(State * pState)
+static bool isHexName(char * pszName, unsigned int cch)
 {
-   int res = 0, bad;
    unsigned int i;
+   if (strlen(pszName) != cch) return false;
+   for (i = 0; i < cch; i++)
+      if (!isxdigit((int) pszName[i])) return false;
+   return true;
+}
+
+
+/* Look for storage files in the directory pszSubDir (relative to the
+   base path, ending in a slash or empty) and add them to the file
+   hash table. */
+static int addFilesIn(State * pState, char * pszSubDir)
+{
+   int res = 0;
    DIR * dir;
    struct dirent * dirent;
    struct stat st;
-   char szName[MAX_VOLUME_BASE_PATH_NAME + 16];
+   char szName[MAX_VOLUME_BASE_PATH_NAME + MAX_STORAGE_FILE_NAME + 1];
+   char szExpected[MAX_STORAGE_FILE_NAME + 1];
    CryptedFileID id;
    FSItem * fsi;
-   
-   pState->cFiles = 0;
-   
-   if (!(dir = opendir(pState->pSuperBlock->szBasePath))) {
-      printf("filesystem: %s, aborting\n", strerror(errno));
+
+   sprintf(szName, "%s%s", pState->pSuperBlock->szBasePath, pszSubDir);
+   if (!(dir = opendir(szName))) {
+      printf("filesystem: %s: %s, aborting\n", szName, strerror(errno));
       return res | AEFSCK_ABORT;
    }
 
@@ -388,28 +406,46 @@ static int addFiles(State * pState)
            strcmp(dirent->d_name + 8, ".enc") != 0))
          continue;
 
-      for (bad = 0, i = 0; i < 8; i++)
-         if (!isxdigit((int) dirent->d_name[i])) bad = 1;
-      if (bad) {
-         printf("filesystem: weird file name %s, skipping\n", dirent->d_name);
+      dirent->d_name[8] = 0;
+      if (!isHexName(dirent->d_name, 8)) {
+         dirent->d_name[8] = '.';
+         printf("filesystem: weird file name %s%s, skipping\n",
+            pszSubDir, dirent->d_name);
          continue;
       }
+      dirent->d_name[8] = '.';
 
       sscanf(dirent->d_name, "%lx", &id);
 
       if (id == 0) {
-         printf("filesystem: file name %s is illegal (id 0 is reserved)\n",
-            dirent->d_name);
+         printf("filesystem: file name %s%s is illegal (id 0 is reserved)\n",
+            pszSubDir, dirent->d_name);
+         continue;
+      }
+
+      /* On a sharded volume, corefs looks for the file in one place
+         only.  A volume whose conversion has been interrupted may
+         have some files elsewhere. */
+      coreMakeStorageFileName(storageFlags(pState), id, szExpected);
+      sprintf(szName, "%s%s", pszSubDir, dirent->d_name);
+      if (strcmp(szName, szExpected) != 0) {
+         printf("filesystem: %s should be %s, skipping (run `aefsutil ... "
+            "shard' to move it)\n", szName, szExpected);
+         res |= AEFSCK_ERRORFOUND | AEFSCK_NOTFIXED;
          continue;
       }
 
       if (id == INFOSECTORFILE_ID) continue;
 
-      if (!(fsi = addFile(pState, id))) return res | AEFSCK_FAIL;
+      if (!(fsi = addFile(pState, id))) {
+         closedir(dir);
+         return res | AEFSCK_FAIL;
+      }
       makeStorageName(pState, id, szName);
       if (stat(szName, &st)) {
          printf("filesystem: statting %s: %s\n",
-            dirent->d_name, strerror(errno));
+            szName, strerror(errno));
+         closedir(dir);
 	 return res | AEFSCK_FAIL;
       }
       fsi->cbStorageSize = st.st_size;
@@ -421,6 +457,73 @@ static int addFiles(State * pState)
 }
 
 
+/* Collect the names of the shard directories (two hex digits) in
+   pszSubDir. */
+static int listShards(State * pState, char * pszSubDir,
+   bool * pafShards)
+{
+   DIR * dir;
+   struct dirent * dirent;
+   char szName[MAX_VOLUME_BASE_PATH_NAME + MAX_STORAGE_FILE_NAME + 1];
+   unsigned int i;
+
+   for (i = 0; i < 256; i++) pafShards[i] = false;
+
+   sprintf(szName, "%s%s", pState->pSuperBlock->szBasePath, pszSubDir);
+   if (!(dir = opendir(szName))) {
+      printf("filesystem: %s: %s, aborting\n", szName, strerror(errno));
+      return AEFSCK_ABORT;
+   }
+
+   while (dirent = readdir(dir))
+      if (isHexName(dirent->d_name, 2) &&
+          sscanf(dirent->d_name, "%x", &i) == 1)
+         pafShards[i] = true;
+
+   closedir(dir);
+   return 0;
+}
+
+
+/* Read the storage directory and look for storage files.  Add them to
+   the file hash table. */
+static int addFiles(State * pState)
+{
+   int res = 0;
+   unsigned int i, j;
+   bool afShards1[256], afShards2[256];
+   char szSubDir[8];
+   
+   pState->cFiles = 0;
+
+   /* Storage files directly in the base path are only expected on
+      flat volumes, but look anyway. */
+   res |= addFilesIn(pState, "");
+   if (STOP(res)) return res;
+
+   if (!(storageFlags(pState) & CSTOR_SHARDED))
+      return res;
+
+   res |= listShards(pState, "", afShards1);
+   if (STOP(res)) return res;
+
+   for (i = 0; i < 256; i++) {
+      if (!afShards1[i]) continue;
+      sprintf(szSubDir, "%02x/", i);
+      res |= listShards(pState, szSubDir, afShards2);
+      if (STOP(res)) return res;
+      for (j = 0; j < 256; j++) {
+         if (!afShards2[j]) continue;
+         sprintf(szSubDir, "%02x/%02x/", i, j);
+         res |= addFilesIn(pState, szSubDir);
+         if (STOP(res)) return res;
+      }
+   }
+
+   return res;
+}
+
+
 static int fsiComparator(const void * p1, const void * p2)
 {
    return
@@ -513,8 +616,9 @@ static void makeDefaultFileInfo(State * pState, FSItem * fsi)
    memset(&fsi->info, 0, sizeof(fsi->info));
    fsi->info.flFlags = CFF_IFREG | CFF_IRUSR | CFF_IWUSR;
    fsi->info.cRefs = 0;
-   fsi->info.csSet = fsi->cbStorageSize / SECTOR_SIZE;
-   fsi->info.cbFileSize = fsi->info.csSet * PAYLOAD_SIZE;
+   fsi->info.csSet = fsi->cbStorageSize / pState->cbSector;
+   fsi->info.cbFileSize = fsi->info.csSet *
+      PAYLOAD_SIZE_OF(pState->cbSector);
    fsi->info.timeCreation = fsi->info.timeAccess =
       fsi->info.timeWrite = time(0);
    fsi->info.idParent = 0;
@@ -779,7 +883,7 @@ static int rewriteFreeList(State * pState)
 
 static int checkISF(State * pState)
 {
-   char szISFName[MAX_VOLUME_BASE_PATH_NAME + 16];
+   char szISFName[MAX_VOLUME_BASE_PATH_NAME + MAX_STORAGE_FILE_NAME + 1];
    struct stat st;
    int res = 0, res2;
    CoreResult cr;
@@ -831,13 +935,13 @@ retry:
    }
 
    /* Is the storage file size a multiple of the sector size? */
-   if (st.st_size % SECTOR_SIZE != 0) {
+   if (st.st_size % pState->cbSector != 0) {
       res |= AEFSCK_ERRORFOUND;
       printf("isf: invalid size");
       if (pState->flags & FSCK_FIX) {
          printf(", truncating\n");
          cr = coreSuggestFileAllocation(pState->pVolume,
-            INFOSECTORFILE_ID, st.st_size / SECTOR_SIZE);
+            INFOSECTORFILE_ID, st.st_size / pState->cbSector);
          if (cr) {
             printf("isf: cannot truncate: %s\n", core2str(cr));
             return res | AEFSCK_ABORT;
@@ -848,7 +952,7 @@ retry:
 
    /* The ISF header will be checked when we walk the free list. */
 
-   pState->csISFSize = st.st_size / SECTOR_SIZE;
+   pState->csISFSize = st.st_size / pState->cbSector;
    pState->fRewriteFreeList = false;
 
    if (pState->flags & FSCK_VERBOSE)
@@ -1137,12 +1241,12 @@ static int checkFileInfo(State * pState, FSItem * fsi)
 
    /* Clamp csSet to the maxima, which depend on the storage file size
       and the actual file size. */
-   csMaxSet = fsi->info.cbFileSize ?
-      (fsi->info.cbFileSize - 1) / PAYLOAD_SIZE + 1 : 0;
+   csMaxSet = fsi->info.cbFileSize ? (fsi->info.cbFileSize - 1) /
+      PAYLOAD_SIZE_OF(pState->cbSector) + 1 : 0;
 
    csSet = fsi->info.csSet;
-   if (csSet > fsi->cbStorageSize / SECTOR_SIZE)
-       csSet = fsi->cbStorageSize / SECTOR_SIZE;
+   if (csSet > fsi->cbStorageSize / pState->cbSector)
+       csSet = fsi->cbStorageSize / pState->cbSector;
    if (csSet > csMaxSet)
        csSet = csMaxSet;
 
@@ -1159,11 +1263,11 @@ static int checkFileInfo(State * pState, FSItem * fsi)
       } else printf("\n");
    }
 
-   assert(fsi->info.csSet * SECTOR_SIZE <= fsi->cbStorageSize);
-   if (fsi->info.csSet * SECTOR_SIZE < fsi->cbStorageSize) {
+   assert(fsi->info.csSet * pState->cbSector <= fsi->cbStorageSize);
+   if (fsi->info.csSet * pState->cbSector < fsi->cbStorageSize) {
       printf("%s: (not an error) storage file size is %ld, but %ld required",
          printFileName(pState, fsi->id),
-         fsi->cbStorageSize, fsi->info.csSet * SECTOR_SIZE);
+         fsi->cbStorageSize, fsi->info.csSet * pState->cbSector);
       if (pState->flags & FSCK_FIX) {
          printf(", truncating\n");
          cr = coreSuggestFileAllocation(pState->pVolume, fsi->id,
@@ -1173,7 +1277,7 @@ static int checkFileInfo(State * pState, FSItem * fsi)
                printFileName(pState, fsi->id), core2str(cr));
             return res | AEFSCK_ABORT;
          }
-         fsi->cbStorageSize = fsi->info.csSet * SECTOR_SIZE;
+         fsi->cbStorageSize = fsi->info.csSet * pState->cbSector;
       } else printf("\n");
    }
 
@@ -2009,6 +2113,8 @@ static int checkFS2(int flags, char * pszBasePath, char * pszPassPhrase)
 
    coreSetDefVolumeParms(&parms);
    if (!(flags & FSCK_FIX)) parms.fReadOnly = true;
+   parms.cInfoCache = 0; /* we write info sectors ourselves */
+   parms.cFreeIDs = 0; /* and the free list */
    
    cr = coreReadSuperBlock(szBasePath, pszPassPhrase, cipherTable, &parms,
       &state.pSuperBlock);
@@ -2017,6 +2123,7 @@ static int checkFS2(int flags, char * pszBasePath, char * pszPassPhrase)
       return AEFSCK_ABORT;
    }
    state.pVolume = state.pSuperBlock->pVolume;
+   state.cbSector = coreQueryVolumeParms(state.pVolume)->cbSector;
    state.readcr = cr;
 
    res = checkVolume(&state);
@@ -48,6 +48,8 @@ Decrypt encrypted storage files to stdout.\n\
   -k, --key=KEY        use specified passphrase, do not ask\n\
   -c, --cipher=CIPHER  use CIPHER (see `mkaefs --help' for a list)\n\
       --no-cbc         do not use CBC mode (only for debugging)\n\
+      --sector-size=N  the volume has sectors of N bytes (see the\n\
+                        `sector-size' line in SUPERBLK.1; default %d)\n\
       --help           display this help and exit\n\
       --version        output version information and exit\n\
 \n\
@@ -55,7 +57,7 @@ Specify `-' to read from standard input.\n\
 Note: if the storage file is piped in through stdin, you should use\n\
 `-k', since the passphrase would otherwise be read from stdin as well.\n\
 ",
-         pszProgramName);
+         pszProgramName, SECTOR_SIZE);
    }
    exit(status);
 }
@@ -77,8 +79,9 @@ int main(int argc, char * * argv)
    char * name;
    bool isstdin;
    FILE * file;
-   octet abData[SECTOR_SIZE];
+   octet abData[MAX_SECTOR_SIZE];
    CryptedSectorData data;
+   unsigned int cbSector = SECTOR_SIZE;
    unsigned int i;
    ssize_t r, w;
    
@@ -90,6 +93,7 @@ int main(int argc, char * * argv)
       { "key", required_argument, 0, 'k' },
       { "cipher", required_argument, 0, 'c' },
       { "no-cbc", no_argument, 0, 3 },
+      { "sector-size", required_argument, 0, 4 },
       { 0, 0, 0, 0 } 
    };
 
@@ -125,6 +129,16 @@ int main(int argc, char * * argv)
             fUseCBC = false;
             break;
 
+         case 4: /* --sector-size */
+            cbSector = atoi(optarg);
+            if (cbSector < SECTOR_SIZE || cbSector > MAX_SECTOR_SIZE ||
+                (cbSector & (cbSector - 1))) {
+               fprintf(stderr, "%s: invalid sector size `%s'\n",
+                  pszProgramName, optarg);
+               printUsage(1);
+            }
+            break;
+
          default:
             printUsage(1);
       }
@@ -198,8 +212,8 @@ int main(int argc, char * * argv)
 
       for (i = 0; ; i++) {
          
-         r = fread(abData, 1, sizeof(abData), file);
-         if (r != sizeof(abData)) {
+         r = fread(abData, 1, cbSector, file);
+         if (r != cbSector) {
             if (feof(file)) {
                if (r)
                   fprintf(stderr, "%s: %s: data missing\n",
@@ -210,7 +224,7 @@ int main(int argc, char * * argv)
             break;
          }
 
-         cr = coreDecryptSectorData(abData, &data, pKey,
+         cr = coreDecryptSectorData(abData, &data, cbSector, pKey,
             fUseCBC ? CCRYPT_USE_CBC : 0);
          if (cr) {
             assert (cr == CORERC_BAD_CHECKSUM);
@@ -218,8 +232,8 @@ int main(int argc, char * * argv)
                pszProgramName, name, i);
          }
 
-         w = fwrite(data.payload, 1, sizeof(data.payload), stdout);
-         if (w != sizeof(data.payload)) {
+         w = fwrite(data.payload, 1, PAYLOAD_SIZE_OF(cbSector), stdout);
+         if (w != PAYLOAD_SIZE_OF(cbSector)) {
             fprintf(stderr, "%s: %s: %s\n",
                pszProgramName, name, strerror(errno));
          }
@@ -33,6 +33,8 @@
 #include <errno.h>
 #include <pwd.h>
 #include <grp.h>
+#include <dirent.h>
+#include <ctype.h>
 
 #include "getopt.h"
 #include "corefs.h"
@@ -429,6 +431,113 @@ static int cat(SuperBlock * pSuperBlock, char * pszPath)
 }
 
 
+/* Move the storage files that are directly in the base path to the
+   subdirectories where a sharded volume keeps them. */
+static int moveToShards(SuperBlock * pSuperBlock, unsigned int flFlags,
+   unsigned long * pcMoved)
+{
+   DIR * dir;
+   struct dirent * dirent;
+   char szOld[MAX_VOLUME_BASE_PATH_NAME + MAX_STORAGE_FILE_NAME + 1];
+   char szNew[MAX_VOLUME_BASE_PATH_NAME + MAX_STORAGE_FILE_NAME + 1];
+   char * pszNew;
+   unsigned int i;
+   CryptedFileID id;
+
+   if (!(dir = opendir(pSuperBlock->szBasePath))) {
+      fprintf(stderr, "%s: reading %s: %s\n", pszProgramName,
+         pSuperBlock->szBasePath, strerror(errno));
+      return 1;
+   }
+
+   strcpy(szNew, pSuperBlock->szBasePath);
+   pszNew = szNew + strlen(szNew);
+
+   while (dirent = readdir(dir)) {
+      
+      if (strlen(dirent->d_name) != 12 ||
+          strcmp(dirent->d_name + 8, ".enc") != 0)
+         continue;
+      for (i = 0; i < 8; i++)
+         if (!isxdigit((int) dirent->d_name[i])) break;
+      if (i < 8 || sscanf(dirent->d_name, "%lx", &id) != 1 || !id)
+         continue;
+
+      /* Create the subdirectories; "xx/yy/" is the start of the new
+         name. */
+      coreMakeStorageFileName(CSTOR_SHARDED, id, pszNew);
+      pszNew[2] = 0;
+      if (mkdir(szNew, 0700) && errno != EEXIST) goto error;
+      pszNew[2] = '/';
+      pszNew[5] = 0;
+      if (mkdir(szNew, 0700) && errno != EEXIST) goto error;
+      pszNew[5] = '/';
+
+      sprintf(szOld, "%s%s", pSuperBlock->szBasePath, dirent->d_name);
+      if (flFlags & FL_VERBOSE)
+         printf("%s -> %s\n", dirent->d_name, pszNew);
+      if (rename(szOld, szNew)) goto error;
+      (*pcMoved)++;
+   }
+
+   closedir(dir);
+   return 0;
+
+ error:
+   fprintf(stderr, "%s: moving %s: %s\n", pszProgramName,
+      dirent->d_name, strerror(errno));
+   closedir(dir);
+   return 1;
+}
+
+
+/* Convert a flat volume into a sharded one.  Files that have been
+   moved already are left alone, so this can simply be run again
+   if it was interrupted. */
+static int shard(SuperBlock * pSuperBlock, unsigned int flFlags)
+{
+   CryptedVolume * pVolume = pSuperBlock->pVolume;
+   unsigned long cMoved, cTotal = 0;
+   CoreResult cr;
+
+   if ((pSuperBlock->flFlags & SBF_DIRTY) && !(flFlags & FL_FORCE)) {
+      fprintf(stderr, "%s: file system is dirty, run aefsck first\n",
+         pszProgramName);
+      return 1;
+   }
+
+   /* The storage files that corefs has open are about to move. */
+   cr = coreFlushVolume(pVolume);
+   if (!cr) cr = coreShrinkOpenStorageFiles(pVolume, 0);
+   if (cr) {
+      fprintf(stderr, "%s: unable to close storage files: %s\n", 
+         pszProgramName, core2str(cr));
+      return 1;
+   }
+
+   /* Renaming entries while reading the directory may cause others
+      to be missed, so repeat until there is nothing left. */
+   do {
+      cMoved = 0;
+      if (moveToShards(pSuperBlock, flFlags, &cMoved)) return 1;
+      cTotal += cMoved;
+   } while (cMoved);
+
+   coreQueryVolumeParms(pVolume)->flStorageFlags |= CSTOR_SHARDED;
+   cr = coreWriteSuperBlock(pSuperBlock, 0);
+   if (cr) {
+      fprintf(stderr, "%s: unable to write superblock: %s\n", 
+         pszProgramName, core2str(cr));
+      return 1;
+   }
+
+   if (flFlags & FL_VERBOSE)
+      printf("%lu storage files moved\n", cTotal);
+
+   return 0;
+}
+
+
 static int doCommand(char * pszPassPhrase, char * pszBasePath, 
    char * pszCommand, int argc, char * * argv, unsigned int flFlags)
 {
@@ -445,7 +554,7 @@ static int doCommand(char * pszPassPhrase, char * pszBasePath,
       strcat(szBasePath, "/");
 
    coreSetDefVolumeParms(&parms);
-   parms.fReadOnly = true;
+   parms.fReadOnly = strcmp(pszCommand, "shard") != 0;
 
    cr = coreReadSuperBlock(szBasePath, pszPassPhrase, cipherTable, 
       &parms, &pSuperBlock);
@@ -472,6 +581,9 @@ static int doCommand(char * pszPassPhrase, char * pszBasePath,
    } else if (strcmp(pszCommand, "cat") == 0) {
       if (argc != 1) paramError();
       res = cat(pSuperBlock, argv[0]);
+   } else if (strcmp(pszCommand, "shard") == 0) {
+      if (argc != 0) paramError();
+      res = shard(pSuperBlock, flFlags);
    } else {
       fprintf(stderr, "%s: unknown command: %s\n", 
          pszProgramName, pszCommand);
@@ -503,7 +615,7 @@ in AEFS-PATH.\n\
       --verylong     show very detailed file information\n\
   -p, --preserve     preserve permissions/ownerships when extracting\n\
   -r, --recursieve   (ls) list recursively\n\
-  -v, --verbose      (dump) show what is happening\n\
+  -v, --verbose      (dump, shard) show what is happening\n\
       --help         display this help and exit\n\
       --version      output version information and exit\n\
 \n\
@@ -513,6 +625,9 @@ COMMAND is one of the following:\n\
   ls PATH            list directory contents\n\
   dump PATH          extract recursively to the current directory\n\
   cat PATH           extract file to standard output\n\
+  shard              spread the storage files over subdirectories\n\
+                     (see `mkaefs --sharded'); the file system must\n\
+                     not be in use\n\
 \n\
 PATH must either be a fully qualified path name (i.e., starting with\n\
 `/') or a hexadecimal number denoting a file ID (inode number).\n\
@@ -554,6 +669,8 @@ int main(int argc, char * * argv)
       { 0, 0, 0, 0 } 
    };
 
+   sysInitPRNG();
+
    pszProgramName = argv[0];
 
    while ((c = getopt_long(argc, argv, "k:dflprv", options, 0)) != EOF) {
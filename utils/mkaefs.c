@@ -154,7 +154,8 @@ static int initVolume(char * pszBasePath, octet * pabDataKey,
 
 
 static int createVolumeInPath(char * pszBasePath, 
-   char * pszCipher, char * pszPassPhrase, bool fUseCBC, bool fDataKey)
+   char * pszCipher, char * pszPassPhrase, bool fUseCBC, bool fDataKey,
+   bool fSharded, unsigned int cbSector)
 {
    CoreResult cr;
    CipherResult cr2;
@@ -229,6 +230,8 @@ static int createVolumeInPath(char * pszBasePath,
       parms.flCryptoFlags |= CCRYPT_USE_CBC;
    else
       parms.flCryptoFlags &= ~CCRYPT_USE_CBC;
+   if (fSharded) parms.flStorageFlags |= CSTOR_SHARDED;
+   parms.cbSector = cbSector;
    parms.csISFGrow = 1;
 
    /* Append a slash, because that's what corefs wants. */
@@ -323,6 +326,12 @@ Create an AEFS file system in directory PATH.\n\
       --no-cbc         do not use CBC mode (only for debugging)\n\
       --no-random-key  do not generate a random data key (compatible\n\
                         with older versions of AEFS)\n\
+      --sharded        spread the storage files over subdirectories\n\
+                        (for file systems with very many files; not\n\
+                        readable by older versions of AEFS)\n\
+      --sector-size=N  use sectors of N bytes, a power of 2 between\n\
+                        %d and %d (default %d; other sizes are not\n\
+                        readable by older versions of AEFS)\n\
       --help           display this help and exit\n\
       --version        output version information and exit\n\
 \n\
@@ -332,7 +341,7 @@ The following table specifies the available ciphers (in\n\
 ciphername-keysize-blocksize format, where the sizes are in number of\n\
 bits).  The first entry in the table is the default cipher.\n\
 ",
-         pszProgramName);
+         pszProgramName, SECTOR_SIZE, MAX_SECTOR_SIZE, SECTOR_SIZE);
       
       for (papCipher = cipherTable; *papCipher; papCipher++) {
          pCipher = *papCipher;
@@ -353,7 +362,8 @@ bits).  The first entry in the table is the default cipher.\n\
 
 int main(int argc, char * * argv)
 {
-   bool fUseCBC = true, fDataKey = true;
+   bool fUseCBC = true, fDataKey = true, fSharded = false;
+   unsigned int cbSector = SECTOR_SIZE;
    int res;
    int c;
    char * pszPassPhrase = 0, * pszCipher = 0, * pszBasePath;
@@ -366,6 +376,8 @@ int main(int argc, char * * argv)
       { "cipher", required_argument, 0, 'c' },
       { "no-cbc", no_argument, 0, 3 },
       { "no-random-key", no_argument, 0, 4 },
+      { "sharded", no_argument, 0, 5 },
+      { "sector-size", required_argument, 0, 6 },
       { 0, 0, 0, 0 } 
    };
 
@@ -405,6 +417,20 @@ int main(int argc, char * * argv)
             fDataKey = false;
             break;
 
+         case 5: /* --sharded */
+            fSharded = true;
+            break;
+
+         case 6: /* --sector-size */
+            cbSector = atoi(optarg);
+            if (cbSector < SECTOR_SIZE || cbSector > MAX_SECTOR_SIZE ||
+                (cbSector & (cbSector - 1))) {
+               fprintf(stderr, "%s: invalid sector size `%s'\n",
+                  pszProgramName, optarg);
+               printUsage(1);
+            }
+            break;
+
          default:
             printUsage(1);
       }
@@ -424,7 +450,7 @@ int main(int argc, char * * argv)
 
    /* Make the volume. */
    res = createVolumeInPath(pszBasePath, pszCipher, pszPassPhrase, 
-      fUseCBC, fDataKey);
+      fUseCBC, fDataKey, fSharded, cbSector);
    if (pszPassPhrase) memset(pszPassPhrase, 0, strlen(pszPassPhrase)); /* burn */
 
    return res;
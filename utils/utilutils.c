@@ -132,6 +132,8 @@ char * core2str(CoreResult cr)
 	 return "storage file is locked";
       case CORERC_SYS + SYS_ROFS:
 	 return "storage file is on a read-only file system";
+      case CORERC_SYS + SYS_TOO_MANY_FILES:
+	 return "too many open storage files";
       case CORERC_SYS + SYS_UNKNOWN:
 	 return "unknown system error";
       default: return "unknown error";